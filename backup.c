@@ -0,0 +1,675 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "backup.h"
+#include "io.h"
+#include "snapshot.h"
+
+// a backup is a directory. base.idx and base.dat are the database as of a snapshot, copied while
+// writers go on: the index is read in large chunks and the pages written since the snapshot
+// began are patched back from its page versions, the data file is copied up to the end the
+// snapshot saw with copy_file_range, which the filesystem may turn into a reflink. values the
+// snapshot can see are not overwritten while it is open, so the copy is consistent.
+// from its first backup on, a handle tracks the index pages and the data grains it writes.
+// delta.<n> holds the ones changed since the previous backup in the directory, read as of a new
+// snapshot, and db_restore applies the deltas to the base in order. the tracking lives with the
+// handle, after a reopen the next backup has to be a full one. <name>.ttl and the secondary
+// indexes are not copied, the restored database rebuilds them.
+
+#define BACKUP_END 2
+
+typedef struct {
+    uint8_t* bits;
+    size_t size; // in bits.
+}Bitmap;
+
+struct Backup {
+    pthread_mutex_t mutex;
+    int fd; // index file the page hook is on, -1 if none.
+    Bitmap pages; // index pages written since the last backup.
+    Bitmap grains; // BACKUP_DATA_GRAIN blocks of the data file written since the last backup.
+    int stale; // writes went around the tracking, the next delta copies both files whole.
+    char* dir; // the backup the maps are relative to, NULL if none.
+    uint32_t seq; // deltas in dir.
+    int busy;
+};
+
+// delta.<n> is a DeltaHeader, then extents each followed by their bytes, up to one of type BACKUP_END.
+typedef struct {
+    uint32_t magic;
+    uint32_t seq;
+    uint32_t ttl; // the database had a .ttl tree.
+    Header header;
+}DeltaHeader;
+
+typedef struct {
+    uint32_t file; // 0 for the index, 1 for the data file.
+    off_t offset;
+    uint64_t size;
+}Extent;
+
+static int bitmap_grow(Bitmap* map, size_t size) {
+    if (size <= map->size) return 0;
+    size_t old = map->size / 8;
+    size_t bytes = old ? old : 64;
+    while (bytes * 8 < size) bytes *= 2;
+    uint8_t* bits = realloc(map->bits, bytes);
+    if (bits == NULL) return -1;
+    memset(bits + old, 0, bytes - old);
+    map->bits = bits;
+    map->size = bytes * 8;
+    return 0;
+}
+
+static int bitmap_mark(Bitmap* map, size_t first, size_t last) {
+    if (bitmap_grow(map, last + 1) < 0) return -1;
+    for (size_t i = first; i <= last; i++) map->bits[i / 8] |= 1 << (i % 8);
+    return 0;
+}
+
+static int bitmap_test(const Bitmap* map, size_t i) {
+    return i < map->size && (map->bits[i / 8] >> (i % 8) & 1);
+}
+
+static int bitmap_merge(Bitmap* into, const Bitmap* from) {
+    if (bitmap_grow(into, from->size) < 0) return -1;
+    for (size_t i = 0; i < from->size / 8; i++) into->bits[i] |= from->bits[i];
+    return 0;
+}
+
+static void bitmap_free(Bitmap* map) {
+    free(map->bits);
+    map->bits = NULL;
+    map->size = 0;
+}
+
+// page hook on the index file of a tracked handle.
+static void track_page(int fd, off_t offset, void* arg) {
+    (void) fd;
+    Backup* backup = arg;
+    size_t page = (size_t) offset / sizeof(IndexPage);
+
+    pthread_mutex_lock(&backup->mutex);
+    if (bitmap_mark(&backup->pages, page, page) < 0) backup->stale = 1;
+    pthread_mutex_unlock(&backup->mutex);
+}
+
+// the caller holds the exclusive latch.
+void backup_track(DB* db, off_t offset, size_t size) {
+    Backup* backup = db->backup;
+    if (backup == NULL || size == 0) return;
+
+    pthread_mutex_lock(&backup->mutex);
+    size_t first = (size_t) offset / BACKUP_DATA_GRAIN;
+    size_t last = ((size_t) offset + size - 1) / BACKUP_DATA_GRAIN;
+    if (bitmap_mark(&backup->grains, first, last) < 0) backup->stale = 1;
+    pthread_mutex_unlock(&backup->mutex);
+}
+
+// start tracking db, or move the page hook to its current index file. the caller holds the
+// exclusive latch.
+static int attach(DB* db) {
+    Backup* backup = db->backup;
+    if (backup == NULL) {
+        if ((backup = malloc(sizeof(Backup))) == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        memset(backup, 0, sizeof(Backup));
+        backup->fd = -1;
+        pthread_mutex_init(&backup->mutex, NULL);
+        db->backup = backup;
+    }
+    if (backup->fd == db->idx_fd) return 0;
+
+    if (backup->fd >= 0) set_page_hook(backup->fd, NULL, backup);
+    backup->fd = -1;
+    if (set_page_hook(db->idx_fd, track_page, backup) < 0) {
+        errno = EMFILE;
+        return -1;
+    }
+    backup->fd = db->idx_fd;
+    return 0;
+}
+
+// the files were rewritten without the tracking, by a reorganize or an import. the caller holds
+// the exclusive latch.
+void backup_invalidate(DB* db) {
+    Backup* backup = db->backup;
+    if (backup == NULL) return;
+
+    int ret = attach(db);
+    pthread_mutex_lock(&backup->mutex);
+    backup->stale = 1;
+    if (ret < 0) {
+        // writes can no longer be tracked, only a full backup starts over.
+        free(backup->dir);
+        backup->dir = NULL;
+    }
+    pthread_mutex_unlock(&backup->mutex);
+}
+
+void backup_free(DB* db) {
+    Backup* backup = db->backup;
+    if (backup == NULL) return;
+
+    if (backup->fd >= 0) set_page_hook(backup->fd, NULL, backup);
+    bitmap_free(&backup->pages);
+    bitmap_free(&backup->grains);
+    free(backup->dir);
+    pthread_mutex_destroy(&backup->mutex);
+    free(backup);
+    db->backup = NULL;
+}
+
+static char* backup_path(const char* dir, const char* file, const char* suffix) {
+    char* path = malloc(strlen(dir) + strlen(file) + strlen(suffix) + 2);
+    if (path == NULL) return NULL;
+    strcpy(path, dir);
+    strcat(path, "/");
+    strcat(path, file);
+    strcat(path, suffix);
+    return path;
+}
+
+static int write_all(int fd, const void* buf, size_t size, off_t offset) {
+    const char* p = buf;
+    while (size > 0) {
+        ssize_t n = pwrite(fd, p, size, offset);
+        if (n < 0) return -1;
+        p += n;
+        size -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+// a short read means the file was cut off.
+static int read_all(int fd, void* buf, size_t size) {
+    char* p = buf;
+    while (size > 0) {
+        ssize_t n = read(fd, p, size);
+        if (n < 0) return -1;
+        if (n == 0) {
+            errno = EINVAL;
+            return -1;
+        }
+        p += n;
+        size -= n;
+    }
+    return 0;
+}
+
+// copy size bytes from in to out, in the kernel where it can be done. bytes past the end of in
+// are left as a hole. buf holds BACKUP_CHUNK bytes for the fallback.
+static int copy_range(int in, off_t in_offset, int out, off_t out_offset, size_t size, char* buf) {
+    int fallback = io_is_direct(in);
+    while (size > 0) {
+        size_t chunk = size < BACKUP_CHUNK ? size : BACKUP_CHUNK;
+        ssize_t n = -1;
+        if (!fallback) {
+            n = copy_file_range(in, &in_offset, out, &out_offset, chunk, 0);
+            if (n < 0 && errno != EXDEV && errno != EINVAL && errno != ENOSYS && errno != EOPNOTSUPP) return -1;
+            if (n < 0) fallback = 1;
+        }
+        if (fallback) {
+            if ((n = io_pread(in, buf, chunk, in_offset)) < 0 || write_all(out, buf, n, out_offset) < 0) return -1;
+            in_offset += n;
+            out_offset += n;
+        }
+        if (n == 0) break;
+        size -= n;
+    }
+    return 0;
+}
+
+// size bytes of the index file at offset as of snapshot.
+static int read_index(DB* db, Snapshot* snapshot, off_t offset, char* buf, size_t size) {
+    ssize_t n = io_pread(snapshot_idx_fd(snapshot), buf, size, offset);
+    if (n < 0) return -1;
+    memset(buf + n, 0, size - n);
+    snapshot_patch(db, snapshot, offset, buf, size);
+    return 0;
+}
+
+// the header of a backup taken from snapshot, marked clean with no space reserved past the ends.
+static void backup_header(Snapshot* snapshot, Header* header) {
+    memcpy(header, snapshot_header(snapshot), sizeof(Header));
+    header->flags |= HEADER_CLEAN;
+    header->idx_reserved = header->idx_end;
+    header->data_reserved = header->data_end;
+}
+
+static int has_ttl(DB* db) {
+    if (db->expirer) return 1;
+    char* path = malloc(strlen(db->name) + strlen(".ttl") + 1);
+    if (path == NULL) return 0;
+    strcpy(path, db->name);
+    strcat(path, ".ttl");
+    int exists = access(path, F_OK) == 0;
+    free(path);
+    return exists;
+}
+
+// files are written under a temporary name and renamed into place once they are synced.
+static int open_out(const char* dir, const char* file) {
+    char* path = backup_path(dir, file, ".tmp");
+    if (path == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    free(path);
+    return fd;
+}
+
+static int finish_out(int fd, const char* dir, const char* file) {
+    char* tmp_path = backup_path(dir, file, ".tmp");
+    char* path = backup_path(dir, file, "");
+    int ret = tmp_path && path ? 0 : -1;
+    if (ret < 0) errno = ENOMEM;
+    if (ret == 0 && (fsync(fd) < 0 || rename(tmp_path, path) < 0)) ret = -1;
+    int err = errno;
+    close(fd);
+    if (ret < 0 && tmp_path) unlink(tmp_path);
+    free(tmp_path);
+    free(path);
+    errno = err;
+    return ret;
+}
+
+static void abort_out(int fd, const char* dir, const char* file) {
+    int err = errno;
+    close(fd);
+    char* path = backup_path(dir, file, ".tmp");
+    if (path) unlink(path);
+    free(path);
+    errno = err;
+}
+
+static int sync_dir(const char* dir) {
+    int fd = open(dir, O_RDONLY | O_DIRECTORY);
+    if (fd < 0) return -1;
+    int ret = fsync(fd);
+    close(fd);
+    return ret;
+}
+
+static int write_base(DB* db, Snapshot* snapshot, const char* dir, char* buf) {
+    Header header;
+    backup_header(snapshot, &header);
+
+    int fd = open_out(dir, "base.dat");
+    if (fd < 0) return -1;
+    if (copy_range(snapshot_data_fd(snapshot), 0, fd, 0, header.data_end, buf) < 0 || ftruncate(fd, header.data_end) < 0) {
+        abort_out(fd, dir, "base.dat");
+        return -1;
+    }
+    if (finish_out(fd, dir, "base.dat") < 0) return -1;
+
+    if (has_ttl(db)) {
+        if ((fd = open_out(dir, "base.ttl")) < 0 || finish_out(fd, dir, "base.ttl") < 0) return -1;
+    }
+
+    if ((fd = open_out(dir, "base.idx")) < 0) return -1;
+    for (off_t offset = 0; offset < header.idx_end; offset += BACKUP_CHUNK) {
+        size_t size = header.idx_end - offset < BACKUP_CHUNK ? header.idx_end - offset : BACKUP_CHUNK;
+        if (read_index(db, snapshot, offset, buf, size) < 0 || write_all(fd, buf, size, offset) < 0) {
+            abort_out(fd, dir, "base.idx");
+            return -1;
+        }
+    }
+    if (write_all(fd, &header, sizeof(Header), 0) < 0) {
+        abort_out(fd, dir, "base.idx");
+        return -1;
+    }
+    if (finish_out(fd, dir, "base.idx") < 0) return -1;
+    return sync_dir(dir);
+}
+
+// write a full backup of db into dir, which must not hold one yet. writers are not blocked.
+int db_backup(DB* db, const char* dir) {
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST) return -1;
+    char* idx_path = backup_path(dir, "base.idx", "");
+    if (idx_path == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    int exists = access(idx_path, F_OK) == 0;
+    free(idx_path);
+    if (exists) {
+        errno = EEXIST;
+        return -1;
+    }
+    char* buf;
+    if (posix_memalign((void**) &buf, IO_ALIGN, BACKUP_CHUNK) != 0) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    pthread_rwlock_wrlock(&db->latch);
+    int ret = attach(db);
+    Backup* backup = db->backup;
+    if (ret == 0) {
+        pthread_mutex_lock(&backup->mutex);
+        if (backup->busy) {
+            errno = EBUSY;
+            ret = -1;
+        } else {
+            // tracking restarts before the snapshot is taken, so no later write can be missed.
+            backup->busy = 1;
+            if (backup->pages.bits) memset(backup->pages.bits, 0, backup->pages.size / 8);
+            if (backup->grains.bits) memset(backup->grains.bits, 0, backup->grains.size / 8);
+            backup->stale = 0;
+            free(backup->dir);
+            backup->dir = NULL;
+            backup->seq = 0;
+        }
+        pthread_mutex_unlock(&backup->mutex);
+    }
+    pthread_rwlock_unlock(&db->latch);
+    if (ret < 0) {
+        free(buf);
+        return -1;
+    }
+
+    Snapshot* snapshot = db_snapshot_begin(db);
+    ret = snapshot ? write_base(db, snapshot, dir, buf) : -1;
+    int err = errno;
+    if (snapshot) db_snapshot_end(db, snapshot);
+    free(buf);
+
+    pthread_mutex_lock(&backup->mutex);
+    if (ret == 0 && (backup->dir = strdup(dir)) == NULL) {
+        err = ENOMEM;
+        ret = -1;
+    }
+    backup->busy = 0;
+    pthread_mutex_unlock(&backup->mutex);
+    errno = err;
+    return ret;
+}
+
+// the next run of set bits at or after *i and below n, at most max long. returns its length and
+// leaves *i at its start, 0 if there is none. with all set every bit counts as set.
+static size_t next_run(const Bitmap* map, int all, size_t* i, size_t n, size_t max) {
+    while (*i < n && !all && !bitmap_test(map, *i)) (*i)++;
+    size_t j = *i;
+    while (j < n && j - *i < max && (all || bitmap_test(map, j))) j++;
+    return j - *i;
+}
+
+static int append(int fd, off_t* pos, const void* buf, size_t size) {
+    if (write_all(fd, buf, size, *pos) < 0) return -1;
+    *pos += size;
+    return 0;
+}
+
+static int write_delta(DB* db, Snapshot* snapshot, const char* dir, uint32_t seq,
+                       const Bitmap* pages, const Bitmap* grains, int stale, char* buf) {
+    char file[32];
+    snprintf(file, sizeof(file), "delta.%u", seq);
+    int fd = open_out(dir, file);
+    if (fd < 0) return -1;
+
+    DeltaHeader delta;
+    memset(&delta, 0, sizeof(DeltaHeader));
+    delta.magic = BACKUP_MAGIC;
+    delta.seq = seq;
+    delta.ttl = has_ttl(db);
+    backup_header(snapshot, &delta.header);
+    const Header* header = &delta.header;
+
+    off_t pos = 0;
+    int ret = append(fd, &pos, &delta, sizeof(DeltaHeader));
+
+    // page 0 is the header, which the DeltaHeader carries.
+    size_t num_pages = header->idx_end / sizeof(IndexPage);
+    size_t run;
+    for (size_t i = 1; ret == 0 && (run = next_run(pages, stale, &i, num_pages, BACKUP_CHUNK / sizeof(IndexPage))); i += run) {
+        Extent extent = {0, (off_t) (i * sizeof(IndexPage)), run * sizeof(IndexPage)};
+        if (read_index(db, snapshot, extent.offset, buf, extent.size) < 0 ||
+            append(fd, &pos, &extent, sizeof(Extent)) < 0 || append(fd, &pos, buf, extent.size) < 0) {
+            ret = -1;
+        }
+    }
+
+    size_t num_grains = (header->data_end + BACKUP_DATA_GRAIN - 1) / BACKUP_DATA_GRAIN;
+    for (size_t i = 0; ret == 0 && (run = next_run(grains, stale, &i, num_grains, BACKUP_CHUNK / BACKUP_DATA_GRAIN)); i += run) {
+        Extent extent = {1, (off_t) (i * BACKUP_DATA_GRAIN), run * BACKUP_DATA_GRAIN};
+        if (extent.offset + (off_t) extent.size > header->data_end) extent.size = header->data_end - extent.offset;
+        ssize_t n = io_pread(snapshot_data_fd(snapshot), buf, extent.size, extent.offset);
+        if (n < 0) {
+            ret = -1;
+            break;
+        }
+        memset(buf + n, 0, extent.size - n);
+        if (append(fd, &pos, &extent, sizeof(Extent)) < 0 || append(fd, &pos, buf, extent.size) < 0) ret = -1;
+    }
+
+    Extent end = {BACKUP_END, 0, 0};
+    if (ret == 0) ret = append(fd, &pos, &end, sizeof(Extent));
+    if (ret < 0) {
+        abort_out(fd, dir, file);
+        return -1;
+    }
+    if (finish_out(fd, dir, file) < 0) return -1;
+    return sync_dir(dir);
+}
+
+// write what changed since the last backup into dir as its next delta. dir must hold the last
+// full backup this handle took, ESTALE otherwise.
+int db_backup_incremental(DB* db, const char* dir) {
+    Bitmap pages = {NULL, 0};
+    Bitmap grains = {NULL, 0};
+    int stale = 0;
+    uint32_t seq = 0;
+
+    pthread_rwlock_wrlock(&db->latch);
+    Backup* backup = db->backup;
+    int ret = 0;
+    if (backup == NULL) {
+        errno = ESTALE;
+        ret = -1;
+    } else {
+        pthread_mutex_lock(&backup->mutex);
+        if (backup->busy) {
+            errno = EBUSY;
+            ret = -1;
+        } else if (backup->dir == NULL || strcmp(backup->dir, dir) != 0) {
+            errno = ESTALE;
+            ret = -1;
+        } else {
+            backup->busy = 1;
+            pages = backup->pages;
+            grains = backup->grains;
+            memset(&backup->pages, 0, sizeof(Bitmap));
+            memset(&backup->grains, 0, sizeof(Bitmap));
+            stale = backup->stale;
+            backup->stale = 0;
+            seq = backup->seq + 1;
+        }
+        pthread_mutex_unlock(&backup->mutex);
+    }
+    pthread_rwlock_unlock(&db->latch);
+    if (ret < 0) return -1;
+
+    char* buf = NULL;
+    Snapshot* snapshot = NULL;
+    if (posix_memalign((void**) &buf, IO_ALIGN, BACKUP_CHUNK) != 0) {
+        buf = NULL;
+        errno = ENOMEM;
+    } else if ((snapshot = db_snapshot_begin(db)) != NULL) {
+        // writes between taking the maps and the snapshot are only in the new ones.
+        pthread_mutex_lock(&backup->mutex);
+        if (bitmap_merge(&pages, &backup->pages) < 0 || bitmap_merge(&grains, &backup->grains) < 0) stale = 1;
+        stale |= backup->stale;
+        pthread_mutex_unlock(&backup->mutex);
+    }
+    ret = snapshot ? write_delta(db, snapshot, dir, seq, &pages, &grains, stale, buf) : -1;
+    int err = errno;
+    if (snapshot) db_snapshot_end(db, snapshot);
+    free(buf);
+
+    pthread_mutex_lock(&backup->mutex);
+    if (ret == 0) {
+        backup->seq = seq;
+    } else if (stale || bitmap_merge(&backup->pages, &pages) < 0 || bitmap_merge(&backup->grains, &grains) < 0) {
+        // the changes go back for the next try.
+        backup->stale = 1;
+    }
+    backup->busy = 0;
+    pthread_mutex_unlock(&backup->mutex);
+    bitmap_free(&pages);
+    bitmap_free(&grains);
+    errno = err;
+    return ret;
+}
+
+static int apply_delta(int fd, uint32_t seq, int idx_fd, int data_fd, Header* header, int* ttl, char* buf) {
+    DeltaHeader delta;
+    if (read_all(fd, &delta, sizeof(DeltaHeader)) < 0) return -1;
+    if (delta.magic != BACKUP_MAGIC || delta.seq != seq) {
+        errno = EINVAL;
+        return -1;
+    }
+    for (;;) {
+        Extent extent;
+        if (read_all(fd, &extent, sizeof(Extent)) < 0) return -1;
+        if (extent.file == BACKUP_END) break;
+        if (extent.file > 1 || extent.size > BACKUP_CHUNK) {
+            errno = EINVAL;
+            return -1;
+        }
+        if (read_all(fd, buf, extent.size) < 0 ||
+            write_all(extent.file ? data_fd : idx_fd, buf, extent.size, extent.offset) < 0) {
+            return -1;
+        }
+    }
+    memcpy(header, &delta.header, sizeof(Header));
+    *ttl |= delta.ttl;
+    return 0;
+}
+
+static int restore_files(const char* dir, int idx_fd, int data_fd, int* ttl, char* buf) {
+    char* idx_path = backup_path(dir, "base.idx", "");
+    char* data_path = backup_path(dir, "base.dat", "");
+    char* ttl_path = backup_path(dir, "base.ttl", "");
+    if (idx_path == NULL || data_path == NULL || ttl_path == NULL) {
+        free(idx_path);
+        free(data_path);
+        free(ttl_path);
+        errno = ENOMEM;
+        return -1;
+    }
+    int in_idx = open(idx_path, O_RDONLY);
+    int in_data = open(data_path, O_RDONLY);
+    *ttl = access(ttl_path, F_OK) == 0;
+    free(idx_path);
+    free(data_path);
+    free(ttl_path);
+
+    Header header;
+    struct stat idx_st, data_st;
+    int ret = in_idx >= 0 && in_data >= 0 && fstat(in_idx, &idx_st) == 0 && fstat(in_data, &data_st) == 0 &&
+              load_index_header(in_idx, &header) >= 0 &&
+              copy_range(in_idx, 0, idx_fd, 0, idx_st.st_size, buf) == 0 &&
+              copy_range(in_data, 0, data_fd, 0, data_st.st_size, buf) == 0 ? 0 : -1;
+    int err = errno;
+    if (in_idx >= 0) close(in_idx);
+    if (in_data >= 0) close(in_data);
+    errno = err;
+
+    for (uint32_t seq = 1; ret == 0; seq++) {
+        char file[32];
+        snprintf(file, sizeof(file), "delta.%u", seq);
+        char* path = backup_path(dir, file, "");
+        int fd = path ? open(path, O_RDONLY) : -1;
+        free(path);
+        if (fd < 0) {
+            if (errno != ENOENT) ret = -1;
+            break;
+        }
+        ret = apply_delta(fd, seq, idx_fd, data_fd, &header, ttl, buf);
+        close(fd);
+    }
+
+    if (ret == 0 && (ftruncate(idx_fd, header.idx_end) < 0 || ftruncate(data_fd, header.data_end) < 0 ||
+                     dump_header(idx_fd, &header) < 0 || fsync(data_fd) < 0 || fsync(idx_fd) < 0)) {
+        ret = -1;
+    }
+    return ret;
+}
+
+// an empty .ttl that is not marked clean, rebuilt from the leaves by the first writable open.
+static int restore_ttl(const char* path) {
+    Header header;
+    memset(&header, 0, sizeof(Header));
+    header.magic_number = INDEX_MAGIC;
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return -1;
+    int ret = write_all(fd, &header, sizeof(Header), 0) < 0 || fsync(fd) < 0 ? -1 : 0;
+    close(fd);
+    return ret;
+}
+
+// rebuild the database name from the backup in dir and all of its deltas. name must not exist.
+int db_restore(const char* dir, const char* name) {
+    const char* suffixes[] = {".idx", ".dat", ".ttl", ".idx.restore", ".dat.restore"};
+    char* paths[5];
+    int ret = 0;
+    for (int i = 0; i < 5; i++) {
+        if ((paths[i] = malloc(strlen(name) + strlen(suffixes[i]) + 1)) == NULL) {
+            ret = -1;
+            continue;
+        }
+        strcpy(paths[i], name);
+        strcat(paths[i], suffixes[i]);
+    }
+    char* buf = NULL;
+    if (ret < 0 || posix_memalign((void**) &buf, IO_ALIGN, BACKUP_CHUNK) != 0) {
+        for (int i = 0; i < 5; i++) free(paths[i]);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    int idx_fd = -1;
+    int data_fd = -1;
+    int ttl = 0;
+    if (access(paths[0], F_OK) == 0 || access(paths[1], F_OK) == 0) {
+        errno = EEXIST;
+        ret = -1;
+    } else if ((idx_fd = open(paths[3], O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0 ||
+               (data_fd = open(paths[4], O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) {
+        ret = -1;
+    } else {
+        ret = restore_files(dir, idx_fd, data_fd, &ttl, buf);
+    }
+    int err = errno;
+    if (idx_fd >= 0) close(idx_fd);
+    if (data_fd >= 0) close(data_fd);
+
+    // the index goes last, a database without one does not exist.
+    if (ret == 0 && (rename(paths[4], paths[1]) < 0 || (ttl && restore_ttl(paths[2]) < 0) ||
+                     rename(paths[3], paths[0]) < 0)) {
+        err = errno;
+        ret = -1;
+        unlink(paths[1]);
+        unlink(paths[2]);
+    }
+    if (ret < 0 && err != EEXIST) {
+        unlink(paths[3]);
+        unlink(paths[4]);
+    }
+    for (int i = 0; i < 5; i++) free(paths[i]);
+    free(buf);
+    errno = err;
+    return ret;
+}
@@ -0,0 +1,20 @@
+#ifndef MDBM_BACKUP_H
+#define MDBM_BACKUP_H
+
+#include <sys/types.h>
+
+#include "mdbm.h"
+
+#define BACKUP_CHUNK (1 << 20) // bytes per read and write while copying.
+#define BACKUP_DATA_GRAIN (64 << 10) // changes to the data file are tracked at this granularity.
+#define BACKUP_MAGIC 0x6d646264
+
+int db_backup(DB* db, const char* dir);
+int db_backup_incremental(DB* db, const char* dir);
+int db_restore(const char* dir, const char* name);
+
+void backup_track(DB* db, off_t offset, size_t size);
+void backup_invalidate(DB* db);
+void backup_free(DB* db);
+
+#endif //MDBM_BACKUP_H
@@ -0,0 +1,394 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <getopt.h>
+#include <stdatomic.h>
+
+#include "mdbm.h"
+#include "snapshot.h"
+#include "histogram.h"
+
+// YCSB-style workloads against a single DB handle shared by all threads.
+//
+//   A  50% read, 50% update            D  95% read of recent keys, 5% insert
+//   B  95% read,  5% update            E  95% short scan, 5% insert
+//   C 100% read                        F  50% read, 50% read-modify-write
+
+#define ZIPF_THETA 0.99
+#define MAX_SCAN 100
+
+typedef enum {
+    OP_READ,
+    OP_UPDATE,
+    OP_INSERT,
+    OP_SCAN,
+    OP_RMW,
+    NUM_OPS,
+}OpType;
+
+static const char* op_names[NUM_OPS] = {"read", "update", "insert", "scan", "rmw"};
+
+typedef enum {
+    DIST_UNIFORM,
+    DIST_ZIPFIAN,
+    DIST_SEQUENTIAL,
+    DIST_LATEST,
+}Distribution;
+
+typedef struct {
+    char workload;
+    Distribution distribution;
+    size_t records;
+    size_t operations;
+    size_t value_size;
+    int threads;
+    const char* path;
+    int skip_load;
+    int print_stats;
+    int direct;
+    size_t buffer;
+}Options;
+
+typedef struct {
+    uint64_t items;
+    double theta;
+    double alpha;
+    double zetan;
+    double eta;
+}Zipfian;
+
+typedef struct {
+    int id;
+    uint64_t rng;
+    size_t operations;
+    uint64_t sequence;
+    Histogram hist[NUM_OPS];
+    size_t errors;
+}Worker;
+
+static DB* db;
+static Options options;
+static Zipfian zipf;
+static atomic_uint_fast64_t inserted; // keys [0, inserted) exist.
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+static uint64_t next_random(uint64_t* state) {
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+static double next_double(uint64_t* state) {
+    return (double) (next_random(state) >> 11) / (double) (1ULL << 53);
+}
+
+// Gray et al., "Quickly Generating Billion-Record Synthetic Databases", as used by YCSB.
+static void zipfian_init(Zipfian* z, uint64_t items, double theta) {
+    z->items = items;
+    z->theta = theta;
+    z->zetan = 0;
+    for (uint64_t i = 1; i <= items; i++) z->zetan += 1.0 / pow((double) i, theta);
+    double zeta2 = 1.0 + 1.0 / pow(2.0, theta);
+    z->alpha = 1.0 / (1.0 - theta);
+    z->eta = (1.0 - pow(2.0 / (double) items, 1.0 - theta)) / (1.0 - zeta2 / z->zetan);
+}
+
+static uint64_t zipfian_next(Zipfian* z, uint64_t* state) {
+    double u = next_double(state);
+    double uz = u * z->zetan;
+    if (uz < 1.0) return 0;
+    if (uz < 1.0 + pow(0.5, z->theta)) return 1;
+    uint64_t rank = (uint64_t) ((double) z->items * pow(z->eta * u - z->eta + 1.0, z->alpha));
+    return rank < z->items ? rank : z->items - 1;
+}
+
+static uint64_t choose_key(Worker* worker) {
+    uint64_t count = atomic_load(&inserted);
+    switch (options.distribution) {
+        case DIST_SEQUENTIAL:
+            return (worker->sequence++ * options.threads + worker->id) % count;
+        case DIST_ZIPFIAN: {
+            // scramble the rank so the hot keys are spread over the tree, as YCSB does.
+            uint64_t rank = zipfian_next(&zipf, &worker->rng);
+            uint64_t state = rank;
+            return next_random(&state) % count;
+        }
+        case DIST_LATEST: {
+            uint64_t back = zipfian_next(&zipf, &worker->rng) % count;
+            return count - 1 - back;
+        }
+        default:
+            return next_random(&worker->rng) % count;
+    }
+}
+
+static OpType choose_op(Worker* worker) {
+    double p = next_double(&worker->rng);
+    switch (options.workload) {
+        case 'a':
+            return p < 0.5 ? OP_READ : OP_UPDATE;
+        case 'b':
+            return p < 0.95 ? OP_READ : OP_UPDATE;
+        case 'd':
+            return p < 0.95 ? OP_READ : OP_INSERT;
+        case 'e':
+            return p < 0.95 ? OP_SCAN : OP_INSERT;
+        case 'f':
+            return p < 0.5 ? OP_READ : OP_RMW;
+        default:
+            return OP_READ;
+    }
+}
+
+static void fill_value(char* value, uint64_t key, uint64_t salt) {
+    uint64_t state = key ^ salt;
+    for (size_t i = 0; i < options.value_size; i += sizeof(uint64_t)) {
+        uint64_t word = next_random(&state);
+        size_t len = options.value_size - i < sizeof(uint64_t) ? options.value_size - i : sizeof(uint64_t);
+        memcpy(value + i, &word, len);
+    }
+}
+
+static int do_scan(uint64_t key, size_t len) {
+    Cursor* cursor = db_cursor_open(db, NULL);
+    if (cursor == NULL) return -1;
+    if (db_cursor_seek(cursor, key) < 0) {
+        db_cursor_close(cursor);
+        return -1;
+    }
+    Cell cell;
+    Record record;
+    for (size_t i = 0; i < len && db_cursor_next(cursor, &cell, &record) == 0; i++) free(record.data);
+    db_cursor_close(cursor);
+    return 0;
+}
+
+static int do_op(Worker* worker, OpType op, char* value) {
+    Record record;
+    uint64_t key;
+
+    // every value has the same size, so reads land in the worker's buffer without allocating.
+    switch (op) {
+        case OP_READ:
+            return db_fetch_into(db, choose_key(worker), value, options.value_size, &record.size);
+        case OP_UPDATE:
+            key = choose_key(worker);
+            fill_value(value, key, worker->rng);
+            record.size = options.value_size;
+            record.data = value;
+            return db_store(db, key, &record, DB_REPLACE);
+        case OP_INSERT:
+            key = atomic_fetch_add(&inserted, 1);
+            fill_value(value, key, 0);
+            record.size = options.value_size;
+            record.data = value;
+            return db_store(db, key, &record, DB_STORE);
+        case OP_SCAN:
+            return do_scan(choose_key(worker), 1 + next_random(&worker->rng) % MAX_SCAN);
+        case OP_RMW:
+            key = choose_key(worker);
+            if (db_fetch_into(db, key, value, options.value_size, &record.size) < 0) return -1;
+            value[0]++;
+            record.data = value;
+            return db_store(db, key, &record, DB_REPLACE);
+        default:
+            return -1;
+    }
+}
+
+static void* run_worker(void* arg) {
+    Worker* worker = arg;
+    char* value = malloc(options.value_size ? options.value_size : 1);
+
+    for (size_t i = 0; i < worker->operations; i++) {
+        OpType op = choose_op(worker);
+        uint64_t start = now_ns();
+        if (do_op(worker, op, value) < 0) worker->errors++;
+        histogram_record(worker->hist + op, now_ns() - start);
+    }
+
+    free(value);
+    return NULL;
+}
+
+static int load(void) {
+    char* value = malloc(options.value_size ? options.value_size : 1);
+    Histogram hist;
+    histogram_reset(&hist);
+
+    uint64_t start = now_ns();
+    for (uint64_t key = 0; key < options.records; key++) {
+        fill_value(value, key, 0);
+        Record record = {options.value_size, value};
+        uint64_t op_start = now_ns();
+        if (db_store(db, key, &record, DB_STORE) < 0) {
+            fprintf(stderr, "load: db_store(%llu): %s\n", (unsigned long long) key, strerror(errno));
+            free(value);
+            return -1;
+        }
+        histogram_record(&hist, now_ns() - op_start);
+    }
+    double elapsed = (double) (now_ns() - start) / 1e9;
+
+    printf("load: %zu records in %.2fs, %.0f ops/s\n", options.records, elapsed, (double) options.records / elapsed);
+    histogram_print(stdout, "insert", &hist);
+    free(value);
+    return 0;
+}
+
+static void usage(const char* prog) {
+    fprintf(stderr,
+            "usage: %s [-w a|b|c|d|e|f] [-d uniform|zipfian|sequential|latest] [-n records]\n"
+            "          [-o operations] [-v value size] [-t threads] [-p path] [-s (skip load)]\n"
+            "          [-S (print engine stats as json)] [-D (O_DIRECT)] [-B write buffer bytes]\n",
+            prog);
+}
+
+static int parse_distribution(const char* name, Distribution* distribution) {
+    if (strcmp(name, "uniform") == 0) *distribution = DIST_UNIFORM;
+    else if (strcmp(name, "zipfian") == 0) *distribution = DIST_ZIPFIAN;
+    else if (strcmp(name, "sequential") == 0) *distribution = DIST_SEQUENTIAL;
+    else if (strcmp(name, "latest") == 0) *distribution = DIST_LATEST;
+    else return -1;
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    options.workload = 'a';
+    options.distribution = DIST_ZIPFIAN;
+    options.records = 100000;
+    options.operations = 100000;
+    options.value_size = 100;
+    options.threads = 1;
+    options.path = "/tmp/mdbm_bench";
+    int distribution_set = 0;
+
+    int c;
+    while ((c = getopt(argc, argv, "w:d:n:o:v:t:p:sSDB:h")) != -1) {
+        switch (c) {
+            case 'w':
+                options.workload = optarg[0];
+                if (options.workload < 'a' || options.workload > 'f') {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'd':
+                if (parse_distribution(optarg, &options.distribution) < 0) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                distribution_set = 1;
+                break;
+            case 'n':
+                options.records = strtoull(optarg, NULL, 10);
+                break;
+            case 'o':
+                options.operations = strtoull(optarg, NULL, 10);
+                break;
+            case 'v':
+                options.value_size = strtoull(optarg, NULL, 10);
+                break;
+            case 't':
+                options.threads = atoi(optarg);
+                break;
+            case 'p':
+                options.path = optarg;
+                break;
+            case 's':
+                options.skip_load = 1;
+                break;
+            case 'S':
+                options.print_stats = 1;
+                break;
+            case 'D':
+                options.direct = O_DIRECT;
+                break;
+            case 'B':
+                options.buffer = strtoull(optarg, NULL, 10);
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (options.records == 0 || options.threads < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (options.workload == 'd' && !distribution_set) options.distribution = DIST_LATEST;
+
+    if (options.skip_load) db = db_open(options.path, O_RDWR | options.direct);
+    else db = db_open(options.path, O_RDWR | O_CREAT | O_TRUNC | options.direct, 0644);
+    if (db == NULL) {
+        perror("db_open");
+        return 1;
+    }
+    if (options.buffer && db_buffer_start(db, options.buffer) < 0) {
+        perror("db_buffer_start");
+        db_close(db);
+        return 1;
+    }
+    if (!options.skip_load && load() < 0) {
+        db_close(db);
+        return 1;
+    }
+    atomic_store(&inserted, options.records);
+    zipfian_init(&zipf, options.records, ZIPF_THETA);
+
+    Worker* workers = calloc(options.threads, sizeof(Worker));
+    pthread_t* threads = calloc(options.threads, sizeof(pthread_t));
+    uint64_t start = now_ns();
+    for (int i = 0; i < options.threads; i++) {
+        workers[i].id = i;
+        workers[i].rng = 0x2545F4914F6CDD1DULL * (i + 1);
+        workers[i].operations = options.operations / options.threads + (i < (int) (options.operations % options.threads));
+        for (int op = 0; op < NUM_OPS; op++) histogram_reset(workers[i].hist + op);
+        pthread_create(threads + i, NULL, run_worker, workers + i);
+    }
+
+    Histogram total;
+    Histogram per_op[NUM_OPS];
+    histogram_reset(&total);
+    size_t errors = 0;
+    for (int op = 0; op < NUM_OPS; op++) histogram_reset(per_op + op);
+    for (int i = 0; i < options.threads; i++) {
+        pthread_join(threads[i], NULL);
+        for (int op = 0; op < NUM_OPS; op++) {
+            histogram_merge(per_op + op, workers[i].hist + op);
+            histogram_merge(&total, workers[i].hist + op);
+        }
+        errors += workers[i].errors;
+    }
+    double elapsed = (double) (now_ns() - start) / 1e9;
+
+    static const char* distribution_names[] = {"uniform", "zipfian", "sequential", "latest"};
+    printf("workload %c, %s keys, %zu records, %zu byte values, %d threads\n", options.workload - 'a' + 'A',
+           distribution_names[options.distribution], options.records, options.value_size, options.threads);
+    printf("run: %zu operations in %.2fs, %.0f ops/s, %zu errors\n", options.operations, elapsed,
+           (double) options.operations / elapsed, errors);
+    for (int op = 0; op < NUM_OPS; op++) {
+        if (per_op[op].total) histogram_print(stdout, op_names[op], per_op + op);
+    }
+    histogram_print(stdout, "all", &total);
+
+    DBStats stats;
+    if (options.print_stats && db_stats(db, &stats) == 0) db_stats_print(stdout, &stats, DB_STATS_JSON);
+
+    free(workers);
+    free(threads);
+    db_close(db);
+    return 0;
+}
@@ -2,78 +2,284 @@
 // Created by Machearn Ning on 2/4/22.
 //
 
+#define _GNU_SOURCE
+
 #include <stdlib.h>
+#include <errno.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sys/stat.h>
 
 #include "lock.h"
 #include "btree.h"
+#include "cache.h"
+#include "io.h"
+#include "slab.h"
+#include "stats.h"
+
+#define MAX_PAGE_HOOK 64
+
+typedef struct {
+    int fd;
+    PageHook hook;
+    void* arg;
+}PageHookEntry;
+
+static PageHookEntry page_hooks[MAX_PAGE_HOOK];
+static atomic_int num_page_hooks;
+static pthread_rwlock_t page_hook_lock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_mutex_t claim_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 IndexPage* split_page(int fd, Header* header, IndexPage* page);
 
-int add_internal_key(int fd, Header* header, IndexPage* child, uint64_t key);
+int add_internal_key(int fd, Header* header, IndexPage* child, uint64_t key, off_t new_child, size_t count);
 
 IndexPage* malloc_index_page() {
-    IndexPage* p = NULL;
-    p = (IndexPage*) malloc(sizeof(IndexPage));
-    memset(p, 0, sizeof(IndexPage));
+    IndexPage* p = slab_alloc(SLAB_PAGE);
+    if (p) memset(p, 0, sizeof(IndexPage));
     return p;
 }
 
 void free_index_page(IndexPage** page) {
-    free(*page);
+    slab_free(SLAB_PAGE, *page);
     *page = NULL;
 }
 
 Cell* malloc_cell() {
-    Cell* c = NULL;
-    c = (Cell*) malloc(sizeof(Cell));
-    memset(c, 0, sizeof(Cell));
+    Cell* c = slab_alloc(SLAB_CELL);
+    if (c) memset(c, 0, sizeof(Cell));
     return c;
 }
 
 void free_cell(Cell** cell) {
-    free(*cell);
+    slab_free(SLAB_CELL, *cell);
     *cell = NULL;
 }
 
 ssize_t load_page(int fd, off_t offset, IndexPage* page) {
-    off_t off;
-    if ((off = lseek(fd, offset, SEEK_SET)) < 0) return -1;
-    if (read_lock_wait(fd, off, SEEK_SET, sizeof(IndexPage)) < 0) return -1;
-    ssize_t ret = read(fd, page, sizeof(IndexPage));
-    if (unlock(fd, off, SEEK_SET, sizeof(IndexPage)) < 0) return -1;
+    if (offset < 0) return -1;
+    PageCache* cache = cache_of(fd);
+    if (cache && cache_read(cache, fd, offset, page)) return sizeof(IndexPage);
+
+    if (read_lock_wait(fd, offset, SEEK_SET, sizeof(IndexPage)) < 0) return -1;
+    ssize_t ret = io_pread(fd, page, sizeof(IndexPage), offset);
+    if (unlock(fd, offset, SEEK_SET, sizeof(IndexPage)) < 0) return -1;
+    stat_add(STAT_PAGE_READS, 1);
+    if (cache && ret == sizeof(IndexPage)) cache_fill(cache, fd, offset, page);
     return ret;
 }
 
+// hook is called with the old image still on disk, before every dump_page to fd. an fd can have
+// one hook per arg, NULL removes the one registered with arg.
+int set_page_hook(int fd, PageHook hook, void* arg) {
+    pthread_rwlock_wrlock(&page_hook_lock);
+    int n = atomic_load(&num_page_hooks);
+    for (int i = 0; i < n; i++) {
+        if (page_hooks[i].fd != fd || page_hooks[i].arg != arg) continue;
+        if (hook) {
+            page_hooks[i].hook = hook;
+            page_hooks[i].arg = arg;
+        } else {
+            page_hooks[i] = page_hooks[n - 1];
+            atomic_store(&num_page_hooks, n - 1);
+        }
+        pthread_rwlock_unlock(&page_hook_lock);
+        return 0;
+    }
+    if (hook == NULL) {
+        pthread_rwlock_unlock(&page_hook_lock);
+        return 0;
+    }
+    if (n == MAX_PAGE_HOOK) {
+        pthread_rwlock_unlock(&page_hook_lock);
+        return -1;
+    }
+    page_hooks[n].fd = fd;
+    page_hooks[n].hook = hook;
+    page_hooks[n].arg = arg;
+    atomic_store(&num_page_hooks, n + 1);
+    pthread_rwlock_unlock(&page_hook_lock);
+    return 0;
+}
+
+// the hooks are copied out and run without page_hook_lock, since a hook takes locks of its own
+// that are held around set_page_hook. an arg stays valid until its handle is freed, so a hook
+// removed after the copy still finds it, and has nothing left to do.
+static void call_page_hook(int fd, off_t offset) {
+    if (atomic_load(&num_page_hooks) == 0) return;
+
+    PageHookEntry hooks[MAX_PAGE_HOOK];
+    int num_hooks = 0;
+    pthread_rwlock_rdlock(&page_hook_lock);
+    int n = atomic_load(&num_page_hooks);
+    for (int i = 0; i < n; i++) {
+        if (page_hooks[i].fd == fd) hooks[num_hooks++] = page_hooks[i];
+    }
+    pthread_rwlock_unlock(&page_hook_lock);
+
+    for (int i = 0; i < num_hooks; i++) hooks[i].hook(fd, offset, hooks[i].arg);
+}
+
 ssize_t dump_page(int fd, IndexPage* page) {
     if (!page) return 0;
 
     off_t offset = page->offset;
-    if (lseek(fd, offset, SEEK_SET) < 0) return -1;
+    if (offset < 0) return -1;
+    call_page_hook(fd, offset);
     if (write_lock_wait(fd, offset, SEEK_SET, sizeof(IndexPage)) < 0) return -1;
-    ssize_t ret = write(fd, page, sizeof(IndexPage));
+    ssize_t ret = io_pwrite(fd, page, sizeof(IndexPage), offset);
     if (unlock(fd, offset, SEEK_SET, sizeof(IndexPage)) < 0) return -1;
+    stat_add(STAT_PAGE_WRITES, 1);
+
+    PageCache* cache = cache_of(fd);
+    if (cache && ret == sizeof(IndexPage)) cache_fill(cache, fd, offset, page);
+    else if (cache) cache_drop(cache, fd, offset);
     return ret;
 }
 
 ssize_t load_header(int fd, Header* header) {
     if (read_lock_wait(fd, 0, SEEK_SET, sizeof(Header)) < 0) return -1;
-    ssize_t ret = read(fd, header, sizeof(Header));
+    ssize_t ret = io_pread(fd, header, sizeof(Header), 0);
     if (unlock(fd, 0, SEEK_SET, sizeof(Header)) < 0) return -1;
     return ret;
 }
 
 ssize_t dump_header(int fd, Header* header) {
-    if (lseek(fd, 0, SEEK_SET) < 0) return -1;
     if (write_lock_wait(fd, 0, SEEK_SET, sizeof(Header)) < 0) return -1;
-    ssize_t ret = write(fd, header, sizeof(Header));
+    ssize_t ret = io_pwrite(fd, header, sizeof(Header), 0);
     if (unlock(fd, 0, SEEK_SET, sizeof(Header)) < 0) return -1;
     return ret;
 }
 
+// hand out size bytes aligned to align. a process appends into a claim of its own, [*end,
+// *reserved). a new claim of whole chunks is taken at the end of the file under the allocation
+// lock, and fallocate grows the file over it, so processes writing the same files never get the
+// same range and appends rarely reach the allocator. the fcntl lock only keeps other processes
+// out, claim_mutex the other handles of this one. a range handed out is never given back.
+// a claim of the data file is also read-locked at CLAIM_LOCK until the handle gives its space
+// back, since what it appended there may not be indexed yet, see punch_data. the index file is
+// left out, its whole-file locks would wait for these.
+static off_t grow_file(int fd, off_t* end, off_t* reserved, size_t size, size_t chunk, off_t align, int data) {
+    off_t offset = (*end + align - 1) / align * align;
+    if (offset + (off_t) size <= *reserved) {
+        *end = offset + (off_t) size;
+        return offset;
+    }
+
+    pthread_mutex_lock(&claim_mutex);
+    if (write_lock_wait(fd, ALLOC_LOCK, SEEK_SET, 1) < 0) {
+        pthread_mutex_unlock(&claim_mutex);
+        return -1;
+    }
+    struct stat st;
+    offset = -1;
+    if (fstat(fd, &st) == 0) {
+        offset = (st.st_size + align - 1) / align * align;
+        off_t step = chunk ? (off_t) chunk : (off_t) size;
+        off_t new_reserved = (offset + (off_t) size + step - 1) / step * step;
+        // without fallocate support the file is only extended, the writes allocate the blocks.
+        if (fallocate(fd, 0, st.st_size, new_reserved - st.st_size) < 0 &&
+            ((errno != EOPNOTSUPP && errno != ENOSYS) || ftruncate(fd, new_reserved) < 0)) {
+            offset = -1;
+        } else {
+#ifdef F_OFD_SETLK
+            if (data) ofd_read_lock(fd, CLAIM_LOCK + st.st_size, SEEK_SET, new_reserved - st.st_size);
+#endif
+            *end = offset + (off_t) size;
+            *reserved = new_reserved;
+        }
+    }
+    unlock(fd, ALLOC_LOCK, SEEK_SET, 1);
+    pthread_mutex_unlock(&claim_mutex);
+    return offset;
+}
+
+// give back the unused rest of the claim of this process, if no one claimed after it. the
+// claim is dropped either way, so a handle opened later starts a claim of its own.
+static void shrink_file(int fd, off_t end, off_t* reserved, int data) {
+    pthread_mutex_lock(&claim_mutex);
+    if (write_lock_wait(fd, ALLOC_LOCK, SEEK_SET, 1) == 0) {
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size == *reserved && end < *reserved) ftruncate(fd, end);
+#ifdef F_OFD_SETLK
+        if (data) ofd_unlock(fd, CLAIM_LOCK, SEEK_SET, ALLOC_LOCK - CLAIM_LOCK);
+#endif
+        unlock(fd, ALLOC_LOCK, SEEK_SET, 1);
+    }
+    *reserved = end;
+    pthread_mutex_unlock(&claim_mutex);
+}
+
+// whether a claim of another handle, of this process or another, overlaps [offset, offset + len).
+static int foreign_claim(int fd, off_t offset, off_t len) {
+#ifdef F_OFD_SETLK
+    struct flock lock;
+    memset(&lock, 0, sizeof(lock));
+    lock.l_type = F_WRLCK;
+    lock.l_whence = SEEK_SET;
+    lock.l_start = CLAIM_LOCK + offset;
+    lock.l_len = len;
+    if (fcntl(fd, F_OFD_GETLK, &lock) < 0) return -1;
+    return lock.l_type != F_UNLCK;
+#else
+    // the claims of others cannot be seen, so any of them may overlap.
+    return 1;
+#endif
+}
+
+// punch a hole over [offset, offset + len) of a data file, under the allocation lock so no one
+// claims the range meanwhile. fails with EBUSY while a claim of another handle overlaps it.
+int punch_data(int fd, off_t offset, off_t len) {
+    pthread_mutex_lock(&claim_mutex);
+    if (write_lock_wait(fd, ALLOC_LOCK, SEEK_SET, 1) < 0) {
+        pthread_mutex_unlock(&claim_mutex);
+        return -1;
+    }
+    int ret = foreign_claim(fd, offset, len);
+    if (ret > 0) {
+        errno = EBUSY;
+        ret = -1;
+    }
+#ifdef FALLOC_FL_PUNCH_HOLE
+    // readers in other processes read-lock what they read, the punch waits for them.
+    if (ret == 0 && (ret = write_lock_wait(fd, offset, SEEK_SET, len)) == 0) {
+        ret = fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, len);
+        unlock(fd, offset, SEEK_SET, len);
+    }
+#endif
+    int err = errno;
+    unlock(fd, ALLOC_LOCK, SEEK_SET, 1);
+    pthread_mutex_unlock(&claim_mutex);
+    errno = err;
+    return ret;
+}
+
+void release_space(int idx_fd, int data_fd, Header* header) {
+    shrink_file(idx_fd, header->idx_end, &header->idx_reserved, 0);
+    if (data_fd >= 0) shrink_file(data_fd, header->data_end, &header->data_reserved, 1);
+}
+
+off_t alloc_page(int fd, Header* header) {
+    return grow_file(fd, &header->idx_end, &header->idx_reserved, sizeof(IndexPage), header->idx_chunk,
+                     sizeof(IndexPage), 0);
+}
+
+off_t alloc_data(int fd, Header* header, size_t size) {
+    return grow_file(fd, &header->data_end, &header->data_reserved, size, header->data_chunk, 1, 1);
+}
+
+// like alloc_data, but the range starts on a block boundary and *size is rounded up to whole
+// blocks, so threads filling ranges of their own never read-modify-write a shared block.
+off_t alloc_data_blocks(int fd, Header* header, size_t* size) {
+    *size = (*size + IO_ALIGN - 1) / IO_ALIGN * IO_ALIGN;
+    return grow_file(fd, &header->data_end, &header->data_reserved, *size, header->data_chunk, IO_ALIGN, 1);
+}
+
 int init_page(IndexPage* page, uint8_t is_root, uint8_t type, off_t parent, off_t prev, off_t next,
               off_t offset, off_t left_most) {
     page->num_cells = 0;
@@ -83,11 +289,12 @@ int init_page(IndexPage* page, uint8_t is_root, uint8_t type, off_t parent, off_
     page->prev_page = prev;
     page->type = type;
     page->left_most = left_most;
+    page->left_most_count = 0;
     page->offset = offset;
     return 0;
 }
 
-int add_cell(IndexPage* leaf, int pos, uint64_t key, off_t offset, uint16_t slot) {
+int add_cell(IndexPage* leaf, int pos, uint64_t key, off_t offset, size_t size) {
     Cell* begin = leaf->cells;
     for (int i = leaf->num_cells - 1; i > pos; i--) {
         memcpy(begin + i + 1, begin + i, sizeof(Cell));
@@ -95,13 +302,20 @@ int add_cell(IndexPage* leaf, int pos, uint64_t key, off_t offset, uint16_t slot
 
     begin[pos + 1].key = key;
     begin[pos + 1].offset = offset;
-    begin[pos + 1].slot_index = slot;
+    begin[pos + 1].expire_at = 0;
+    begin[pos + 1].size = size;
 
     leaf->num_cells++;
 
     return 0;
 }
 
+// add_cell for a whole leaf cell, keeping its expiry.
+static void add_leaf_cell(IndexPage* leaf, int pos, const Cell* cell) {
+    add_cell(leaf, pos, cell->key, cell->offset, cell->size);
+    leaf->cells[pos + 1].expire_at = cell->expire_at;
+}
+
 int delete_cell(IndexPage* node, int pos) {
     if (node->num_cells < 1) return -1;
 
@@ -150,291 +364,268 @@ int search_leaf_node(IndexPage* node, uint64_t key, Cell* cell) {
     return (int) left - 1;
 }
 
-int add_root(int fd, Header* header, IndexPage* root, IndexPage* new_page, IndexPage* child, off_t root_offset) {
-    IndexPage* new_root = malloc_index_page();
-    init_page(new_root, 1, INTERNAL_NODE, -1, -1, -1, root_offset, root->offset);
+int find_parent(int fd, Header* header, off_t child, uint64_t key, IndexPage* parent) {
+    if (header->root_offset < 0 || header->root_offset == child) return 1;
+
+    off_t off = header->root_offset;
+    while (1) {
+        if (load_page(fd, off, parent) < 0) return -1;
+        if (parent->type != INTERNAL_NODE) return -1;
+
+        int pos = search_internal_node(parent, key);
+        if (pos < 0) return -1;
+
+        off_t next = pos >= MAX_CELL ? parent->left_most : parent->cells[pos].offset;
+        if (next == child) return 0;
+        if (next < 0) return -1;
+        off = next;
+    }
+}
+
+int init_root(int fd, Header* header, IndexPage* left_child, uint64_t key, off_t right_child, size_t count) {
+    IndexPage* root = malloc_index_page();
+    off_t root_offset;
+    if ((root_offset = alloc_page(fd, header)) < 0) {
+        free_index_page(&root);
+        return -1;
+    }
+    init_page(root, 1, INTERNAL_NODE, -1, -1, -1, root_offset, left_child->offset);
+
+    root->left_most_count = page_keys(left_child);
+    root->cells[0].key = key;
+    root->cells[0].offset = right_child;
+    root->cells[0].expire_at = 0;
+    root->cells[0].size = count;
+    root->num_cells = 1;
 
     header->node_number++;
     header->height++;
     header->root_offset = root_offset;
 
-    root->is_root = 1;
-    root->parent = root_offset;
-    new_page->parent = root_offset;
+    left_child->is_root = 0;
+    left_child->parent = root_offset;
 
-    if (dump_page(fd, new_root) < 0) {
-        free_index_page(&new_root);
+    if (dump_page(fd, root) < 0) {
+        free_index_page(&root);
         return -1;
     }
+    free_index_page(&root);
+    if (dump_page(fd, left_child) < 0) return -1;
+    if (dump_header(fd, header) < 0) return -1;
+    return 0;
+}
 
+int insert_internal_page(int fd, Header* header, IndexPage* prev, uint64_t key, off_t child, size_t count) {
+    stat_add(STAT_PAGE_SPLITS, 1);
     off_t off;
-    if ((off = lseek(fd, 0, SEEK_END)) < 0) {
-        free_index_page(&new_root);
+    if ((off = alloc_page(fd, header)) < 0) return -1;
+
+    IndexPage* recover_prev = malloc_index_page();
+    memcpy(recover_prev, prev, sizeof(IndexPage));
+
+    IndexPage* new_page = malloc_index_page();
+
+    init_page(new_page, 0, INTERNAL_NODE, prev->parent, prev->offset, prev->next_page, off, -1);
+    add_cell(new_page, -1, key, child, count);
+
+    prev->next_page = off;
+    header->node_number++;
+
+    if (dump_page(fd, new_page) < 0 || dump_page(fd, prev) < 0) {
+        while (dump_page(fd, recover_prev) < 0);
+        free_index_page(&new_page);
+        free_index_page(&recover_prev);
         return -1;
     }
-    new_page->offset = off;
-    root->next_page = new_page->offset;
-    if (child) child->parent = off;
-    if (dump_page(fd, new_page) < 0 || dump_page(fd, root) < 0 || dump_page(fd, child) < 0) {
-        free_index_page(&new_root);
+
+    if (add_internal_key(fd, header, prev, key, off, count) < 0) {
+        while (dump_page(fd, recover_prev) < 0);
+        free_index_page(&new_page);
+        free_index_page(&recover_prev);
         return -1;
     }
 
-    add_cell(new_root, -1, new_page->cells->key, new_page->offset, sizeof(IndexPage));
-    int ret = (int) dump_page(fd, new_root);
-    free_index_page(&new_root);
-    return ret;
-}
-
-int add_parent_key(int fd, Header* header, IndexPage* prev, IndexPage* new_page, uint64_t key) {
-    if (dump_page(fd, new_page) < 0 || dump_page(fd, prev) < 0) return -1;
-    return add_internal_key(fd, header, new_page, key);
+    free_index_page(&new_page);
+    free_index_page(&recover_prev);
+    return dump_header(fd, header) < 0 ? -1 : 0;
 }
 
 IndexPage* split_page(int fd, Header* header, IndexPage* page) {
-    off_t recover;
-    if ((recover = lseek(fd, 0, SEEK_END)) < 0) return NULL;
+    stat_add(STAT_PAGE_SPLITS, 1);
+    off_t off;
+    if ((off = alloc_page(fd, header)) < 0) return NULL;
 
     IndexPage* recover_page = malloc_index_page();
     memcpy(recover_page, page, sizeof(IndexPage));
 
     IndexPage* new_page = malloc_index_page();
 
-    off_t off = recover;
+    // internal pages keep the separator as their first cell, so left_most of the right half is never followed.
     init_page(new_page, 0, page->type, page->parent, page->offset, page->next_page, off, -1);
 
     uint8_t num = page->num_cells;
     uint8_t half = num / 2;
 
-    Cell* begin = page->cells;
-    Cell* new_begin = new_page->cells;
-
-    for (int i = half; i < num; i++) {
-        memcpy(new_begin + i - half, begin + i, sizeof(Cell));
-    }
-
+    memcpy(new_page->cells, page->cells + half, (num - half) * sizeof(Cell));
     new_page->num_cells = num - half;
 
     page->num_cells = half;
-    page->is_root = 0;
     page->next_page = new_page->offset;
 
     header->node_number++;
 
-    if (page->is_root) {
-        if (add_root(fd, header, page, new_page, NULL, off) < 0) {
-            ftruncate(fd, recover);
-            while (dump_page(fd, recover_page) < 0);
-            free_index_page(&new_page);
-            free_index_page(&recover_page);
-            return NULL;
-        }
-    } else {
-        if (add_parent_key(fd, header, page, new_page, new_page->cells->key) < 0) {
-            ftruncate(fd, recover);
-            while (dump_page(fd, recover_page) < 0);
-            free_index_page(&new_page);
-            free_index_page(&recover_page);
-            return NULL;
-        }
-    }
-
-    free_index_page(&new_page);
-    if (dump_header(fd, header) < 0) {
-        ftruncate(fd, recover);
+    if (dump_page(fd, new_page) < 0 || dump_page(fd, page) < 0 ||
+        add_internal_key(fd, header, page, new_page->cells[0].key, new_page->offset, page_keys(new_page)) < 0 ||
+        dump_header(fd, header) < 0) {
         while (dump_page(fd, recover_page) < 0);
+        memcpy(page, recover_page, sizeof(IndexPage));
+        header->node_number--;
+        free_index_page(&new_page);
         free_index_page(&recover_page);
         return NULL;
     }
-    free_index_page(&recover_page);
 
+    free_index_page(&recover_page);
     return new_page;
 }
 
-int insert_internal_page(int fd, Header* header, IndexPage* prev, IndexPage* child, uint64_t key) {
-    off_t recover;
-    if ((recover = lseek(fd, 0, SEEK_END)) < 0) return -1;
-
-    IndexPage* recover_prev = malloc_index_page();
-    memcpy(recover_prev, prev, sizeof(IndexPage));
-    IndexPage* recover_child = malloc_index_page();
-    memcpy(recover_child, child, sizeof(IndexPage));
-
-    IndexPage* new_page = malloc_index_page();
-
-    off_t off = recover;
-    init_page(new_page, 0, INTERNAL_NODE, prev->parent, prev->offset, -1, off, -1);
-
-    add_cell(new_page, -1, key, child->offset, sizeof(IndexPage));
-
-    prev->next_page = off;
-    header->node_number++;
-
-    child->parent = off;
-    if (dump_page(fd, child) < 0) {
-        free_index_page(&new_page);
-        return -1;
-    }
-
-    if (prev->is_root) {
-        if (add_root(fd, header, prev, new_page, child, off) < 0) {
-            ftruncate(fd, recover);
-            while (dump_page(fd, recover_prev) < 0);
-            while (dump_page(fd, recover_child) < 0);
-            free_index_page(&new_page);
-            free_index_page(&recover_prev);
-            free_index_page(&recover_child);
-            return -1;
-        }
-    } else {
-        if (add_parent_key(fd, header, prev, new_page, key) < 0) {
-            ftruncate(fd, recover);
-            while (dump_page(fd, recover_prev) < 0);
-            free_index_page(&new_page);
-            free_index_page(&recover_prev);
-            free_index_page(&recover_child);
-            return -1;
-        }
-    }
-
-    free_index_page(&new_page);
-    if (dump_header(fd, header) < 0) {
-        ftruncate(fd, recover);
-        while (dump_page(fd, recover_prev) < 0);
-        while (dump_page(fd, recover_child) < 0);
-        free_index_page(&recover_prev);
-        free_index_page(&recover_child);
-        return -1;
-    }
-    free_index_page(&recover_prev);
-    free_index_page(&recover_child);
-
-    return 0;
+// the number of keys under the entry of an internal page that search_internal_node returned.
+static void set_child_keys(IndexPage* node, int pos, size_t count) {
+    if (pos < 0 || pos >= MAX_CELL) node->left_most_count = count;
+    else node->cells[pos].size = count;
 }
 
-int init_root(int fd, Header* header, IndexPage* left_child, uint64_t key) {
-    IndexPage* root = malloc_index_page();
-    off_t root_offset;
-    if ((root_offset = lseek(fd, 0, SEEK_END)) < 0) {
-        free_index_page(&root);
-        return -1;
-    }
-    init_page(root, 1, INTERNAL_NODE, -1, -1, -1, root_offset, left_child->offset);
-
-    root->cells[0].key = key;
-    root->cells[0].offset = left_child->next_page;
-    root->cells[0].slot_index = -1;
-    root->num_cells = 1;
-
-    header->node_number++;
-    header->height++;
-    header->root_offset = root_offset;
+// child was split at key, new_child took count of its keys. the entry of child is only brought
+// down once it is in the page it ends up in, so a split of the parent still sees the old total.
+int add_internal_key(int fd, Header* header, IndexPage* child, uint64_t key, off_t new_child, size_t count) {
+    IndexPage* node = malloc_index_page();
 
-    if (dump_page(fd, root) < 0) {
-        free_index_page(&root);
+    int found = find_parent(fd, header, child->offset, key, node);
+    if (found < 0) {
+        free_index_page(&node);
         return -1;
     }
-    if (dump_header(fd, header) < 0) {
-        free_index_page(&root);
-        return -1;
+    if (found == 1) {
+        free_index_page(&node);
+        return init_root(fd, header, child, key, new_child, count);
     }
-    return 0;
-}
-
-int add_internal_key(int fd, Header* header, IndexPage* child, uint64_t key) {
-    IndexPage* node = malloc_index_page();
-    off_t node_offset = child->parent;
-
-    if (node_offset == -1) return init_root(fd, header, child, key);
 
-    if (load_page(fd, node_offset, node) < 0) return -1;
     int pos = search_internal_node(node, key);
-
-    if (pos < 0) return -1;
-    if (pos == MAX_CELL) return -1;
-
-    if (node->cells[pos].key == key) return -1;
+    if (pos >= MAX_CELL) pos = -1;
+    if (pos >= 0 && node->cells[pos].key == key) {
+        free_index_page(&node);
+        return -1;
+    }
 
     if (pos == MAX_CELL - 1) {
-        int ret = insert_internal_page(fd, header, node, child, key);
+        set_child_keys(node, pos, page_keys(child));
+        int ret = insert_internal_page(fd, header, node, key, new_child, count);
         free_index_page(&node);
         return ret;
     }
 
     if (node->num_cells == MAX_CELL) {
         IndexPage* new_node;
-        if (!(new_node = split_page(fd, header, node))) return -1;
-        int pos1 = search_internal_node(node, key);
-        int pos2 = search_internal_node(new_node, key);
+        if (!(new_node = split_page(fd, header, node))) {
+            free_index_page(&node);
+            return -1;
+        }
 
         int ret;
-        if (pos2 == -1) {
-            add_cell(node, pos1, key, child->offset, sizeof(IndexPage));
+        if (key < new_node->cells[0].key) {
+            int pos1 = search_internal_node(node, key);
+            set_child_keys(node, pos1, page_keys(child));
+            add_cell(node, pos1 >= MAX_CELL ? -1 : pos1, key, new_child, count);
             ret = (int) dump_page(fd, node);
         } else {
-            add_cell(new_node, pos2, key, child->offset, sizeof(IndexPage));
+            int pos2 = search_internal_node(new_node, key);
+            set_child_keys(new_node, pos2, page_keys(child));
+            add_cell(new_node, pos2, key, new_child, count);
             ret = (int) dump_page(fd, new_node);
         }
         free_index_page(&node);
         free_index_page(&new_node);
-        return ret;
+        return ret < 0 ? -1 : 0;
     }
 
-    add_cell(node, pos, key, child->offset, sizeof(IndexPage));
+    set_child_keys(node, pos, page_keys(child));
+    add_cell(node, pos, key, new_child, count);
     int ret = (int) dump_page(fd, node);
     free_index_page(&node);
 
-    return ret;
+    return ret < 0 ? -1 : 0;
 }
 
 int insert_leaf_page(int fd, Header* header, IndexPage* prev, const Cell* cell) {
-    off_t recover;
-    if ((recover = lseek(fd, 0, SEEK_END)) < 0) return -1;
+    stat_add(STAT_PAGE_SPLITS, 1);
+    off_t off;
+    if ((off = alloc_page(fd, header)) < 0) return -1;
 
     IndexPage* recover_prev = malloc_index_page();
     memcpy(recover_prev, prev, sizeof(IndexPage));
 
     IndexPage* new_leaf = malloc_index_page();
 
-    off_t off = recover;
-    init_page(new_leaf, 0, LEAF_NODE, prev->parent, prev->offset, -1, off, -1);
-    add_cell(new_leaf, -1, cell->key, cell->offset, cell->slot_index);
+    init_page(new_leaf, 0, LEAF_NODE, prev->parent, prev->offset, prev->next_page, off, -1);
+    add_leaf_cell(new_leaf, -1, cell);
 
     prev->next_page = new_leaf->offset;
+    header->node_number++;
 
     if (dump_page(fd, new_leaf) < 0 || dump_page(fd, prev) < 0) {
-        ftruncate(fd, recover);
+        while (dump_page(fd, recover_prev) < 0);
+        free_index_page(&new_leaf);
+        free_index_page(&recover_prev);
         return -1;
     }
 
-    int ret = add_internal_key(fd, header, new_leaf, cell->key);
+    // the new key is counted by insert_index, like any other.
+    int ret = add_internal_key(fd, header, prev, cell->key, new_leaf->offset, 0);
     free_index_page(&new_leaf);
-    if (ret < 0) {
-        ftruncate(fd, recover);
+    if (ret < 0 || dump_header(fd, header) < 0) {
         while (dump_page(fd, recover_prev) < 0);
+        free_index_page(&recover_prev);
         return -1;
     }
-    return ret;
+    free_index_page(&recover_prev);
+    return 0;
 }
 
 int load_index_header(int fd, Header* header) {
-    load_header(fd, header);
+    if (load_header(fd, header) < (ssize_t) sizeof(Header)) return -1;
+    if (header->magic_number != INDEX_MAGIC) {
+        errno = EINVAL;
+        return -1;
+    }
+    // a claim belongs to the process that took it, the one on disk may still be in use.
+    header->idx_reserved = header->idx_end;
+    header->data_reserved = header->data_end;
     return fd;
 }
 
 int create_tree(int fd) {
     Header header;
-    header.magic_number = 0x1234;
+    memset(&header, 0, sizeof(Header));
+    header.magic_number = INDEX_MAGIC;
+    header.flags = HEADER_CLEAN;
     header.height = 1;
     header.node_number = 1;
+    header.idx_end = HEADER_SIZE;
+    header.idx_reserved = HEADER_SIZE;
+    header.idx_chunk = DEFAULT_IDX_CHUNK;
+    header.data_chunk = DEFAULT_DATA_CHUNK;
 
     header.root_offset = -1;
 
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    header.origin = ((uint64_t) now.tv_sec * 1000000000 + (uint64_t) now.tv_nsec) ^ (uint64_t) getpid() << 40;
+
     if (dump_header(fd, &header) < 0) return -1;
 
     IndexPage* left_leaf = malloc_index_page();
     init_page(left_leaf, 0, LEAF_NODE, -1, -1, -1, -1, -1);
-    if ((left_leaf->offset = lseek(fd, 0, SEEK_END)) < 0) {
+    if ((left_leaf->offset = alloc_page(fd, &header)) < 0) {
         free_index_page(&left_leaf);
         return -1;
     }
@@ -454,6 +645,7 @@ int get_left_most_leaf(int fd, Header* header, IndexPage* leaf) {
     return 0;
 }
 
+// returns the position of the last cell whose key <= key in the leaf (-1 if none), or -2 on error.
 int search_index(int fd, Header* header, IndexPage* node, uint64_t key, Cell* Cell) {
     int flag = 0;
     if (!node) {
@@ -462,54 +654,61 @@ int search_index(int fd, Header* header, IndexPage* node, uint64_t key, Cell* Ce
     }
     off_t off = header->root_offset < 0 ? header->left_most_leaf_offset : header->root_offset;
 
-    if (load_page(fd, off, node) < 0) return -1;
+    int ret = -2;
+    if (load_page(fd, off, node) < 0) {
+        if (flag) free_index_page(&node);
+        return ret;
+    }
     while (node->type == INTERNAL_NODE) {
         int pos = search_internal_node(node, key);
-        if (pos < 0) return -1;
 
         off_t offset;
-        if (pos >= MAX_CELL) offset = node->left_most;
+        if (pos < 0) offset = -1;
+        else if (pos >= MAX_CELL) offset = node->left_most;
         else offset = node->cells[pos].offset;
 
-        if (load_page(fd, offset, node) < 0) return -1;
+        if (offset < 0 || load_page(fd, offset, node) < 0) {
+            if (flag) free_index_page(&node);
+            return ret;
+        }
     }
 
-    int ret = search_leaf_node(node, key, Cell);
+    ret = search_leaf_node(node, key, Cell);
     if (flag) free_index_page(&node);
     return ret;
 }
 
 ssize_t insert_index(int fd, Header* header, IndexPage* leaf, int pos, const Cell* cell) {
+    ssize_t ret;
     if (pos == MAX_CELL - 1) {
-        int ret = insert_leaf_page(fd, header, leaf, cell);
-        return ret;
-    }
-
-    if (leaf->num_cells == MAX_CELL) {
+        ret = insert_leaf_page(fd, header, leaf, cell);
+    } else if (leaf->num_cells == MAX_CELL) {
         IndexPage* new_leaf;
         if (!(new_leaf = split_page(fd, header, leaf))) return -1;
         int pos1 = search_leaf_node(leaf, cell->key, NULL);
         int pos2 = search_leaf_node(new_leaf, cell->key, NULL);
 
-        int ret;
         if (pos2 == -1) {
-            add_cell(leaf, pos1, cell->key, cell->offset, cell->slot_index);
+            add_leaf_cell(leaf, pos1, cell);
             ret = (int) dump_page(fd, leaf);
         } else {
-            add_cell(new_leaf, pos2, cell->key, cell->offset, cell->slot_index);
+            add_leaf_cell(new_leaf, pos2, cell);
             ret = (int) dump_page(fd, new_leaf);
         }
         free_index_page(&new_leaf);
-        return ret;
+    } else {
+        add_leaf_cell(leaf, pos, cell);
+        ret = dump_page(fd, leaf);
     }
-
-    add_cell(leaf, pos, cell->key, cell->offset, cell->slot_index);
-    return dump_page(fd, leaf);
+    if (ret < 0 || count_adjust(fd, header, cell->key, 1) < 0) return -1;
+    return ret;
 }
 
-ssize_t delete_index(int fd, IndexPage* leaf, int pos) {
+ssize_t delete_index(int fd, Header* header, IndexPage* leaf, int pos) {
+    uint64_t key = leaf->cells[pos].key;
     int ret = delete_cell(leaf, pos);
     if (dump_page(fd, leaf) < 0) return -1;
+    if (ret == 0 && count_adjust(fd, header, key, -1) < 0) return -1;
     return ret;
 }
 
@@ -544,3 +743,155 @@ int next_key(int fd, IndexPage* leaf, int* pos, Cell* cell) {
     }
     return 0;
 }
+
+size_t page_keys(const IndexPage* page) {
+    if (page->type == LEAF_NODE) return page->num_cells;
+    size_t count = page->left_most >= 0 ? page->left_most_count : 0;
+    for (int i = 0; i < page->num_cells; i++) count += page->cells[i].size;
+    return count;
+}
+
+// add delta to the counts on the way from the root to the leaf of key. a no-op unless the tree
+// keeps counts.
+int count_adjust(int fd, Header* header, uint64_t key, int delta) {
+    if (!(header->flags & HEADER_COUNTS) || header->root_offset < 0) return 0;
+    IndexPage* node = malloc_index_page();
+    if (node == NULL) return -1;
+
+    off_t offset = header->root_offset;
+    int ret = 0;
+    while (ret == 0) {
+        if (load_page(fd, offset, node) < 0) {
+            ret = -1;
+            break;
+        }
+        if (node->type != INTERNAL_NODE) break;
+        int pos = search_internal_node(node, key);
+        if (pos < 0) {
+            ret = -1;
+            break;
+        }
+        if (pos >= MAX_CELL) {
+            node->left_most_count += delta;
+            offset = node->left_most;
+        } else {
+            node->cells[pos].size += delta;
+            offset = node->cells[pos].offset;
+        }
+        if (dump_page(fd, node) < 0) ret = -1;
+    }
+    free_index_page(&node);
+    return ret;
+}
+
+static int count_subtree(int fd, off_t offset, size_t* count) {
+    IndexPage* page = malloc_index_page();
+    if (page == NULL) return -1;
+    if (load_page(fd, offset, page) < 0) {
+        free_index_page(&page);
+        return -1;
+    }
+    int ret = 0;
+    if (page->type == INTERNAL_NODE) {
+        size_t child = 0;
+        if (page->left_most >= 0 && (ret = count_subtree(fd, page->left_most, &child)) == 0) {
+            page->left_most_count = child;
+        }
+        for (int i = 0; ret == 0 && i < page->num_cells; i++) {
+            if ((ret = count_subtree(fd, page->cells[i].offset, &child)) == 0) page->cells[i].size = child;
+        }
+        if (ret == 0 && dump_page(fd, page) < 0) ret = -1;
+    }
+    *count = page_keys(page);
+    free_index_page(&page);
+    return ret;
+}
+
+// fill in the counts of every internal page, one visit per page.
+int count_tree(int fd, Header* header) {
+    size_t count;
+    if (header->root_offset < 0) return 0;
+    return count_subtree(fd, header->root_offset, &count);
+}
+
+int count_keys(int fd, Header* header, size_t* count) {
+    IndexPage* page = malloc_index_page();
+    if (page == NULL) return -1;
+    off_t offset = header->root_offset < 0 ? header->left_most_leaf_offset : header->root_offset;
+    int ret = load_page(fd, offset, page) < 0 ? -1 : 0;
+    if (ret == 0) *count = page_keys(page);
+    free_index_page(&page);
+    return ret;
+}
+
+// the number of keys below key.
+int rank_key(int fd, Header* header, uint64_t key, size_t* rank) {
+    IndexPage* node = malloc_index_page();
+    if (node == NULL) return -1;
+    *rank = 0;
+    off_t offset = header->root_offset < 0 ? header->left_most_leaf_offset : header->root_offset;
+    for (;;) {
+        if (load_page(fd, offset, node) < 0) {
+            free_index_page(&node);
+            return -1;
+        }
+        if (node->type == LEAF_NODE) break;
+        int pos = search_internal_node(node, key);
+        if (pos < 0) {
+            free_index_page(&node);
+            return -1;
+        }
+        if (pos >= MAX_CELL) {
+            offset = node->left_most;
+            continue;
+        }
+        if (node->left_most >= 0) *rank += node->left_most_count;
+        for (int i = 0; i < pos; i++) *rank += node->cells[i].size;
+        offset = node->cells[pos].offset;
+    }
+    int pos = search_leaf_node(node, key, NULL);
+    *rank += (size_t) (pos + 1) - (pos >= 0 && node->cells[pos].key == key);
+    free_index_page(&node);
+    return 0;
+}
+
+// the cell of the key with rank keys below it. ERANGE if there are not that many.
+int select_key(int fd, Header* header, size_t rank, Cell* cell) {
+    IndexPage* node = malloc_index_page();
+    if (node == NULL) return -1;
+    off_t offset = header->root_offset < 0 ? header->left_most_leaf_offset : header->root_offset;
+    for (;;) {
+        if (load_page(fd, offset, node) < 0) {
+            free_index_page(&node);
+            return -1;
+        }
+        if (node->type == LEAF_NODE) break;
+        offset = -1;
+        if (node->left_most >= 0 && rank < node->left_most_count) {
+            offset = node->left_most;
+        } else {
+            if (node->left_most >= 0) rank -= node->left_most_count;
+            for (int i = 0; i < node->num_cells; i++) {
+                if (rank < node->cells[i].size) {
+                    offset = node->cells[i].offset;
+                    break;
+                }
+                rank -= node->cells[i].size;
+            }
+        }
+        if (offset < 0) {
+            free_index_page(&node);
+            errno = ERANGE;
+            return -1;
+        }
+    }
+    int ret = 0;
+    if (rank < node->num_cells) {
+        memcpy(cell, node->cells + rank, sizeof(Cell));
+    } else {
+        errno = ERANGE;
+        ret = -1;
+    }
+    free_index_page(&node);
+    return ret;
+}
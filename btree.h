@@ -5,9 +5,21 @@
 #ifndef MDBM_BTREE_H
 #define MDBM_BTREE_H
 
+#include <stdint.h>
 #include <sys/types.h>
 
 #define MAX_CELL 126
+#define HEADER_SIZE 4096 // the header is padded to a full page, so every index page is page aligned.
+#define ALLOC_LOCK ((off_t) 1 << 62) // a byte past any data, write-locked while a process claims space.
+#define CLAIM_LOCK ((off_t) 1 << 61) // a claim [a, b) is read-locked at CLAIM_LOCK + a by its handle.
+#define INDEX_MAGIC 0x1235
+#define HEADER_CLEAN 0x1 // set while no writer has the file open, cleared by db_open.
+#define HEADER_COUNTS 0x2 // inserts and deletes keep the key counts of internal pages up to date.
+#define HEADER_UINT_KEYS 0x4 // the database holds uint64_t keys, see key_kind in mdbm.c.
+#define HEADER_BYTE_KEYS 0x8 // the database holds byte-string keys.
+
+#define DEFAULT_IDX_CHUNK (1 << 20) // the index file grows by this much at a time.
+#define DEFAULT_DATA_CHUNK (4 << 20) // the data file grows by this much at a time.
 
 typedef struct Cell Cell;
 typedef struct IndexPage IndexPage;
@@ -20,18 +32,29 @@ typedef enum {
 
 struct Header {
     int magic_number;
+    uint32_t flags;
     size_t node_number;
     size_t height;
 
     off_t root_offset;
     off_t left_most_leaf_offset;
+
+    // both files are preallocated past their logical end, so the end is kept here instead of SEEK_END.
+    off_t idx_end;
+    off_t idx_reserved;
+    off_t data_end;
+    off_t data_reserved;
+    size_t idx_chunk;
+    size_t data_chunk;
+    uint64_t key_layers; // the layers of byte-string keys made so far, see mdbm.c.
+    uint64_t origin; // drawn when the files are created, the tree of an index takes the one of its database.
 };
 
 struct Cell {
     uint64_t key;
     off_t offset; // if page is leaf, it is the offset of data page, else it is the offset of subpage.
-    size_t slot_index; // the index of slot_index.
-    size_t tuple_size;
+    uint64_t expire_at; // if page is leaf, the unix time in seconds the value expires at, 0 if never.
+    size_t size; // if page is leaf, it is the size of the value, else it is the number of keys under the subpage.
 };
 
 struct IndexPage {
@@ -44,9 +67,12 @@ struct IndexPage {
     off_t prev_page;
     off_t next_page;
     Cell cells[MAX_CELL];
-    char padding[16];
+    uint64_t left_most_count; // only for internal node, the number of keys under left_most.
+    char padding[8];
 };
 
+typedef void (*PageHook)(int fd, off_t offset, void* arg);
+
 IndexPage* malloc_index_page();
 void free_index_page(IndexPage** page);
 Cell* malloc_cell();
@@ -55,14 +81,39 @@ void free_cell(Cell** cell);
 int first_key(int fd, Header* header, IndexPage* leaf, Cell* cell);
 int next_key(int fd, IndexPage* leaf, int* pos, Cell* cell);
 
+ssize_t load_page(int fd, off_t offset, IndexPage* page);
+ssize_t dump_page(int fd, IndexPage* page);
+int set_page_hook(int fd, PageHook hook, void* arg);
+
+int search_internal_node(IndexPage* node, uint64_t key);
+int search_leaf_node(IndexPage* node, uint64_t key, Cell* cell);
+int add_cell(IndexPage* leaf, int pos, uint64_t key, off_t offset, size_t size);
+int delete_cell(IndexPage* node, int pos);
+int init_page(IndexPage* page, uint8_t is_root, uint8_t type, off_t parent, off_t prev, off_t next,
+              off_t offset, off_t left_most);
+IndexPage* split_page(int fd, Header* header, IndexPage* page);
+
 int load_index_header(int fd, Header* header);
+ssize_t dump_header(int fd, Header* header);
+off_t alloc_page(int fd, Header* header);
+off_t alloc_data(int fd, Header* header, size_t size);
+off_t alloc_data_blocks(int fd, Header* header, size_t* size);
+void release_space(int idx_fd, int data_fd, Header* header);
+int punch_data(int fd, off_t offset, off_t len);
 
 int create_tree(int fd);
 int get_left_most_leaf(int fd, Header* header, IndexPage* leaf);
 
 ssize_t insert_index(int fd, Header* header, IndexPage* leaf, int pos, const Cell* cell);
 int search_index(int fd, Header* header, IndexPage* node, uint64_t key, Cell* Cell);
-ssize_t delete_index(int fd, IndexPage* leaf, int pos);
+ssize_t delete_index(int fd, Header* header, IndexPage* leaf, int pos);
 ssize_t update_index(int fd, IndexPage* leaf, int pos, const Cell* cell);
 
+size_t page_keys(const IndexPage* page);
+int count_adjust(int fd, Header* header, uint64_t key, int delta);
+int count_tree(int fd, Header* header);
+int count_keys(int fd, Header* header, size_t* count);
+int rank_key(int fd, Header* header, uint64_t key, size_t* rank);
+int select_key(int fd, Header* header, size_t rank, Cell* cell);
+
 #endif //MDBM_BTREE_H
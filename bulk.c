@@ -0,0 +1,161 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bulk.h"
+
+// builds a tree bottom-up from cells in key order, writing every page once. one page per level
+// is open at a time. when it is full the next page at its level is started and its first key
+// goes up into the level above, so pages come out as full as a sequential load leaves them.
+// the first page of every level keeps its first child in left_most, like the root init_root
+// makes, so keys below every separator still have somewhere to go. internal cells get the key
+// counts of their pages, whether or not the tree keeps them up to date afterwards.
+
+struct BulkBuilder {
+    int fd;
+    Header* header;
+    int height;
+    IndexPage* pages[BULK_MAX_HEIGHT];
+    int empty;
+    uint64_t last;
+};
+
+// header belongs to a tree fresh from create_tree, its one empty leaf becomes the first leaf.
+BulkBuilder* bulk_open(int fd, Header* header) {
+    if (header->root_offset >= 0 || header->node_number != 1) {
+        errno = EINVAL;
+        return NULL;
+    }
+    BulkBuilder* builder = malloc(sizeof(BulkBuilder));
+    if (builder == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    memset(builder, 0, sizeof(BulkBuilder));
+    builder->fd = fd;
+    builder->header = header;
+    builder->height = 1;
+    builder->empty = 1;
+    if ((builder->pages[0] = malloc_index_page()) == NULL) {
+        free(builder);
+        errno = ENOMEM;
+        return NULL;
+    }
+    init_page(builder->pages[0], 0, LEAF_NODE, -1, -1, -1, header->left_most_leaf_offset, -1);
+    return builder;
+}
+
+// the entry of the open page at level in the open page above it, which is its last cell or,
+// for the first page of the level, left_most.
+static void set_open_count(BulkBuilder* builder, int level) {
+    IndexPage* parent = builder->pages[level + 1];
+    size_t count = page_keys(builder->pages[level]);
+    if (parent->num_cells) parent->cells[parent->num_cells - 1].size = count;
+    else parent->left_most_count = count;
+}
+
+// the page at level is full: write it and continue in a new one whose first key is key.
+static int next_page(BulkBuilder* builder, int level, uint64_t key) {
+    IndexPage* full = builder->pages[level];
+    IndexPage* page = malloc_index_page();
+    if (page == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    off_t offset = alloc_page(builder->fd, builder->header);
+    if (offset < 0) {
+        free_index_page(&page);
+        return -1;
+    }
+    init_page(page, 0, full->type, -1, full->offset, -1, offset, -1);
+    full->next_page = offset;
+    builder->header->node_number++;
+
+    if (level + 1 == builder->height) {
+        if (builder->height == BULK_MAX_HEIGHT) {
+            free_index_page(&page);
+            errno = EOVERFLOW;
+            return -1;
+        }
+        IndexPage* parent = malloc_index_page();
+        if (parent == NULL) {
+            free_index_page(&page);
+            errno = ENOMEM;
+            return -1;
+        }
+        off_t parent_offset = alloc_page(builder->fd, builder->header);
+        if (parent_offset < 0) {
+            free_index_page(&parent);
+            free_index_page(&page);
+            return -1;
+        }
+        init_page(parent, 0, INTERNAL_NODE, -1, -1, -1, parent_offset, full->offset);
+        parent->left_most_count = page_keys(full);
+        full->parent = parent_offset;
+        builder->pages[builder->height++] = parent;
+        builder->header->node_number++;
+    } else {
+        // the full page is complete, so its count goes up before the parent may be written.
+        set_open_count(builder, level);
+        if (builder->pages[level + 1]->num_cells == MAX_CELL && next_page(builder, level + 1, key) < 0) {
+            free_index_page(&page);
+            return -1;
+        }
+    }
+
+    IndexPage* parent = builder->pages[level + 1];
+    add_cell(parent, parent->num_cells - 1, key, offset, 0);
+    page->parent = parent->offset;
+
+    ssize_t ret = dump_page(builder->fd, full);
+    free_index_page(&full);
+    builder->pages[level] = page;
+    if (ret < 0) {
+        errno = EIO;
+        return -1;
+    }
+    return 0;
+}
+
+// cells must come in strictly increasing key order.
+int bulk_add(BulkBuilder* builder, const Cell* cell) {
+    if (!builder->empty && cell->key <= builder->last) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (builder->pages[0]->num_cells == MAX_CELL && next_page(builder, 0, cell->key) < 0) return -1;
+
+    IndexPage* leaf = builder->pages[0];
+    memcpy(leaf->cells + leaf->num_cells++, cell, sizeof(Cell));
+    builder->empty = 0;
+    builder->last = cell->key;
+    return 0;
+}
+
+// writes the open pages and the header.
+int bulk_finish(BulkBuilder** builder) {
+    BulkBuilder* b = *builder;
+    Header* header = b->header;
+    IndexPage* top = b->pages[b->height - 1];
+    if (b->height > 1) top->is_root = 1;
+    header->height = b->height;
+    header->root_offset = b->height > 1 ? top->offset : -1;
+
+    for (int level = 0; level + 1 < b->height; level++) set_open_count(b, level);
+
+    int ret = 0;
+    for (int level = 0; level < b->height; level++) {
+        if (dump_page(b->fd, b->pages[level]) < 0) ret = -1;
+    }
+    if (ret == 0 && dump_header(b->fd, header) < 0) ret = -1;
+    bulk_abort(builder);
+    if (ret < 0) errno = EIO;
+    return ret;
+}
+
+void bulk_abort(BulkBuilder** builder) {
+    if (!(*builder)) return;
+    for (int level = 0; level < (*builder)->height; level++) free_index_page((*builder)->pages + level);
+    free(*builder);
+    *builder = NULL;
+}
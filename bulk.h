@@ -0,0 +1,15 @@
+#ifndef MDBM_BULK_H
+#define MDBM_BULK_H
+
+#include "btree.h"
+
+#define BULK_MAX_HEIGHT 16
+
+typedef struct BulkBuilder BulkBuilder;
+
+BulkBuilder* bulk_open(int fd, Header* header);
+int bulk_add(BulkBuilder* builder, const Cell* cell);
+int bulk_finish(BulkBuilder** builder);
+void bulk_abort(BulkBuilder** builder);
+
+#endif //MDBM_BULK_H
@@ -0,0 +1,600 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "io.h"
+
+// write-through cache of index pages and data blocks. frames are found through a chained hash
+// table and evicted with the CLOCK algorithm. a pinned frame is never evicted or overwritten, a
+// write to it unlinks it instead, so a pinned block stays unchanged until the last pin is dropped.
+//
+// the frames and buckets are split into stripes, each with a mutex, a clock hand and chains of
+// its own, so threads touching different blocks rarely wait for each other. the hash of a block
+// picks its stripe, and a block only ever lives in a frame of that stripe.
+//
+// the whole cache lives in one mapping that holds no pointers, so it can be a shared memory
+// segment mapped by every process that opens the same database. blocks are keyed by the file's
+// device and inode rather than by fd, which differs between processes.
+
+#define CACHE_MAGIC 0x6d64626d63616368ULL
+#define ATTACH_RETRIES 8
+#define READY_WAIT_MS 1000
+#define MAX_STRIPES 16
+#define STRIPE_MIN_FRAMES 64 // a smaller cache has fewer stripes, so that pins rarely fill one.
+
+typedef struct {
+    uint64_t file; // 0 when the frame is free.
+    off_t offset;
+    int32_t next; // next frame in the hash chain, -1 at the end.
+    uint32_t pins;
+    uint8_t referenced;
+}Frame;
+
+typedef struct {
+    pthread_mutex_t mutex;
+    size_t hand; // the next frame of the stripe the clock looks at, counted from its first.
+    size_t pinned; // frames of the stripe with pins.
+}Stripe;
+
+typedef struct {
+    uint64_t magic;
+    atomic_int ready; // set by the creator once the segment is initialized.
+    size_t num_frames;
+    size_t num_buckets;
+    size_t num_stripes; // a power of two, dividing both of the above.
+    size_t attached; // processes mapping a shared segment, under the mutex of stripe 0.
+    Stripe stripes[MAX_STRIPES];
+}Segment;
+
+struct PageCache {
+    Segment* segment;
+    size_t map_size;
+    IndexPage* pages; // page i belongs to frame i, aligned for O_DIRECT.
+    Frame* frames;
+    int32_t* buckets;
+    atomic_size_t pins; // pins held by this process, over all stripes.
+    char* name; // shm name, NULL for a private cache.
+};
+
+static _Atomic(PageCache*) caches[IO_MAX_FD];
+static uint64_t files[IO_MAX_FD];
+
+static size_t layout(size_t num_frames, size_t num_buckets) {
+    size_t size = IO_ALIGN + num_frames * sizeof(IndexPage) + num_frames * sizeof(Frame) + num_buckets * sizeof(int32_t);
+    return (size + IO_ALIGN - 1) / IO_ALIGN * IO_ALIGN;
+}
+
+static void map_arrays(PageCache* cache) {
+    char* base = (char*) cache->segment;
+    cache->pages = (IndexPage*) (base + IO_ALIGN);
+    cache->frames = (Frame*) (base + IO_ALIGN + cache->segment->num_frames * sizeof(IndexPage));
+    cache->buckets = (int32_t*) (cache->frames + cache->segment->num_frames);
+}
+
+static size_t frames_per_stripe(const PageCache* cache) {
+    return cache->segment->num_frames / cache->segment->num_stripes;
+}
+
+static void clear_stripe(PageCache* cache, size_t stripe, int keep_pins) {
+    Segment* segment = cache->segment;
+    size_t num_frames = frames_per_stripe(cache);
+    size_t num_buckets = segment->num_buckets / segment->num_stripes;
+    for (size_t i = stripe * num_frames; i < (stripe + 1) * num_frames; i++) {
+        cache->frames[i].file = 0;
+        cache->frames[i].next = -1;
+        cache->frames[i].referenced = 0;
+        if (!keep_pins) cache->frames[i].pins = 0;
+    }
+    for (size_t i = stripe * num_buckets; i < (stripe + 1) * num_buckets; i++) cache->buckets[i] = -1;
+    segment->stripes[stripe].hand = 0;
+}
+
+static void clear_frames(PageCache* cache, int keep_pins) {
+    for (size_t i = 0; i < cache->segment->num_stripes; i++) clear_stripe(cache, i, keep_pins);
+}
+
+static int init_segment(PageCache* cache, size_t num_frames, size_t num_buckets, size_t num_stripes, int shared) {
+    Segment* segment = cache->segment;
+    segment->magic = CACHE_MAGIC;
+    segment->num_frames = num_frames;
+    segment->num_buckets = num_buckets;
+    segment->num_stripes = num_stripes;
+
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    if (shared) {
+        pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+        pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    }
+    int ret = 0;
+    for (size_t i = 0; i < num_stripes && ret == 0; i++) {
+        if ((ret = pthread_mutex_init(&segment->stripes[i].mutex, &attr)) != 0) {
+            while (i-- > 0) pthread_mutex_destroy(&segment->stripes[i].mutex);
+        }
+    }
+    pthread_mutexattr_destroy(&attr);
+    if (ret != 0) {
+        errno = ret;
+        return -1;
+    }
+
+    map_arrays(cache);
+    clear_frames(cache, 0);
+    atomic_store(&segment->ready, 1);
+    return 0;
+}
+
+// a process that died holding the mutex of a stripe may have left one of its chains half
+// updated, so the stripe is emptied. pins are kept, their frames just become unreachable until
+// released.
+static void lock(PageCache* cache, size_t stripe) {
+    pthread_mutex_t* mutex = &cache->segment->stripes[stripe].mutex;
+    if (pthread_mutex_lock(mutex) == EOWNERDEAD) {
+        clear_stripe(cache, stripe, 1);
+        pthread_mutex_consistent(mutex);
+    }
+}
+
+static void unlock_cache(PageCache* cache, size_t stripe) {
+    pthread_mutex_unlock(&cache->segment->stripes[stripe].mutex);
+}
+
+// the frames are rounded down to a whole number per stripe, the buckets up to a power of two.
+static size_t frames_for(size_t bytes, size_t* num_buckets, size_t* num_stripes) {
+    size_t num_frames = bytes / sizeof(IndexPage);
+    *num_stripes = 1;
+    while (*num_stripes < MAX_STRIPES && num_frames / (*num_stripes * 2) >= STRIPE_MIN_FRAMES) *num_stripes <<= 1;
+    num_frames = num_frames / *num_stripes * *num_stripes;
+    *num_buckets = *num_stripes;
+    while (*num_buckets < num_frames) *num_buckets <<= 1;
+    return num_frames;
+}
+
+PageCache* cache_open(size_t bytes) {
+    size_t num_buckets;
+    size_t num_stripes;
+    size_t num_frames = frames_for(bytes, &num_buckets, &num_stripes);
+    if (num_frames == 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    PageCache* cache = malloc(sizeof(PageCache));
+    if (cache == NULL) return NULL;
+    memset(cache, 0, sizeof(PageCache));
+    cache->map_size = layout(num_frames, num_buckets);
+    void* map = mmap(NULL, cache->map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED) {
+        free(cache);
+        errno = ENOMEM;
+        return NULL;
+    }
+    cache->segment = map;
+    if (init_segment(cache, num_frames, num_buckets, num_stripes, 0) < 0) {
+        munmap(map, cache->map_size);
+        free(cache);
+        return NULL;
+    }
+    return cache;
+}
+
+static char* segment_name(const char* path) {
+    char* real = realpath(path, NULL);
+    if (real == NULL) return NULL;
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (const char* p = real; *p; p++) h = (h ^ (uint8_t) *p) * 0x100000001b3ULL;
+    free(real);
+
+    char* name = malloc(32);
+    if (name) snprintf(name, 32, "/mdbm-%016llx", (unsigned long long) h);
+    return name;
+}
+
+// maps the segment behind fd, initializing it if this process created it.
+static int map_segment(PageCache* cache, int fd, int created, size_t bytes) {
+    size_t num_buckets;
+    size_t num_stripes;
+    size_t num_frames = frames_for(bytes, &num_buckets, &num_stripes);
+    if (created) {
+        cache->map_size = layout(num_frames, num_buckets);
+        if (ftruncate(fd, (off_t) cache->map_size) < 0) return -1;
+    } else {
+        // the creator decides the size, wait until it has published it.
+        struct stat st;
+        for (int ms = 0;; ms++) {
+            if (fstat(fd, &st) < 0) return -1;
+            if (st.st_size > 0) break;
+            if (ms == READY_WAIT_MS) {
+                errno = ETIMEDOUT;
+                return -1;
+            }
+            usleep(1000);
+        }
+        cache->map_size = (size_t) st.st_size;
+    }
+
+    void* map = mmap(NULL, cache->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) return -1;
+    cache->segment = map;
+    if (created) return init_segment(cache, num_frames, num_buckets, num_stripes, 1);
+
+    for (int ms = 0; !atomic_load(&cache->segment->ready); ms++) {
+        if (ms == READY_WAIT_MS) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        usleep(1000);
+    }
+    Segment* segment = cache->segment;
+    if (segment->magic != CACHE_MAGIC || layout(segment->num_frames, segment->num_buckets) != cache->map_size ||
+        segment->num_stripes == 0 || segment->num_stripes > MAX_STRIPES ||
+        (segment->num_stripes & (segment->num_stripes - 1)) || segment->num_frames % segment->num_stripes ||
+        segment->num_buckets % segment->num_stripes) {
+        errno = EINVAL;
+        return -1;
+    }
+    map_arrays(cache);
+    return 0;
+}
+
+static int same_object(int fd, const char* name) {
+    int current = shm_open(name, O_RDWR, 0);
+    if (current < 0) return 0;
+    struct stat a, b;
+    int same = fstat(fd, &a) == 0 && fstat(current, &b) == 0 && a.st_ino == b.st_ino && a.st_dev == b.st_dev;
+    close(current);
+    return same;
+}
+
+// attaches to the segment shared by every process that opens path. bytes only matters for the
+// process that creates it. the last process to detach removes it.
+PageCache* cache_open_shared(const char* path, size_t bytes) {
+    if (bytes / sizeof(IndexPage) == 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    PageCache* cache = malloc(sizeof(PageCache));
+    if (cache == NULL) return NULL;
+    memset(cache, 0, sizeof(PageCache));
+    if ((cache->name = segment_name(path)) == NULL) {
+        free(cache);
+        return NULL;
+    }
+
+    for (int attempt = 0; attempt < ATTACH_RETRIES; attempt++) {
+        int created = 1;
+        int fd = shm_open(cache->name, O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (fd < 0 && errno == EEXIST) {
+            created = 0;
+            fd = shm_open(cache->name, O_RDWR, 0);
+        }
+        if (fd < 0) {
+            if (errno == ENOENT) continue;
+            break;
+        }
+
+        if (map_segment(cache, fd, created, bytes) < 0) {
+            int err = errno;
+            if (cache->segment) munmap(cache->segment, cache->map_size);
+            cache->segment = NULL;
+            if (created) shm_unlink(cache->name);
+            close(fd);
+            errno = err;
+            break;
+        }
+
+        // the last user may have unlinked the name between our open and now, then start over.
+        lock(cache, 0);
+        int alive = same_object(fd, cache->name);
+        // a segment nobody is attached to was left behind by processes that died, and the files
+        // may have changed since, so it starts out empty.
+        if (alive && cache->segment->attached++ == 0 && !created) clear_frames(cache, 1);
+        unlock_cache(cache, 0);
+        close(fd);
+        if (alive) return cache;
+
+        munmap(cache->segment, cache->map_size);
+        cache->segment = NULL;
+    }
+
+    free(cache->name);
+    free(cache);
+    if (errno == 0) errno = EAGAIN;
+    return NULL;
+}
+
+int cache_close(PageCache** cache) {
+    if (!(*cache)) return 0;
+    if ((*cache)->pins) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    Segment* segment = (*cache)->segment;
+    if ((*cache)->name) {
+        lock(*cache, 0);
+        if (--segment->attached == 0) shm_unlink((*cache)->name);
+        unlock_cache(*cache, 0);
+    } else {
+        for (size_t i = 0; i < segment->num_stripes; i++) pthread_mutex_destroy(&segment->stripes[i].mutex);
+    }
+    munmap(segment, (*cache)->map_size);
+    free((*cache)->name);
+    free(*cache);
+    *cache = NULL;
+    return 0;
+}
+
+static uint64_t hash_block(uint64_t file, off_t offset) {
+    return ((uint64_t) offset / sizeof(IndexPage)) * 0x9E3779B97F4A7C15ULL ^ file * 0xC2B2AE3D27D4EB4FULL;
+}
+
+// the top bits of the hash pick the stripe, lower ones the bucket within it.
+static size_t stripe_of(const PageCache* cache, uint64_t file, off_t offset) {
+    return (size_t) (hash_block(file, offset) >> 58) & (cache->segment->num_stripes - 1);
+}
+
+static size_t bucket_of(const PageCache* cache, uint64_t file, off_t offset) {
+    size_t num_buckets = cache->segment->num_buckets / cache->segment->num_stripes;
+    uint64_t h = hash_block(file, offset);
+    return stripe_of(cache, file, offset) * num_buckets + ((size_t) (h >> 17) & (num_buckets - 1));
+}
+
+static int32_t find_frame(const PageCache* cache, uint64_t file, off_t offset) {
+    int32_t i = cache->buckets[bucket_of(cache, file, offset)];
+    while (i >= 0 && (cache->frames[i].file != file || cache->frames[i].offset != offset)) i = cache->frames[i].next;
+    return i;
+}
+
+static void unlink_frame(PageCache* cache, int32_t frame) {
+    Frame* f = cache->frames + frame;
+    int32_t* link = cache->buckets + bucket_of(cache, f->file, f->offset);
+    while (*link != frame) link = &cache->frames[*link].next;
+    *link = f->next;
+    f->file = 0;
+    f->next = -1;
+}
+
+// returns a free frame of the stripe, or -1 if every frame of it is pinned.
+static int32_t evict(PageCache* cache, size_t stripe) {
+    Stripe* s = cache->segment->stripes + stripe;
+    size_t num_frames = frames_per_stripe(cache);
+    for (size_t i = 0; i < 2 * num_frames + 1; i++) {
+        int32_t frame = (int32_t) (stripe * num_frames + s->hand);
+        Frame* f = cache->frames + frame;
+        s->hand = (s->hand + 1) % num_frames;
+        if (f->pins) continue;
+        if (f->file == 0) return frame;
+        if (f->referenced) {
+            f->referenced = 0;
+            continue;
+        }
+        unlink_frame(cache, frame);
+        return frame;
+    }
+    return -1;
+}
+
+static int32_t insert_frame(PageCache* cache, uint64_t file, off_t offset) {
+    int32_t frame = evict(cache, stripe_of(cache, file, offset));
+    if (frame < 0) return -1;
+    Frame* f = cache->frames + frame;
+    f->file = file;
+    f->offset = offset;
+    size_t bucket = bucket_of(cache, file, offset);
+    f->next = cache->buckets[bucket];
+    cache->buckets[bucket] = frame;
+    return frame;
+}
+
+static uint64_t file_of(int fd) {
+    return fd >= 0 && fd < IO_MAX_FD ? files[fd] : 0;
+}
+
+// the cache is looked up by fd in load_page and dump_page. fds past IO_MAX_FD are not cached.
+int cache_attach(int fd, PageCache* cache) {
+    struct stat st;
+    if (fd < 0 || fd >= IO_MAX_FD || fstat(fd, &st) < 0) {
+        errno = EBADF;
+        return -1;
+    }
+    // 0 marks a free frame, which an id can only be if the device bits cancel out the inode.
+    uint64_t file = (uint64_t) st.st_dev << 40 ^ (uint64_t) st.st_ino;
+    files[fd] = file ? file : 1;
+    atomic_store_explicit(caches + fd, cache, memory_order_release);
+    return 0;
+}
+
+void cache_detach(int fd) {
+    if (fd < 0 || fd >= IO_MAX_FD) return;
+    atomic_store(caches + fd, NULL);
+}
+
+// drops the blocks of the file behind fd, which was replaced or truncated.
+void cache_purge(PageCache* cache, int fd) {
+    uint64_t file = file_of(fd);
+    if (file == 0) return;
+    size_t num_frames = frames_per_stripe(cache);
+    for (size_t stripe = 0; stripe < cache->segment->num_stripes; stripe++) {
+        lock(cache, stripe);
+        for (size_t i = stripe * num_frames; i < (stripe + 1) * num_frames; i++) {
+            if (cache->frames[i].file == file) unlink_frame(cache, (int32_t) i);
+        }
+        unlock_cache(cache, stripe);
+    }
+}
+
+PageCache* cache_of(int fd) {
+    if (fd < 0 || fd >= IO_MAX_FD) return NULL;
+    return atomic_load_explicit(caches + fd, memory_order_acquire);
+}
+
+// copies the cached page at offset into page, returns 1 on a hit and 0 on a miss.
+int cache_read(PageCache* cache, int fd, off_t offset, IndexPage* page) {
+    uint64_t file = file_of(fd);
+    size_t stripe = stripe_of(cache, file, offset);
+    lock(cache, stripe);
+    int32_t frame = find_frame(cache, file, offset);
+    if (frame >= 0) {
+        cache->frames[frame].referenced = 1;
+        memcpy(page, cache->pages + frame, sizeof(IndexPage));
+    }
+    unlock_cache(cache, stripe);
+    return frame >= 0;
+}
+
+void cache_fill(PageCache* cache, int fd, off_t offset, const IndexPage* page) {
+    uint64_t file = file_of(fd);
+    if (file == 0) return;
+    size_t stripe = stripe_of(cache, file, offset);
+    lock(cache, stripe);
+    int32_t frame = find_frame(cache, file, offset);
+    if (frame >= 0 && cache->frames[frame].pins) {
+        unlink_frame(cache, frame);
+        frame = -1;
+    }
+    if (frame < 0) frame = insert_frame(cache, file, offset);
+    if (frame >= 0) {
+        cache->frames[frame].referenced = 1;
+        memcpy(cache->pages + frame, page, sizeof(IndexPage));
+    }
+    unlock_cache(cache, stripe);
+}
+
+void cache_drop(PageCache* cache, int fd, off_t offset) {
+    uint64_t file = file_of(fd);
+    size_t stripe = stripe_of(cache, file, offset);
+    lock(cache, stripe);
+    int32_t frame = find_frame(cache, file, offset);
+    if (frame >= 0) unlink_frame(cache, frame);
+    unlock_cache(cache, stripe);
+}
+
+// the caller holds the mutex of the stripe of frame.
+static const char* pin_frame(PageCache* cache, int32_t frame, int32_t* pinned) {
+    Frame* f = cache->frames + frame;
+    if (f->pins++ == 0) cache->segment->stripes[(size_t) frame / frames_per_stripe(cache)].pinned++;
+    f->referenced = 1;
+    atomic_fetch_add(&cache->pins, 1);
+    *pinned = frame;
+    return (const char*) (cache->pages + frame);
+}
+
+// pins the cached block at offset, NULL on a miss.
+const char* cache_pin(PageCache* cache, int fd, off_t offset, int32_t* frame) {
+    uint64_t file = file_of(fd);
+    if (file == 0) return NULL;
+    size_t stripe = stripe_of(cache, file, offset);
+    lock(cache, stripe);
+    int32_t found = find_frame(cache, file, offset);
+    const char* block = found >= 0 ? pin_frame(cache, found, frame) : NULL;
+    unlock_cache(cache, stripe);
+    return block;
+}
+
+// caches a block read after a miss and pins it. a block cached by someone else in the meantime
+// is newer and wins. NULL if every frame of its stripe is pinned.
+const char* cache_pin_fill(PageCache* cache, int fd, off_t offset, const void* block, int32_t* frame) {
+    uint64_t file = file_of(fd);
+    if (file == 0) return NULL;
+    size_t stripe = stripe_of(cache, file, offset);
+    lock(cache, stripe);
+    int32_t found = find_frame(cache, file, offset);
+    if (found < 0 && (found = insert_frame(cache, file, offset)) >= 0) {
+        memcpy(cache->pages + found, block, sizeof(IndexPage));
+    }
+    const char* pinned = found >= 0 ? pin_frame(cache, found, frame) : NULL;
+    unlock_cache(cache, stripe);
+    return pinned;
+}
+
+void cache_unpin(PageCache* cache, int32_t frame) {
+    size_t stripe = (size_t) frame / frames_per_stripe(cache);
+    lock(cache, stripe);
+    Frame* f = cache->frames + frame;
+    if (--f->pins == 0) cache->segment->stripes[stripe].pinned--;
+    atomic_fetch_sub(&cache->pins, 1);
+    unlock_cache(cache, stripe);
+}
+
+// the offsets of the blocks of the file behind fd that are cached, at most max of them.
+size_t cache_list(PageCache* cache, int fd, off_t* offsets, size_t max) {
+    uint64_t file = file_of(fd);
+    if (file == 0) return 0;
+    size_t n = 0;
+    size_t num_frames = frames_per_stripe(cache);
+    for (size_t stripe = 0; stripe < cache->segment->num_stripes && n < max; stripe++) {
+        lock(cache, stripe);
+        for (size_t i = stripe * num_frames; i < (stripe + 1) * num_frames && n < max; i++) {
+            if (cache->frames[i].file == file) offsets[n++] = cache->frames[i].offset;
+        }
+        unlock_cache(cache, stripe);
+    }
+    return n;
+}
+
+// caches a prefetched block in a free frame, never evicting anything. a block already cached is
+// newer and kept. returns -1 once no frame of its stripe is free.
+int cache_warm(PageCache* cache, int fd, off_t offset, const void* block) {
+    uint64_t file = file_of(fd);
+    if (file == 0) return 0;
+    size_t stripe = stripe_of(cache, file, offset);
+    Stripe* s = cache->segment->stripes + stripe;
+    size_t num_frames = frames_per_stripe(cache);
+    int ret = 0;
+    lock(cache, stripe);
+    if (find_frame(cache, file, offset) < 0) {
+        ret = -1;
+        for (size_t i = 0; i < num_frames; i++) {
+            int32_t frame = (int32_t) (stripe * num_frames + s->hand);
+            Frame* f = cache->frames + frame;
+            s->hand = (s->hand + 1) % num_frames;
+            if (f->file || f->pins) continue;
+            f->file = file;
+            f->offset = offset;
+            f->referenced = 0;
+            size_t bucket = bucket_of(cache, file, offset);
+            f->next = cache->buckets[bucket];
+            cache->buckets[bucket] = frame;
+            memcpy(cache->pages + frame, block, sizeof(IndexPage));
+            ret = 0;
+            break;
+        }
+    }
+    unlock_cache(cache, stripe);
+    return ret;
+}
+
+// applies a write of size bytes at offset to the cached blocks it overlaps. each block is
+// updated under the mutex of its own stripe.
+void cache_write(PageCache* cache, int fd, off_t offset, const void* data, size_t size) {
+    uint64_t file = file_of(fd);
+    if (file == 0) return;
+    const char* src = data;
+    off_t end = offset + (off_t) size;
+    for (off_t block = offset / CACHE_BLOCK * CACHE_BLOCK; block < end; block += CACHE_BLOCK) {
+        size_t stripe = stripe_of(cache, file, block);
+        lock(cache, stripe);
+        int32_t frame = find_frame(cache, file, block);
+        if (frame >= 0 && cache->frames[frame].pins) {
+            unlink_frame(cache, frame);
+        } else if (frame >= 0) {
+            off_t from = offset > block ? offset : block;
+            off_t to = end < block + CACHE_BLOCK ? end : block + CACHE_BLOCK;
+            memcpy((char*) (cache->pages + frame) + (from - block), src + (from - offset), (size_t) (to - from));
+        }
+        unlock_cache(cache, stripe);
+    }
+}
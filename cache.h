@@ -0,0 +1,35 @@
+#ifndef MDBM_CACHE_H
+#define MDBM_CACHE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "btree.h"
+
+#define DB_DIRECT_CACHE (64 << 20) // cache of a handle opened with O_DIRECT.
+#define CACHE_BLOCK 4096 // data blocks are cached at this size and alignment, the size of an index page.
+
+typedef struct PageCache PageCache;
+
+PageCache* cache_open(size_t bytes);
+PageCache* cache_open_shared(const char* path, size_t bytes);
+int cache_close(PageCache** cache);
+
+int cache_attach(int fd, PageCache* cache);
+void cache_detach(int fd);
+void cache_purge(PageCache* cache, int fd);
+PageCache* cache_of(int fd);
+
+int cache_read(PageCache* cache, int fd, off_t offset, IndexPage* page);
+void cache_fill(PageCache* cache, int fd, off_t offset, const IndexPage* page);
+void cache_drop(PageCache* cache, int fd, off_t offset);
+
+const char* cache_pin(PageCache* cache, int fd, off_t offset, int32_t* frame);
+const char* cache_pin_fill(PageCache* cache, int fd, off_t offset, const void* block, int32_t* frame);
+void cache_unpin(PageCache* cache, int32_t frame);
+void cache_write(PageCache* cache, int fd, off_t offset, const void* data, size_t size);
+
+size_t cache_list(PageCache* cache, int fd, off_t* offsets, size_t max);
+int cache_warm(PageCache* cache, int fd, off_t offset, const void* block);
+
+#endif //MDBM_CACHE_H
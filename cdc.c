@@ -0,0 +1,554 @@
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "cdc.h"
+#include "lock.h"
+
+// the change feed of a database is a series of append-only segments, <name>.cdc.<seq>, where seq
+// is the sequence number of the first change in it. every write that succeeds appends one change
+// under the exclusive latch, so the numbers follow the order the writes took effect in, starting
+// at 1. buffered writes are logged when they are made, not when they are flushed. each change is
+// checksummed: a reader stops at one that is not complete yet, and a writer that reopens the feed
+// cuts a torn one off. the current segment is locked, one process writes the feed at a time.
+// a tailer, usually in another process, reads the segments in large chunks and applies the
+// changes to a replica of its own. a change carries the whole value, so applying one twice does
+// no harm and a replica can resume from any position at or before the one it has reached.
+
+typedef struct {
+    uint32_t magic;
+    uint32_t unused;
+    uint64_t first; // sequence number of the first change.
+}SegmentHeader;
+
+typedef struct {
+    uint64_t seq;
+    uint64_t key;
+    uint64_t expire_at;
+    uint32_t size;
+    uint32_t op;
+    uint32_t check; // of the entry with check 0, and of the value.
+    uint32_t unused;
+}ChangeEntry;
+
+struct ChangeFeed {
+    int fd; // current segment.
+    off_t end;
+    uint64_t first;
+    uint64_t next_seq;
+};
+
+struct CdcTailer {
+    char* name;
+    uint64_t seq; // of the next change to return.
+    int fd; // segment being read.
+    off_t pos;
+    off_t batch_pos; // where the changes of the last read start.
+    char* buf; // CDC_READ_CHUNK bytes, more for a change that does not fit.
+    size_t cap;
+};
+
+static uint32_t checksum(const ChangeEntry* entry, const void* value) {
+    ChangeEntry copy = *entry;
+    copy.check = 0;
+    uint32_t hash = 2166136261u;
+    const unsigned char* p = (const unsigned char*) &copy;
+    for (size_t i = 0; i < sizeof(ChangeEntry); i++) hash = (hash ^ p[i]) * 16777619u;
+    p = value;
+    for (size_t i = 0; i < entry->size; i++) hash = (hash ^ p[i]) * 16777619u;
+    return hash;
+}
+
+// returns the length of the change at the start of buf, 0 if it is cut off or invalid. *wanted
+// is set to the length it needs, 0 if buf does not start with a change.
+static size_t parse_change(const char* buf, size_t len, ChangeEntry* entry, size_t* wanted) {
+    *wanted = 0;
+    if (len < sizeof(ChangeEntry)) return 0;
+    memcpy(entry, buf, sizeof(ChangeEntry));
+    if (entry->op != CDC_PUT && entry->op != CDC_DELETE) return 0;
+    *wanted = sizeof(ChangeEntry) + entry->size;
+    if (len < *wanted || checksum(entry, buf + sizeof(ChangeEntry)) != entry->check) return 0;
+    return *wanted;
+}
+
+static char* segment_path(const char* name, uint64_t first, const char* suffix) {
+    char* path = malloc(strlen(name) + strlen(suffix) + 32);
+    if (path) sprintf(path, "%s.cdc.%llu%s", name, (unsigned long long) first, suffix);
+    return path;
+}
+
+static int compare_seq(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*) a;
+    uint64_t y = *(const uint64_t*) b;
+    return x < y ? -1 : x > y;
+}
+
+// the first sequence numbers of the segments of name in order. returns how many there are.
+static ssize_t list_segments(const char* name, uint64_t** firsts) {
+    const char* slash = strrchr(name, '/');
+    const char* base = slash ? slash + 1 : name;
+    size_t base_len = strlen(base);
+    char* dir = slash ? strndup(name, slash == name ? 1 : (size_t) (slash - name)) : strdup(".");
+    *firsts = NULL;
+    if (dir == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    DIR* d = opendir(dir);
+    free(dir);
+    if (d == NULL) return -1;
+
+    size_t count = 0;
+    size_t capacity = 0;
+    struct dirent* entry;
+    while ((entry = readdir(d)) != NULL) {
+        const char* s = entry->d_name;
+        if (strncmp(s, base, base_len) != 0 || strncmp(s + base_len, ".cdc.", 5) != 0) continue;
+        s += base_len + 5;
+        char* end;
+        if (*s < '0' || *s > '9') continue;
+        uint64_t first = strtoull(s, &end, 10);
+        if (*end) continue;
+
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 16;
+            uint64_t* grown = realloc(*firsts, capacity * sizeof(uint64_t));
+            if (grown == NULL) {
+                closedir(d);
+                free(*firsts);
+                *firsts = NULL;
+                errno = ENOMEM;
+                return -1;
+            }
+            *firsts = grown;
+        }
+        (*firsts)[count++] = first;
+    }
+    closedir(d);
+    if (count > 0) qsort(*firsts, count, sizeof(uint64_t), compare_seq);
+    return (ssize_t) count;
+}
+
+static void remove_segments(const char* name) {
+    uint64_t* firsts;
+    ssize_t count = list_segments(name, &firsts);
+    for (ssize_t i = 0; i < count; i++) {
+        char* path = segment_path(name, firsts[i], "");
+        if (path) unlink(path);
+        free(path);
+    }
+    free(firsts);
+}
+
+// find the end of the last complete change in the segment at fd, and the number after it.
+static int scan_segment(int fd, uint64_t first, off_t* end, uint64_t* next_seq) {
+    size_t cap = CDC_READ_CHUNK;
+    char* buf = malloc(cap);
+    if (buf == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    off_t pos = sizeof(SegmentHeader);
+    *next_seq = first;
+    for (;;) {
+        ssize_t n = pread(fd, buf, cap, pos);
+        if (n < 0) {
+            free(buf);
+            return -1;
+        }
+        size_t off = 0;
+        size_t total;
+        size_t wanted;
+        ChangeEntry entry;
+        while ((total = parse_change(buf + off, n - off, &entry, &wanted)) > 0) {
+            *next_seq = entry.seq + 1;
+            off += total;
+        }
+        pos += off;
+        if (off > 0) continue;
+        if (wanted > cap && (size_t) n == cap) {
+            char* grown = realloc(buf, wanted);
+            if (grown == NULL) {
+                free(buf);
+                errno = ENOMEM;
+                return -1;
+            }
+            buf = grown;
+            cap = wanted;
+            continue;
+        }
+        break;
+    }
+    free(buf);
+    *end = pos;
+    return 0;
+}
+
+// start the segment of changes from first on. it is written under a temporary name, so a tailer
+// never finds it without its header.
+static int create_segment(DB* db, ChangeFeed* feed, uint64_t first) {
+    char* tmp_path = segment_path(db->name, first, ".tmp");
+    char* path = segment_path(db->name, first, "");
+    if (tmp_path == NULL || path == NULL) {
+        free(tmp_path);
+        free(path);
+        errno = ENOMEM;
+        return -1;
+    }
+    SegmentHeader header = {CDC_MAGIC, 0, first};
+    int fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    int ret = fd < 0 || write_lock(fd, 0, SEEK_SET, 0) < 0 ||
+              pwrite(fd, &header, sizeof(SegmentHeader), 0) != sizeof(SegmentHeader) ||
+              rename(tmp_path, path) < 0 ? -1 : 0;
+    if (ret < 0) {
+        int err = errno;
+        if (fd >= 0) close(fd);
+        unlink(tmp_path);
+        errno = err;
+    } else {
+        if (feed->fd >= 0) {
+            fsync(feed->fd);
+            close(feed->fd);
+        }
+        feed->fd = fd;
+        feed->end = sizeof(SegmentHeader);
+        feed->first = first;
+        feed->next_seq = first;
+    }
+    free(tmp_path);
+    free(path);
+    return ret;
+}
+
+// carry on in the last segment, cutting off a change that was torn by a crash.
+static int reopen_segment(DB* db, ChangeFeed* feed, uint64_t first) {
+    char* path = segment_path(db->name, first, "");
+    if (path == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    int fd = open(path, O_RDWR);
+    free(path);
+    if (fd < 0) return -1;
+    if (write_lock(fd, 0, SEEK_SET, 0) < 0) {
+        close(fd);
+        errno = EBUSY;
+        return -1;
+    }
+
+    SegmentHeader header;
+    int ret = pread(fd, &header, sizeof(SegmentHeader), 0) == sizeof(SegmentHeader) && header.magic == CDC_MAGIC &&
+              header.first == first ? 0 : -1;
+    if (ret < 0) errno = EINVAL;
+    if (ret == 0) ret = scan_segment(fd, first, &feed->end, &feed->next_seq);
+    if (ret == 0) ret = ftruncate(fd, feed->end);
+    if (ret < 0) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    feed->fd = fd;
+    feed->first = first;
+    return 0;
+}
+
+// open the feed of db, starting it if it has none. the caller holds the exclusive latch.
+static int attach(DB* db) {
+    if (db->feed) return 0;
+    if (!db->writable) {
+        errno = EBADF;
+        return -1;
+    }
+
+    uint64_t* firsts;
+    ssize_t count = list_segments(db->name, &firsts);
+    if (count < 0) return -1;
+    ChangeFeed* feed = malloc(sizeof(ChangeFeed));
+    if (feed == NULL) {
+        free(firsts);
+        errno = ENOMEM;
+        return -1;
+    }
+    memset(feed, 0, sizeof(ChangeFeed));
+    feed->fd = -1;
+    int ret = count ? reopen_segment(db, feed, firsts[count - 1]) : create_segment(db, feed, 1);
+    free(firsts);
+    if (ret < 0) {
+        free(feed);
+        return -1;
+    }
+    db->feed = feed;
+    return 0;
+}
+
+// attach the feed when a writable handle opens a database that has one.
+int cdc_open(DB* db, int truncated) {
+    if (truncated) {
+        remove_segments(db->name);
+        return 0;
+    }
+    uint64_t* firsts;
+    ssize_t count = list_segments(db->name, &firsts);
+    free(firsts);
+    if (count < 0) return -1;
+    return count ? attach(db) : 0;
+}
+
+// the caller holds the exclusive latch.
+int cdc_append(DB* db, uint64_t key, const Record* value, uint64_t expire_at) {
+    ChangeFeed* feed = db->feed;
+    if (value && value->size > UINT32_MAX) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (feed->end >= CDC_SEGMENT_SIZE && create_segment(db, feed, feed->next_seq) < 0) return -1;
+
+    ChangeEntry entry;
+    memset(&entry, 0, sizeof(ChangeEntry));
+    entry.seq = feed->next_seq;
+    entry.key = key;
+    entry.op = value ? CDC_PUT : CDC_DELETE;
+    entry.expire_at = value ? expire_at : 0;
+    entry.size = value ? (uint32_t) value->size : 0;
+    entry.check = checksum(&entry, value ? value->data : NULL);
+
+    struct iovec iov[2] = {{&entry, sizeof(ChangeEntry)}, {value ? value->data : NULL, entry.size}};
+    ssize_t total = sizeof(ChangeEntry) + entry.size;
+    if (pwritev(feed->fd, iov, 2, feed->end) != total) {
+        // the readers would stop at a torn change and miss everything after it.
+        ftruncate(feed->fd, feed->end);
+        errno = EIO;
+        return -1;
+    }
+    feed->end += total;
+    feed->next_seq++;
+    return 0;
+}
+
+void cdc_free(DB* db) {
+    ChangeFeed* feed = db->feed;
+    if (feed == NULL) return;
+    if (feed->fd >= 0) {
+        fsync(feed->fd);
+        close(feed->fd);
+    }
+    free(feed);
+    db->feed = NULL;
+}
+
+// append every write of db to its change feed from now on, and in later handles until
+// db_cdc_stop. only one process writes the feed of a database at a time.
+int db_cdc_start(DB* db) {
+    pthread_rwlock_wrlock(&db->latch);
+    int ret = attach(db);
+    pthread_rwlock_unlock(&db->latch);
+    return ret;
+}
+
+// stop the feed and remove its segments.
+int db_cdc_stop(DB* db) {
+    pthread_rwlock_wrlock(&db->latch);
+    cdc_free(db);
+    remove_segments(db->name);
+    pthread_rwlock_unlock(&db->latch);
+    return 0;
+}
+
+// remove the segments that only hold changes before seq, once every replica is past it.
+int db_cdc_trim(DB* db, uint64_t seq) {
+    pthread_rwlock_wrlock(&db->latch);
+    uint64_t* firsts;
+    ssize_t count = list_segments(db->name, &firsts);
+    for (ssize_t i = 0; i + 1 < count && firsts[i + 1] <= seq; i++) {
+        char* path = segment_path(db->name, firsts[i], "");
+        if (path) unlink(path);
+        free(path);
+    }
+    pthread_rwlock_unlock(&db->latch);
+    free(firsts);
+    return count < 0 ? -1 : 0;
+}
+
+// the sequence number of the last change appended, 0 if there is none yet.
+int db_cdc_seq(DB* db, uint64_t* seq) {
+    pthread_rwlock_rdlock(&db->latch);
+    int ret = db->feed ? 0 : -1;
+    if (db->feed) *seq = db->feed->next_seq - 1;
+    pthread_rwlock_unlock(&db->latch);
+    if (ret < 0) errno = ENOENT;
+    return ret;
+}
+
+static int tail_segment(CdcTailer* tailer, uint64_t first) {
+    char* path = segment_path(tailer->name, first, "");
+    if (path == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    int fd = open(path, O_RDONLY);
+    free(path);
+    if (fd < 0) return -1;
+
+    SegmentHeader header;
+    if (pread(fd, &header, sizeof(SegmentHeader), 0) != sizeof(SegmentHeader) || header.magic != CDC_MAGIC ||
+        header.first != first) {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+    if (tailer->fd >= 0) close(tailer->fd);
+    tailer->fd = fd;
+    tailer->pos = sizeof(SegmentHeader);
+    tailer->batch_pos = tailer->pos;
+    return 0;
+}
+
+// follow the feed of the database name from change seq on. ESTALE if it was trimmed past seq.
+CdcTailer* db_cdc_tail(const char* name, uint64_t seq) {
+    if (seq == 0) seq = 1;
+    uint64_t* firsts;
+    ssize_t count = list_segments(name, &firsts);
+    if (count < 0) return NULL;
+    if (count == 0 || firsts[0] > seq) {
+        free(firsts);
+        errno = count ? ESTALE : ENOENT;
+        return NULL;
+    }
+    ssize_t i = count - 1;
+    while (firsts[i] > seq) i--;
+    uint64_t first = firsts[i];
+    free(firsts);
+
+    CdcTailer* tailer = malloc(sizeof(CdcTailer));
+    if (tailer == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    memset(tailer, 0, sizeof(CdcTailer));
+    tailer->fd = -1;
+    tailer->seq = seq;
+    tailer->name = strdup(name);
+    tailer->buf = malloc(CDC_READ_CHUNK);
+    tailer->cap = CDC_READ_CHUNK;
+    if (tailer->name == NULL || tailer->buf == NULL) {
+        db_cdc_close(tailer);
+        errno = ENOMEM;
+        return NULL;
+    }
+    if (tail_segment(tailer, first) < 0) {
+        int err = errno;
+        db_cdc_close(tailer);
+        errno = err;
+        return NULL;
+    }
+    return tailer;
+}
+
+// read up to max_changes changes in order. returns how many, 0 once it has caught up.
+ssize_t db_cdc_read(CdcTailer* tailer, Change* changes, size_t max_changes) {
+    if (max_changes == 0) return 0;
+    for (;;) {
+        ssize_t n = pread(tailer->fd, tailer->buf, tailer->cap, tailer->pos);
+        if (n < 0) return -1;
+
+        size_t off = 0;
+        size_t count = 0;
+        size_t total;
+        size_t wanted;
+        ChangeEntry entry;
+        tailer->batch_pos = tailer->pos;
+        while (count < max_changes && (total = parse_change(tailer->buf + off, n - off, &entry, &wanted)) > 0) {
+            if (entry.seq >= tailer->seq) {
+                Change* change = changes + count++;
+                change->seq = entry.seq;
+                change->op = (int) entry.op;
+                change->key = entry.key;
+                change->expire_at = entry.expire_at;
+                change->value.size = entry.size;
+                change->value.data = entry.op == CDC_PUT ? tailer->buf + off + sizeof(ChangeEntry) : NULL;
+                tailer->seq = entry.seq + 1;
+            }
+            off += total;
+        }
+        tailer->pos += off;
+        if (count > 0) return (ssize_t) count;
+        if (off > 0) continue;
+
+        if (wanted > tailer->cap && (size_t) n == tailer->cap) {
+            char* grown = realloc(tailer->buf, wanted);
+            if (grown == NULL) {
+                errno = ENOMEM;
+                return -1;
+            }
+            tailer->buf = grown;
+            tailer->cap = wanted;
+            continue;
+        }
+
+        // the end of this segment. the writer may have moved on to the next one, which starts
+        // with the change after the last one read.
+        char* path = segment_path(tailer->name, tailer->seq, "");
+        if (path == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        int next = access(path, F_OK) == 0;
+        free(path);
+        if (!next) return 0;
+        if (tail_segment(tailer, tailer->seq) < 0) return -1;
+    }
+}
+
+// read up to max_changes changes and apply them to replica in order. returns how many were
+// applied, 0 once it has caught up. on failure the tailer is left at the change that failed.
+ssize_t db_cdc_apply(CdcTailer* tailer, DB* replica, size_t max_changes) {
+    Change* changes = malloc((max_changes ? max_changes : 1) * sizeof(Change));
+    if (changes == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    ssize_t count = db_cdc_read(tailer, changes, max_changes);
+    uint64_t now = (uint64_t) time(NULL);
+    for (ssize_t i = 0; i < count; i++) {
+        Change* change = changes + i;
+        int ret;
+        if (change->op == CDC_DELETE || (change->expire_at && change->expire_at <= now)) {
+            ret = db_delete(replica, change->key) < 0 && errno != ENOENT ? -1 : 0;
+        } else if (change->expire_at) {
+            ret = db_store_ttl(replica, change->key, &change->value, DB_STORE, (uint32_t) (change->expire_at - now));
+        } else {
+            ret = db_store(replica, change->key, &change->value, DB_STORE);
+        }
+        if (ret < 0) {
+            // read it again next time, the changes before it are skipped.
+            tailer->seq = change->seq;
+            tailer->pos = tailer->batch_pos;
+            count = -1;
+            break;
+        }
+    }
+    free(changes);
+    return count;
+}
+
+// the sequence number of the next change the tailer returns, where a replica resumes from.
+uint64_t db_cdc_position(CdcTailer* tailer) {
+    return tailer->seq;
+}
+
+void db_cdc_close(CdcTailer* tailer) {
+    if (tailer == NULL) return;
+    if (tailer->fd >= 0) close(tailer->fd);
+    free(tailer->name);
+    free(tailer->buf);
+    free(tailer);
+}
@@ -0,0 +1,40 @@
+#ifndef MDBM_CDC_H
+#define MDBM_CDC_H
+
+#include <sys/types.h>
+
+#include "mdbm.h"
+
+#define CDC_SEGMENT_SIZE (64 << 20) // the writer starts a new segment once one is this long.
+#define CDC_READ_CHUNK (1 << 20) // bytes a tailer reads at a time.
+#define CDC_MAGIC 0x63646331
+
+#define CDC_PUT 1
+#define CDC_DELETE 2
+
+typedef struct {
+    uint64_t seq;
+    int op; // CDC_PUT or CDC_DELETE.
+    uint64_t key;
+    uint64_t expire_at; // of a put, 0 if it does not expire.
+    Record value; // of a put, owned by the tailer until its next read.
+}Change;
+
+typedef struct CdcTailer CdcTailer;
+
+int db_cdc_start(DB* db);
+int db_cdc_stop(DB* db);
+int db_cdc_trim(DB* db, uint64_t seq);
+int db_cdc_seq(DB* db, uint64_t* seq);
+
+CdcTailer* db_cdc_tail(const char* name, uint64_t seq);
+ssize_t db_cdc_read(CdcTailer* tailer, Change* changes, size_t max_changes);
+ssize_t db_cdc_apply(CdcTailer* tailer, DB* replica, size_t max_changes);
+uint64_t db_cdc_position(CdcTailer* tailer);
+void db_cdc_close(CdcTailer* tailer);
+
+int cdc_open(DB* db, int truncated);
+int cdc_append(DB* db, uint64_t key, const Record* value, uint64_t expire_at);
+void cdc_free(DB* db);
+
+#endif //MDBM_CDC_H
@@ -0,0 +1,555 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "compact.h"
+#include "snapshot.h"
+#include "lock.h"
+#include "io.h"
+#include "cache.h"
+#include "backup.h"
+
+#define COMPACT_IDLE_MS 1000
+#define REGION_PUNCHED 1
+#define REGION_CLAIMED 2 // another handle still holds a claim over part of the region.
+
+typedef struct {
+    uint64_t key;
+    off_t offset;
+}Victim;
+
+struct Compactor {
+    size_t* dead; // dead bytes per region of the data file.
+    uint8_t* reclaimed; // REGION_PUNCHED once the hole of a region has been punched.
+    size_t num_regions;
+    int stale; // the accounting has to be rebuilt from the leaves before it is used.
+
+    ssize_t region; // region being evacuated, -1 if none.
+    off_t punch_start;
+    Victim* victims;
+    size_t num_victims;
+    size_t next_victim;
+
+    size_t rate_limit; // bytes per second, 0 for unlimited.
+    int running;
+    pthread_t thread;
+    pthread_mutex_t mutex; // serializes steps and guards running.
+    pthread_cond_t cond;
+};
+
+static Compactor* malloc_compactor() {
+    Compactor* compactor = malloc(sizeof(Compactor));
+    if (compactor == NULL) return NULL;
+    memset(compactor, 0, sizeof(Compactor));
+    compactor->stale = 1;
+    compactor->region = -1;
+    pthread_mutex_init(&compactor->mutex, NULL);
+    pthread_cond_init(&compactor->cond, NULL);
+    return compactor;
+}
+
+static int grow_regions(Compactor* compactor, size_t num_regions) {
+    if (num_regions <= compactor->num_regions) return 0;
+
+    size_t* dead = realloc(compactor->dead, num_regions * sizeof(size_t));
+    if (dead == NULL) return -1;
+    compactor->dead = dead;
+    uint8_t* reclaimed = realloc(compactor->reclaimed, num_regions);
+    if (reclaimed == NULL) return -1;
+    compactor->reclaimed = reclaimed;
+
+    memset(compactor->dead + compactor->num_regions, 0, (num_regions - compactor->num_regions) * sizeof(size_t));
+    memset(compactor->reclaimed + compactor->num_regions, 0, num_regions - compactor->num_regions);
+    compactor->num_regions = num_regions;
+    return 0;
+}
+
+// the caller holds the exclusive latch.
+void compact_account(DB* db, off_t offset, size_t size) {
+    Compactor* compactor = db->compactor;
+    if (compactor == NULL || compactor->stale || size == 0) return;
+
+    off_t end = offset + (off_t) size;
+    if (grow_regions(compactor, (end + COMPACT_REGION_SIZE - 1) / COMPACT_REGION_SIZE) < 0) {
+        compactor->stale = 1;
+        return;
+    }
+    while (offset < end) {
+        size_t region = offset / COMPACT_REGION_SIZE;
+        off_t region_end = (off_t) (region + 1) * COMPACT_REGION_SIZE;
+        off_t chunk_end = end < region_end ? end : region_end;
+        compactor->dead[region] += chunk_end - offset;
+        offset = chunk_end;
+    }
+}
+
+// the caller holds the exclusive latch.
+void compact_invalidate(DB* db) {
+    Compactor* compactor = db->compactor;
+    if (compactor == NULL) return;
+    compactor->stale = 1;
+    compactor->region = -1;
+    free(compactor->victims);
+    compactor->victims = NULL;
+    compactor->num_victims = 0;
+    compactor->next_victim = 0;
+}
+
+// walk the leaves one at a time under the shared latch and call visit for every cell.
+static int walk_leaves(DB* db, void (*visit)(const Cell*, void*), void* arg) {
+    IndexPage* leaf = malloc_index_page();
+    if (leaf == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    pthread_rwlock_rdlock(&db->latch);
+    off_t leaf_offset = db->header->left_most_leaf_offset;
+    pthread_rwlock_unlock(&db->latch);
+
+    while (leaf_offset != -1) {
+        pthread_rwlock_rdlock(&db->latch);
+        if (load_page(db->idx_fd, leaf_offset, leaf) < 0) {
+            pthread_rwlock_unlock(&db->latch);
+            free_index_page(&leaf);
+            errno = EIO;
+            return -1;
+        }
+        pthread_rwlock_unlock(&db->latch);
+
+        for (int i = 0; i < leaf->num_cells; i++) visit(leaf->cells + i, arg);
+        leaf_offset = leaf->next_page;
+    }
+
+    free_index_page(&leaf);
+    return 0;
+}
+
+typedef struct {
+    size_t* live;
+    size_t num_regions;
+}LiveMap;
+
+static void count_live(const Cell* cell, void* arg) {
+    LiveMap* map = arg;
+    off_t offset = cell->offset;
+    off_t end = cell->offset + (off_t) cell->size;
+    while (offset < end) {
+        size_t region = offset / COMPACT_REGION_SIZE;
+        if (region >= map->num_regions) return;
+        off_t region_end = (off_t) (region + 1) * COMPACT_REGION_SIZE;
+        off_t chunk_end = end < region_end ? end : region_end;
+        map->live[region] += chunk_end - offset;
+        offset = chunk_end;
+    }
+}
+
+static int rebuild_accounting(DB* db) {
+    Compactor* compactor = db->compactor;
+
+    pthread_rwlock_rdlock(&db->latch);
+    off_t data_end = db->header->data_end;
+    pthread_rwlock_unlock(&db->latch);
+    if (data_end < 0) return -1;
+
+    LiveMap map;
+    map.num_regions = (data_end + COMPACT_REGION_SIZE - 1) / COMPACT_REGION_SIZE;
+    map.live = calloc(map.num_regions ? map.num_regions : 1, sizeof(size_t));
+    if (map.live == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    if (walk_leaves(db, count_live, &map) < 0) {
+        free(map.live);
+        return -1;
+    }
+
+    pthread_rwlock_wrlock(&db->latch);
+    if (grow_regions(compactor, map.num_regions) < 0) {
+        pthread_rwlock_unlock(&db->latch);
+        free(map.live);
+        errno = ENOMEM;
+        return -1;
+    }
+    for (size_t i = 0; i < map.num_regions; i++) {
+        off_t region_end = (off_t) (i + 1) * COMPACT_REGION_SIZE;
+        size_t len = region_end < data_end ? COMPACT_REGION_SIZE : data_end - (off_t) i * COMPACT_REGION_SIZE;
+        compactor->dead[i] = len > map.live[i] ? len - map.live[i] : 0;
+    }
+    compactor->stale = 0;
+    pthread_rwlock_unlock(&db->latch);
+
+    free(map.live);
+    return 0;
+}
+
+typedef struct {
+    Compactor* compactor;
+    off_t start;
+    off_t end;
+    size_t capacity;
+    int failed;
+}VictimScan;
+
+static void collect_victim(const Cell* cell, void* arg) {
+    VictimScan* scan = arg;
+    Compactor* compactor = scan->compactor;
+    off_t cell_end = cell->offset + (off_t) cell->size;
+
+    // a value that runs into the region from the left stays put, so the hole starts after it.
+    if (cell->offset < scan->start) {
+        if (cell_end > compactor->punch_start) compactor->punch_start = cell_end;
+        return;
+    }
+    if (cell->offset >= scan->end || scan->failed) return;
+
+    if (compactor->num_victims == scan->capacity) {
+        size_t capacity = scan->capacity ? scan->capacity * 2 : 256;
+        Victim* victims = realloc(compactor->victims, capacity * sizeof(Victim));
+        if (victims == NULL) {
+            scan->failed = 1;
+            return;
+        }
+        compactor->victims = victims;
+        scan->capacity = capacity;
+    }
+    compactor->victims[compactor->num_victims].key = cell->key;
+    compactor->victims[compactor->num_victims].offset = cell->offset;
+    compactor->num_victims++;
+}
+
+static int compare_victim(const void* a, const void* b) {
+    off_t x = ((const Victim*) a)->offset;
+    off_t y = ((const Victim*) b)->offset;
+    return x < y ? -1 : x > y;
+}
+
+// pick the most fragmented region that is not the tail of the file and list its live values.
+static int pick_region(DB* db) {
+    Compactor* compactor = db->compactor;
+
+    pthread_rwlock_rdlock(&db->latch);
+    off_t data_end = db->header->data_end;
+    ssize_t best = -1;
+    double best_ratio = COMPACT_MIN_DEAD_RATIO;
+    size_t tail = data_end > 0 ? (data_end - 1) / COMPACT_REGION_SIZE : 0;
+    // a region another handle has a claim in is only tried again once no other is left.
+    for (int pass = 0; pass < 2 && best < 0; pass++) {
+        for (size_t i = 0; i < compactor->num_regions && i < tail; i++) {
+            if (compactor->reclaimed[i] != (pass ? REGION_CLAIMED : 0)) continue;
+            double ratio = (double) compactor->dead[i] / COMPACT_REGION_SIZE;
+            if (ratio >= best_ratio) {
+                best = (ssize_t) i;
+                best_ratio = ratio;
+            }
+        }
+    }
+    pthread_rwlock_unlock(&db->latch);
+    if (best < 0) return 0;
+
+    VictimScan scan;
+    memset(&scan, 0, sizeof(VictimScan));
+    scan.compactor = compactor;
+    scan.start = (off_t) best * COMPACT_REGION_SIZE;
+    scan.end = scan.start + COMPACT_REGION_SIZE;
+
+    compactor->num_victims = 0;
+    compactor->next_victim = 0;
+    compactor->punch_start = scan.start;
+    if (walk_leaves(db, collect_victim, &scan) < 0) return -1;
+    if (scan.failed) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    if (compactor->num_victims > 0) qsort(compactor->victims, compactor->num_victims, sizeof(Victim), compare_victim);
+    compactor->region = best;
+    return 1;
+}
+
+// move one live value to the end of the data file if its cell still points into the region.
+static ssize_t relocate(DB* db, IndexPage* node, const Victim* victim) {
+    Compactor* compactor = db->compactor;
+    Cell cell;
+
+    pthread_rwlock_wrlock(&db->latch);
+    if (compactor->region < 0) {
+        pthread_rwlock_unlock(&db->latch);
+        return 0;
+    }
+    // a reorganize or a snapshot may have begun since the step started, both want the value left
+    // where it is.
+    if (db->reorg || snapshot_active(db)) {
+        pthread_rwlock_unlock(&db->latch);
+        errno = EBUSY;
+        return -1;
+    }
+    int pos = search_index(db->idx_fd, db->header, node, victim->key, &cell);
+    if (pos < -1) {
+        pthread_rwlock_unlock(&db->latch);
+        errno = EIO;
+        return -1;
+    }
+    // an empty value reads nothing from the region, so it can stay.
+    if (pos < 0 || cell.key != victim->key || cell.offset != victim->offset || cell.size == 0) {
+        pthread_rwlock_unlock(&db->latch);
+        return 0;
+    }
+
+    char* data = malloc(cell.size);
+    if (data == NULL) {
+        pthread_rwlock_unlock(&db->latch);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    Cell new_cell;
+    memcpy(&new_cell, &cell, sizeof(Cell));
+    if ((new_cell.offset = alloc_data(db->data_fd, db->header, cell.size)) < 0 ||
+        read_lock_wait(db->data_fd, cell.offset, SEEK_SET, cell.size) < 0) {
+        pthread_rwlock_unlock(&db->latch);
+        free(data);
+        errno = EIO;
+        return -1;
+    }
+    ssize_t ret = io_pread(db->data_fd, data, cell.size, cell.offset);
+    unlock(db->data_fd, cell.offset, SEEK_SET, cell.size);
+    if (ret < 0 || write_lock_wait(db->data_fd, new_cell.offset, SEEK_SET, cell.size) < 0) {
+        pthread_rwlock_unlock(&db->latch);
+        free(data);
+        errno = EIO;
+        return -1;
+    }
+    ret = io_pwrite(db->data_fd, data, cell.size, new_cell.offset);
+    if (db->cache && ret >= 0) cache_write(db->cache, db->data_fd, new_cell.offset, data, cell.size);
+    if (ret >= 0) backup_track(db, new_cell.offset, cell.size);
+    unlock(db->data_fd, new_cell.offset, SEEK_SET, cell.size);
+    free(data);
+
+    if (ret < 0 || update_index(db->idx_fd, node, pos, &new_cell) < 0) {
+        pthread_rwlock_unlock(&db->latch);
+        errno = EIO;
+        return -1;
+    }
+    // the value is unchanged, so the secondary indexes and the change feed have nothing to see.
+    if (db_reorg_log(db, victim->key) < 0) {
+        pthread_rwlock_unlock(&db->latch);
+        return -1;
+    }
+
+    // the part of the value past the region end is now dead in the next region.
+    off_t region_end = (off_t) (compactor->region + 1) * COMPACT_REGION_SIZE;
+    off_t cell_end = cell.offset + (off_t) cell.size;
+    if (cell_end > region_end) compact_account(db, region_end, cell_end - region_end);
+    pthread_rwlock_unlock(&db->latch);
+
+    return (ssize_t) cell.size;
+}
+
+// returns 1 once the region is reclaimed or first set aside, 0 when it has to wait.
+static int reclaim_region(DB* db) {
+    Compactor* compactor = db->compactor;
+
+    pthread_rwlock_wrlock(&db->latch);
+    // the relocated values may still be read through an open snapshot or copied by a reorganize,
+    // retry on a later step.
+    if (compactor->region < 0 || db->reorg || snapshot_active(db)) {
+        pthread_rwlock_unlock(&db->latch);
+        return 0;
+    }
+    off_t region_end = (off_t) (compactor->region + 1) * COMPACT_REGION_SIZE;
+    off_t len = region_end - compactor->punch_start;
+    // another handle may have appended into the region what it has not indexed yet, the region
+    // waits until that handle gives its claim back.
+    if (len > 0 && punch_data(db->data_fd, compactor->punch_start, len) < 0) {
+        int ret = -1;
+        if (errno == EBUSY) {
+            // setting it aside lets the next step go on with the other regions.
+            ret = compactor->reclaimed[compactor->region] != REGION_CLAIMED;
+            compactor->reclaimed[compactor->region] = REGION_CLAIMED;
+        }
+        compactor->region = -1;
+        pthread_rwlock_unlock(&db->latch);
+        return ret;
+    }
+    compactor->reclaimed[compactor->region] = REGION_PUNCHED;
+    compactor->dead[compactor->region] = 0;
+    compactor->region = -1;
+    pthread_rwlock_unlock(&db->latch);
+    return 1;
+}
+
+static Compactor* attach_compactor(DB* db) {
+    pthread_rwlock_wrlock(&db->latch);
+    if (db->compactor == NULL) db->compactor = malloc_compactor();
+    Compactor* compactor = db->compactor;
+    pthread_rwlock_unlock(&db->latch);
+    if (compactor == NULL) errno = ENOMEM;
+    return compactor;
+}
+
+// relocate up to max_bytes of live values out of the most fragmented region.
+// returns the number of bytes moved, 0 when there is nothing worth compacting.
+static ssize_t compact_step(DB* db, size_t max_bytes) {
+    Compactor* compactor = attach_compactor(db);
+    if (compactor == NULL) return -1;
+
+    pthread_mutex_lock(&compactor->mutex);
+
+    pthread_rwlock_rdlock(&db->latch);
+    int busy = db->reorg != NULL || snapshot_active(db);
+    int stale = compactor->stale;
+    pthread_rwlock_unlock(&db->latch);
+    if (busy) {
+        pthread_mutex_unlock(&compactor->mutex);
+        return 0;
+    }
+
+    if (stale && rebuild_accounting(db) < 0) {
+        pthread_mutex_unlock(&compactor->mutex);
+        return -1;
+    }
+
+    if (compactor->region < 0) {
+        int picked = pick_region(db);
+        if (picked <= 0) {
+            pthread_mutex_unlock(&compactor->mutex);
+            return picked;
+        }
+    }
+
+    IndexPage* node = malloc_index_page();
+    if (node == NULL) {
+        pthread_mutex_unlock(&compactor->mutex);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    size_t moved = 0;
+    while (moved < max_bytes && compactor->next_victim < compactor->num_victims) {
+        ssize_t ret = relocate(db, node, compactor->victims + compactor->next_victim);
+        if (ret < 0 && errno == EBUSY) {
+            // the victim is kept for the step after the reorganize or the snapshot.
+            free_index_page(&node);
+            pthread_mutex_unlock(&compactor->mutex);
+            return (ssize_t) moved;
+        }
+        if (ret < 0) {
+            free_index_page(&node);
+            pthread_mutex_unlock(&compactor->mutex);
+            return -1;
+        }
+        compactor->next_victim++;
+        moved += ret;
+    }
+    free_index_page(&node);
+
+    int reclaimed = 0;
+    if (compactor->next_victim == compactor->num_victims && (reclaimed = reclaim_region(db)) < 0) {
+        pthread_mutex_unlock(&compactor->mutex);
+        return -1;
+    }
+
+    pthread_mutex_unlock(&compactor->mutex);
+    // report progress even if every value had already moved away.
+    return moved ? (ssize_t) moved : reclaimed;
+}
+
+ssize_t db_compact_step(DB* db, size_t max_bytes) {
+    stat_begin(scope, db->stats);
+    ssize_t ret = compact_step(db, max_bytes);
+    stat_end(STAT_OP_NONE, scope);
+    return ret;
+}
+
+static void* compact_main(void* arg) {
+    DB* db = arg;
+    Compactor* compactor = db->compactor;
+
+    pthread_mutex_lock(&compactor->mutex);
+    while (compactor->running) {
+        size_t rate_limit = compactor->rate_limit;
+        pthread_mutex_unlock(&compactor->mutex);
+
+        ssize_t moved = db_compact_step(db, COMPACT_STEP_BYTES);
+
+        // sleep long enough to keep the average below the rate limit, or idle when there is no work.
+        long long pause_ns;
+        if (moved <= 0) pause_ns = (long long) COMPACT_IDLE_MS * 1000000;
+        else if (rate_limit) pause_ns = (long long) ((double) moved * 1e9 / (double) rate_limit);
+        else pause_ns = 0;
+
+        pthread_mutex_lock(&compactor->mutex);
+        if (pause_ns > 0 && compactor->running) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += pause_ns / 1000000000;
+            deadline.tv_nsec += pause_ns % 1000000000;
+            if (deadline.tv_nsec >= 1000000000) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait(&compactor->cond, &compactor->mutex, &deadline);
+        }
+    }
+    pthread_mutex_unlock(&compactor->mutex);
+    return NULL;
+}
+
+// start a background thread compacting the data file at no more than rate_limit bytes per second.
+int db_compact_start(DB* db, size_t rate_limit) {
+    Compactor* compactor = attach_compactor(db);
+    if (compactor == NULL) return -1;
+
+    pthread_mutex_lock(&compactor->mutex);
+    if (compactor->running) {
+        pthread_mutex_unlock(&compactor->mutex);
+        errno = EBUSY;
+        return -1;
+    }
+    compactor->rate_limit = rate_limit;
+    compactor->running = 1;
+    if (pthread_create(&compactor->thread, NULL, compact_main, db) != 0) {
+        compactor->running = 0;
+        pthread_mutex_unlock(&compactor->mutex);
+        errno = EAGAIN;
+        return -1;
+    }
+    pthread_mutex_unlock(&compactor->mutex);
+    return 0;
+}
+
+int db_compact_stop(DB* db) {
+    Compactor* compactor = db->compactor;
+    if (compactor == NULL) return 0;
+
+    pthread_mutex_lock(&compactor->mutex);
+    if (!compactor->running) {
+        pthread_mutex_unlock(&compactor->mutex);
+        return 0;
+    }
+    compactor->running = 0;
+    pthread_cond_signal(&compactor->cond);
+    pthread_mutex_unlock(&compactor->mutex);
+
+    return pthread_join(compactor->thread, NULL) == 0 ? 0 : -1;
+}
+
+void compact_free(DB* db) {
+    Compactor* compactor = db->compactor;
+    if (compactor == NULL) return;
+
+    db_compact_stop(db);
+    pthread_mutex_destroy(&compactor->mutex);
+    pthread_cond_destroy(&compactor->cond);
+    free(compactor->dead);
+    free(compactor->reclaimed);
+    free(compactor->victims);
+    free(compactor);
+    db->compactor = NULL;
+}
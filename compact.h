@@ -0,0 +1,20 @@
+#ifndef MDBM_COMPACT_H
+#define MDBM_COMPACT_H
+
+#include <sys/types.h>
+
+#include "mdbm.h"
+
+#define COMPACT_REGION_SIZE (1 << 20) // the data file is accounted and reclaimed in regions of this size.
+#define COMPACT_STEP_BYTES (64 << 10) // live bytes relocated per step by the background thread.
+#define COMPACT_MIN_DEAD_RATIO 0.25 // regions with less dead space than this are left alone.
+
+int db_compact_start(DB* db, size_t rate_limit);
+int db_compact_stop(DB* db);
+ssize_t db_compact_step(DB* db, size_t max_bytes);
+
+void compact_account(DB* db, off_t offset, size_t size);
+void compact_invalidate(DB* db);
+void compact_free(DB* db);
+
+#endif //MDBM_COMPACT_H
@@ -8,30 +8,30 @@
 
 #include "data.h"
 #include "lock.h"
+#include "io.h"
+#include "slab.h"
 
 DataPage* malloc_data_page() {
-    DataPage* data_page = (DataPage*)malloc(sizeof(DataPage));
-    memset(data_page, 0, sizeof(DataPage));
+    DataPage* data_page = slab_alloc(SLAB_PAGE);
+    if (data_page) memset(data_page, 0, sizeof(DataPage));
     return data_page;
 }
 
 void free_data_page(DataPage** data_page) {
-    free(*data_page);
+    slab_free(SLAB_PAGE, *data_page);
     *data_page = NULL;
 }
 
 ssize_t dump_data_page(int fd, DataPage* data_page) {
     if (write_lock_wait(fd, data_page->offset, SEEK_SET, sizeof(DataPage)) == -1) return -1;
-    if (lseek(fd, data_page->offset, SEEK_SET) < 0) return -1;
-    ssize_t ret = write(fd, data_page, sizeof(DataPage));
+    ssize_t ret = io_pwrite(fd, data_page, sizeof(DataPage), data_page->offset);
     if (unlock(fd, data_page->offset, SEEK_SET, sizeof(DataPage)) == -1) return -1;
     return ret;
 }
 
 ssize_t load_data_page(int fd, DataPage* data_page, off_t offset) {
     if (read_lock_wait(fd, offset, SEEK_SET, sizeof(DataPage)) == -1) return -1;
-    if (lseek(fd, offset, SEEK_SET) < 0) return -1;
-    ssize_t ret = read(fd, data_page, sizeof(DataPage));
+    ssize_t ret = io_pread(fd, data_page, sizeof(DataPage), offset);
     if (unlock(fd, offset, SEEK_SET, sizeof(DataPage)) == -1) return -1;
     return ret;
 }
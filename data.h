@@ -5,6 +5,7 @@
 #ifndef MDBM_DATA_H
 #define MDBM_DATA_H
 
+#include <stdint.h>
 #include <sys/types.h>
 
 #define PAYLOAD_SIZE 4072
@@ -0,0 +1,118 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "mdbm.h"
+#include "import.h"
+
+// mdbm_import [-m memory MB] [-t threads] [-T (truncate)] <db name> [input]
+// loads lines of <key>\t<value> from input, or stdin, into an empty database. the key is a
+// decimal uint64_t, the value is the rest of the line without the newline. the lines may come in
+// any order, a key given more than once keeps its last value.
+
+static void usage(const char* prog) {
+    fprintf(stderr, "usage: %s [-m memory MB] [-t threads] [-T (truncate)] <db name> [input]\n", prog);
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char** argv) {
+    size_t memory = 256;
+    int threads = 1;
+    int truncate = 0;
+    int c;
+    while ((c = getopt(argc, argv, "m:t:Th")) != -1) {
+        switch (c) {
+            case 'm':
+                memory = strtoull(optarg, NULL, 10);
+                break;
+            case 't':
+                threads = atoi(optarg);
+                break;
+            case 'T':
+                truncate = 1;
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (optind != argc - 1 && optind != argc - 2) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (threads < 1 || threads > IMPORT_MAX_THREADS) {
+        fprintf(stderr, "threads must be between 1 and %d\n", IMPORT_MAX_THREADS);
+        return 1;
+    }
+
+    FILE* input = stdin;
+    if (optind == argc - 2 && (input = fopen(argv[optind + 1], "r")) == NULL) {
+        perror(argv[optind + 1]);
+        return 1;
+    }
+
+    DB* db = db_open(argv[optind], O_RDWR | O_CREAT | (truncate ? O_TRUNC : 0), 0644);
+    if (db == NULL) {
+        fprintf(stderr, "%s: cannot open: %s\n", argv[optind], strerror(errno));
+        return 1;
+    }
+    Importer* importer = db_import_begin(db, memory << 20);
+    if (importer == NULL) {
+        fprintf(stderr, "%s: cannot import: %s\n", argv[optind], strerror(errno));
+        db_close(db);
+        return 1;
+    }
+
+    double start = now();
+    char* line = NULL;
+    size_t capacity = 0;
+    ssize_t len;
+    size_t records = 0;
+    size_t line_number = 0;
+    while ((len = getline(&line, &capacity, input)) >= 0) {
+        line_number++;
+        if (len && line[len - 1] == '\n') line[--len] = '\0';
+        char* end;
+        errno = 0;
+        unsigned long long key = strtoull(line, &end, 10);
+        if (end == line || *end != '\t' || errno) {
+            fprintf(stderr, "line %zu: expected <key>\\t<value>\n", line_number);
+            db_import_abort(&importer);
+            db_close(db);
+            return 1;
+        }
+        end++;
+        if (db_import_add(importer, key, end, (size_t) (line + len - end)) < 0) {
+            fprintf(stderr, "line %zu: %s\n", line_number, strerror(errno));
+            db_import_abort(&importer);
+            db_close(db);
+            return 1;
+        }
+        records++;
+    }
+    free(line);
+    if (input != stdin) fclose(input);
+
+    double sorted = now();
+    if (db_import_finish(&importer, threads) < 0) {
+        fprintf(stderr, "%s: import failed: %s\n", argv[optind], strerror(errno));
+        db_close(db);
+        return 1;
+    }
+    double done = now();
+    printf("%zu records, %.2fs reading and sorting, %.2fs merging and building\n", records, sorted - start,
+           done - sorted);
+    db_close(db);
+    return 0;
+}
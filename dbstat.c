@@ -0,0 +1,301 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "btree.h"
+
+// mdbm_stat <db name>
+// offline report of the tree shape and the space usage of <name>.idx and <name>.dat. the index
+// is read front to back in large chunks, the tree is then walked in memory from the root, so
+// the tool runs at sequential read speed on databases of any size.
+
+#define READ_CHUNK_PAGES 256
+#define FILL_BUCKETS 10
+#define MAX_LEVELS 64
+
+typedef struct {
+    uint8_t type;
+    uint8_t num_cells;
+    int8_t level; // distance from the root, -1 if the page was never reached.
+    uint8_t valid; // the page records its own offset, anything else is garbage or never written.
+    size_t first_child; // index into the children array for internal pages.
+    uint64_t live_bytes; // value bytes referenced by a leaf.
+}PageInfo;
+
+typedef struct {
+    PageInfo* pages;
+    size_t num_pages;
+    size_t* children; // page numbers of the children of all internal pages, in page order.
+    size_t num_children;
+    size_t children_capacity;
+    off_t first_page;
+}Scan;
+
+static ssize_t page_number(const Scan* scan, off_t offset) {
+    if (offset < scan->first_page) return -1;
+    off_t rel = offset - scan->first_page;
+    if (rel % (off_t) sizeof(IndexPage)) return -1;
+    size_t n = (size_t) (rel / (off_t) sizeof(IndexPage));
+    return n < scan->num_pages ? (ssize_t) n : -1;
+}
+
+static int add_child(Scan* scan, off_t offset) {
+    if (scan->num_children == scan->children_capacity) {
+        size_t capacity = scan->children_capacity ? scan->children_capacity * 2 : 1024;
+        size_t* children = realloc(scan->children, capacity * sizeof(size_t));
+        if (children == NULL) return -1;
+        scan->children = children;
+        scan->children_capacity = capacity;
+    }
+    ssize_t n = page_number(scan, offset);
+    scan->children[scan->num_children++] = n < 0 ? (size_t) -1 : (size_t) n;
+    return 0;
+}
+
+static int read_index(int fd, Scan* scan) {
+    IndexPage* chunk = malloc(READ_CHUNK_PAGES * sizeof(IndexPage));
+    if (chunk == NULL) return -1;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    for (size_t n = 0; n < scan->num_pages; n += READ_CHUNK_PAGES) {
+        size_t count = scan->num_pages - n < READ_CHUNK_PAGES ? scan->num_pages - n : READ_CHUNK_PAGES;
+        off_t offset = scan->first_page + (off_t) (n * sizeof(IndexPage));
+        if (pread(fd, chunk, count * sizeof(IndexPage), offset) != (ssize_t) (count * sizeof(IndexPage))) {
+            free(chunk);
+            return -1;
+        }
+
+        for (size_t i = 0; i < count; i++) {
+            IndexPage* page = chunk + i;
+            PageInfo* info = scan->pages + n + i;
+            info->level = -1;
+            info->type = (uint8_t) page->type;
+            info->num_cells = page->num_cells;
+            info->valid = page->offset == offset + (off_t) (i * sizeof(IndexPage)) && page->num_cells <= MAX_CELL;
+            if (!info->valid) continue;
+
+            if (page->type == LEAF_NODE) {
+                for (int j = 0; j < page->num_cells; j++) info->live_bytes += page->cells[j].size;
+                continue;
+            }
+            info->first_child = scan->num_children;
+            if (page->left_most >= 0 && add_child(scan, page->left_most) < 0) {
+                free(chunk);
+                return -1;
+            }
+            for (int j = 0; j < page->num_cells; j++) {
+                if (add_child(scan, page->cells[j].offset) < 0) {
+                    free(chunk);
+                    return -1;
+                }
+            }
+        }
+    }
+    free(chunk);
+    return 0;
+}
+
+// assigns levels breadth first from the root, returns the height or -1 if the tree is broken.
+static int walk_tree(Scan* scan, off_t root, size_t* bad_links) {
+    ssize_t start = page_number(scan, root);
+    if (start < 0 || !scan->pages[start].valid) return -1;
+
+    size_t* queue = malloc(scan->num_pages * sizeof(size_t));
+    if (queue == NULL) return -1;
+    size_t head = 0, tail = 0;
+    queue[tail++] = (size_t) start;
+    scan->pages[start].level = 0;
+    int height = 1;
+
+    while (head < tail) {
+        PageInfo* info = scan->pages + queue[head++];
+        if (info->level + 1 > height) height = info->level + 1;
+        if (info->type != INTERNAL_NODE) continue;
+
+        size_t end = info->first_child + info->num_cells + 1;
+        for (size_t i = info->first_child; i < end && i < scan->num_children; i++) {
+            size_t child = scan->children[i];
+            if (child == (size_t) -1 || !scan->pages[child].valid) {
+                (*bad_links)++;
+                continue;
+            }
+            if (scan->pages[child].level >= 0 || info->level + 1 >= MAX_LEVELS) continue;
+            scan->pages[child].level = (int8_t) (info->level + 1);
+            queue[tail++] = child;
+        }
+    }
+    free(queue);
+    return height;
+}
+
+// end of the last written range below size. a preallocated tail is unwritten, which SEEK_DATA and
+// SEEK_HOLE report as a hole; a file system without them counts the whole file as written.
+static off_t written_end(int fd, off_t size) {
+    off_t end = 0;
+    off_t offset = 0;
+    while (offset < size) {
+        off_t data = lseek(fd, offset, SEEK_DATA);
+        if (data < 0) return errno == ENXIO ? end : size;
+        if (data >= size) break;
+        off_t hole = lseek(fd, data, SEEK_HOLE);
+        if (hole < 0 || hole > size) hole = size;
+        end = hole;
+        offset = hole;
+    }
+    return end;
+}
+
+// bytes below end that compaction has punched out of the data file.
+static uint64_t punched_bytes(int fd, off_t end) {
+    uint64_t holes = 0;
+    off_t offset = 0;
+    while (offset < end) {
+        off_t hole = lseek(fd, offset, SEEK_HOLE);
+        if (hole < 0 || hole >= end) break;
+        off_t data = lseek(fd, hole, SEEK_DATA);
+        if (data < 0 || data > end) data = end;
+        holes += (uint64_t) (data - hole);
+        offset = data;
+    }
+    return holes;
+}
+
+static void print_bytes(const char* name, uint64_t bytes, uint64_t total) {
+    printf("  %-16s %14llu bytes", name, (unsigned long long) bytes);
+    if (total) printf("  %5.1f%%", 100.0 * (double) bytes / (double) total);
+    printf("\n");
+}
+
+int main(int argc, char** argv) {
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s <db name>\n", argv[0]);
+        return 1;
+    }
+
+    char* idx_path = malloc(strlen(argv[1]) + 5);
+    char* data_path = malloc(strlen(argv[1]) + 5);
+    sprintf(idx_path, "%s.idx", argv[1]);
+    sprintf(data_path, "%s.dat", argv[1]);
+
+    int idx_fd = open(idx_path, O_RDONLY);
+    if (idx_fd < 0) {
+        perror(idx_path);
+        return 1;
+    }
+
+    Header header;
+    struct stat st;
+    if (load_index_header(idx_fd, &header) < 0 || fstat(idx_fd, &st) < 0) {
+        fprintf(stderr, "%s: cannot read header: %s\n", idx_path, strerror(errno));
+        return 1;
+    }
+
+    Scan scan;
+    memset(&scan, 0, sizeof(Scan));
+    scan.first_page = HEADER_SIZE;
+    // the header ends are the cursors of the last process that wrote them back, and other handles
+    // may have allocated past them, so the file itself bounds the scan. pages past the written
+    // extent are preallocated and were never written.
+    off_t idx_written = written_end(idx_fd, st.st_size);
+    off_t idx_size = st.st_size;
+    if (idx_written > scan.first_page) {
+        off_t pages = (idx_written - scan.first_page + (off_t) sizeof(IndexPage) - 1) / (off_t) sizeof(IndexPage);
+        scan.num_pages = (size_t) pages;
+        if (scan.first_page + pages * (off_t) sizeof(IndexPage) > st.st_size) {
+            scan.num_pages = (size_t) (st.st_size - scan.first_page) / sizeof(IndexPage);
+        }
+    }
+    scan.pages = calloc(scan.num_pages ? scan.num_pages : 1, sizeof(PageInfo));
+    if (scan.pages == NULL || read_index(idx_fd, &scan) < 0) {
+        fprintf(stderr, "%s: cannot read pages: %s\n", idx_path, strerror(errno));
+        return 1;
+    }
+    close(idx_fd);
+
+    size_t bad_links = 0;
+    off_t root = header.root_offset < 0 ? header.left_most_leaf_offset : header.root_offset;
+    int height = walk_tree(&scan, root, &bad_links);
+
+    size_t per_level[MAX_LEVELS] = {0};
+    size_t fill[FILL_BUCKETS + 1] = {0};
+    size_t leaves = 0, empty_leaves = 0, orphans = 0, invalid = 0, cells = 0;
+    uint64_t live_bytes = 0;
+    for (size_t i = 0; i < scan.num_pages; i++) {
+        PageInfo* info = scan.pages + i;
+        if (!info->valid) {
+            invalid++;
+            continue;
+        }
+        if (info->level < 0) {
+            orphans++;
+            continue;
+        }
+        per_level[info->level]++;
+        if (info->type != LEAF_NODE) continue;
+        leaves++;
+        cells += info->num_cells;
+        live_bytes += info->live_bytes;
+        if (info->num_cells == 0) empty_leaves++;
+        fill[info->num_cells * FILL_BUCKETS / MAX_CELL]++;
+    }
+
+    printf("%s: %zu pages of %zu bytes\n", idx_path, scan.num_pages, sizeof(IndexPage));
+    printf("  file             %lld bytes, %lld written (header says %lld)\n", (long long) idx_size,
+           (long long) idx_written, (long long) header.idx_end);
+    if (height < 0) printf("  root at %lld is not a valid page\n", (long long) root);
+    printf("  height           %d (header says %zu)\n", height, header.height);
+    for (int level = 0; level < height && level < MAX_LEVELS; level++) {
+        printf("  level %-10d %zu pages\n", level, per_level[level]);
+    }
+    printf("  keys             %zu\n", cells);
+    printf("  leaves           %zu, %zu empty\n", leaves, empty_leaves);
+    printf("  orphaned pages   %zu\n", orphans);
+    printf("  invalid pages    %zu\n", invalid);
+    printf("  broken links     %zu\n", bad_links);
+    printf("  mean leaf fill   %.1f%%\n", leaves ? 100.0 * (double) cells / (double) (leaves * MAX_CELL) : 0.0);
+    printf("  leaf fill distribution:\n");
+    for (int i = 0; i <= FILL_BUCKETS; i++) {
+        if (!fill[i]) continue;
+        if (i == FILL_BUCKETS) printf("    %9s %zu\n", "100%", fill[i]);
+        else printf("    %3d%%-%3d%% %zu\n", i * 100 / FILL_BUCKETS, (i + 1) * 100 / FILL_BUCKETS, fill[i]);
+    }
+
+    int data_fd = open(data_path, O_RDONLY);
+    if (data_fd < 0 || fstat(data_fd, &st) < 0) {
+        perror(data_path);
+        return 1;
+    }
+
+    // the extent is block granular, so a header end within its last block is the exact end. a
+    // punched range is a hole too, and a last region that compaction punched shows as preallocated.
+    off_t data_written = written_end(data_fd, st.st_size);
+    if (header.data_end <= data_written && header.data_end > data_written - (off_t) st.st_blksize) {
+        data_written = header.data_end;
+    }
+    uint64_t size = (uint64_t) data_written;
+    uint64_t reclaimed = punched_bytes(data_fd, (off_t) size);
+    close(data_fd);
+    uint64_t dead = size > live_bytes ? size - live_bytes : 0;
+    printf("%s: %llu bytes, %llu preallocated (header says %lld)\n", data_path, (unsigned long long) size,
+           (unsigned long long) (st.st_size > (off_t) size ? (uint64_t) st.st_size - size : 0),
+           (long long) header.data_end);
+    print_bytes("live", live_bytes, size);
+    print_bytes("dead", dead, size);
+    print_bytes("punched", reclaimed, size);
+
+    double wasted_pages = (double) (empty_leaves + orphans) / (double) (scan.num_pages ? scan.num_pages : 1);
+    double dead_ratio = size ? (double) (dead > reclaimed ? dead - reclaimed : 0) / (double) size : 0;
+    if (wasted_pages > 0.1 || dead_ratio > 0.25) printf("db_reorganize would reclaim space\n");
+
+    free(scan.pages);
+    free(scan.children);
+    free(idx_path);
+    free(data_path);
+    return 0;
+}
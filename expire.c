@@ -0,0 +1,415 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "expire.h"
+#include "bulk.h"
+
+// values stored with a ttl keep their expiry time in the leaf cell, so a fetch can tell that they
+// are gone. <name>.ttl is a second tree over the same keys in time order: an entry is keyed by
+// the expiry time in the high 32 bits and a hash of the key in the low 32, and keeps the key in
+// offset. keys whose time and hash collide take the next free slot. entries are only a hint, a
+// step checks the cell before it removes a value, so an entry left behind by an overwrite does
+// no harm. the tree is only written under the exclusive latch of the handle. it is marked clean
+// on close and rebuilt from the leaves if a handle did not get that far.
+
+struct Expirer {
+    int fd;
+    Header header;
+    IndexPage* page; // scratch space for the holder of the exclusive latch.
+    size_t dropped; // entries removed since the tree was built, their slots stay empty.
+
+    unsigned interval_ms;
+    int running;
+    pthread_t thread;
+    pthread_mutex_t mutex; // guards running.
+    pthread_cond_t cond;
+};
+
+// whether the value of cell has expired, see db_store_ttl.
+int cell_expired(const Cell* cell) {
+    return cell->expire_at && cell->expire_at <= (uint64_t) time(NULL);
+}
+
+static uint64_t entry_key(uint64_t expire_at, uint64_t key) {
+    return expire_at << 32 | (key * 0x9e3779b97f4a7c15ULL) >> 32;
+}
+
+static char* ttl_path(DB* db, const char* suffix) {
+    char* path = malloc(strlen(db->name) + strlen(suffix) + 1);
+    if (path == NULL) return NULL;
+    strcpy(path, db->name);
+    strcat(path, suffix);
+    return path;
+}
+
+// hands out the entries of a rebuild in key order, returns 1 with the next, 0 at the end.
+typedef int (*EntrySource)(void* arg, Cell* entry);
+
+typedef struct {
+    int fd;
+    IndexPage* leaf;
+    int pos;
+}TreeSource;
+
+static int next_in_tree(void* arg, Cell* entry) {
+    TreeSource* source = arg;
+    while (source->pos >= source->leaf->num_cells) {
+        if (source->leaf->next_page == -1) return 0;
+        if (load_page(source->fd, source->leaf->next_page, source->leaf) < 0) {
+            errno = EIO;
+            return -1;
+        }
+        source->pos = 0;
+    }
+    *entry = source->leaf->cells[source->pos++];
+    return 1;
+}
+
+typedef struct {
+    Cell* entries;
+    size_t count;
+    size_t capacity;
+    size_t next;
+}ArraySource;
+
+static int next_in_array(void* arg, Cell* entry) {
+    ArraySource* source = arg;
+    if (source->next == source->count) return 0;
+    *entry = source->entries[source->next++];
+    return 1;
+}
+
+static int compare_entry(const void* a, const void* b) {
+    uint64_t x = ((const Cell*) a)->key;
+    uint64_t y = ((const Cell*) b)->key;
+    return x < y ? -1 : x > y;
+}
+
+// the entries of every value with an expiry, from the leaves of the database.
+static int collect_entries(DB* db, ArraySource* source) {
+    IndexPage* leaf = malloc_index_page();
+    if (leaf == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    for (off_t offset = db->header->left_most_leaf_offset; offset != -1; offset = leaf->next_page) {
+        if (load_page(db->idx_fd, offset, leaf) < 0) {
+            free_index_page(&leaf);
+            errno = EIO;
+            return -1;
+        }
+        for (int i = 0; i < leaf->num_cells; i++) {
+            if (leaf->cells[i].expire_at == 0) continue;
+            if (source->count == source->capacity) {
+                size_t capacity = source->capacity ? source->capacity * 2 : 1024;
+                Cell* entries = realloc(source->entries, capacity * sizeof(Cell));
+                if (entries == NULL) {
+                    free_index_page(&leaf);
+                    errno = ENOMEM;
+                    return -1;
+                }
+                source->entries = entries;
+                source->capacity = capacity;
+            }
+            uint64_t key = leaf->cells[i].key;
+            source->entries[source->count++] = (Cell) {entry_key(leaf->cells[i].expire_at, key), (off_t) key, 0, 0};
+        }
+    }
+    free_index_page(&leaf);
+
+    if (source->count > 0) qsort(source->entries, source->count, sizeof(Cell), compare_entry);
+    for (size_t i = 1; i < source->count; i++) {
+        if (source->entries[i].key <= source->entries[i - 1].key) source->entries[i].key = source->entries[i - 1].key + 1;
+    }
+    return 0;
+}
+
+// bulk-build a new .ttl tree from source and rename it over the old one.
+static int rebuild(DB* db, EntrySource next, void* arg) {
+    Expirer* expirer = db->expirer;
+    char* path = ttl_path(db, ".ttl");
+    char* tmp_path = ttl_path(db, ".ttl.rebuild");
+    if (path == NULL || tmp_path == NULL) {
+        free(path);
+        free(tmp_path);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    Header header;
+    BulkBuilder* builder = NULL;
+    int fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    int ret = fd < 0 || create_tree(fd) < 0 || load_index_header(fd, &header) < 0 ||
+              (builder = bulk_open(fd, &header)) == NULL ? -1 : 0;
+    Cell entry;
+    while (ret == 0 && (ret = next(arg, &entry)) > 0) ret = bulk_add(builder, &entry);
+    if (ret < 0) bulk_abort(&builder);
+    else if (bulk_finish(&builder) < 0) ret = -1;
+
+    if (ret == 0) {
+        header.flags &= ~HEADER_CLEAN;
+        if (dump_header(fd, &header) < 0 || rename(tmp_path, path) < 0) ret = -1;
+    }
+    if (ret < 0) {
+        int err = errno;
+        if (fd >= 0) close(fd);
+        unlink(tmp_path);
+        errno = err;
+    } else {
+        close(expirer->fd);
+        expirer->fd = fd;
+        expirer->header = header;
+        expirer->dropped = 0;
+    }
+    free(path);
+    free(tmp_path);
+    return ret;
+}
+
+static int rebuild_from_leaves(DB* db) {
+    ArraySource source = {NULL, 0, 0, 0};
+    int ret = collect_entries(db, &source);
+    if (ret == 0) ret = rebuild(db, next_in_array, &source);
+    free(source.entries);
+    return ret;
+}
+
+// open <name>.ttl, creating it if needed. the caller holds the exclusive latch.
+int expire_attach(DB* db) {
+    if (db->expirer) return 0;
+    if (!db->writable) {
+        errno = EBADF;
+        return -1;
+    }
+
+    Expirer* expirer = malloc(sizeof(Expirer));
+    char* path = ttl_path(db, ".ttl");
+    if (expirer == NULL || path == NULL) {
+        free(expirer);
+        free(path);
+        errno = ENOMEM;
+        return -1;
+    }
+    memset(expirer, 0, sizeof(Expirer));
+    expirer->interval_ms = EXPIRE_IDLE_MS;
+    expirer->page = malloc_index_page();
+    expirer->fd = open(path, O_RDWR | O_CREAT, 0644);
+    free(path);
+
+    struct stat st;
+    int ret = expirer->page && expirer->fd >= 0 && fstat(expirer->fd, &st) == 0 ? 0 : -1;
+    if (ret == 0 && st.st_size == 0) ret = create_tree(expirer->fd);
+    if (ret == 0) ret = load_index_header(expirer->fd, &expirer->header) < 0 ? -1 : 0;
+    if (ret < 0) {
+        int err = errno;
+        if (expirer->fd >= 0) close(expirer->fd);
+        free_index_page(&expirer->page);
+        free(expirer);
+        errno = err;
+        return -1;
+    }
+    pthread_mutex_init(&expirer->mutex, NULL);
+    pthread_cond_init(&expirer->cond, NULL);
+    db->expirer = expirer;
+
+    // a handle that did not close may have stored values whose entries never made it.
+    if (!(expirer->header.flags & HEADER_CLEAN)) return rebuild_from_leaves(db);
+    expirer->header.flags &= ~HEADER_CLEAN;
+    return dump_header(expirer->fd, &expirer->header) < 0 ? -1 : 0;
+}
+
+// attach <name>.ttl when a writable handle opens a database that has one.
+int expire_open(DB* db, int truncated) {
+    char* path = ttl_path(db, ".ttl");
+    if (path == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    if (truncated) unlink(path);
+    int exists = access(path, F_OK) == 0;
+    free(path);
+    return exists ? expire_attach(db) : 0;
+}
+
+// the caller holds the exclusive latch.
+int expire_add(DB* db, uint64_t expire_at, uint64_t key) {
+    if (expire_attach(db) < 0) return -1;
+    Expirer* expirer = db->expirer;
+    for (uint64_t slot = entry_key(expire_at, key);; slot++) {
+        Cell cell;
+        int pos = search_index(expirer->fd, &expirer->header, expirer->page, slot, &cell);
+        if (pos < -1) {
+            errno = EIO;
+            return -1;
+        }
+        if (pos >= 0 && cell.key == slot) {
+            if ((uint64_t) cell.offset == key) return 0;
+            continue;
+        }
+        Cell entry = {slot, (off_t) key, 0, 0};
+        if (insert_index(expirer->fd, &expirer->header, expirer->page, pos, &entry) < 0) {
+            errno = EIO;
+            return -1;
+        }
+        return 0;
+    }
+}
+
+// drop the entry of key, if it is found before a free slot. the caller holds the exclusive latch.
+int expire_remove(DB* db, uint64_t expire_at, uint64_t key) {
+    Expirer* expirer = db->expirer;
+    if (expirer == NULL) return 0;
+    for (uint64_t slot = entry_key(expire_at, key);; slot++) {
+        Cell cell;
+        int pos = search_index(expirer->fd, &expirer->header, expirer->page, slot, &cell);
+        if (pos < -1) {
+            errno = EIO;
+            return -1;
+        }
+        if (pos < 0 || cell.key != slot) return 0;
+        if ((uint64_t) cell.offset != key) continue;
+        if (delete_index(expirer->fd, &expirer->header, expirer->page, pos) < 0) {
+            errno = EIO;
+            return -1;
+        }
+        expirer->dropped++;
+        return 0;
+    }
+}
+
+// take up to max_keys entries due by now off the front of the tree and return their keys, in
+// time order. leaves are never merged, so once about half of the slots may have been emptied
+// the tree is rebuilt from the entries that are left. the caller holds the exclusive latch.
+ssize_t expire_take(DB* db, uint64_t now, uint64_t* keys, size_t max_keys) {
+    Expirer* expirer = db->expirer;
+    if (expirer == NULL) return 0;
+
+    IndexPage* leaf = expirer->page;
+    size_t taken = 0;
+    off_t offset = expirer->header.left_most_leaf_offset;
+    while (offset != -1 && taken < max_keys) {
+        if (load_page(expirer->fd, offset, leaf) < 0) {
+            errno = EIO;
+            return -1;
+        }
+        int due = 0;
+        while (due < leaf->num_cells && taken < max_keys && leaf->cells[due].key >> 32 <= now) {
+            keys[taken++] = (uint64_t) leaf->cells[due++].offset;
+        }
+        if (due) {
+            memmove(leaf->cells, leaf->cells + due, (leaf->num_cells - due) * sizeof(Cell));
+            leaf->num_cells -= due;
+            if (dump_page(expirer->fd, leaf) < 0) {
+                errno = EIO;
+                return -1;
+            }
+        }
+        if (leaf->num_cells) break;
+        offset = leaf->next_page;
+    }
+
+    expirer->dropped += taken;
+    size_t pages = expirer->header.node_number;
+    if ((offset == -1 && pages > 1) || (pages > EXPIRE_REBUILD_PAGES && expirer->dropped > pages * MAX_CELL / 4)) {
+        TreeSource source = {expirer->fd, leaf, 0};
+        if (load_page(expirer->fd, expirer->header.left_most_leaf_offset, leaf) < 0) {
+            errno = EIO;
+            return -1;
+        }
+        if (rebuild(db, next_in_tree, &source) < 0) return -1;
+    }
+    return (ssize_t) taken;
+}
+
+static void* expire_main(void* arg) {
+    DB* db = arg;
+    Expirer* expirer = db->expirer;
+
+    pthread_mutex_lock(&expirer->mutex);
+    while (expirer->running) {
+        pthread_mutex_unlock(&expirer->mutex);
+
+        ssize_t taken = db_expire_step(db, EXPIRE_BATCH);
+
+        // a full batch may leave more due, anything less waits for the next interval.
+        pthread_mutex_lock(&expirer->mutex);
+        if (taken < EXPIRE_BATCH && expirer->running) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += expirer->interval_ms / 1000;
+            deadline.tv_nsec += (long) (expirer->interval_ms % 1000) * 1000000;
+            if (deadline.tv_nsec >= 1000000000) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait(&expirer->cond, &expirer->mutex, &deadline);
+        }
+    }
+    pthread_mutex_unlock(&expirer->mutex);
+    return NULL;
+}
+
+// start a background thread removing expired values every interval_ms, EXPIRE_IDLE_MS if 0.
+int db_expire_start(DB* db, unsigned interval_ms) {
+    pthread_rwlock_wrlock(&db->latch);
+    int ret = expire_attach(db);
+    pthread_rwlock_unlock(&db->latch);
+    if (ret < 0) return -1;
+
+    Expirer* expirer = db->expirer;
+    pthread_mutex_lock(&expirer->mutex);
+    if (expirer->running) {
+        pthread_mutex_unlock(&expirer->mutex);
+        errno = EBUSY;
+        return -1;
+    }
+    expirer->interval_ms = interval_ms ? interval_ms : EXPIRE_IDLE_MS;
+    expirer->running = 1;
+    if (pthread_create(&expirer->thread, NULL, expire_main, db) != 0) {
+        expirer->running = 0;
+        pthread_mutex_unlock(&expirer->mutex);
+        errno = EAGAIN;
+        return -1;
+    }
+    pthread_mutex_unlock(&expirer->mutex);
+    return 0;
+}
+
+int db_expire_stop(DB* db) {
+    Expirer* expirer = db->expirer;
+    if (expirer == NULL) return 0;
+
+    pthread_mutex_lock(&expirer->mutex);
+    if (!expirer->running) {
+        pthread_mutex_unlock(&expirer->mutex);
+        return 0;
+    }
+    expirer->running = 0;
+    pthread_cond_signal(&expirer->cond);
+    pthread_mutex_unlock(&expirer->mutex);
+
+    return pthread_join(expirer->thread, NULL) == 0 ? 0 : -1;
+}
+
+void expire_free(DB* db) {
+    Expirer* expirer = db->expirer;
+    if (expirer == NULL) return;
+
+    db_expire_stop(db);
+    release_space(expirer->fd, -1, &expirer->header);
+    expirer->header.flags |= HEADER_CLEAN;
+    dump_header(expirer->fd, &expirer->header);
+    close(expirer->fd);
+    pthread_mutex_destroy(&expirer->mutex);
+    pthread_cond_destroy(&expirer->cond);
+    free_index_page(&expirer->page);
+    free(expirer);
+    db->expirer = NULL;
+}
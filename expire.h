@@ -0,0 +1,23 @@
+#ifndef MDBM_EXPIRE_H
+#define MDBM_EXPIRE_H
+
+#include <sys/types.h>
+
+#include "mdbm.h"
+
+#define EXPIRE_BATCH 1024 // due keys removed per step by the background thread.
+#define EXPIRE_IDLE_MS 1000
+#define EXPIRE_REBUILD_PAGES 64 // a .ttl tree this small is only rebuilt once it is empty.
+
+int db_expire_start(DB* db, unsigned interval_ms);
+int db_expire_stop(DB* db);
+
+int cell_expired(const Cell* cell);
+int expire_open(DB* db, int truncated);
+int expire_attach(DB* db);
+int expire_add(DB* db, uint64_t expire_at, uint64_t key);
+int expire_remove(DB* db, uint64_t expire_at, uint64_t key);
+ssize_t expire_take(DB* db, uint64_t now, uint64_t* keys, size_t max_keys);
+void expire_free(DB* db);
+
+#endif //MDBM_EXPIRE_H
@@ -0,0 +1,71 @@
+#include <string.h>
+
+#include "histogram.h"
+
+static int bucket_index(uint64_t value) {
+    if (value < HIST_SUB_BUCKETS) return (int) value;
+    int shift = 63 - __builtin_clzll(value) - HIST_SUB_BITS;
+    int sub = (int) (value >> shift) - HIST_SUB_BUCKETS;
+    return HIST_SUB_BUCKETS + shift * HIST_SUB_BUCKETS + sub;
+}
+
+// the largest value that falls into bucket index.
+static uint64_t bucket_value(int index) {
+    if (index < HIST_SUB_BUCKETS) return (uint64_t) index;
+    int shift = (index - HIST_SUB_BUCKETS) / HIST_SUB_BUCKETS;
+    uint64_t sub = (uint64_t) ((index - HIST_SUB_BUCKETS) % HIST_SUB_BUCKETS);
+    if (shift + HIST_SUB_BITS >= 63 && sub == HIST_SUB_BUCKETS - 1) return UINT64_MAX;
+    return ((HIST_SUB_BUCKETS + sub + 1) << shift) - 1;
+}
+
+void histogram_reset(Histogram* hist) {
+    memset(hist, 0, sizeof(Histogram));
+    hist->min = UINT64_MAX;
+}
+
+void histogram_record(Histogram* hist, uint64_t value) {
+    hist->counts[bucket_index(value)]++;
+    hist->total++;
+    hist->sum += value;
+    if (value < hist->min) hist->min = value;
+    if (value > hist->max) hist->max = value;
+}
+
+void histogram_merge(Histogram* dst, const Histogram* src) {
+    for (int i = 0; i < HIST_BUCKETS; i++) dst->counts[i] += src->counts[i];
+    dst->total += src->total;
+    dst->sum += src->sum;
+    if (src->min < dst->min) dst->min = src->min;
+    if (src->max > dst->max) dst->max = src->max;
+}
+
+// percentile in [0, 100]; reports the upper edge of the bucket, capped at the observed maximum.
+uint64_t histogram_percentile(const Histogram* hist, double percentile) {
+    if (hist->total == 0) return 0;
+    uint64_t rank = (uint64_t) (percentile / 100.0 * (double) hist->total + 0.5);
+    if (rank < 1) rank = 1;
+    if (rank > hist->total) rank = hist->total;
+
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += hist->counts[i];
+        if (seen >= rank) {
+            uint64_t value = bucket_value(i);
+            return value < hist->max ? value : hist->max;
+        }
+    }
+    return hist->max;
+}
+
+double histogram_mean(const Histogram* hist) {
+    return hist->total ? (double) hist->sum / (double) hist->total : 0;
+}
+
+void histogram_print(FILE* out, const char* name, const Histogram* hist) {
+    fprintf(out, "%-8s count=%llu mean=%.0fns p50=%lluns p99=%lluns p999=%lluns max=%lluns\n", name,
+            (unsigned long long) hist->total, histogram_mean(hist),
+            (unsigned long long) histogram_percentile(hist, 50),
+            (unsigned long long) histogram_percentile(hist, 99),
+            (unsigned long long) histogram_percentile(hist, 99.9),
+            (unsigned long long) (hist->total ? hist->max : 0));
+}
@@ -0,0 +1,27 @@
+#ifndef MDBM_HISTOGRAM_H
+#define MDBM_HISTOGRAM_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define HIST_SUB_BITS 5 // 32 linear sub-buckets per power of two, about 3% relative error.
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS)
+
+// log-linear latency histogram in the style of HdrHistogram, values are nanoseconds.
+typedef struct {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+}Histogram;
+
+void histogram_reset(Histogram* hist);
+void histogram_record(Histogram* hist, uint64_t value);
+void histogram_merge(Histogram* dst, const Histogram* src);
+uint64_t histogram_percentile(const Histogram* hist, double percentile);
+double histogram_mean(const Histogram* hist);
+void histogram_print(FILE* out, const char* name, const Histogram* hist);
+
+#endif //MDBM_HISTOGRAM_H
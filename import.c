@@ -0,0 +1,707 @@
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "import.h"
+#include "bulk.h"
+#include "cache.h"
+#include "io.h"
+#include "memtable.h"
+#include "scan.h"
+#include "snapshot.h"
+#include "backup.h"
+
+// loads unsorted input into an empty database with a few sequential passes. entries are
+// collected in memory up to the budget, sorted and spilled into runs. db_import_finish splits
+// the key space on keys sampled from the runs and merges each range on a thread of its own.
+// every thread appends its values to the data file in large batches, and the index is built
+// bottom-up from the merged cells. a key added more than once keeps its last value.
+
+#define IMPORT_SAMPLE_EVERY 1024 // every this many entries of a run are remembered with their offset.
+#define IMPORT_BATCH (1 << 20) // values are written to the data file in batches of this size.
+#define IMPORT_MIN_READ (64 << 10)
+
+typedef struct {
+    uint64_t key;
+    uint32_t size;
+    uint32_t pad;
+}RunEntry;
+
+typedef struct {
+    uint64_t key;
+    off_t offset;
+}RunSample;
+
+// a sorted run of entries without duplicate keys. the file is unlinked as soon as it is
+// created, so nothing is left behind if the import does not finish.
+typedef struct {
+    int fd;
+    off_t size;
+    RunSample* samples;
+    size_t num_samples;
+}Run;
+
+typedef struct {
+    uint64_t key;
+    size_t seq; // order of arrival, the last of equal keys wins.
+    size_t offset; // of the value in the arena.
+    size_t size;
+}Pending;
+
+struct Importer {
+    DB* db;
+    size_t memory;
+    char* arena;
+    size_t arena_used;
+    size_t arena_capacity;
+    Pending* pending;
+    size_t num_pending;
+    size_t pending_capacity;
+    size_t seq;
+    Run* runs;
+    size_t num_runs;
+};
+
+static int write_full(int fd, const void* data, size_t size, off_t offset) {
+    const char* p = data;
+    while (size) {
+        ssize_t n = pwrite(fd, p, size, offset);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) continue;
+            if (n == 0) errno = EIO;
+            return -1;
+        }
+        p += n;
+        size -= (size_t) n;
+        offset += n;
+    }
+    return 0;
+}
+
+static int open_temp(DB* db, const char* kind, size_t n) {
+    char* path = malloc(strlen(db->name) + strlen(kind) + 24);
+    if (path == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    sprintf(path, "%s.%s.%zu", db->name, kind, n);
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd >= 0) unlink(path);
+    free(path);
+    return fd;
+}
+
+typedef struct {
+    int fd;
+    off_t offset;
+    char* buf;
+    size_t used;
+}Writer;
+
+static int writer_flush(Writer* writer) {
+    if (writer->used && write_full(writer->fd, writer->buf, writer->used, writer->offset) < 0) return -1;
+    writer->offset += (off_t) writer->used;
+    writer->used = 0;
+    return 0;
+}
+
+static int writer_put(Writer* writer, const void* data, size_t size) {
+    const char* p = data;
+    while (size) {
+        if (writer->used == IMPORT_BATCH && writer_flush(writer) < 0) return -1;
+        size_t n = IMPORT_BATCH - writer->used < size ? IMPORT_BATCH - writer->used : size;
+        memcpy(writer->buf + writer->used, p, n);
+        writer->used += n;
+        p += n;
+        size -= n;
+    }
+    return 0;
+}
+
+typedef struct {
+    int fd;
+    int run;
+    off_t end;
+    off_t offset; // file offset of buf[0].
+    char* buf;
+    size_t capacity;
+    size_t base; // capacity the buffer returns to after an entry larger than it.
+    size_t len;
+    size_t pos;
+    size_t consumed; // bytes of the current entry.
+    RunEntry entry;
+    const char* value;
+    int done;
+}Reader;
+
+// make need bytes past pos contiguous in the buffer.
+static int reader_fill(Reader* reader, size_t need) {
+    if (reader->len - reader->pos >= need) return 0;
+    memmove(reader->buf, reader->buf + reader->pos, reader->len - reader->pos);
+    reader->offset += (off_t) reader->pos;
+    reader->len -= reader->pos;
+    reader->pos = 0;
+    size_t capacity = need > reader->base ? need : reader->base;
+    if (capacity != reader->capacity && reader->len <= capacity) {
+        char* buf = realloc(reader->buf, capacity);
+        if (buf == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        reader->buf = buf;
+        reader->capacity = capacity;
+    }
+    while (reader->len < need) {
+        ssize_t n = pread(reader->fd, reader->buf + reader->len, reader->capacity - reader->len,
+                          reader->offset + (off_t) reader->len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            errno = EIO;
+            return -1;
+        }
+        reader->len += (size_t) n;
+    }
+    return 0;
+}
+
+// step to the next entry of the run, done is set at its end.
+static int reader_next(Reader* reader) {
+    reader->pos += reader->consumed;
+    reader->consumed = 0;
+    if (reader->offset + (off_t) reader->pos >= reader->end) {
+        reader->done = 1;
+        return 0;
+    }
+    if (reader_fill(reader, sizeof(RunEntry)) < 0) return -1;
+    memcpy(&reader->entry, reader->buf + reader->pos, sizeof(RunEntry));
+    if (reader_fill(reader, sizeof(RunEntry) + reader->entry.size) < 0) return -1;
+    reader->value = reader->buf + reader->pos + sizeof(RunEntry);
+    reader->consumed = sizeof(RunEntry) + reader->entry.size;
+    return 0;
+}
+
+static void free_runs(Importer* importer) {
+    for (size_t i = 0; i < importer->num_runs; i++) {
+        close(importer->runs[i].fd);
+        free(importer->runs[i].samples);
+    }
+    free(importer->runs);
+    importer->runs = NULL;
+    importer->num_runs = 0;
+}
+
+static int empty_tree(DB* db) {
+    if (db->header->root_offset >= 0 || db->header->node_number != 1) return 0;
+    if (db->memtable && memtable_count(db->memtable)) return 0;
+    IndexPage* leaf = malloc_index_page();
+    if (leaf == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    int ret = -1;
+    if (load_page(db->idx_fd, db->header->left_most_leaf_offset, leaf) < 0) errno = EIO;
+    else ret = leaf->num_cells == 0;
+    free_index_page(&leaf);
+    return ret;
+}
+
+// the database must be empty. memory bounds the entries held before they are spilled into a run.
+Importer* db_import_begin(DB* db, size_t memory) {
+    if (memory < IMPORT_MIN_MEMORY) {
+        errno = EINVAL;
+        return NULL;
+    }
+    // the import bypasses the write path, so it would leave secondary indexes and the change
+    // feed behind.
+    if (db->indexes || db->feed) {
+        errno = EBUSY;
+        return NULL;
+    }
+    pthread_rwlock_rdlock(&db->latch);
+    int empty = empty_tree(db);
+    pthread_rwlock_unlock(&db->latch);
+    if (empty <= 0) {
+        if (empty == 0) errno = ENOTEMPTY;
+        return NULL;
+    }
+
+    Importer* importer = malloc(sizeof(Importer));
+    if (importer == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    memset(importer, 0, sizeof(Importer));
+    importer->db = db;
+    importer->memory = memory;
+    return importer;
+}
+
+static int compare_pending(const void* a, const void* b) {
+    const Pending* x = a;
+    const Pending* y = b;
+    if (x->key != y->key) return x->key < y->key ? -1 : 1;
+    return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+// sort what is in memory and write it out as the next run.
+static int spill(Importer* importer) {
+    if (importer->num_pending == 0) return 0;
+    Run* runs = realloc(importer->runs, (importer->num_runs + 1) * sizeof(Run));
+    if (runs == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    importer->runs = runs;
+    Run* run = runs + importer->num_runs;
+    memset(run, 0, sizeof(Run));
+    size_t max_samples = importer->num_pending / IMPORT_SAMPLE_EVERY + 1;
+    run->samples = malloc(max_samples * sizeof(RunSample));
+    Writer writer = {open_temp(importer->db, "run", importer->num_runs), 0, malloc(IMPORT_BATCH), 0};
+    run->fd = writer.fd;
+    if (run->samples == NULL || writer.buf == NULL || writer.fd < 0) {
+        int err = writer.fd < 0 ? errno : ENOMEM;
+        if (writer.fd >= 0) close(writer.fd);
+        free(run->samples);
+        free(writer.buf);
+        errno = err;
+        return -1;
+    }
+    importer->num_runs++;
+
+    qsort(importer->pending, importer->num_pending, sizeof(Pending), compare_pending);
+    size_t written = 0;
+    int ret = 0;
+    for (size_t i = 0; ret == 0 && i < importer->num_pending; i++) {
+        const Pending* pending = importer->pending + i;
+        if (i + 1 < importer->num_pending && pending[1].key == pending->key) continue;
+        if (written++ % IMPORT_SAMPLE_EVERY == 0) {
+            run->samples[run->num_samples].key = pending->key;
+            run->samples[run->num_samples++].offset = writer.offset + (off_t) writer.used;
+        }
+        RunEntry entry = {pending->key, (uint32_t) pending->size, 0};
+        ret = writer_put(&writer, &entry, sizeof(RunEntry));
+        if (ret == 0) ret = writer_put(&writer, importer->arena + pending->offset, pending->size);
+    }
+    if (ret == 0) ret = writer_flush(&writer);
+    run->size = writer.offset;
+    free(writer.buf);
+
+    importer->num_pending = 0;
+    importer->arena_used = 0;
+    return ret;
+}
+
+// grow *buf to hold need bytes, doubling but never past limit.
+static int reserve(void** buf, size_t* capacity, size_t need, size_t limit) {
+    if (need <= *capacity) return 0;
+    size_t grown = *capacity ? *capacity * 2 : 64 << 10;
+    if (grown > limit) grown = limit;
+    if (grown < need) grown = need;
+    void* p = realloc(*buf, grown);
+    if (p == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    *buf = p;
+    *capacity = grown;
+    return 0;
+}
+
+int db_import_add(Importer* importer, uint64_t key, const void* data, size_t size) {
+    if (size > UINT32_MAX || (data == NULL && size)) {
+        errno = EINVAL;
+        return -1;
+    }
+    size_t held = importer->arena_used + (importer->num_pending + 1) * sizeof(Pending);
+    if (importer->num_pending && held + size > importer->memory && spill(importer) < 0) return -1;
+
+    // the budget is split between values and their entries in proportion to what arrives.
+    size_t limit = importer->memory;
+    if (reserve((void**) &importer->arena, &importer->arena_capacity, importer->arena_used + size, limit) < 0 ||
+        reserve((void**) &importer->pending, &importer->pending_capacity,
+                (importer->num_pending + 1) * sizeof(Pending), limit) < 0) {
+        return -1;
+    }
+    Pending* pending = importer->pending + importer->num_pending++;
+    pending->key = key;
+    pending->seq = importer->seq++;
+    pending->offset = importer->arena_used;
+    pending->size = size;
+    if (size) memcpy(importer->arena + importer->arena_used, data, size);
+    importer->arena_used += size;
+    return 0;
+}
+
+void db_import_abort(Importer** importer) {
+    if (!(*importer)) return;
+    free_runs(*importer);
+    free((*importer)->arena);
+    free((*importer)->pending);
+    free(*importer);
+    *importer = NULL;
+}
+
+static int compare_key(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*) a;
+    uint64_t y = *(const uint64_t*) b;
+    return x < y ? -1 : x > y;
+}
+
+// split the key space on the sampled keys into ranges of about the same number of entries.
+static int import_partition(Importer* importer, int parts, KeyRange* ranges) {
+    size_t num_keys = 0;
+    for (size_t i = 0; i < importer->num_runs; i++) num_keys += importer->runs[i].num_samples;
+    uint64_t* keys = malloc((num_keys ? num_keys : 1) * sizeof(uint64_t));
+    if (keys == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    num_keys = 0;
+    for (size_t i = 0; i < importer->num_runs; i++) {
+        for (size_t s = 0; s < importer->runs[i].num_samples; s++) keys[num_keys++] = importer->runs[i].samples[s].key;
+    }
+    qsort(keys, num_keys, sizeof(uint64_t), compare_key);
+
+    int count = 0;
+    uint64_t lo = 0;
+    for (int i = 1; i < parts && num_keys; i++) {
+        uint64_t bound = keys[(size_t) i * num_keys / parts];
+        if (bound <= lo) continue;
+        ranges[count].lo = lo;
+        ranges[count].hi = bound;
+        ranges[count].bounded = 1;
+        count++;
+        lo = bound;
+    }
+    ranges[count].lo = lo;
+    ranges[count].hi = 0;
+    ranges[count].bounded = 0;
+    free(keys);
+    return count + 1;
+}
+
+// one range of the merge. the first part feeds its cells straight into the tree, the others
+// keep theirs in a file until the parts before them are in.
+typedef struct {
+    Importer* importer;
+    KeyRange range;
+    pthread_mutex_t* mutex; // guards the data end of the header.
+    atomic_int* failed;
+    size_t read_size;
+    BulkBuilder* builder;
+    Writer cells;
+    size_t num_cells;
+    char* batch;
+    size_t batch_used;
+    Cell* batch_cells;
+    size_t num_batch;
+    size_t batch_capacity;
+    int err;
+}ImportPart;
+
+static int deliver(ImportPart* part, const Cell* cell) {
+    part->num_cells++;
+    if (part->builder) return bulk_add(part->builder, cell);
+    return writer_put(&part->cells, cell, sizeof(Cell));
+}
+
+// write the batched values in one piece at the end of the data file. batches are whole blocks,
+// so with O_DIRECT no two threads read-modify-write the same block and most writes need no bounce.
+static int flush_batch(ImportPart* part) {
+    if (part->num_batch == 0) return 0;
+    DB* db = part->importer->db;
+    size_t length = part->batch_used;
+    pthread_mutex_lock(part->mutex);
+    off_t base = alloc_data_blocks(db->data_fd, db->header, &length);
+    pthread_mutex_unlock(part->mutex);
+    if (base < 0) {
+        errno = EIO;
+        return -1;
+    }
+    // a value larger than a batch is written from the caller's buffer, which has no room to pad.
+    if (length <= IMPORT_BATCH) memset(part->batch + part->batch_used, 0, length - part->batch_used);
+    else length = part->batch_used;
+    if (length && io_pwrite(db->data_fd, part->batch, length, base) != (ssize_t) length) {
+        errno = EIO;
+        return -1;
+    }
+    for (size_t i = 0; i < part->num_batch; i++) {
+        part->batch_cells[i].offset += base;
+        if (deliver(part, part->batch_cells + i) < 0) return -1;
+    }
+    part->batch_used = 0;
+    part->num_batch = 0;
+    return 0;
+}
+
+static int emit(ImportPart* part, uint64_t key, const char* value, size_t size) {
+    if (part->batch_used + size > IMPORT_BATCH && flush_batch(part) < 0) return -1;
+    if (part->num_batch == part->batch_capacity) {
+        size_t capacity = part->batch_capacity ? part->batch_capacity * 2 : 1024;
+        Cell* cells = realloc(part->batch_cells, capacity * sizeof(Cell));
+        if (cells == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        part->batch_cells = cells;
+        part->batch_capacity = capacity;
+    }
+    if (size > IMPORT_BATCH) {
+        // a value larger than a batch goes out on its own.
+        char* batch = part->batch;
+        part->batch = (char*) value;
+        part->batch_used = size;
+        part->batch_cells[0] = (Cell) {key, 0, 0, size};
+        part->num_batch = 1;
+        int ret = flush_batch(part);
+        part->batch = batch;
+        return ret;
+    }
+    memcpy(part->batch + part->batch_used, value, size);
+    part->batch_cells[part->num_batch++] = (Cell) {key, (off_t) part->batch_used, 0, size};
+    part->batch_used += size;
+    return 0;
+}
+
+// later runs come first among equal keys, so the newest value wins.
+static int reader_before(const Reader* a, const Reader* b) {
+    if (a->entry.key != b->entry.key) return a->entry.key < b->entry.key;
+    return a->run > b->run;
+}
+
+static void sift_down(Reader** heap, size_t size, size_t i) {
+    for (;;) {
+        size_t min = i;
+        size_t left = 2 * i + 1;
+        if (left < size && reader_before(heap[left], heap[min])) min = left;
+        if (left + 1 < size && reader_before(heap[left + 1], heap[min])) min = left + 1;
+        if (min == i) return;
+        Reader* swap = heap[i];
+        heap[i] = heap[min];
+        heap[min] = swap;
+        i = min;
+    }
+}
+
+// the run position of the last sampled key not above key.
+static off_t run_start(const Run* run, uint64_t key) {
+    size_t lo = 0;
+    size_t hi = run->num_samples;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (run->samples[mid].key <= key) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo ? run->samples[lo - 1].offset : 0;
+}
+
+static int merge_part(ImportPart* part, Reader* readers, Reader** heap) {
+    Importer* importer = part->importer;
+    size_t size = 0;
+    for (size_t i = 0; i < importer->num_runs; i++) {
+        Reader* reader = readers + i;
+        reader->fd = importer->runs[i].fd;
+        reader->run = (int) i;
+        reader->end = importer->runs[i].size;
+        reader->offset = run_start(importer->runs + i, part->range.lo);
+        if ((reader->buf = malloc(part->read_size)) == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        reader->capacity = part->read_size;
+        reader->base = part->read_size;
+        do {
+            if (reader_next(reader) < 0) return -1;
+        } while (!reader->done && reader->entry.key < part->range.lo);
+        if (!reader->done) heap[size++] = reader;
+    }
+    for (size_t i = size; i-- > 0;) sift_down(heap, size, i);
+
+    while (size && !atomic_load_explicit(part->failed, memory_order_relaxed)) {
+        uint64_t key = heap[0]->entry.key;
+        if (part->range.bounded && key >= part->range.hi) break;
+        if (emit(part, key, heap[0]->value, heap[0]->entry.size) < 0) return -1;
+        while (size && heap[0]->entry.key == key) {
+            if (reader_next(heap[0]) < 0) return -1;
+            if (heap[0]->done) heap[0] = heap[--size];
+            sift_down(heap, size, 0);
+        }
+    }
+    if (flush_batch(part) < 0) return -1;
+    return part->builder ? 0 : writer_flush(&part->cells);
+}
+
+static void* part_main(void* arg) {
+    ImportPart* part = arg;
+    size_t num_runs = part->importer->num_runs;
+    Reader* readers = calloc(num_runs ? num_runs : 1, sizeof(Reader));
+    Reader** heap = malloc((num_runs ? num_runs : 1) * sizeof(Reader*));
+    void* batch = NULL;
+    if (posix_memalign(&batch, IO_ALIGN, IMPORT_BATCH) == 0) part->batch = batch;
+    int ret = -1;
+    if (readers == NULL || heap == NULL || part->batch == NULL) errno = ENOMEM;
+    else ret = merge_part(part, readers, heap);
+    if (ret < 0) {
+        part->err = errno;
+        atomic_store(part->failed, 1);
+    }
+    for (size_t i = 0; readers && i < num_runs; i++) free(readers[i].buf);
+    free(readers);
+    free(heap);
+    free(part->batch);
+    free(part->batch_cells);
+    part->batch = NULL;
+    part->batch_cells = NULL;
+    return NULL;
+}
+
+// append the cells a part kept in its file to the tree.
+static int add_cells(BulkBuilder* builder, ImportPart* part) {
+    Reader reader;
+    memset(&reader, 0, sizeof(Reader));
+    reader.fd = part->cells.fd;
+    reader.end = part->cells.offset;
+    reader.capacity = IMPORT_BATCH;
+    reader.base = IMPORT_BATCH;
+    if ((reader.buf = malloc(IMPORT_BATCH)) == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    int ret = 0;
+    while (ret == 0 && reader.offset + (off_t) reader.pos < reader.end) {
+        ret = reader_fill(&reader, sizeof(Cell));
+        if (ret == 0) ret = bulk_add(builder, (Cell*) (reader.buf + reader.pos));
+        reader.pos += sizeof(Cell);
+    }
+    free(reader.buf);
+    return ret;
+}
+
+static int build(Importer* importer, BulkBuilder* builder, int threads) {
+    KeyRange ranges[IMPORT_MAX_THREADS];
+    int parts = import_partition(importer, threads, ranges);
+    if (parts < 0) return -1;
+
+    // every part reads from every run, the read buffers share the budget.
+    size_t readers = importer->num_runs * (size_t) parts;
+    size_t read_size = readers ? importer->memory / readers : IMPORT_MIN_READ;
+    if (read_size < IMPORT_MIN_READ) read_size = IMPORT_MIN_READ;
+    if (read_size > IMPORT_BATCH) read_size = IMPORT_BATCH;
+
+    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+    atomic_int failed = 0;
+    ImportPart part[IMPORT_MAX_THREADS];
+    pthread_t tids[IMPORT_MAX_THREADS];
+    int started[IMPORT_MAX_THREADS];
+    memset(part, 0, parts * sizeof(ImportPart));
+    int err = 0;
+    for (int i = 0; i < parts; i++) {
+        part[i].importer = importer;
+        part[i].range = ranges[i];
+        part[i].mutex = &mutex;
+        part[i].failed = &failed;
+        part[i].read_size = read_size;
+        part[i].cells.fd = -1;
+        if (i == 0) {
+            part[i].builder = builder;
+        } else if ((part[i].cells.fd = open_temp(importer->db, "cells", i)) < 0 ||
+                   (part[i].cells.buf = malloc(IMPORT_BATCH)) == NULL) {
+            err = part[i].cells.fd < 0 ? errno : ENOMEM;
+            parts = i + 1;
+            break;
+        }
+    }
+    for (int i = 0; err == 0 && i < parts; i++) {
+        // the first part runs on the calling thread, as does any that fails to get its own.
+        started[i] = i > 0 && pthread_create(tids + i, NULL, part_main, part + i) == 0;
+    }
+    if (err == 0) part_main(part);
+    for (int i = 1; err == 0 && i < parts; i++) {
+        if (started[i]) pthread_join(tids[i], NULL);
+        else part_main(part + i);
+    }
+
+    for (int i = 0; i < parts && err == 0; i++) err = part[i].err;
+    for (int i = 1; i < parts && err == 0; i++) {
+        if (add_cells(builder, part + i) < 0) err = errno;
+    }
+    for (int i = 1; i < parts; i++) {
+        if (part[i].cells.fd >= 0) close(part[i].cells.fd);
+        free(part[i].cells.buf);
+    }
+    if (err) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+// the importer is freed either way. on failure the database is left empty again, the space
+// the partial load took stays allocated until it is reorganized.
+int db_import_finish(Importer** importer, int threads) {
+    Importer* im = *importer;
+    if (threads < 1 || threads > IMPORT_MAX_THREADS) {
+        db_import_abort(importer);
+        errno = EINVAL;
+        return -1;
+    }
+    if (spill(im) < 0) {
+        int err = errno;
+        db_import_abort(importer);
+        errno = err;
+        return -1;
+    }
+    free(im->arena);
+    free(im->pending);
+    im->arena = NULL;
+    im->pending = NULL;
+
+    DB* db = im->db;
+    pthread_rwlock_wrlock(&db->latch);
+    int empty = empty_tree(db);
+    int ret = -1;
+    // an index or a change feed opened since db_import_begin would miss the imported keys too.
+    if (empty == 0 || db->reorg || snapshot_active(db) || db->indexes || db->feed) {
+        errno = empty == 0 ? ENOTEMPTY : EBUSY;
+    } else if (empty > 0 && (db->header->flags & HEADER_BYTE_KEYS)) {
+        // the keys are uint64_t, see key_kind in mdbm.c.
+        errno = EINVAL;
+    } else if (empty > 0) {
+        Header before;
+        memcpy(&before, db->header, sizeof(Header));
+        db->header->flags |= HEADER_UINT_KEYS;
+        BulkBuilder* builder = bulk_open(db->idx_fd, db->header);
+        if (builder && build(im, builder, threads) == 0 && fsync(db->data_fd) == 0) {
+            ret = bulk_finish(&builder);
+        } else {
+            int err = errno;
+            bulk_abort(&builder);
+            // put back the empty leaf, keeping the new ends of both files.
+            before.idx_end = db->header->idx_end;
+            before.idx_reserved = db->header->idx_reserved;
+            before.data_end = db->header->data_end;
+            before.data_reserved = db->header->data_reserved;
+            memcpy(db->header, &before, sizeof(Header));
+            IndexPage* leaf = malloc_index_page();
+            if (leaf) {
+                init_page(leaf, 0, LEAF_NODE, -1, -1, -1, before.left_most_leaf_offset, -1);
+                dump_page(db->idx_fd, leaf);
+                free_index_page(&leaf);
+            }
+            dump_header(db->idx_fd, db->header);
+            errno = err;
+        }
+        if (db->cache) cache_purge(db->cache, db->data_fd);
+        backup_invalidate(db);
+    }
+    pthread_rwlock_unlock(&db->latch);
+
+    int err = errno;
+    db_import_abort(importer);
+    errno = err;
+    return ret;
+}
@@ -0,0 +1,16 @@
+#ifndef MDBM_IMPORT_H
+#define MDBM_IMPORT_H
+
+#include "mdbm.h"
+
+#define IMPORT_MAX_THREADS 64
+#define IMPORT_MIN_MEMORY (1 << 20)
+
+typedef struct Importer Importer;
+
+Importer* db_import_begin(DB* db, size_t memory);
+int db_import_add(Importer* importer, uint64_t key, const void* data, size_t size);
+int db_import_finish(Importer** importer, int threads);
+void db_import_abort(Importer** importer);
+
+#endif //MDBM_IMPORT_H
@@ -0,0 +1,382 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "index.h"
+#include "expire.h"
+#include "io.h"
+#include "lock.h"
+#include "memtable.h"
+#include "snapshot.h"
+
+// a secondary index is a database of its own, <name>.<index>.idx and .dat. it holds one empty
+// byte-string key per posting, the attribute the extractor finds in a value followed by the key
+// of the value, both big endian, so the keys with one attribute sort together in key order.
+// every write of the primary passes the old and the new value to index_update under its
+// exclusive latch, so the indexes change with it, one posting at a time however many keys share
+// the attribute. an index is only kept up to date by handles that opened it.
+
+struct SecondaryIndex {
+    char* name;
+    DB* tree;
+    KeyExtractor extract;
+    void* arg;
+    int broken; // an update failed half way, the files are removed on close so the next open rebuilds them.
+    SecondaryIndex* next;
+};
+
+#define POSTING_SIZE (2 * sizeof(uint64_t))
+
+typedef struct {
+    uint64_t attr;
+    uint64_t key;
+}Posting;
+
+static size_t posting_key(unsigned char* entry, uint64_t attr, uint64_t key) {
+    size_t size = db_key_append_u64(entry, attr);
+    return size + db_key_append_u64(entry + size, key);
+}
+
+static uint64_t read_u64(const unsigned char* bytes) {
+    uint64_t value = 0;
+    for (int i = 0; i < 8; i++) value = value << 8 | bytes[i];
+    return value;
+}
+
+static char* index_path(DB* db, const char* name, const char* suffix) {
+    char* path = malloc(strlen(db->name) + strlen(name) + strlen(suffix) + 2);
+    if (path == NULL) return NULL;
+    strcpy(path, db->name);
+    strcat(path, ".");
+    strcat(path, name);
+    strcat(path, suffix);
+    return path;
+}
+
+static void remove_files(DB* db, const char* name) {
+    const char* suffixes[] = {".idx", ".dat", ".log", ".ttl"};
+    for (int i = 0; i < 4; i++) {
+        char* path = index_path(db, name, suffixes[i]);
+        if (path) unlink(path);
+        free(path);
+    }
+}
+
+// whether the index was closed by the last handle that had it open, and built from these files
+// rather than ones truncated or created since.
+static int index_clean(DB* db, const char* name) {
+    char* path = index_path(db, name, ".idx");
+    int fd = path ? open(path, O_RDONLY) : -1;
+    free(path);
+    if (fd < 0) return 0;
+    Header header;
+    int clean = load_index_header(fd, &header) >= 0 && (header.flags & HEADER_CLEAN) &&
+                header.origin == db->header->origin;
+    close(fd);
+    return clean;
+}
+
+static SecondaryIndex* find_index(DB* db, const char* name) {
+    for (SecondaryIndex* index = db->indexes; index; index = index->next) {
+        if (strcmp(index->name, name) == 0) return index;
+    }
+    return NULL;
+}
+
+static void close_index(DB* db, SecondaryIndex* index) {
+    db_close(index->tree);
+    if (index->broken) remove_files(db, index->name);
+    free(index->name);
+    free(index);
+}
+
+static int compare_posting(const void* a, const void* b) {
+    const Posting* x = a;
+    const Posting* y = b;
+    if (x->attr != y->attr) return x->attr < y->attr ? -1 : 1;
+    return x->key < y->key ? -1 : x->key > y->key;
+}
+
+typedef struct {
+    Posting* postings;
+    size_t count;
+    size_t capacity;
+}PostingList;
+
+static int push_posting(PostingList* list, uint64_t attr, uint64_t key) {
+    if (list->count == list->capacity) {
+        size_t capacity = list->capacity ? list->capacity * 2 : 1024;
+        Posting* postings = realloc(list->postings, capacity * sizeof(Posting));
+        if (postings == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        list->postings = postings;
+        list->capacity = capacity;
+    }
+    list->postings[list->count++] = (Posting) {attr, key};
+    return 0;
+}
+
+// extract the attribute of every live value, the caller holds the exclusive latch of db.
+static int collect_postings(DB* db, SecondaryIndex* index, PostingList* list) {
+    IndexPage* leaf = malloc_index_page();
+    Record value = {0, NULL};
+    size_t capacity = 0;
+    if (leaf == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    int ret = 0;
+    for (off_t offset = db->header->left_most_leaf_offset; ret == 0 && offset != -1; offset = leaf->next_page) {
+        if (load_page(db->idx_fd, offset, leaf) < 0) {
+            errno = EIO;
+            ret = -1;
+            break;
+        }
+        for (int i = 0; ret == 0 && i < leaf->num_cells; i++) {
+            const Cell* cell = leaf->cells + i;
+            if (cell_expired(cell)) continue;
+            if (cell->size > capacity) {
+                char* data = realloc(value.data, cell->size);
+                if (data == NULL) {
+                    errno = ENOMEM;
+                    ret = -1;
+                    break;
+                }
+                value.data = data;
+                capacity = cell->size;
+            }
+            value.size = cell->size;
+            if (cell->size && read_lock_wait(db->data_fd, cell->offset, SEEK_SET, cell->size) < 0) {
+                errno = EAGAIN;
+                ret = -1;
+                break;
+            }
+            ssize_t read = io_pread(db->data_fd, value.data, cell->size, cell->offset);
+            if (cell->size) unlock(db->data_fd, cell->offset, SEEK_SET, cell->size);
+            if (read < 0) {
+                errno = EIO;
+                ret = -1;
+                break;
+            }
+            // a database of byte-string keys is indexed by the values of its keys, see put_cell.
+            Record entry = value;
+            Record key;
+            int link = db->header->flags & HEADER_BYTE_KEYS ? db_key_record(&value, &key, &entry) : 0;
+            if (link < 0) {
+                ret = -1;
+                break;
+            }
+            if (link) continue;
+            uint64_t attr;
+            int has = index->extract(cell->key, &entry, &attr, index->arg);
+            if (has < 0 || (has && push_posting(list, attr, cell->key) < 0)) ret = -1;
+        }
+    }
+    free(value.data);
+    free_index_page(&leaf);
+    return ret;
+}
+
+// fill the empty tree of index from the values of db, the caller holds the exclusive latch of db.
+static int build_index(DB* db, SecondaryIndex* index) {
+    PostingList list = {NULL, 0, 0};
+    if (collect_postings(db, index, &list) < 0) {
+        free(list.postings);
+        return -1;
+    }
+    if (list.count) qsort(list.postings, list.count, sizeof(Posting), compare_posting);
+
+    // in order through the write buffer, so the leaves are written about once each.
+    Record empty = {0, ""};
+    int ret = db_buffer_start(index->tree, INDEX_BUILD_MEMORY);
+    int buffered = ret == 0;
+    for (size_t i = 0; ret == 0 && i < list.count; i++) {
+        unsigned char entry[POSTING_SIZE];
+        size_t size = posting_key(entry, list.postings[i].attr, list.postings[i].key);
+        ret = db_store_key(index->tree, entry, size, &empty, DB_STORE);
+    }
+    if (buffered && db_buffer_stop(index->tree) < 0) ret = -1;
+    free(list.postings);
+    return ret;
+}
+
+// write-lock db with its write buffer empty, so that its leaves hold every value.
+static int latch_flushed(DB* db) {
+    while (1) {
+        pthread_rwlock_wrlock(&db->latch);
+        if (db->memtable == NULL || memtable_count(db->memtable) == 0) return 0;
+        pthread_rwlock_unlock(&db->latch);
+        if (db_buffer_flush(db) < 0) return -1;
+    }
+}
+
+// maintain the index name of db with extract from now on. an index that does not exist, or was
+// not closed cleanly, is built from the values first. every writer of db has to open its
+// indexes, writes by a handle that did not are missing from them.
+int db_index_open(DB* db, const char* name, KeyExtractor extract, void* arg) {
+    size_t len = name ? strlen(name) : 0;
+    if (len == 0 || len >= INDEX_NAME_MAX || strchr(name, '/') || extract == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    SecondaryIndex* index = malloc(sizeof(SecondaryIndex));
+    if (index == NULL || (index->name = strdup(name)) == NULL) {
+        free(index);
+        errno = ENOMEM;
+        return -1;
+    }
+    index->extract = extract;
+    index->arg = arg;
+    index->broken = 0;
+    index->tree = NULL;
+
+    if (latch_flushed(db) < 0) {
+        free(index->name);
+        free(index);
+        return -1;
+    }
+    if (find_index(db, name)) {
+        pthread_rwlock_unlock(&db->latch);
+        free(index->name);
+        free(index);
+        errno = EEXIST;
+        return -1;
+    }
+
+    int ret = 0;
+    char* path = index_path(db, name, "");
+    int direct = db->direct ? O_DIRECT : 0;
+    if (path == NULL) {
+        errno = ENOMEM;
+        ret = -1;
+    } else if (!db->writable) {
+        index->tree = db_open(path, O_RDONLY | direct);
+        if (index->tree == NULL) ret = -1;
+    } else {
+        int clean = index_clean(db, name);
+        index->tree = db_open(path, O_RDWR | O_CREAT | direct | (clean ? 0 : O_TRUNC), 0644);
+        if (index->tree) index->tree->header->origin = db->header->origin;
+        if (index->tree == NULL || (!clean && build_index(db, index) < 0)) ret = -1;
+    }
+    free(path);
+
+    if (ret < 0) {
+        int err = errno;
+        if (index->tree) {
+            index->broken = 1;
+            close_index(db, index);
+        } else {
+            free(index->name);
+            free(index);
+        }
+        pthread_rwlock_unlock(&db->latch);
+        errno = err;
+        return -1;
+    }
+    index->next = db->indexes;
+    db->indexes = index;
+    pthread_rwlock_unlock(&db->latch);
+    return 0;
+}
+
+// stop maintaining the index name and remove its files.
+int db_index_drop(DB* db, const char* name) {
+    pthread_rwlock_wrlock(&db->latch);
+    SecondaryIndex** link = &db->indexes;
+    while (*link && strcmp((*link)->name, name) != 0) link = &(*link)->next;
+    SecondaryIndex* index = *link;
+    if (index == NULL) {
+        pthread_rwlock_unlock(&db->latch);
+        errno = ENOENT;
+        return -1;
+    }
+    *link = index->next;
+    index->broken = 1;
+    close_index(db, index);
+    pthread_rwlock_unlock(&db->latch);
+    return 0;
+}
+
+// add the posting of key under attr, or take it out.
+static int posting_change(DB* tree, uint64_t attr, uint64_t key, int add) {
+    unsigned char entry[POSTING_SIZE];
+    size_t size = posting_key(entry, attr, key);
+    if (add) {
+        Record empty = {0, ""};
+        return db_store_key(tree, entry, size, &empty, DB_STORE);
+    }
+    if (db_delete_key(tree, entry, size) < 0 && errno != ENOENT) return -1;
+    return 0;
+}
+
+// the value of key went from old_value to new_value, either NULL if there was none. the caller
+// holds the exclusive latch of db.
+int index_update(DB* db, uint64_t key, const Record* old_value, const Record* new_value) {
+    for (SecondaryIndex* index = db->indexes; index; index = index->next) {
+        uint64_t old_attr = 0, new_attr = 0;
+        int had = old_value ? index->extract(key, old_value, &old_attr, index->arg) : 0;
+        int has = new_value ? index->extract(key, new_value, &new_attr, index->arg) : 0;
+        if (had < 0 || has < 0) {
+            index->broken = 1;
+            return -1;
+        }
+        if (had && has && old_attr == new_attr) continue;
+        if ((had && posting_change(index->tree, old_attr, key, 0) < 0) ||
+            (has && posting_change(index->tree, new_attr, key, 1) < 0)) {
+            index->broken = 1;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+typedef struct {
+    IndexVisitor visit;
+    void* arg;
+    int ret;
+}IndexScan;
+
+static int visit_posting(const void* entry, size_t size, const Record* value, void* arg) {
+    (void) value;
+    IndexScan* scan = arg;
+    if (size != POSTING_SIZE) {
+        errno = EIO;
+        scan->ret = -1;
+    } else {
+        scan->ret = scan->visit(read_u64(entry), read_u64((const unsigned char*) entry + sizeof(uint64_t)), scan->arg);
+    }
+    return scan->ret;
+}
+
+// visit the keys whose attribute in the index name is in [lo, hi), as of one snapshot of the
+// index. only the index is read. returns 0, -1 on error, or the nonzero value a visitor stopped with.
+int db_index_scan(DB* db, const char* name, uint64_t lo, uint64_t hi, IndexVisitor visit, void* arg) {
+    pthread_rwlock_rdlock(&db->latch);
+    SecondaryIndex* index = find_index(db, name);
+    DB* tree = index ? index->tree : NULL;
+    pthread_rwlock_unlock(&db->latch);
+    if (tree == NULL) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    unsigned char lo_key[sizeof(uint64_t)], hi_key[sizeof(uint64_t)];
+    IndexScan scan = {visit, arg, 0};
+    if (db_scan_keys(tree, lo_key, db_key_append_u64(lo_key, lo), hi_key, db_key_append_u64(hi_key, hi),
+                     visit_posting, &scan) < 0) return -1;
+    return scan.ret;
+}
+
+void index_free(DB* db) {
+    while (db->indexes) {
+        SecondaryIndex* index = db->indexes;
+        db->indexes = index->next;
+        close_index(db, index);
+    }
+}
@@ -0,0 +1,26 @@
+#ifndef MDBM_INDEX_H
+#define MDBM_INDEX_H
+
+#include "mdbm.h"
+
+#define INDEX_NAME_MAX 64
+#define INDEX_BUILD_MEMORY (64 << 20) // the write buffer of an index while it is rebuilt.
+
+// sets *attr to the attribute the value of key is indexed under and returns 1, or returns 0 if
+// it has none. -1 with errno fails the write that asked. in a database of byte-string keys, key
+// is the tree key of the cell that holds the key, which changes when a longer key with the same
+// slice is stored, see mdbm.c.
+typedef int (*KeyExtractor)(uint64_t key, const Record* value, uint64_t* attr, void* arg);
+
+// called by db_index_scan for each key in attribute order, and in key order within one
+// attribute. a nonzero return stops the scan.
+typedef int (*IndexVisitor)(uint64_t attr, uint64_t key, void* arg);
+
+int db_index_open(DB* db, const char* name, KeyExtractor extract, void* arg);
+int db_index_drop(DB* db, const char* name);
+int db_index_scan(DB* db, const char* name, uint64_t lo, uint64_t hi, IndexVisitor visit, void* arg);
+
+int index_update(DB* db, uint64_t key, const Record* old_value, const Record* new_value);
+void index_free(DB* db);
+
+#endif //MDBM_INDEX_H
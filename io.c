@@ -0,0 +1,81 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "io.h"
+
+static atomic_uchar direct_fds[IO_MAX_FD];
+
+// switches O_DIRECT on or off for fd and remembers it, so unaligned requests can be bounced.
+int io_set_direct(int fd, int direct) {
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0) return -1;
+    if (direct) flags |= O_DIRECT;
+    else flags &= ~O_DIRECT;
+    if (fcntl(fd, F_SETFL, flags) < 0) return -1;
+    if (fd < IO_MAX_FD) atomic_store(direct_fds + fd, (unsigned char) (direct != 0));
+    return 0;
+}
+
+int io_is_direct(int fd) {
+    return fd >= 0 && fd < IO_MAX_FD && atomic_load_explicit(direct_fds + fd, memory_order_relaxed);
+}
+
+static int is_aligned(const void* buf, size_t size, off_t offset) {
+    return ((uintptr_t) buf | size | (size_t) offset) % IO_ALIGN == 0;
+}
+
+// the blocks covering [offset, offset + size), read into an aligned bounce buffer.
+// blocks past the end of the file read as zeros. returns the buffer or NULL.
+static char* read_blocks(int fd, off_t offset, size_t size, off_t* start, size_t* length) {
+    *start = offset / IO_ALIGN * IO_ALIGN;
+    *length = ((size_t) (offset - *start) + size + IO_ALIGN - 1) / IO_ALIGN * IO_ALIGN;
+
+    void* bounce;
+    if (posix_memalign(&bounce, IO_ALIGN, *length) != 0) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    ssize_t ret = pread(fd, bounce, *length, *start);
+    if (ret < 0) {
+        free(bounce);
+        return NULL;
+    }
+    memset((char*) bounce + ret, 0, *length - (size_t) ret);
+    return bounce;
+}
+
+ssize_t io_pread(int fd, void* buf, size_t size, off_t offset) {
+    if (!io_is_direct(fd) || is_aligned(buf, size, offset)) return pread(fd, buf, size, offset);
+
+    off_t start;
+    size_t length;
+    char* bounce = read_blocks(fd, offset, size, &start, &length);
+    if (bounce == NULL) return -1;
+    memcpy(buf, bounce + (offset - start), size);
+    free(bounce);
+    return (ssize_t) size;
+}
+
+// unaligned direct writes read-modify-write the covering blocks. the caller's range lock only
+// covers its own bytes, so neighbours in the same block rely on the handle's write latch.
+ssize_t io_pwrite(int fd, const void* buf, size_t size, off_t offset) {
+    if (!io_is_direct(fd) || is_aligned(buf, size, offset)) return pwrite(fd, buf, size, offset);
+
+    off_t start;
+    size_t length;
+    char* bounce = read_blocks(fd, offset, size, &start, &length);
+    if (bounce == NULL) return -1;
+    memcpy(bounce + (offset - start), buf, size);
+    ssize_t ret = pwrite(fd, bounce, length, start);
+    free(bounce);
+    if (ret < 0) return -1;
+    return ret < (ssize_t) length ? 0 : (ssize_t) size;
+}
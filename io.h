@@ -0,0 +1,15 @@
+#ifndef MDBM_IO_H
+#define MDBM_IO_H
+
+#include <sys/types.h>
+
+#define IO_ALIGN 4096 // O_DIRECT needs buffers, offsets and lengths aligned to the logical block size.
+#define IO_MAX_FD 4096 // fds beyond this are always treated as buffered.
+
+int io_set_direct(int fd, int direct);
+int io_is_direct(int fd);
+
+ssize_t io_pread(int fd, void* buf, size_t size, off_t offset);
+ssize_t io_pwrite(int fd, const void* buf, size_t size, off_t offset);
+
+#endif //MDBM_IO_H
@@ -2,7 +2,10 @@
 // Created by Machearn Ning on 3/24/22.
 //
 
+#include <errno.h>
+
 #include "lock.h"
+#include "stats.h"
 
 int lock_region(int fd, int cmd, int type, off_t offset, int whence, off_t len) {
     struct flock lock;
@@ -11,7 +14,16 @@ int lock_region(int fd, int cmd, int type, off_t offset, int whence, off_t len)
     lock.l_start = offset;
     lock.l_whence = (short) whence;
     lock.l_len = len;
+    lock.l_pid = 0;
 
+#ifdef MDBM_STATS
+    // try without blocking first, so a wait is only counted when another process holds the range.
+    if (cmd == F_SETLKW) {
+        if (fcntl(fd, F_SETLK, &lock) == 0) return 0;
+        if (errno != EAGAIN && errno != EACCES) return -1;
+        stat_add(STAT_LOCK_WAITS, 1);
+    }
+#endif
     return fcntl(fd, cmd, &lock);
 }
 
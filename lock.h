@@ -25,4 +25,14 @@ int lock_region(int fd, int cmd, int type, off_t offset, int whence, off_t len);
 #define unlock(fd, offset, whence, len) \
     lock_region((fd), F_SETLK, F_UNLCK, (offset), (whence), (len))
 
+#ifdef F_OFD_SETLK
+// open file description locks belong to the descriptor rather than the process, so they also
+// tell apart two handles of one process.
+#define ofd_read_lock(fd, offset, whence, len) \
+    lock_region((fd), F_OFD_SETLK, F_RDLCK, (offset), (whence), (len))
+
+#define ofd_unlock(fd, offset, whence, len) \
+    lock_region((fd), F_OFD_SETLK, F_UNLCK, (offset), (whence), (len))
+#endif
+
 #endif //MDBM_LOCK_H
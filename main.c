@@ -1,12 +0,0 @@
-//
-// Created by Machearn Ning on 2/5/22.
-//
-
-#include <stdio.h>
-#include "mdbm.h"
-
-int main() {
-    printf("%lu\n", sizeof(IndexPage));
-    printf("%lu\n", sizeof(Cell));
-    return 0;
-}
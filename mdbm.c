@@ -2,28 +2,60 @@
 // Created by Machearn Ning on 3/21/22.
 //
 
+#define _GNU_SOURCE
+
 #include <stdarg.h>
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdatomic.h>
 #include <unistd.h>
 #include <fcntl.h>
-#include <sys/syslimits.h>
 #include <stdio.h>
+#include <time.h>
+#include <libgen.h>
+#include <sys/stat.h>
 
 #include "mdbm.h"
+#include "compact.h"
+#include "snapshot.h"
 #include "lock.h"
+#include "io.h"
+#include "cache.h"
+#include "slab.h"
+#include "memtable.h"
+#include "scan.h"
+#include "bulk.h"
+#include "expire.h"
+#include "index.h"
+#include "backup.h"
+#include "cdc.h"
+#include "warm.h"
+#include "stats.h"
+
+#define REORG_FINAL_DELTA 1024 // the writers are stopped once the delta log is this short.
+#define REORG_CATCH_UP_ROUNDS 8
+#define REORG_EXTENT (4 << 20) // a copy thread appends values to extents of this size.
+
+struct Reorg {
+    uint64_t* keys; // keys stored or deleted since the copy pass started.
+    size_t num_keys;
+    size_t capacity;
+};
+
+static int flush_buffer(DB* db);
+static int recover_swap(const char* name);
+static int load_value(DB* db, uint64_t key, Record* record, int expired);
 
 Record* malloc_record() {
-    Record* record = NULL;
-    record = (Record*) malloc(sizeof(Record));
-    memset(record, 0, sizeof(Record));
+    Record* record = slab_alloc(SLAB_RECORD);
+    if (record) memset(record, 0, sizeof(Record));
     return record;
 }
 
 void free_record(Record** ptr) {
     if (ptr == NULL) return;
-    free(*ptr);
+    slab_free(SLAB_RECORD, *ptr);
     *ptr = NULL;
 }
 
@@ -32,16 +64,48 @@ static DB* db_alloc(size_t nameLen) {
     char* name = malloc(nameLen + 1);
 
     DB* db = malloc(sizeof(DB));
+    memset(db, 0, sizeof(DB));
+    db->idx_fd = -1;
+    db->data_fd = -1;
     db->header = header;
     db->name = name;
+    db->stats = malloc_stats();
+    pthread_rwlock_init(&db->latch, NULL);
 
     return db;
 }
 
+static void free_reorg(Reorg** reorg) {
+    if (!(*reorg)) return;
+    free((*reorg)->keys);
+    free(*reorg);
+    *reorg = NULL;
+}
+
+// forget everything keyed by the fd number before it is closed and handed out again.
+static void release_fd(DB* db, int fd) {
+    if (fd < 0) return;
+    cache_detach(fd);
+    if (db->direct) io_set_direct(fd, 0);
+    close(fd);
+}
+
 static void db_free(DB** db) {
     if (!(*db)) return;
-    if ((*db)->idx_fd >= 0) close((*db)->idx_fd);
-    if ((*db)->data_fd >= 0) close((*db)->data_fd);
+    warm_free(*db);
+    index_free(*db);
+    backup_free(*db);
+    cdc_free(*db);
+    expire_free(*db);
+    compact_free(*db);
+    snapshot_free(*db);
+    release_fd(*db, (*db)->idx_fd);
+    release_fd(*db, (*db)->data_fd);
+    cache_close(&(*db)->cache);
+    memtable_close(&(*db)->memtable);
+    free_reorg(&(*db)->reorg);
+    pthread_rwlock_destroy(&(*db)->latch);
+    free_stats(&(*db)->stats);
     free((*db)->header);
     free((*db)->name);
     free(*db);
@@ -55,6 +119,135 @@ void db_free_record(Record** record) {
     *record = NULL;
 }
 
+static void latch_read(DB* db) {
+#ifdef MDBM_STATS
+    if (pthread_rwlock_tryrdlock(&db->latch) == 0) return;
+    stat_add(STAT_LATCH_WAITS, 1);
+#endif
+    pthread_rwlock_rdlock(&db->latch);
+}
+
+static void latch_write(DB* db) {
+#ifdef MDBM_STATS
+    if (pthread_rwlock_trywrlock(&db->latch) == 0) return;
+    stat_add(STAT_LATCH_WAITS, 1);
+#endif
+    pthread_rwlock_wrlock(&db->latch);
+}
+
+static char* db_file_name(const char* name, const char* suffix) {
+    char* path = malloc(strlen(name) + strlen(suffix) + 1);
+    if (path == NULL) return NULL;
+    strcpy(path, name);
+    strcat(path, suffix);
+    return path;
+}
+
+// a length of 0 would lock to the end of the file, over the locks past the data, so an empty
+// value is not locked at all.
+static ssize_t read_data(int fd, off_t offset, void* data, size_t size) {
+    if (size == 0) return 0;
+    if (read_lock_wait(fd, offset, SEEK_SET, size) < 0) return -1;
+    ssize_t ret = io_pread(fd, data, size, offset);
+    if (unlock(fd, offset, SEEK_SET, size) < 0) return -1;
+    return ret;
+}
+
+static ssize_t write_data(DB* db, off_t offset, const void* data, size_t size) {
+    int fd = db->data_fd;
+    if (size == 0) return 0;
+    if (write_lock_wait(fd, offset, SEEK_SET, size) < 0) return -1;
+    ssize_t ret = io_pwrite(fd, data, size, offset);
+    if (db->cache && ret >= 0) cache_write(db->cache, fd, offset, data, size);
+    if (ret >= 0) backup_track(db, offset, size);
+    if (unlock(fd, offset, SEEK_SET, size) < 0) return -1;
+    return ret;
+}
+
+static ssize_t blank_data(DB* db, off_t offset, size_t size) {
+    char* blank = calloc(1, size ? size : 1);
+    if (blank == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    ssize_t ret = write_data(db, offset, blank, size);
+    free(blank);
+    return ret;
+}
+
+// remember a key touched while db_reorganize runs, so the catch-up pass can copy its latest state.
+static int log_delta(DB* db, uint64_t key) {
+    Reorg* reorg = db->reorg;
+    if (reorg == NULL) return 0;
+
+    if (reorg->num_keys == reorg->capacity) {
+        size_t capacity = reorg->capacity ? reorg->capacity * 2 : 1024;
+        uint64_t* keys = realloc(reorg->keys, capacity * sizeof(uint64_t));
+        if (keys == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        reorg->keys = keys;
+        reorg->capacity = capacity;
+    }
+    reorg->keys[reorg->num_keys++] = key;
+    return 0;
+}
+
+// the data end is only written with the header, so after a crash it is rebuilt from the values
+// the leaves still point to. anything appended past them was never indexed and is dead anyway.
+static int recover_data_end(DB* db) {
+    IndexPage* leaf = malloc_index_page();
+    if (leaf == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    off_t end = db->header->data_end;
+    off_t offset = db->header->left_most_leaf_offset;
+    while (offset != -1) {
+        if (load_page(db->idx_fd, offset, leaf) < 0) {
+            free_index_page(&leaf);
+            errno = EIO;
+            return -1;
+        }
+        for (int i = 0; i < leaf->num_cells; i++) {
+            off_t value_end = leaf->cells[i].offset + (off_t) leaf->cells[i].size;
+            if (value_end > end) end = value_end;
+        }
+        offset = leaf->next_page;
+    }
+    free_index_page(&leaf);
+
+    db->header->data_end = end;
+    db->header->data_reserved = end;
+    return 0;
+}
+
+// writes buffered by a handle that never closed are still in the log, unless the files were
+// truncated. a log locked by another process belongs to a live handle and is left alone.
+static int replay_buffer(DB* db, int truncated) {
+    char* path = db_file_name(db->name, ".log");
+    if (path == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    if (truncated) unlink(path);
+    if (access(path, F_OK) < 0) {
+        free(path);
+        return 0;
+    }
+    if ((db->memtable = memtable_open(path, 0)) == NULL) {
+        free(path);
+        return errno == EBUSY ? 0 : -1;
+    }
+    int ret = flush_buffer(db);
+    if (ret == 0) unlink(path);
+    memtable_close(&db->memtable);
+    free(path);
+    return ret;
+}
+
 DB* db_open(const char* name, int oflag, ...) {
     size_t len;
     int mode;
@@ -64,12 +257,13 @@ DB* db_open(const char* name, int oflag, ...) {
     db = db_alloc(len);
     strcpy(db->name, name);
 
-    char* idx_file_name = malloc(len + 4 + 1);
-    char* data_file_name = malloc(len + 4 + 1);
-    strcpy(idx_file_name, name);
-    strcat(idx_file_name, ".idx");
-    strcpy(data_file_name, name);
-    strcat(data_file_name, ".dat");
+    if (recover_swap(name) < 0) {
+        db_free(&db);
+        return NULL;
+    }
+
+    char* idx_file_name = db_file_name(name, ".idx");
+    char* data_file_name = db_file_name(name, ".dat");
 
     if (oflag & O_CREAT) {
         va_list ap;
@@ -81,533 +275,2135 @@ DB* db_open(const char* name, int oflag, ...) {
         db->data_fd = open(data_file_name, oflag, mode);
     } else {
         db->idx_fd = open(idx_file_name, oflag);
-        load_index_header(db->idx_fd, db->header);
         db->data_fd = open(data_file_name, oflag);
     }
 
+    free(idx_file_name);
+    free(data_file_name);
+
     if (db->idx_fd < 0 || db->data_fd < 0) {
         db_free(&db);
-        free(idx_file_name);
-        free(data_file_name);
         return NULL;
     }
 
-    if ((oflag & (O_CREAT | O_TRUNC)) == (O_CREAT | O_TRUNC)) {
+    // O_DIRECT bypasses the kernel page cache, so the index pages are cached by the handle instead.
+    if (oflag & O_DIRECT) {
+        db->direct = 1;
+        if (io_set_direct(db->idx_fd, 1) < 0 || io_set_direct(db->data_fd, 1) < 0 ||
+            db_set_cache(db, DB_DIRECT_CACHE) < 0) {
+            db_free(&db);
+            return NULL;
+        }
+    }
+
+    if (oflag & O_CREAT) {
         if (write_lock_wait(db->idx_fd, 0, SEEK_SET, 0) < 0) {
             db_free(&db);
-            free(idx_file_name);
-            free(data_file_name);
             return NULL;
         }
-        if (create_tree(db->idx_fd) < 0) {
+        struct stat st;
+        if (fstat(db->idx_fd, &st) < 0 || (st.st_size == 0 && create_tree(db->idx_fd) < 0)) {
+            unlock(db->idx_fd, 0, SEEK_SET, 0);
             db_free(&db);
-            free(idx_file_name);
-            free(data_file_name);
             return NULL;
         }
         if (unlock(db->idx_fd, 0, SEEK_SET, 0) < 0) {
             db_free(&db);
-            free(idx_file_name);
-            free(data_file_name);
             return NULL;
         }
     }
 
-    free(idx_file_name);
-    free(data_file_name);
+    if (load_index_header(db->idx_fd, db->header) < 0) {
+        db_free(&db);
+        return NULL;
+    }
+
+    if ((oflag & O_ACCMODE) != O_RDONLY) {
+        db->writable = 1;
+        if (!(db->header->flags & HEADER_CLEAN) && recover_data_end(db) < 0) {
+            db_free(&db);
+            return NULL;
+        }
+        db->header->flags &= ~HEADER_CLEAN;
+        if (dump_header(db->idx_fd, db->header) < 0 || replay_buffer(db, oflag & O_TRUNC) < 0 ||
+            expire_open(db, oflag & O_TRUNC) < 0 || cdc_open(db, oflag & O_TRUNC) < 0) {
+            db_free(&db);
+            return NULL;
+        }
+    }
+
+    warm_open(db, oflag & O_TRUNC);
     return db;
 }
 
 void db_close(DB* db) {
+    db_warm_stop(db);
+    db_expire_stop(db);
+    db_buffer_stop(db);
+    db_warm_save(db);
+    if (db->writable) {
+        latch_write(db);
+        release_space(db->idx_fd, db->data_fd, db->header);
+        db->header->flags |= HEADER_CLEAN;
+        dump_header(db->idx_fd, db->header);
+        pthread_rwlock_unlock(&db->latch);
+    }
     db_free(&db);
 }
 
-int db_fetch(DB* db, uint64_t key, Record* record) {
-    Cell* cell = malloc(sizeof(Cell));
-    int pos = search_index(db->idx_fd, db->header, NULL, key, cell);
-    if (pos < 0 || cell->key != key) {
-        errno = ENOENT;
+static void attach_cache(DB* db, PageCache* cache) {
+    if (cache == NULL) return;
+    cache_attach(db->idx_fd, cache);
+    cache_attach(db->data_fd, cache);
+}
+
+static int replace_cache(DB* db, PageCache* cache) {
+    latch_write(db);
+    cache_detach(db->idx_fd);
+    cache_detach(db->data_fd);
+    PageCache* old = db->cache;
+    if (cache_close(&old) < 0) {
+        // views still point into the old cache.
+        attach_cache(db, db->cache);
+        pthread_rwlock_unlock(&db->latch);
+        cache_close(&cache);
         return -1;
     }
+    db->cache = cache;
+    attach_cache(db, cache);
+    pthread_rwlock_unlock(&db->latch);
+    return 0;
+}
 
-    void* data = malloc(cell->size);
-    if (data == NULL) {
-        free(cell);
+int db_set_cache(DB* db, size_t bytes) {
+    PageCache* cache = NULL;
+    if (bytes && (cache = cache_open(bytes)) == NULL) return -1;
+    return replace_cache(db, cache);
+}
+
+// every process that opens this database and calls db_share_cache maps the same cache. its size
+// is set by the first one. writes go through to the files, so the cache never holds dirty pages.
+int db_share_cache(DB* db, size_t bytes) {
+    char* path = db_file_name(db->name, ".idx");
+    if (path == NULL) {
         errno = ENOMEM;
         return -1;
     }
+    PageCache* cache = cache_open_shared(path, bytes);
+    free(path);
+    if (cache == NULL) return -1;
+    return replace_cache(db, cache);
+}
 
-    if (read_lock_wait(db->data_fd, cell->offset, SEEK_SET, cell->size) < 0) {
-        free(data);
-        free(cell);
-        errno = EAGAIN;
+int db_set_growth(DB* db, size_t idx_chunk, size_t data_chunk) {
+    if (!db->writable || idx_chunk % sizeof(IndexPage)) {
+        errno = EINVAL;
         return -1;
     }
+    latch_write(db);
+    if (idx_chunk) db->header->idx_chunk = idx_chunk;
+    if (data_chunk) db->header->data_chunk = data_chunk;
+    ssize_t ret = dump_header(db->idx_fd, db->header);
+    pthread_rwlock_unlock(&db->latch);
+    return ret < 0 ? -1 : 0;
+}
 
-    if (lseek(db->data_fd, cell->offset, SEEK_SET) < 0) {
-        free(data);
-        free(cell);
+// the state of key in the write buffer, the caller holds the latch. a buffered value sets the
+// size and expiry of cell, whether it expired or not.
+static MemtableState lookup_buffer(DB* db, uint64_t key, const char** data, Cell* cell) {
+    if (db->memtable == NULL) return MEMTABLE_MISS;
+    cell->key = key;
+    return memtable_get(db->memtable, key, data, &cell->size, &cell->expire_at);
+}
+
+// reads the value into buf, or into a new buffer if buf is NULL. a value larger than cap fails
+// with ENOBUFS and leaves its size in record->size.
+static int fetch(DB* db, uint64_t key, void* buf, size_t cap, Record* record) {
+    Cell cell;
+    const char* buffered = NULL;
+    latch_read(db);
+    MemtableState state = lookup_buffer(db, key, &buffered, &cell);
+    if (state == MEMTABLE_DELETED ||
+        (state == MEMTABLE_MISS && (search_index(db->idx_fd, db->header, NULL, key, &cell) < 0 || cell.key != key)) ||
+        cell_expired(&cell)) {
+        pthread_rwlock_unlock(&db->latch);
+        errno = ENOENT;
         return -1;
     }
-    if (read(db->data_fd, data, cell->size) < 0) {
-        free(data);
-        free(cell);
-        errno = EIO;
+
+    if (buf && cell.size > cap) {
+        pthread_rwlock_unlock(&db->latch);
+        record->size = cell.size;
+        errno = ENOBUFS;
         return -1;
     }
 
-    if (unlock(db->data_fd, cell->offset, SEEK_SET, cell->size) < 0) {
-        free(data);
-        free(cell);
-        errno = EAGAIN;
+    void* data = buf ? buf : malloc(cell.size ? cell.size : 1);
+    if (data == NULL) {
+        pthread_rwlock_unlock(&db->latch);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    if (buffered) {
+        memcpy(data, buffered, cell.size);
+    } else if (read_data(db->data_fd, cell.offset, data, cell.size) < 0) {
+        pthread_rwlock_unlock(&db->latch);
+        if (data != buf) free(data);
+        errno = EIO;
         return -1;
     }
+    pthread_rwlock_unlock(&db->latch);
+    stat_add(STAT_DATA_READ, cell.size);
 
-    record->size = cell->size;
+    record->size = cell.size;
     record->data = data;
     return 0;
 }
 
-int db_store(DB* db, uint64_t key, Record* record, int flag) {
-    if (record == NULL || record->data == NULL) {
-        errno = EINVAL;
-        return -1;
-    }
+// the data half of a store: write record where it goes and fill in new_cell. old_cell is the
+// current cell of key if it exists.
+static int place_value(DB* db, int exists, const Cell* old_cell, uint64_t key, Record* record, Cell* new_cell) {
+    memset(new_cell, 0, sizeof(Cell));
+    new_cell->key = key;
+    new_cell->size = record->size;
 
-    if (flag != DB_INSERT && flag != DB_REPLACE && flag != DB_STORE) {
-        errno = EINVAL;
+    // a value that still fits is overwritten in place, anything larger is appended.
+    // open snapshots may still read the old value, so then it is always appended and left alone.
+    if (exists && !snapshot_active(db) && record->size <= old_cell->size) {
+        new_cell->offset = old_cell->offset;
+    } else if ((new_cell->offset = alloc_data(db->data_fd, db->header, record->size)) < 0) {
+        errno = EIO;
         return -1;
     }
 
-    IndexPage* node = malloc_index_page();
-    Cell* new_cell = malloc_cell();
-    Cell* old_cell = malloc_cell();
-
-    new_cell->size = record->size;
-    new_cell->key = key;
-    if ((new_cell->offset = lseek(db->data_fd, 0, SEEK_END)) < 0) {
-        free_index_page(&node);
-        free_cell(&new_cell);
-        free_cell(&old_cell);
+    if (write_data(db, new_cell->offset, record->data, record->size) < 0) {
         errno = EIO;
         return -1;
     }
+    stat_add(exists && new_cell->offset == old_cell->offset ? STAT_DATA_OVERWRITTEN : STAT_DATA_APPENDED, record->size);
+    return 0;
+}
 
-    int pos = search_index(db->idx_fd, db->header, node, key, old_cell);
-    if (pos < 0) {
-        free_index_page(&node);
-        free_cell(&new_cell);
-        free_cell(&old_cell);
-        errno = ENOENT;
+// give back the bytes old_cell no longer needs once the index stops pointing to them.
+// new_cell is its replacement, NULL if the key was deleted.
+static int retire_value(DB* db, const Cell* old_cell, const Cell* new_cell) {
+    if (new_cell && new_cell->offset == old_cell->offset) {
+        compact_account(db, old_cell->offset + (off_t) new_cell->size, old_cell->size - new_cell->size);
+        return 0;
+    }
+    if (!snapshot_active(db) && blank_data(db, old_cell->offset, old_cell->size) < 0) {
+        errno = EIO;
         return -1;
     }
-    if (node->cells[pos].key == key) {
-        if (flag == DB_INSERT) {
-            free_index_page(&node);
-            free_cell(&new_cell);
-            free_cell(&old_cell);
-            errno = EEXIST;
-            return -1;
-        }
-
-        ssize_t ret = update_index(db->idx_fd, node, pos, new_cell);
-        free_index_page(&node);
-        if (ret < 0) {
-            free_cell(&new_cell);
-            free_cell(&old_cell);
-            errno = EAGAIN;
-            return -1;
-        }
-
-        if (write_lock_wait(db->data_fd, node->cells[pos].offset, SEEK_SET, node->cells[pos].size) <
-            0) {
-            free_cell(&new_cell);
-            free_cell(&old_cell);
-            errno = EAGAIN;
-            return -1;
-        }
-
-        if (lseek(db->data_fd, node->cells[pos].offset, SEEK_SET) < 0) {
-            free_cell(&new_cell);
-            free_cell(&old_cell);
-            errno = EIO;
-            return -1;
-        }
-
-        if (old_cell->size < record->size) {
-            char* blank = malloc(old_cell->size);
-            if (blank == NULL) {
-                free_cell(&new_cell);
-                free_cell(&old_cell);
-                errno = ENOMEM;
-                return -1;
-            }
-            if (write(db->data_fd, blank, old_cell->size) < 0) {
-                free(blank);
-                free_cell(&new_cell);
-                free_cell(&old_cell);
-                errno = EIO;
-                return -1;
-            }
-            free(blank);
-            if (lseek(db->data_fd, 0, SEEK_END) < 0) {
-                free_cell(&new_cell);
-                free_cell(&old_cell);
-                errno = EIO;
-                return -1;
-            }
-        }
-
-        if (write(db->data_fd, record->data, record->size) < 0) {
-            free_index_page(&node);
-            free_cell(&new_cell);
-            errno = EIO;
-            return -1;
-        }
+    compact_account(db, old_cell->offset, old_cell->size);
+    return 0;
+}
 
-        if (unlock(db->data_fd, node->cells[pos].offset, SEEK_SET, node->cells[pos].size) < 0) {
-            free_index_page(&node);
-            free_cell(&new_cell);
-            errno = EAGAIN;
-            return -1;
-        }
-    } else {
-        free_cell(&old_cell);
-        if (flag == DB_REPLACE) {
-            free_index_page(&node);
-            free_cell(&new_cell);
-            errno = ENOENT;
-            return -1;
-        }
-        ssize_t ret = insert_index(db->idx_fd, db->header, node, pos, new_cell);
-        free_index_page(&node);
-        if (ret < 0) {
-            free_cell(&new_cell);
-            errno = EAGAIN;
-            return -1;
-        }
+// store record at pos, where search_index left key in node. old_cell is its current cell if it
+// exists. expire_at is the expiry of the new value, 0 if it has none.
+static int write_value(DB* db, IndexPage* node, int pos, int exists, const Cell* old_cell, uint64_t key,
+                       Record* record, uint64_t expire_at) {
+    Cell new_cell;
+    if (place_value(db, exists, old_cell, key, record, &new_cell) < 0) return -1;
+    new_cell.expire_at = expire_at;
 
-        if (write_lock_wait(db->data_fd, new_cell->offset, SEEK_SET, new_cell->size) < 0) {
-            free_cell(&new_cell);
-            errno = EAGAIN;
-            return -1;
-        }
-        if (lseek(db->data_fd, new_cell->offset, SEEK_SET) < 0) {
-            free_cell(&new_cell);
-            errno = EIO;
-            return -1;
-        }
-        if (write(db->data_fd, record->data, record->size) < 0) {
-            free_cell(&new_cell);
-            errno = EIO;
-            return -1;
-        }
-        if (unlock(db->data_fd, new_cell->offset, SEEK_SET, new_cell->size) < 0) {
-            free_cell(&new_cell);
-            errno = EAGAIN;
-            return -1;
-        }
+    // a value overwritten in place at its old size leaves the leaf as it is.
+    ssize_t ret = 0;
+    if (!exists) ret = insert_index(db->idx_fd, db->header, node, pos, &new_cell);
+    else if (new_cell.offset != old_cell->offset || new_cell.size != old_cell->size ||
+             new_cell.expire_at != old_cell->expire_at) {
+        ret = update_index(db->idx_fd, node, pos, &new_cell);
+    }
+    if (ret < 0) {
+        errno = EAGAIN;
+        return -1;
     }
 
-    free_index_page(&node);
-    free_cell(&new_cell);
-    free_cell(&old_cell);
-    return 0;
+    if (exists && retire_value(db, old_cell, &new_cell) < 0) return -1;
+    uint64_t old_expire_at = exists ? old_cell->expire_at : 0;
+    if (old_expire_at != expire_at) {
+        if (old_expire_at && expire_remove(db, old_expire_at, key) < 0) return -1;
+        if (expire_at && expire_add(db, expire_at, key) < 0) return -1;
+    }
+    return log_delta(db, key);
 }
 
-int db_delete(DB* db, uint64_t key) {
-    IndexPage* node = malloc_index_page();
-    if (node == NULL) {
-        errno = ENOMEM;
+// store a value under key, the caller holds the exclusive latch. node is scratch space. an
+// expired value counts as missing.
+static int store_value(DB* db, IndexPage* node, uint64_t key, Record* record, int flag, uint64_t expire_at) {
+    Cell old_cell;
+    int pos = search_index(db->idx_fd, db->header, node, key, &old_cell);
+    if (pos < -1) {
+        errno = EIO;
         return -1;
     }
 
-    Cell* cell = malloc_cell();
-    if (cell == NULL) {
-        free_index_page(&node);
-        errno = ENOMEM;
+    int exists = pos >= 0 && node->cells[pos].key == key;
+    int live = exists && !cell_expired(&old_cell);
+    if (live && flag == DB_INSERT) {
+        errno = EEXIST;
         return -1;
     }
-
-    int pos = search_index(db->idx_fd, db->header, node, key, cell);
-    if (pos < 0) {
-        free_index_page(&node);
-        free_cell(&cell);
+    if (!live && flag == DB_REPLACE) {
         errno = ENOENT;
         return -1;
     }
-    if (node->cells[pos].key != key) {
-        free_index_page(&node);
-        free_cell(&cell);
+
+    return write_value(db, node, pos, exists, &old_cell, key, record, expire_at);
+}
+
+// drop key and its value, the caller holds the exclusive latch. node is scratch space. if due is
+// set, only a value that expired by then is dropped. an expired value is dropped all the same,
+// but reported as missing.
+static int delete_value(DB* db, IndexPage* node, uint64_t key, uint64_t due) {
+    Cell cell;
+    int pos = search_index(db->idx_fd, db->header, node, key, &cell);
+    if (pos < 0 || node->cells[pos].key != key) {
         errno = ENOENT;
         return -1;
     }
+    if (due && (cell.expire_at == 0 || cell.expire_at > due)) return 0;
 
-    ssize_t ret = delete_index(db->idx_fd, node, pos);
-    free_index_page(&node);
-    if (ret < 0) {
-        free_cell(&cell);
+    if (delete_index(db->idx_fd, db->header, node, pos) < 0) {
         errno = ENOENT;
         return -1;
     }
 
-    if (write_lock_wait(db->data_fd, cell->offset, SEEK_SET, cell->size) < 0) {
-        free_cell(&cell);
-        errno = EAGAIN;
+    if (retire_value(db, &cell, NULL) < 0) return -1;
+    // the entry of a due key was taken already.
+    if (!due && cell.expire_at && expire_remove(db, cell.expire_at, key) < 0) return -1;
+    if (log_delta(db, key) < 0) return -1;
+    if (!due && cell_expired(&cell)) {
+        errno = ENOENT;
         return -1;
     }
+    return 0;
+}
 
-    if (lseek(db->data_fd, cell->offset, SEEK_SET) < 0) {
-        free_cell(&cell);
-        return -1;
-    }
-    char* blank = malloc(cell->size);
-    if (blank == NULL) {
-        free_cell(&cell);
-        errno = ENOMEM;
-        return -1;
-    }
-    memset(blank, 0, cell->size);
+// a flush applies the buffered keys that fall into one leaf to it in memory and writes it once.
+typedef struct {
+    DB* db;
+    IndexPage* leaf;
+    int batched; // leaf is loaded and keys up to last go into it.
+    uint64_t last;
+    int delta; // keys added to the leaf less keys removed, for the counts above it.
+    uint64_t due; // set by db_expire_step, deletes then only drop values that expired by this time.
+    int num_retired;
+    Cell old_cells[MAX_CELL];
+    Cell new_cells[MAX_CELL];
+    int deleted[MAX_CELL];
+}Flush;
 
-    ret = write(db->data_fd, blank, cell->size);
-    free(blank);
-    blank = NULL;
-    free_cell(&cell);
-    if (ret < 0) {
+static int end_batch(Flush* flush) {
+    if (!flush->batched) return 0;
+    flush->batched = 0;
+    if (dump_page(flush->db->idx_fd, flush->leaf) < 0 ||
+        (flush->delta && count_adjust(flush->db->idx_fd, flush->db->header, flush->last, flush->delta) < 0)) {
         errno = EIO;
         return -1;
     }
-
-    if (unlock(db->data_fd, cell->offset, SEEK_SET, cell->size) < 0) {
-        errno = EAGAIN;
-        return -1;
+    flush->delta = 0;
+    for (int i = 0; i < flush->num_retired; i++) {
+        const Cell* new_cell = flush->deleted[i] ? NULL : flush->new_cells + i;
+        if (retire_value(flush->db, flush->old_cells + i, new_cell) < 0) return -1;
     }
+    flush->num_retired = 0;
     return 0;
 }
 
-int db_first_key(DB* db, Cell* cell) {
-    IndexPage* leaf = malloc_index_page();
-    if (leaf == NULL) {
-        errno = ENOMEM;
-        return -1;
-    }
-    return first_key(db->idx_fd, db->header, leaf, cell);
-}
-
-int db_next_key(DB* db, IndexPage* leaf, int* pos, Cell* cell) {
-    return next_key(db->idx_fd, leaf, pos, cell);
-}
+static int flush_entry(uint64_t key, const char* data, size_t size, uint64_t expire_at, void* arg) {
+    Flush* flush = arg;
+    DB* db = flush->db;
+    Record record = {size, (char*) data};
 
-int db_reorganize(DB* db) {
-    char* tmp_idx_path = "/tmp/tmp.idx";
-    int new_idx_fd = open(tmp_idx_path, O_RDWR | O_CREAT, 0644);
-    if (new_idx_fd < 0) {
-        return errno;
+    IndexPage* leaf = flush->leaf;
+    if (flush->batched && (key > flush->last || flush->num_retired == MAX_CELL)) {
+        if (end_batch(flush) < 0) return -1;
     }
-
-    char* tmp_data_path = "/tmp/tmp.data";
-    int new_data_fd = open(tmp_data_path, O_RDWR | O_CREAT, 0644);
-    if (new_data_fd < 0) {
-        close(new_idx_fd);
-        return errno;
+    if (!flush->batched) {
+        if (search_index(db->idx_fd, db->header, leaf, key, NULL) < -1) {
+            errno = EIO;
+            return -1;
+        }
+        // past its last key the key may belong to the next leaf, so it takes the normal path.
+        if (leaf->num_cells == 0 || key > leaf->cells[leaf->num_cells - 1].key) {
+            if (data == NULL) return delete_value(db, leaf, key, flush->due) < 0 && errno != ENOENT ? -1 : 0;
+            return store_value(db, leaf, key, &record, DB_STORE, expire_at);
+        }
+        flush->batched = 1;
+        flush->last = leaf->cells[leaf->num_cells - 1].key;
     }
 
-    Cell* cell = malloc_cell();
-    if (cell == NULL) {
-        close(new_idx_fd);
-        close(new_data_fd);
-        errno = ENOMEM;
-        return -1;
+    Cell old_cell;
+    int pos = search_leaf_node(leaf, key, &old_cell);
+    int exists = pos >= 0 && leaf->cells[pos].key == key;
+    if (data == NULL && !exists) return 0;
+    if (data == NULL && flush->due && (old_cell.expire_at == 0 || old_cell.expire_at > flush->due)) return 0;
+    if (data && !exists && leaf->num_cells >= MAX_CELL - 1) {
+        // the leaf has to split, which the normal path does.
+        if (end_batch(flush) < 0) return -1;
+        return store_value(db, leaf, key, &record, DB_STORE, expire_at);
     }
 
-    Record* record = malloc_record();
-    if (record == NULL) {
-        close(new_idx_fd);
-        close(new_data_fd);
-        free_cell(&cell);
-        errno = ENOMEM;
-        return -1;
+    int i = flush->num_retired;
+    if (data == NULL) {
+        delete_cell(leaf, pos);
+        flush->delta--;
+    } else {
+        if (place_value(db, exists, &old_cell, key, &record, flush->new_cells + i) < 0) return -1;
+        flush->new_cells[i].expire_at = expire_at;
+        if (exists) {
+            memcpy(leaf->cells + pos, flush->new_cells + i, sizeof(Cell));
+        } else {
+            add_cell(leaf, pos, key, flush->new_cells[i].offset, size);
+            leaf->cells[pos + 1].expire_at = expire_at;
+            flush->delta++;
+        }
     }
-
-    IndexPage* leaf = malloc_index_page();
-    if (leaf == NULL) {
-        close(new_idx_fd);
-        close(new_data_fd);
-        free_cell(&cell);
-        free_record(&record);
-        errno = ENOMEM;
-        return -1;
+    // <name>.ttl follows the expiry like on the direct path, the entry of a due key was taken already.
+    uint64_t old_expire_at = exists && !flush->due ? old_cell.expire_at : 0;
+    if (old_expire_at != expire_at) {
+        if (old_expire_at && expire_remove(db, old_expire_at, key) < 0) return -1;
+        if (expire_at && expire_add(db, expire_at, key) < 0) return -1;
+    }
+    if (exists) {
+        memcpy(flush->old_cells + i, &old_cell, sizeof(Cell));
+        flush->deleted[i] = data == NULL;
+        flush->num_retired++;
     }
+    return log_delta(db, key);
+}
+
+// move the buffered writes into the tree in key order, the caller holds the exclusive latch.
+// the log is only cleared once the tree is on disk, so a crash in between replays it again.
+static int flush_buffer(DB* db) {
+    if (db->memtable == NULL || memtable_count(db->memtable) == 0) return 0;
 
-    IndexPage* new_leaf = malloc_index_page();
-    if (new_leaf == NULL) {
-        close(new_idx_fd);
-        close(new_data_fd);
-        free_cell(&cell);
-        free_record(&record);
+    Flush* flush = malloc(sizeof(Flush));
+    IndexPage* leaf = malloc_index_page();
+    if (flush == NULL || leaf == NULL) {
+        free(flush);
         free_index_page(&leaf);
         errno = ENOMEM;
         return -1;
     }
+    memset(flush, 0, sizeof(Flush));
+    flush->db = db;
+    flush->leaf = leaf;
 
-    int pos = -1;
-    int new_pos = -1;
-    int next_key_ret = 0;
-    off_t new_record_offset = 0;
-    Header new_header;
+    int ret = memtable_scan(db->memtable, flush_entry, flush);
+    if (ret == 0) ret = end_batch(flush);
+    free_index_page(&leaf);
+    free(flush);
+    if (ret < 0) return -1;
 
-    if (first_key(db->idx_fd, db->header, leaf, cell) < 0) {
-        close(new_idx_fd);
-        close(new_data_fd);
-        free_cell(&cell);
-        free_record(&record);
-        free_index_page(&leaf);
-        free_index_page(&new_leaf);
-        errno = ENOENT;
+    if (dump_header(db->idx_fd, db->header) < 0 || fsync(db->data_fd) < 0 || fsync(db->idx_fd) < 0 ||
+        memtable_clear(db->memtable) < 0) {
+        errno = EIO;
         return -1;
     }
-    pos++;
+    return 0;
+}
 
-    create_tree(new_idx_fd);
-    load_index_header(new_idx_fd, &new_header);
-    get_left_most_leaf(db->idx_fd, &new_header, new_leaf);
+// whether key has a value, in the buffer or in the tree. node is scratch space.
+static int key_exists(DB* db, IndexPage* node, uint64_t key) {
+    const char* data;
+    Cell cell;
+    MemtableState state = lookup_buffer(db, key, &data, &cell);
+    if (state != MEMTABLE_MISS) return state == MEMTABLE_VALUE && !cell_expired(&cell);
 
-    do {
-        if (read_lock_wait(db->data_fd, cell->offset, SEEK_SET, cell->size) < 0) {
-            close(new_idx_fd);
-            close(new_data_fd);
-            free_cell(&cell);
-            free_record(&record);
-            free_index_page(&leaf);
-            free_index_page(&new_leaf);
-            errno = EAGAIN;
+    int pos = search_index(db->idx_fd, db->header, node, key, NULL);
+    if (pos < -1) {
+        errno = EIO;
+        return -1;
+    }
+    return pos >= 0 && node->cells[pos].key == key && !cell_expired(node->cells + pos);
+}
+
+// store through the write buffer if there is one, the caller holds the exclusive latch.
+// expire_at is the expiry of the value, 0 if it has none.
+static int put_value(DB* db, IndexPage* node, uint64_t key, Record* record, int flag, uint64_t expire_at) {
+    if (db->memtable == NULL) return store_value(db, node, key, record, flag, expire_at);
+
+    // only a blind store skips the tree.
+    if (flag != DB_STORE) {
+        int exists = key_exists(db, node, key);
+        if (exists < 0) return -1;
+        if (exists && flag == DB_INSERT) {
+            errno = EEXIST;
             return -1;
         }
-        if (lseek(db->data_fd, cell->offset, SEEK_SET) < 0) {
-            close(new_idx_fd);
-            close(new_data_fd);
-            free_cell(&cell);
-            free_record(&record);
-            free_index_page(&leaf);
-            free_index_page(&new_leaf);
+        if (!exists && flag == DB_REPLACE) {
+            errno = ENOENT;
             return -1;
         }
-        if (read(db->data_fd, record, cell->size) < 0) {
-            close(new_idx_fd);
-            close(new_data_fd);
-            free_cell(&cell);
-            free_record(&record);
-            free_index_page(&leaf);
-            free_index_page(&new_leaf);
-            errno = EIO;
-            return -1;
+    }
+    if (memtable_put(db->memtable, key, record->data, record->size, expire_at) < 0) return -1;
+    return memtable_full(db->memtable) ? flush_buffer(db) : 0;
+}
+
+static int remove_value(DB* db, IndexPage* node, uint64_t key) {
+    if (db->memtable == NULL) return delete_value(db, node, key, 0);
+
+    int exists = key_exists(db, node, key);
+    if (exists < 0) return -1;
+    if (!exists) {
+        errno = ENOENT;
+        return -1;
+    }
+    if (memtable_delete(db->memtable, key) < 0) return -1;
+    return memtable_full(db->memtable) ? flush_buffer(db) : 0;
+}
+
+// a write of key reads the value it replaces first, expired or not, and hands both to the
+// secondary indexes once it succeeded. the caller holds the exclusive latch.
+static int index_before(DB* db, uint64_t key, Record* old_value) {
+    memset(old_value, 0, sizeof(Record));
+    if (db->indexes == NULL) return 0;
+    return load_value(db, key, old_value, 1) < 0 && errno != ENOENT ? -1 : 0;
+}
+
+// ret is the result of the write, new_value is NULL for a delete.
+static int index_after(DB* db, int ret, uint64_t key, Record* old_value, const Record* new_value) {
+    if (ret == 0 && db->indexes) ret = index_update(db, key, old_value->data ? old_value : NULL, new_value);
+    free(old_value->data);
+    return ret;
+}
+
+// a database holds uint64_t keys or byte-string keys, since the cells of byte-string keys sit
+// under tree keys a uint64_t key could take. its first store decides, and a write of the other
+// kind fails with EINVAL. files from before the flags take the kind of their next store. the
+// caller holds the exclusive latch.
+static int key_kind(DB* db, uint32_t kind, int store) {
+    uint32_t other = kind == HEADER_UINT_KEYS ? HEADER_BYTE_KEYS : HEADER_UINT_KEYS;
+    if (db->header->flags & other) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (!store || (db->header->flags & kind)) return 0;
+    db->header->flags |= kind;
+    if (dump_header(db->idx_fd, db->header) < 0) {
+        errno = EIO;
+        return -1;
+    }
+    return 0;
+}
+
+// append a write that succeeded to the change feed, value is NULL for a delete.
+static int log_change(DB* db, int ret, uint64_t key, const Record* value, uint64_t expire_at) {
+    if (ret == 0 && db->feed) ret = cdc_append(db, key, value, expire_at);
+    return ret;
+}
+
+static int store(DB* db, uint64_t key, Record* record, int flag) {
+    if (record == NULL || record->data == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (flag != DB_INSERT && flag != DB_REPLACE && flag != DB_STORE) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    IndexPage* node = malloc_index_page();
+    if (node == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    latch_write(db);
+    Record old_value;
+    int ret = key_kind(db, HEADER_UINT_KEYS, 1);
+    if (ret == 0) ret = index_before(db, key, &old_value);
+    if (ret == 0) ret = index_after(db, put_value(db, node, key, record, flag, 0), key, &old_value, record);
+    ret = log_change(db, ret, key, record, 0);
+    pthread_rwlock_unlock(&db->latch);
+    free_index_page(&node);
+    return ret;
+}
+
+static int delete(DB* db, uint64_t key) {
+    IndexPage* node = malloc_index_page();
+    if (node == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    latch_write(db);
+    Record old_value;
+    int ret = key_kind(db, HEADER_UINT_KEYS, 0);
+    if (ret == 0) ret = index_before(db, key, &old_value);
+    if (ret == 0) ret = index_after(db, remove_value(db, node, key), key, &old_value, NULL);
+    ret = log_change(db, ret, key, NULL, 0);
+    pthread_rwlock_unlock(&db->latch);
+    free_index_page(&node);
+    return ret;
+}
+
+// buffer stores and deletes in memory and in <name>.log, and move them into the tree in key
+// order once they take up bytes, so that a leaf is written once per flush instead of once per key.
+// reads see them right away. snapshots, cursors and db_first_key see the tree, starting a
+// snapshot flushes the buffer first. an acknowledged write survives a crash of the process, see
+// db_buffer_set_sync for a crash of the machine.
+int db_buffer_start(DB* db, size_t bytes) {
+    if (!db->writable || bytes == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    char* path = db_file_name(db->name, ".log");
+    if (path == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    latch_write(db);
+    if (db->memtable) {
+        pthread_rwlock_unlock(&db->latch);
+        free(path);
+        errno = EBUSY;
+        return -1;
+    }
+    db->memtable = memtable_open(path, bytes);
+    int err = errno;
+    pthread_rwlock_unlock(&db->latch);
+    free(path);
+    if (db->memtable == NULL) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+int db_buffer_flush(DB* db) {
+    latch_write(db);
+    int ret = flush_buffer(db);
+    pthread_rwlock_unlock(&db->latch);
+    return ret;
+}
+
+// db_buffer_flush for a caller that holds the exclusive latch already.
+int db_buffer_flush_latched(DB* db) {
+    return flush_buffer(db);
+}
+
+// with sync set, every buffered write is synced to <name>.log before it returns, so a crash of
+// the machine loses none of the writes acknowledged since.
+int db_buffer_set_sync(DB* db, int sync) {
+    latch_write(db);
+    if (db->memtable == NULL) {
+        pthread_rwlock_unlock(&db->latch);
+        errno = EINVAL;
+        return -1;
+    }
+    memtable_set_sync(db->memtable, sync);
+    pthread_rwlock_unlock(&db->latch);
+    return 0;
+}
+
+// flush the buffer and stop buffering. the log is removed while it is still locked.
+int db_buffer_stop(DB* db) {
+    char* path = db_file_name(db->name, ".log");
+    if (path == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    latch_write(db);
+    int ret = flush_buffer(db);
+    if (ret == 0 && db->memtable) {
+        unlink(path);
+        memtable_close(&db->memtable);
+    }
+    pthread_rwlock_unlock(&db->latch);
+    free(path);
+    return ret;
+}
+
+// a miss or a duplicate is an answer, not an error.
+static void count_error(int ret) {
+    if (ret < 0 && errno != ENOENT && errno != EEXIST) stat_add(STAT_ERRORS, 1);
+}
+
+int db_fetch(DB* db, uint64_t key, Record* record) {
+    stat_begin(scope, db->stats);
+    int ret = fetch(db, key, NULL, 0, record);
+    count_error(ret);
+    stat_end(STAT_OP_FETCH, scope);
+    return ret;
+}
+
+// like db_fetch, but into a buffer of the caller. *size is the value size, also when it did not fit.
+int db_fetch_into(DB* db, uint64_t key, void* buf, size_t cap, size_t* size) {
+    if (buf == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    stat_begin(scope, db->stats);
+    Record record = {0, NULL};
+    int ret = fetch(db, key, buf, cap, &record);
+    if (size) *size = record.size;
+    count_error(ret);
+    stat_end(STAT_OP_FETCH, scope);
+    return ret;
+}
+
+// a value inside one cached block is returned in place with the block pinned. anything else is
+// copied, into a slab page when it fits.
+static int fetch_view(DB* db, uint64_t key, DBView* view) {
+    Cell cell;
+    const char* buffered = NULL;
+    latch_read(db);
+    MemtableState state = lookup_buffer(db, key, &buffered, &cell);
+    if (state == MEMTABLE_DELETED ||
+        (state == MEMTABLE_MISS && (search_index(db->idx_fd, db->header, NULL, key, &cell) < 0 || cell.key != key)) ||
+        cell_expired(&cell)) {
+        pthread_rwlock_unlock(&db->latch);
+        errno = ENOENT;
+        return -1;
+    }
+
+    // a buffered value can change under the view, so it is always copied.
+    off_t block = buffered ? 0 : cell.offset / CACHE_BLOCK * CACHE_BLOCK;
+    view->size = cell.size;
+    if (db->cache && !buffered && cell.offset + (off_t) cell.size <= block + CACHE_BLOCK) {
+        const char* data = cache_pin(db->cache, db->data_fd, block, &view->frame);
+        if (data == NULL) {
+            // the block is read under the shared latch, so no store can slip in before it is cached.
+            char* page = slab_alloc(SLAB_PAGE);
+            if (page && read_data(db->data_fd, block, page, CACHE_BLOCK) >= 0) {
+                data = cache_pin_fill(db->cache, db->data_fd, block, page, &view->frame);
+            }
+            slab_free(SLAB_PAGE, page);
         }
-        if (unlock(db->data_fd, cell->offset, SEEK_SET, cell->size) < 0) {
-            close(new_idx_fd);
-            close(new_data_fd);
-            free_cell(&cell);
-            free_record(&record);
-            free_index_page(&leaf);
-            free_index_page(&new_leaf);
-            errno = EAGAIN;
-            return -1;
+        if (data) {
+            pthread_rwlock_unlock(&db->latch);
+            view->cache = db->cache;
+            view->data = data + (cell.offset - block);
+            return 0;
         }
+    }
 
-        if (write_lock_wait(new_data_fd, new_record_offset, SEEK_SET, cell->size) < 0) {
-            close(new_idx_fd);
-            close(new_data_fd);
-            free_cell(&cell);
-            free_record(&record);
-            free_index_page(&leaf);
-            free_index_page(&new_leaf);
-            errno = EAGAIN;
+    view->cache = NULL;
+    view->copy = cell.size <= CACHE_BLOCK ? slab_alloc(SLAB_PAGE) : malloc(cell.size);
+    if (view->copy == NULL) {
+        pthread_rwlock_unlock(&db->latch);
+        errno = ENOMEM;
+        return -1;
+    }
+    if (buffered) {
+        memcpy(view->copy, buffered, cell.size);
+    } else if (read_data(db->data_fd, cell.offset, view->copy, cell.size) < 0) {
+        pthread_rwlock_unlock(&db->latch);
+        db_view_release(view);
+        errno = EIO;
+        return -1;
+    }
+    pthread_rwlock_unlock(&db->latch);
+    view->data = view->copy;
+    return 0;
+}
+
+int db_fetch_view(DB* db, uint64_t key, DBView* view) {
+    memset(view, 0, sizeof(DBView));
+    view->frame = -1;
+    stat_begin(scope, db->stats);
+    int ret = fetch_view(db, key, view);
+    if (ret == 0) stat_add(STAT_DATA_READ, view->size);
+    count_error(ret);
+    stat_end(STAT_OP_FETCH, scope);
+    return ret;
+}
+
+void db_view_release(DBView* view) {
+    if (view->cache) cache_unpin(view->cache, view->frame);
+    else if (view->size <= CACHE_BLOCK) slab_free(SLAB_PAGE, view->copy);
+    else free(view->copy);
+    memset(view, 0, sizeof(DBView));
+    view->frame = -1;
+}
+
+int db_store(DB* db, uint64_t key, Record* record, int flag) {
+    stat_begin(scope, db->stats);
+    int ret = store(db, key, record, flag);
+    count_error(ret);
+    stat_end(STAT_OP_STORE, scope);
+    return ret;
+}
+
+int db_delete(DB* db, uint64_t key) {
+    stat_begin(scope, db->stats);
+    int ret = delete(db, key);
+    count_error(ret);
+    stat_end(STAT_OP_DELETE, scope);
+    return ret;
+}
+
+static int store_ttl(DB* db, uint64_t key, Record* record, int flag, uint32_t ttl) {
+    if (record == NULL || record->data == NULL || ttl == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (flag != DB_INSERT && flag != DB_REPLACE && flag != DB_STORE) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    // entries of <name>.ttl have 32 bits for the time.
+    uint64_t expire_at = (uint64_t) time(NULL) + ttl;
+    if (expire_at > UINT32_MAX) expire_at = UINT32_MAX;
+
+    IndexPage* node = malloc_index_page();
+    if (node == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    latch_write(db);
+    Record old_value;
+    int ret = key_kind(db, HEADER_UINT_KEYS, 1);
+    if (ret == 0) ret = index_before(db, key, &old_value);
+    if (ret == 0) ret = index_after(db, put_value(db, node, key, record, flag, expire_at), key, &old_value, record);
+    ret = log_change(db, ret, key, record, expire_at);
+    pthread_rwlock_unlock(&db->latch);
+    free_index_page(&node);
+    return ret;
+}
+
+// like db_store, but the value expires ttl seconds from now. fetches and cursors stop finding it
+// then, and db_expire_step or the thread of db_expire_start removes it. storing the key again
+// without a ttl drops the expiry, db_add_u64, db_compare_and_swap and db_merge keep it.
+int db_store_ttl(DB* db, uint64_t key, Record* record, int flag, uint32_t ttl) {
+    stat_begin(scope, db->stats);
+    int ret = store_ttl(db, key, record, flag, ttl);
+    count_error(ret);
+    stat_end(STAT_OP_STORE, scope);
+    return ret;
+}
+
+// the time key expires at in seconds since the epoch, 0 if it does not.
+int db_expiry(DB* db, uint64_t key, uint64_t* expire_at) {
+    Cell cell;
+    const char* buffered;
+    latch_read(db);
+    MemtableState state = lookup_buffer(db, key, &buffered, &cell);
+    int ret = -1;
+    *expire_at = 0;
+    if (state == MEMTABLE_VALUE ||
+        (state == MEMTABLE_MISS && search_index(db->idx_fd, db->header, NULL, key, &cell) >= 0 && cell.key == key)) {
+        if (!cell_expired(&cell)) {
+            *expire_at = cell.expire_at;
+            ret = 0;
+        }
+    }
+    pthread_rwlock_unlock(&db->latch);
+    if (ret < 0) errno = ENOENT;
+    return ret;
+}
+
+// read-modify-write under the exclusive latch with one descent, so the update is atomic against
+// the other threads of the handle. a value that keeps its size is rewritten where it is, without
+// touching the index or growing the data file.
+
+#define MODIFY_INLINE 64 // values up to this size are read onto the stack.
+
+// sets result to the new value of a key from value, NULL if the key has none. result->data stays
+// owned by the modifier. a nonzero return leaves the key as it is and is passed on.
+typedef int (*Modifier)(const Record* value, Record* result, void* arg);
+
+// result is left with the new value, and *expire_at with its expiry.
+static int modify_value(DB* db, IndexPage* node, uint64_t key, Modifier modifier, void* arg, Record* result,
+                        uint64_t* expire_at) {
+    Record value = {0, NULL};
+    *expire_at = 0;
+    const char* buffered;
+    Cell old_cell;
+    MemtableState state = lookup_buffer(db, key, &buffered, &old_cell);
+    if (state != MEMTABLE_MISS) {
+        // the buffer has the latest state, and the new one goes there as well.
+        int live = state == MEMTABLE_VALUE && !cell_expired(&old_cell);
+        value.data = (char*) buffered;
+        value.size = old_cell.size;
+        int ret = modifier(live ? &value : NULL, result, arg);
+        if (ret) return ret;
+        *expire_at = live ? old_cell.expire_at : 0;
+        return put_value(db, node, key, result, DB_STORE, *expire_at);
+    }
+
+    int pos = search_index(db->idx_fd, db->header, node, key, &old_cell);
+    if (pos < -1) {
+        errno = EIO;
+        return -1;
+    }
+    int exists = pos >= 0 && old_cell.key == key;
+    int live = exists && !cell_expired(&old_cell);
+    char inline_value[MODIFY_INLINE];
+    if (live) {
+        value.size = old_cell.size;
+        value.data = value.size <= MODIFY_INLINE ? inline_value : malloc(value.size);
+        if (value.data == NULL) {
+            errno = ENOMEM;
             return -1;
         }
-        if (write(new_data_fd, record, cell->size) < 0) {
-            close(new_idx_fd);
-            close(new_data_fd);
-            free_cell(&cell);
-            free_record(&record);
-            free_index_page(&leaf);
-            free_index_page(&new_leaf);
+        if (read_data(db->data_fd, old_cell.offset, value.data, value.size) < 0) {
+            if (value.data != inline_value) free(value.data);
             errno = EIO;
             return -1;
         }
-        new_record_offset += (off_t) cell->size;
-        if (unlock(new_data_fd, 0, SEEK_SET, cell->size) < 0) {
-            close(new_idx_fd);
-            close(new_data_fd);
-            free_cell(&cell);
-            free_record(&record);
-            free_index_page(&leaf);
-            free_index_page(&new_leaf);
-            errno = EAGAIN;
+        stat_add(STAT_DATA_READ, value.size);
+    }
+
+    int ret = modifier(live ? &value : NULL, result, arg);
+    if (value.data != inline_value) free(value.data);
+    if (ret) return ret;
+    // the value keeps its expiry.
+    *expire_at = live ? old_cell.expire_at : 0;
+    if (db->memtable) return put_value(db, node, key, result, DB_STORE, *expire_at);
+    return write_value(db, node, pos, exists, &old_cell, key, result, *expire_at);
+}
+
+static int modify(DB* db, uint64_t key, Modifier modifier, void* arg) {
+    IndexPage* node = malloc_index_page();
+    if (node == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    stat_begin(scope, db->stats);
+    latch_write(db);
+    Record old_value;
+    Record result = {0, NULL};
+    uint64_t expire_at = 0;
+    int ret = key_kind(db, HEADER_UINT_KEYS, 1);
+    if (ret == 0) ret = index_before(db, key, &old_value);
+    if (ret == 0) {
+        ret = modify_value(db, node, key, modifier, arg, &result, &expire_at);
+        ret = log_change(db, index_after(db, ret, key, &old_value, &result), key, &result, expire_at);
+    }
+    pthread_rwlock_unlock(&db->latch);
+    free_index_page(&node);
+    count_error(ret);
+    stat_end(STAT_OP_STORE, scope);
+    return ret;
+}
+
+typedef struct {
+    int64_t delta;
+    uint64_t sum;
+}AddArg;
+
+static int add_u64(const Record* value, Record* result, void* arg) {
+    AddArg* add = arg;
+    uint64_t old = 0;
+    if (value) {
+        if (value->size != sizeof(uint64_t)) {
+            errno = EINVAL;
             return -1;
         }
+        memcpy(&old, value->data, sizeof(uint64_t));
+    }
+    add->sum = old + (uint64_t) add->delta;
+    result->data = (char*) &add->sum;
+    result->size = sizeof(uint64_t);
+    return 0;
+}
 
-        new_pos = search_index(new_idx_fd, &new_header, new_leaf, cell->key, NULL);
-        insert_index(new_idx_fd, &new_header, new_leaf, new_pos, cell);
+// add delta to the uint64_t in native byte order stored under key, which starts at 0 if the key
+// is missing. the sum wraps around, *sum is set to it if sum is not NULL. EINVAL if the value is
+// not 8 bytes long.
+int db_add_u64(DB* db, uint64_t key, int64_t delta, uint64_t* sum) {
+    AddArg add = {delta, 0};
+    int ret = modify(db, key, add_u64, &add);
+    if (ret == 0 && sum) *sum = add.sum;
+    return ret;
+}
 
-        next_key_ret = db_next_key(db, leaf, &pos, cell);
-        if (next_key_ret == -1) {
-            close(new_idx_fd);
-            close(new_data_fd);
-            free_cell(&cell);
-            free_record(&record);
-            free_index_page(&leaf);
-            free_index_page(&new_leaf);
-            errno = EIO;
+typedef struct {
+    const Record* expected;
+    const Record* desired;
+}SwapArg;
+
+static int compare_and_swap(const Record* value, Record* result, void* arg) {
+    SwapArg* swap = arg;
+    const Record* expected = swap->expected;
+    if (value == NULL ? expected != NULL :
+        expected == NULL || value->size != expected->size || memcmp(value->data, expected->data, value->size)) {
+        errno = ECANCELED;
+        return -1;
+    }
+    *result = *swap->desired;
+    return 0;
+}
+
+// store desired under key if its value is expected, or if it has none and expected is NULL.
+// ECANCELED if the value was something else.
+int db_compare_and_swap(DB* db, uint64_t key, const Record* expected, const Record* desired) {
+    if (desired == NULL || desired->data == NULL || (expected && expected->data == NULL && expected->size)) {
+        errno = EINVAL;
+        return -1;
+    }
+    SwapArg swap = {expected, desired};
+    return modify(db, key, compare_and_swap, &swap);
+}
+
+typedef struct {
+    DB* db;
+    const Record* operand;
+    Record result;
+}MergeArg;
+
+static int merge(const Record* value, Record* result, void* arg) {
+    MergeArg* merge = arg;
+    int ret = merge->db->merge(value, merge->operand, &merge->result, merge->db->merge_arg);
+    if (ret) return ret;
+    if (merge->result.data == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    *result = merge->result;
+    return 0;
+}
+
+// the operator db_merge applies, NULL to remove it.
+int db_set_merge_operator(DB* db, MergeOperator merge, void* arg) {
+    latch_write(db);
+    db->merge = merge;
+    db->merge_arg = arg;
+    pthread_rwlock_unlock(&db->latch);
+    return 0;
+}
+
+// replace the value of key with what the merge operator makes of it and operand. EINVAL if no
+// operator is set.
+int db_merge(DB* db, uint64_t key, const Record* operand) {
+    if (db->merge == NULL || operand == NULL || (operand->data == NULL && operand->size)) {
+        errno = EINVAL;
+        return -1;
+    }
+    MergeArg arg = {db, operand, {0, NULL}};
+    int ret = modify(db, key, merge, &arg);
+    free(arg.result.data);
+    return ret;
+}
+
+// read the latest value of key into a new buffer, the caller holds the latch. an expired value
+// is only read if expired is set.
+static int load_value(DB* db, uint64_t key, Record* record, int expired) {
+    Cell cell;
+    const char* buffered;
+    MemtableState state = lookup_buffer(db, key, &buffered, &cell);
+    if (state == MEMTABLE_DELETED || (state == MEMTABLE_VALUE && !expired && cell_expired(&cell))) {
+        errno = ENOENT;
+        return -1;
+    }
+    if (state == MEMTABLE_VALUE) {
+        if ((record->data = malloc(cell.size ? cell.size : 1)) == NULL) {
+            errno = ENOMEM;
             return -1;
         }
-    } while (next_key_ret == -2);
+        memcpy(record->data, buffered, cell.size);
+        record->size = cell.size;
+        return 0;
+    }
 
-    // todo: write lock when rename file
-    char path[PATH_MAX];
-    if (fcntl(db->idx_fd, F_GETPATH, path) < 0) {
-        close(new_idx_fd);
-        close(new_data_fd);
-        free_cell(&cell);
-        free_record(&record);
-        free_index_page(&leaf);
-        free_index_page(&new_leaf);
+    int pos = search_index(db->idx_fd, db->header, NULL, key, &cell);
+    if (pos < -1) {
         errno = EIO;
         return -1;
     }
-    close(db->idx_fd);
-    db->idx_fd = new_idx_fd;
-    if (rename(tmp_idx_path, path) < 0) {
-        close(new_idx_fd);
-        close(new_data_fd);
-        free_cell(&cell);
-        free_record(&record);
-        free_index_page(&leaf);
-        free_index_page(&new_leaf);
+    if (pos < 0 || cell.key != key || (!expired && cell_expired(&cell))) {
+        errno = ENOENT;
+        return -1;
+    }
+    char* data = malloc(cell.size ? cell.size : 1);
+    if (data == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    if (read_data(db->data_fd, cell.offset, data, cell.size) < 0) {
+        free(data);
         errno = EIO;
         return -1;
     }
+    stat_add(STAT_DATA_READ, cell.size);
+    record->size = cell.size;
+    record->data = data;
+    return 0;
+}
 
-    if (fcntl(db->data_fd, F_GETPATH, path) < 0) {
-        close(new_idx_fd);
-        close(new_data_fd);
-        free_cell(&cell);
-        free_record(&record);
-        free_index_page(&leaf);
-        free_index_page(&new_leaf);
+// byte-string keys. the tree is still keyed by a uint64_t, so a key is cut into slices of
+// KEY_SLICE bytes that are looked up one layer at a time, like in a trie. the tree key of a slice
+// holds its layer, the slice big endian and zero padded, and a tag, see slice_key. a key that
+// ends within its slice has a cell of its own. the keys that go on past the same slice share one
+// cell: the record of the only one of them, or a link to a layer below where they are told apart
+// by their next slice. records hold the full key, so a lookup compares integers on the way down
+// and the full key once at the end, and a store or delete writes one record, plus two for each
+// layer it has to add. layers are numbered by the header and kept once made.
+
+#define KEY_SLICE 4
+#define KEY_MORE (KEY_SLICE + 1) // the tag of the cell of the keys that go on past their slice.
+#define KEY_LAYERS ((uint64_t) 1 << 24)
+#define KEY_LINK UINT32_MAX // the key size of a record that links to a layer, its value is the layer.
+
+// the value of a byte-string key cell: key size, value size, key, value.
+typedef struct {
+    uint32_t key_size;
+    uint32_t value_size;
+}KeyRecord;
+
+// the cell key belongs in, as find_cell left it.
+typedef struct {
+    uint64_t tree_key;
+    size_t pos; // the byte the slice of the cell starts at.
+    Record record; // the value of the cell, a new buffer.
+    Record key; // the key and the value in record.
+    Record value;
+}KeySearch;
+
+// the tree key of the slice of key that starts at byte pos, in layer. the tag is the number of
+// bytes of a key that ends in the slice, or KEY_MORE, so that shorter keys sort first.
+static uint64_t slice_key(uint64_t layer, const void* key, size_t size, size_t pos) {
+    const unsigned char* bytes = key;
+    uint64_t slice = 0;
+    for (size_t i = pos; i < pos + KEY_SLICE; i++) slice = slice << 8 | (i < size ? bytes[i] : 0);
+    size_t left = size - pos;
+    return layer << 40 | slice << 8 | (left > KEY_SLICE ? KEY_MORE : left);
+}
+
+static int compare_bytes(const void* a, size_t a_size, const void* b, size_t b_size) {
+    int cmp = a_size && b_size ? memcmp(a, b, a_size < b_size ? a_size : b_size) : 0;
+    if (cmp) return cmp;
+    return a_size < b_size ? -1 : a_size > b_size;
+}
+
+// split a record into its key and value. returns 1 for a link, 0 for a key, -1 with EIO if it
+// is neither.
+static int parse_record(const Record* record, Record* key, Record* value) {
+    KeyRecord head;
+    if (record->size < sizeof(KeyRecord)) {
         errno = EIO;
         return -1;
     }
-    close(db->data_fd);
-    db->data_fd = new_data_fd;
-    if (rename(tmp_data_path, path) < 0) {
-        close(new_idx_fd);
-        close(new_data_fd);
-        free_cell(&cell);
-        free_record(&record);
-        free_index_page(&leaf);
-        free_index_page(&new_leaf);
+    memcpy(&head, record->data, sizeof(KeyRecord));
+    int link = head.key_size == KEY_LINK;
+    key->size = link ? 0 : head.key_size;
+    key->data = record->data + sizeof(KeyRecord);
+    value->size = head.value_size;
+    value->data = key->data + key->size;
+    if (record->size != sizeof(KeyRecord) + key->size + value->size || (link && value->size != sizeof(uint64_t))) {
         errno = EIO;
         return -1;
     }
+    return link;
+}
+
+// split the record of a byte-string key cell, as a cursor or db_first_key sees it, into the key
+// and the value it holds. both point into record. returns 1 for a link to a layer below, 0 for a
+// key, -1 with EIO if it is neither.
+int db_key_record(const Record* record, Record* key, Record* value) {
+    return parse_record(record, key, value);
+}
+
+// a record of key and value in a new buffer, value is NULL for a link to layer.
+static int make_record(const void* key, size_t size, const Record* value, uint64_t layer, Record* record) {
+    KeyRecord head = {value ? (uint32_t) size : KEY_LINK, value ? (uint32_t) value->size : sizeof(uint64_t)};
+    record->size = sizeof(KeyRecord) + (value ? size : 0) + head.value_size;
+    if ((record->data = malloc(record->size)) == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    memcpy(record->data, &head, sizeof(KeyRecord));
+    char* data = record->data + sizeof(KeyRecord);
+    if (value == NULL) {
+        memcpy(data, &layer, sizeof(uint64_t));
+        return 0;
+    }
+    if (size) memcpy(data, key, size);
+    if (value->size) memcpy(data + size, value->data, value->size);
+    return 0;
+}
+
+// walk the layers down to the cell key belongs in. returns 1 if there is one, which may hold
+// another key with the same slice, 0 if not, -1 on error. the caller holds the latch.
+static int find_cell(DB* db, const void* key, size_t size, KeySearch* search) {
+    uint64_t layer = 0;
+    for (search->pos = 0;; search->pos += KEY_SLICE) {
+        search->tree_key = slice_key(layer, key, size, search->pos);
+        if (load_value(db, search->tree_key, &search->record, 0) < 0) return errno == ENOENT ? 0 : -1;
+        int link = parse_record(&search->record, &search->key, &search->value);
+        if (link == 1) memcpy(&layer, search->value.data, sizeof(uint64_t));
+        if (link == 0) return 1;
+        free(search->record.data);
+        if (link < 0) return -1;
+    }
+}
+
+static int same_key(const KeySearch* search, const void* key, size_t size) {
+    return compare_bytes(search->key.data, search->key.size, key, size) == 0;
+}
+
+// the secondary indexes see a cell by its tree key and the value of the key in it, a link as no
+// value. record is turned into that value in place.
+static void cell_value(Record* record) {
+    Record key, value;
+    if (record->data == NULL) return;
+    if (parse_record(record, &key, &value) != 0) {
+        free(record->data);
+        memset(record, 0, sizeof(Record));
+        return;
+    }
+    memmove(record->data, value.data, value.size);
+    record->size = value.size;
+}
+
+// cells are written and removed through the secondary indexes and the change feed like the
+// values of uint64_t keys.
+static int put_cell(DB* db, IndexPage* node, uint64_t tree_key, Record* record) {
+    Record old_value, key, value;
+    int ret = index_before(db, tree_key, &old_value);
+    if (ret < 0) return -1;
+    cell_value(&old_value);
+    int link = parse_record(record, &key, &value);
+    ret = put_value(db, node, tree_key, record, DB_STORE, 0);
+    ret = index_after(db, ret, tree_key, &old_value, link == 0 ? &value : NULL);
+    return log_change(db, ret, tree_key, record, 0);
+}
+
+static int remove_cell(DB* db, IndexPage* node, uint64_t tree_key) {
+    Record old_value;
+    int ret = index_before(db, tree_key, &old_value);
+    if (ret < 0) return -1;
+    cell_value(&old_value);
+    ret = index_after(db, remove_value(db, node, tree_key), tree_key, &old_value, NULL);
+    return log_change(db, ret, tree_key, NULL, 0);
+}
+
+// move the key in the cell of search to a new layer, which the cell then links to.
+static int push_down(DB* db, IndexPage* node, KeySearch* search) {
+    if ((search->tree_key & 0xff) != KEY_MORE) {
+        errno = EIO;
+        return -1;
+    }
+    if (db->header->key_layers + 1 >= KEY_LAYERS) {
+        errno = ENOSPC;
+        return -1;
+    }
+    // the number is on disk before any link to it, so a crash cannot hand it out twice.
+    uint64_t layer = ++db->header->key_layers;
+    if (dump_header(db->idx_fd, db->header) < 0) {
+        errno = EIO;
+        return -1;
+    }
+    Record link;
+    if (make_record(NULL, 0, NULL, layer, &link) < 0) return -1;
+    uint64_t moved = slice_key(layer, search->key.data, search->key.size, search->pos + KEY_SLICE);
+    int ret = put_cell(db, node, moved, &search->record);
+    if (ret == 0) ret = put_cell(db, node, search->tree_key, &link);
+    free(link.data);
+    return ret;
+}
+
+static int fetch_key(DB* db, const void* key, size_t size, Record* record) {
+    if (key == NULL && size) {
+        errno = EINVAL;
+        return -1;
+    }
+    KeySearch search;
+    latch_read(db);
+    int ret = find_cell(db, key, size, &search);
+    pthread_rwlock_unlock(&db->latch);
+    if (ret < 0) return -1;
+    if (ret == 0 || !same_key(&search, key, size)) {
+        if (ret) free(search.record.data);
+        errno = ENOENT;
+        return -1;
+    }
+    memmove(search.record.data, search.value.data, search.value.size);
+    record->size = search.value.size;
+    record->data = search.record.data;
+    return 0;
+}
+
+static int store_key(DB* db, const void* key, size_t size, Record* record, int flag) {
+    if ((key == NULL && size) || size >= KEY_LINK || record == NULL || record->data == NULL ||
+        record->size > UINT32_MAX) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (flag != DB_INSERT && flag != DB_REPLACE && flag != DB_STORE) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    Record entry;
+    IndexPage* node = malloc_index_page();
+    if (node == NULL || make_record(key, size, record, 0, &entry) < 0) {
+        free_index_page(&node);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    KeySearch search;
+    latch_write(db);
+    int ret = key_kind(db, HEADER_BYTE_KEYS, 1);
+    // another key in the cell moves down a layer, where the two are looked up again.
+    while (ret == 0 && (ret = find_cell(db, key, size, &search)) == 1 && !same_key(&search, key, size)) {
+        ret = push_down(db, node, &search);
+        free(search.record.data);
+        if (ret < 0) break;
+    }
+    if (ret == 1) free(search.record.data);
+    if (ret == 1 && flag == DB_INSERT) {
+        errno = EEXIST;
+        ret = -1;
+    } else if (ret == 0 && flag == DB_REPLACE) {
+        errno = ENOENT;
+        ret = -1;
+    } else if (ret >= 0) {
+        ret = put_cell(db, node, search.tree_key, &entry);
+    }
+    pthread_rwlock_unlock(&db->latch);
+
+    free_index_page(&node);
+    free(entry.data);
+    return ret;
+}
+
+static int delete_key(DB* db, const void* key, size_t size) {
+    if (key == NULL && size) {
+        errno = EINVAL;
+        return -1;
+    }
+    IndexPage* node = malloc_index_page();
+    if (node == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    KeySearch search;
+    latch_write(db);
+    int found = key_kind(db, HEADER_BYTE_KEYS, 0);
+    if (found == 0) found = find_cell(db, key, size, &search);
+    int ret = -1;
+    if (found == 1 && same_key(&search, key, size)) {
+        ret = remove_cell(db, node, search.tree_key);
+    } else if (found >= 0) {
+        errno = ENOENT;
+    }
+    if (found == 1) free(search.record.data);
+    pthread_rwlock_unlock(&db->latch);
+
+    free_index_page(&node);
+    return ret;
+}
+
+// visit the keys in [lo, hi) in order as of one snapshot. hi NULL means no upper bound. the
+// layers are walked depth first with one cursor, which seeks back to the link it left a layer
+// by once the layer below is done. the walk starts at the slices of lo.
+static int scan_keys(DB* db, const void* lo, size_t lo_size, const void* hi, size_t hi_size,
+                     KeyVisitor visit, void* arg) {
+    Cursor* cursor = db_cursor_open(db, NULL);
+    if (cursor == NULL) return -1;
+
+    uint64_t* resume = NULL; // the tree key to go on from in each layer above the current one.
+    size_t depth = 0;
+    size_t capacity = 0;
+    uint64_t layer = 0;
+    size_t pos = 0;
+    int on_lo = 1; // the layers walked so far follow the slices of lo.
+    int ret = db_cursor_seek(cursor, slice_key(0, lo, lo_size, 0) & ~(uint64_t) 0xff);
+    while (ret == 0) {
+        Cell cell;
+        Record record;
+        ret = db_cursor_next(cursor, &cell, &record);
+        if (ret == 0 && cell.key >> 40 != layer) {
+            free(record.data);
+            ret = -2;
+        }
+        if (ret == -2 && depth > 0) {
+            uint64_t next = resume[--depth];
+            layer = next >> 40;
+            pos -= KEY_SLICE;
+            on_lo = 0;
+            ret = db_cursor_seek(cursor, next);
+            continue;
+        }
+        if (ret < 0) break;
+
+        Record key, value;
+        int link = parse_record(&record, &key, &value);
+        if (link == 1) {
+            if (depth == capacity) {
+                size_t grown = capacity ? capacity * 2 : 8;
+                uint64_t* stack = realloc(resume, grown * sizeof(uint64_t));
+                if (stack == NULL) {
+                    free(record.data);
+                    errno = ENOMEM;
+                    ret = -1;
+                    break;
+                }
+                resume = stack;
+                capacity = grown;
+            }
+            // a tag is never 0xff, so the next tree key is still in the layer.
+            resume[depth++] = cell.key + 1;
+            on_lo = on_lo && cell.key == slice_key(layer, lo, lo_size, pos);
+            memcpy(&layer, value.data, sizeof(uint64_t));
+            pos += KEY_SLICE;
+            ret = db_cursor_seek(cursor, on_lo ? slice_key(layer, lo, lo_size, pos) & ~(uint64_t) 0xff : layer << 40);
+        } else if (link == 0 && compare_bytes(key.data, key.size, lo, lo_size) >= 0) {
+            if (hi && compare_bytes(key.data, key.size, hi, hi_size) >= 0) ret = 1;
+            else if (visit(key.data, key.size, &value, arg)) ret = 1;
+        }
+        free(record.data);
+        if (link < 0) ret = -1;
+    }
+    free(resume);
+    db_cursor_close(cursor);
+    return ret == -1 ? -1 : 0;
+}
+
+int db_fetch_key(DB* db, const void* key, size_t size, Record* record) {
+    stat_begin(scope, db->stats);
+    int ret = fetch_key(db, key, size, record);
+    count_error(ret);
+    stat_end(STAT_OP_FETCH, scope);
+    return ret;
+}
+
+int db_store_key(DB* db, const void* key, size_t size, Record* record, int flag) {
+    stat_begin(scope, db->stats);
+    int ret = store_key(db, key, size, record, flag);
+    count_error(ret);
+    stat_end(STAT_OP_STORE, scope);
+    return ret;
+}
+
+int db_delete_key(DB* db, const void* key, size_t size) {
+    stat_begin(scope, db->stats);
+    int ret = delete_key(db, key, size);
+    count_error(ret);
+    stat_end(STAT_OP_DELETE, scope);
+    return ret;
+}
+
+int db_scan_keys(DB* db, const void* lo, size_t lo_size, const void* hi, size_t hi_size,
+                 KeyVisitor visit, void* arg) {
+    stat_begin(scope, db->stats);
+    int ret = scan_keys(db, lo, lo_size, hi, hi_size, visit, arg);
+    count_error(ret);
+    stat_end(STAT_OP_SCAN, scope);
+    return ret;
+}
+
+// every key starting with prefix: the upper bound is the prefix with its last byte below 0xff
+// incremented and the rest dropped.
+int db_scan_prefix(DB* db, const void* prefix, size_t size, KeyVisitor visit, void* arg) {
+    char* hi = malloc(size ? size : 1);
+    if (hi == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    if (size) memcpy(hi, prefix, size);
+    size_t hi_size = size;
+    while (hi_size && (unsigned char) hi[hi_size - 1] == 0xff) hi_size--;
+    if (hi_size) hi[hi_size - 1]++;
+
+    int ret = db_scan_keys(db, prefix, size, hi_size ? hi : NULL, hi_size, visit, arg);
+    free(hi);
+    return ret;
+}
+
+// append value to a composite key so that the keys sort by it numerically.
+size_t db_key_append_u64(void* key, uint64_t value) {
+    unsigned char* bytes = key;
+    for (int i = 7; i >= 0; i--) {
+        bytes[i] = value & 0xff;
+        value >>= 8;
+    }
+    return 8;
+}
+
+int db_first_key(DB* db, Cell* cell) {
+    IndexPage* leaf = malloc_index_page();
+    if (leaf == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    stat_begin(scope, db->stats);
+    latch_read(db);
+    int ret = first_key(db->idx_fd, db->header, leaf, cell);
+    pthread_rwlock_unlock(&db->latch);
+    stat_end(STAT_OP_SCAN, scope);
+    return ret;
+}
+
+int db_next_key(DB* db, IndexPage* leaf, int* pos, Cell* cell) {
+    stat_begin(scope, db->stats);
+    latch_read(db);
+    int ret = next_key(db->idx_fd, leaf, pos, cell);
+    pthread_rwlock_unlock(&db->latch);
+    stat_end(STAT_OP_SCAN, scope);
+    return ret;
+}
+
+typedef struct {
+    int idx_fd;
+    int data_fd;
+    Header header;
+    IndexPage* node;
+}ReorgTarget;
+
+// copy the live value of cell into the rebuilt files, the caller holds the latch.
+static int reorg_copy(DB* db, ReorgTarget* target, const Cell* cell) {
+    char* data = malloc(cell->size ? cell->size : 1);
+    if (data == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    Cell new_cell;
+    memcpy(&new_cell, cell, sizeof(Cell));
+    if (read_data(db->data_fd, cell->offset, data, cell->size) < 0 ||
+        (new_cell.offset = alloc_data(target->data_fd, &target->header, cell->size)) < 0 ||
+        io_pwrite(target->data_fd, data, cell->size, new_cell.offset) < 0) {
+        free(data);
+        errno = EIO;
+        return -1;
+    }
+    free(data);
+
+    int pos = search_index(target->idx_fd, &target->header, target->node, cell->key, NULL);
+    if (pos < -1) {
+        errno = EIO;
+        return -1;
+    }
+
+    ssize_t ret;
+    if (pos >= 0 && target->node->cells[pos].key == cell->key) {
+        ret = update_index(target->idx_fd, target->node, pos, &new_cell);
+    } else {
+        ret = insert_index(target->idx_fd, &target->header, target->node, pos, &new_cell);
+    }
+    if (ret < 0) {
+        errno = EIO;
+        return -1;
+    }
+    return 0;
+}
+
+// bring one key of the rebuilt files up to date with the live tree.
+static int reorg_apply(DB* db, ReorgTarget* target, uint64_t key) {
+    Cell cell;
+    int pos = search_index(db->idx_fd, db->header, NULL, key, &cell);
+    if (pos < -1) {
+        errno = EIO;
+        return -1;
+    }
+    if (pos >= 0 && cell.key == key) return reorg_copy(db, target, &cell);
+
+    pos = search_index(target->idx_fd, &target->header, target->node, key, NULL);
+    if (pos < -1) {
+        errno = EIO;
+        return -1;
+    }
+    if (pos >= 0 && target->node->cells[pos].key == key) {
+        if (delete_index(target->idx_fd, &target->header, target->node, pos) < 0) {
+            errno = EIO;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int compare_key(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*) a;
+    uint64_t y = *(const uint64_t*) b;
+    return x < y ? -1 : x > y;
+}
+
+static void reorg_abort(DB* db, ReorgTarget* target, char* tmp_idx_path, char* tmp_data_path) {
+    latch_write(db);
+    free_reorg(&db->reorg);
+    pthread_rwlock_unlock(&db->latch);
+
+    if (target->idx_fd >= 0) close(target->idx_fd);
+    if (target->data_fd >= 0) close(target->data_fd);
+    free_index_page(&target->node);
+    unlink(tmp_idx_path);
+    unlink(tmp_data_path);
+    free(tmp_idx_path);
+    free(tmp_data_path);
+}
+
+// one range of keys of the copy pass. values go into extents of the new data file that only
+// this range writes to, and their cells are kept in key order for the bulk build.
+typedef struct {
+    DB* db;
+    ReorgTarget* target;
+    pthread_mutex_t* mutex; // guards the target header while extents are allocated.
+    atomic_int* failed;
+    KeyRange range;
+    off_t extent;
+    size_t extent_left;
+    Cell* cells;
+    size_t num_cells;
+    size_t capacity;
+    int err;
+}ReorgPart;
+
+static off_t part_alloc(ReorgPart* part, size_t size) {
+    if (size > part->extent_left) {
+        // the rest of the old extent stays dead until the next compaction.
+        size_t length = size > REORG_EXTENT ? size : REORG_EXTENT;
+        pthread_mutex_lock(part->mutex);
+        off_t extent = alloc_data(part->target->data_fd, &part->target->header, length);
+        pthread_mutex_unlock(part->mutex);
+        if (extent < 0) return -1;
+        part->extent = extent;
+        part->extent_left = length;
+    }
+    off_t offset = part->extent;
+    part->extent += (off_t) size;
+    part->extent_left -= size;
+    return offset;
+}
+
+// copy the value of cell and keep its new cell, the caller holds the latch.
+static int part_copy(ReorgPart* part, const Cell* cell) {
+    if (part->num_cells == part->capacity) {
+        size_t capacity = part->capacity ? part->capacity * 2 : 1024;
+        Cell* cells = realloc(part->cells, capacity * sizeof(Cell));
+        if (cells == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        part->cells = cells;
+        part->capacity = capacity;
+    }
+    char* data = malloc(cell->size ? cell->size : 1);
+    if (data == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    Cell* new_cell = part->cells + part->num_cells;
+    memcpy(new_cell, cell, sizeof(Cell));
+    if (read_data(part->db->data_fd, cell->offset, data, cell->size) < 0 ||
+        (new_cell->offset = part_alloc(part, cell->size)) < 0 ||
+        io_pwrite(part->target->data_fd, data, cell->size, new_cell->offset) < 0) {
+        free(data);
+        errno = EIO;
+        return -1;
+    }
+    free(data);
+    part->num_cells++;
+    return 0;
+}
+
+// walk the leaves of the range, each under the shared latch. a split behind the walk only moves
+// keys that were already copied, and keys stored since are in the delta log anyway.
+static void* part_main(void* arg) {
+    ReorgPart* part = arg;
+    DB* db = part->db;
+    IndexPage* leaf = malloc_index_page();
+    if (leaf == NULL) {
+        part->err = ENOMEM;
+        atomic_store(part->failed, 1);
+        return NULL;
+    }
+
+    latch_read(db);
+    int ret = 0;
+    if (search_index(db->idx_fd, db->header, leaf, part->range.lo, NULL) < -1) {
+        errno = EIO;
+        ret = -1;
+    }
+    for (;;) {
+        int end = 0;
+        for (int i = 0; ret == 0 && !end && i < leaf->num_cells; i++) {
+            const Cell* cell = leaf->cells + i;
+            if (cell->key < part->range.lo) continue;
+            if (part->num_cells && cell->key <= part->cells[part->num_cells - 1].key) continue;
+            if (part->range.bounded && cell->key >= part->range.hi) end = 1;
+            else ret = part_copy(part, cell);
+        }
+        off_t next = leaf->next_page;
+        pthread_rwlock_unlock(&db->latch);
+        if (ret < 0 || end || next == -1 || atomic_load(part->failed)) break;
+
+        latch_read(db);
+        if (load_page(db->idx_fd, next, leaf) < 0) {
+            errno = EIO;
+            ret = -1;
+        }
+    }
+    free_index_page(&leaf);
+    if (ret < 0) {
+        part->err = errno;
+        atomic_store(part->failed, 1);
+    }
+    return NULL;
+}
+
+// copy pass: the key space is split into ranges that are copied on threads of their own, then
+// the new tree is built bottom-up from their cells in one sequential pass.
+static int copy_parts(DB* db, ReorgTarget* target, int threads) {
+    KeyRange ranges[SCAN_MAX_THREADS];
+    int parts = scan_partition(db, threads, ranges);
+    if (parts < 0) return -1;
+
+    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+    atomic_int failed = 0;
+    ReorgPart part[SCAN_MAX_THREADS];
+    pthread_t tids[SCAN_MAX_THREADS];
+    int started[SCAN_MAX_THREADS];
+    memset(part, 0, parts * sizeof(ReorgPart));
+    for (int i = 0; i < parts; i++) {
+        part[i].db = db;
+        part[i].target = target;
+        part[i].mutex = &mutex;
+        part[i].failed = &failed;
+        part[i].range = ranges[i];
+        started[i] = i > 0 && pthread_create(tids + i, NULL, part_main, part + i) == 0;
+    }
+    part_main(part);
+    for (int i = 1; i < parts; i++) {
+        if (started[i]) pthread_join(tids[i], NULL);
+        else part_main(part + i);
+    }
+
+    // an unused tail at the end of the file is handed back, the others stay dead until compaction.
+    for (int shrunk = 1; shrunk;) {
+        shrunk = 0;
+        for (int i = 0; i < parts; i++) {
+            if (part[i].extent_left && part[i].extent + (off_t) part[i].extent_left == target->header.data_end) {
+                target->header.data_end = part[i].extent;
+                part[i].extent_left = 0;
+                shrunk = 1;
+            }
+        }
+    }
+
+    int ret = 0;
+    int err = 0;
+    for (int i = 0; i < parts && err == 0; i++) err = part[i].err;
+    // no other process knows the new file yet, so its end can still move back.
+    if (err == 0 && ftruncate(target->data_fd, target->header.data_end) < 0) err = errno;
+    target->header.data_reserved = target->header.data_end;
+    BulkBuilder* builder = err ? NULL : bulk_open(target->idx_fd, &target->header);
+    if (builder == NULL && err == 0) err = errno;
+    for (int i = 0; i < parts && err == 0; i++) {
+        for (size_t c = 0; c < part[i].num_cells && err == 0; c++) {
+            if (bulk_add(builder, part[i].cells + c) < 0) err = errno;
+        }
+    }
+    if (err) bulk_abort(&builder);
+    else if (bulk_finish(&builder) < 0) err = errno;
+
+    for (int i = 0; i < parts; i++) free(part[i].cells);
+    if (err) {
+        errno = err;
+        ret = -1;
+    }
+    return ret;
+}
+
+// the rebuilt files are moved over the old ones once <name>.reorg is on disk. the marker says
+// that both .reorg files are complete, so a swap cut short by a crash is finished by db_open
+// rather than leaving a new data file next to the old index.
+static int sync_parent(const char* path) {
+    char* copy = strdup(path);
+    if (copy == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    int fd = open(dirname(copy), O_RDONLY | O_DIRECTORY);
+    free(copy);
+    if (fd < 0) return -1;
+    int ret = fsync(fd);
+    close(fd);
+    return ret;
+}
+
+static int write_marker(const char* path) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return -1;
+    int ret = fsync(fd);
+    close(fd);
+    return ret < 0 ? -1 : sync_parent(path);
+}
+
+// renames whichever .reorg file is still there and drops the marker. the marker goes only
+// after the renames are durable, or a later reorganize could be finished half written.
+static int finish_swap(const char* name, const char* marker_path) {
+    const char* suffixes[2] = {".dat", ".idx"};
+    int ret = 0;
+    for (int i = 0; ret == 0 && i < 2; i++) {
+        char* path = db_file_name(name, suffixes[i]);
+        char* tmp_path = path ? db_file_name(path, ".reorg") : NULL;
+        if (tmp_path == NULL) {
+            errno = ENOMEM;
+            ret = -1;
+        } else if (rename(tmp_path, path) < 0 && errno != ENOENT) {
+            ret = -1;
+        }
+        free(path);
+        free(tmp_path);
+    }
+    if (ret == 0) ret = sync_parent(marker_path);
+    if (ret == 0 && unlink(marker_path) < 0) ret = -1;
+    if (ret == 0) ret = sync_parent(marker_path);
+    return ret;
+}
+
+static int recover_swap(const char* name) {
+    char* marker_path = db_file_name(name, ".reorg");
+    if (marker_path == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    int ret = access(marker_path, F_OK) == 0 ? finish_swap(name, marker_path) : 0;
+    free(marker_path);
+    return ret;
+}
+
+// rebuilds <name>.idx and <name>.dat next to the originals while readers and writers continue.
+// writers log the keys they touch; the log is replayed until it is short enough to finish
+// under the exclusive latch, then the new files are renamed over the old ones. snapshots and
+// cursors open across the swap keep reading the old files until they end.
+static int reorganize(DB* db, int threads) {
+    ReorgTarget target;
+    memset(&target, 0, sizeof(ReorgTarget));
+    target.idx_fd = -1;
+    target.data_fd = -1;
+
+    latch_write(db);
+    if (db->reorg) {
+        pthread_rwlock_unlock(&db->latch);
+        errno = EBUSY;
+        return -1;
+    }
+    if (flush_buffer(db) < 0) {
+        pthread_rwlock_unlock(&db->latch);
+        return -1;
+    }
+    db->reorg = malloc(sizeof(Reorg));
+    if (db->reorg == NULL) {
+        pthread_rwlock_unlock(&db->latch);
+        errno = ENOMEM;
+        return -1;
+    }
+    memset(db->reorg, 0, sizeof(Reorg));
+    pthread_rwlock_unlock(&db->latch);
+
+    char* tmp_idx_path = db_file_name(db->name, ".idx.reorg");
+    char* tmp_data_path = db_file_name(db->name, ".dat.reorg");
+    target.node = malloc_index_page();
+    if (tmp_idx_path == NULL || tmp_data_path == NULL || target.node == NULL) {
+        reorg_abort(db, &target, tmp_idx_path, tmp_data_path);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    target.idx_fd = open(tmp_idx_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    target.data_fd = open(tmp_data_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (target.idx_fd < 0 || target.data_fd < 0 || create_tree(target.idx_fd) < 0 ||
+        load_index_header(target.idx_fd, &target.header) < 0) {
+        int err = errno;
+        reorg_abort(db, &target, tmp_idx_path, tmp_data_path);
+        errno = err;
+        return -1;
+    }
+    target.header.flags |= db->header->flags & (HEADER_COUNTS | HEADER_UINT_KEYS | HEADER_BYTE_KEYS);
+
+    if (copy_parts(db, &target, threads) < 0) {
+        int err = errno;
+        reorg_abort(db, &target, tmp_idx_path, tmp_data_path);
+        errno = err;
+        return -1;
+    }
+
+    // catch-up pass: replay the delta log until the last round can run with writers stopped.
+    for (int round = 0;; round++) {
+        latch_write(db);
+        uint64_t* keys = db->reorg->keys;
+        size_t num_keys = db->reorg->num_keys;
+        db->reorg->keys = NULL;
+        db->reorg->num_keys = 0;
+        db->reorg->capacity = 0;
+
+        int final = num_keys <= REORG_FINAL_DELTA || round >= REORG_CATCH_UP_ROUNDS;
+        if (!final) pthread_rwlock_unlock(&db->latch);
+
+        if (num_keys > 0) qsort(keys, num_keys, sizeof(uint64_t), compare_key);
+        for (size_t i = 0; i < num_keys; i++) {
+            if (i > 0 && keys[i] == keys[i - 1]) continue;
+            if (!final) latch_read(db);
+            int ret = reorg_apply(db, &target, keys[i]);
+            if (!final) pthread_rwlock_unlock(&db->latch);
+            if (ret < 0) {
+                int err = errno;
+                if (final) pthread_rwlock_unlock(&db->latch);
+                free(keys);
+                reorg_abort(db, &target, tmp_idx_path, tmp_data_path);
+                errno = err;
+                return -1;
+            }
+        }
+        free(keys);
+        if (final) break;
+    }
+
+    // swap, still holding the exclusive latch. the whole-file lock keeps other processes out.
+    char* marker_path = db_file_name(db->name, ".reorg");
+    target.header.key_layers = db->header->key_layers;
+    target.header.origin = db->header->origin;
+    target.header.flags &= ~HEADER_CLEAN;
+    if (marker_path == NULL || write_lock_wait(db->idx_fd, 0, SEEK_SET, 0) < 0 ||
+        dump_header(target.idx_fd, &target.header) < 0 || fsync(target.data_fd) < 0 || fsync(target.idx_fd) < 0 ||
+        write_marker(marker_path) < 0) {
+        int err = errno;
+        unlock(db->idx_fd, 0, SEEK_SET, 0);
+        pthread_rwlock_unlock(&db->latch);
+        free(marker_path);
+        reorg_abort(db, &target, tmp_idx_path, tmp_data_path);
+        errno = err;
+        return -1;
+    }
+    // past the marker the swap is done. the handle moves to the new files even if a rename
+    // fails, and the next db_open finishes it.
+    finish_swap(db->name, marker_path);
+    free(marker_path);
+
+    int old_idx_fd = db->idx_fd;
+    int old_data_fd = db->data_fd;
+    if (db->cache) {
+        cache_purge(db->cache, old_data_fd);
+        cache_purge(db->cache, old_idx_fd);
+    }
+    db->data_fd = target.data_fd;
+    db->idx_fd = target.idx_fd;
+    // snapshots taken before the swap go on reading the old pair.
+    if (snapshot_retire(db, old_idx_fd, old_data_fd)) {
+        unlock(old_idx_fd, 0, SEEK_SET, 0);
+        cache_detach(old_idx_fd);
+        cache_detach(old_data_fd);
+    } else {
+        release_fd(db, old_data_fd);
+        release_fd(db, old_idx_fd);
+    }
+    if (db->direct) {
+        io_set_direct(db->data_fd, 1);
+        io_set_direct(db->idx_fd, 1);
+    }
+    attach_cache(db, db->cache);
+    memcpy(db->header, &target.header, sizeof(Header));
+    free_reorg(&db->reorg);
+    compact_invalidate(db);
+    backup_invalidate(db);
+    pthread_rwlock_unlock(&db->latch);
+
+    free_index_page(&target.node);
+    free(tmp_idx_path);
+    free(tmp_data_path);
+    return 0;
+}
+
+int db_reorganize(DB* db) {
+    return db_reorganize_parallel(db, 1);
+}
+
+int db_reorganize_parallel(DB* db, int threads) {
+    if (threads < 1 || threads > SCAN_MAX_THREADS) {
+        errno = EINVAL;
+        return -1;
+    }
+    stat_begin(scope, db->stats);
+    int ret = reorganize(db, threads);
+    stat_end(STAT_OP_NONE, scope);
+    return ret;
+}
+
+// for writers outside this file, the caller holds the exclusive latch.
+int db_reorg_log(DB* db, uint64_t key) {
+    return log_delta(db, key);
+}
+
+// take the value of key out of the secondary indexes and log its removal to the change feed if it
+// is due, ahead of the removal.
+static int before_expiry(DB* db, uint64_t key, uint64_t due) {
+    Cell cell;
+    int pos = search_index(db->idx_fd, db->header, NULL, key, &cell);
+    if (pos < -1) {
+        errno = EIO;
+        return -1;
+    }
+    if (pos < 0 || cell.key != key || cell.expire_at == 0 || cell.expire_at > due) return 0;
+    Record old_value = {0, NULL};
+    if (db->indexes && load_value(db, key, &old_value, 1) < 0) return -1;
+    return log_change(db, index_after(db, 0, key, &old_value, NULL), key, NULL, 0);
+}
+
+// remove up to max_keys expired values. their keys are taken from <name>.ttl in time order and
+// removed in key order, so a leaf is written once for all of its keys in the batch. returns the
+// number of entries taken, which is less than max_keys once nothing else is due.
+static ssize_t expire_step(DB* db, size_t max_keys) {
+    uint64_t* keys = malloc((max_keys ? max_keys : 1) * sizeof(uint64_t));
+    Flush* flush = malloc(sizeof(Flush));
+    IndexPage* leaf = malloc_index_page();
+    if (keys == NULL || flush == NULL || leaf == NULL) {
+        free(keys);
+        free(flush);
+        free_index_page(&leaf);
+        errno = ENOMEM;
+        return -1;
+    }
+    memset(flush, 0, sizeof(Flush));
+    flush->db = db;
+    flush->leaf = leaf;
+    flush->due = (uint64_t) time(NULL);
+
+    latch_write(db);
+    // a buffered value gets its entry once it is in the tree, so one that is due is flushed first.
+    uint64_t expiry = db->memtable ? memtable_expiry(db->memtable) : 0;
+    int ret = expiry && expiry <= flush->due ? flush_buffer(db) : 0;
+    ssize_t taken = ret < 0 ? -1 : expire_take(db, flush->due, keys, max_keys);
+    if (taken < 0) ret = -1;
+    if (taken > 0) {
+        qsort(keys, taken, sizeof(uint64_t), compare_key);
+        for (ssize_t i = 0; ret == 0 && i < taken; i++) {
+            if (i && keys[i] == keys[i - 1]) continue;
+            // a buffered write of the key is newer than its cell and not due.
+            const char* buffered;
+            Cell cell;
+            if (lookup_buffer(db, keys[i], &buffered, &cell) != MEMTABLE_MISS) continue;
+            if (db->indexes || db->feed) ret = before_expiry(db, keys[i], flush->due);
+            if (ret == 0) ret = flush_entry(keys[i], NULL, 0, 0, flush);
+        }
+        if (ret == 0) ret = end_batch(flush);
+    }
+    pthread_rwlock_unlock(&db->latch);
+    free(keys);
+    free(flush);
+    free_index_page(&leaf);
+    return ret < 0 ? -1 : taken;
+}
+
+ssize_t db_expire_step(DB* db, size_t max_keys) {
+    stat_begin(scope, db->stats);
+    ssize_t ret = expire_step(db, max_keys);
+    stat_end(STAT_OP_NONE, scope);
+    return ret;
+}
+
+// keep the number of keys under every internal cell, for the order statistics below. the
+// counts are filled in with one pass over the index, every insert and delete then updates them
+// on the way down to its leaf. the tree keys are counted, which for byte-string keys includes the
+// links to their layers.
+int db_enable_counts(DB* db) {
+    if (db->memtable && db_buffer_flush(db) < 0) return -1;
+    stat_begin(scope, db->stats);
+    latch_write(db);
+    int ret = 0;
+    if (db->reorg) {
+        errno = EBUSY;
+        ret = -1;
+    } else if (!(db->header->flags & HEADER_COUNTS)) {
+        if (count_tree(db->idx_fd, db->header) < 0) {
+            errno = EIO;
+            ret = -1;
+        } else {
+            db->header->flags |= HEADER_COUNTS;
+            if (dump_header(db->idx_fd, db->header) < 0) {
+                errno = EIO;
+                ret = -1;
+            }
+        }
+    }
+    pthread_rwlock_unlock(&db->latch);
+    stat_end(STAT_OP_NONE, scope);
+    return ret;
+}
+
+typedef enum {
+    ORDER_COUNT,
+    ORDER_RANK,
+    ORDER_SELECT,
+}OrderQuery;
+
+// one order-statistic query, reading height pages. buffered writes are moved into the tree first.
+static int order_query(DB* db, OrderQuery query, uint64_t key, size_t* n, Cell* cell) {
+    if (db->memtable && db_buffer_flush(db) < 0) return -1;
+    stat_begin(scope, db->stats);
+    latch_read(db);
+    int ret;
+    if (!(db->header->flags & HEADER_COUNTS)) {
+        errno = ENOTSUP;
+        ret = -1;
+    } else if (query == ORDER_COUNT) {
+        ret = count_keys(db->idx_fd, db->header, n);
+    } else if (query == ORDER_RANK) {
+        ret = rank_key(db->idx_fd, db->header, key, n);
+    } else {
+        ret = select_key(db->idx_fd, db->header, *n, cell);
+    }
+    if (ret < 0 && errno != ENOTSUP && errno != ERANGE) errno = EIO;
+    pthread_rwlock_unlock(&db->latch);
+    count_error(ret);
+    stat_end(STAT_OP_NONE, scope);
+    return ret;
+}
+
+int db_count_keys(DB* db, size_t* count) {
+    return order_query(db, ORDER_COUNT, 0, count, NULL);
+}
+
+// the number of keys below key.
+int db_rank(DB* db, uint64_t key, size_t* rank) {
+    return order_query(db, ORDER_RANK, key, rank, NULL);
+}
+
+// the key with rank keys below it, ERANGE past the last key.
+int db_select(DB* db, size_t rank, Cell* cell) {
+    return order_query(db, ORDER_SELECT, 0, &rank, cell);
+}
+
+// the number of keys in [lo, hi). writers may run between the two ranks.
+int db_count_range(DB* db, uint64_t lo, uint64_t hi, size_t* count) {
+    size_t below_lo, below_hi;
+    if (db_rank(db, lo, &below_lo) < 0 || db_rank(db, hi, &below_hi) < 0) return -1;
+    *count = below_hi > below_lo ? below_hi - below_lo : 0;
+    return 0;
+}
+
+// a key chosen uniformly at random, *seed is the state of the generator and is advanced.
+// ENOENT if the database is empty.
+int db_sample(DB* db, uint64_t* seed, Cell* cell) {
+    for (;;) {
+        size_t count;
+        if (db_count_keys(db, &count) < 0) return -1;
+        if (count == 0) {
+            errno = ENOENT;
+            return -1;
+        }
+        // splitmix64, the multiply-shift maps it to [0, count) without a division.
+        uint64_t z = (*seed += 0x9e3779b97f4a7c15ull);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+        z ^= z >> 31;
+        size_t rank = (size_t) (((unsigned __int128) z * count) >> 64);
+        if (db_select(db, rank, cell) == 0) return 0;
+        // a delete between the two calls can leave the rank past the end, so draw again.
+        if (errno != ERANGE) return -1;
+    }
+}
 
+int db_stats(DB* db, DBStats* stats) {
+#ifdef MDBM_STATS
+    stats_collect(db->stats, stats);
     return 0;
+#else
+    stats_collect(NULL, stats);
+    errno = ENOTSUP;
+    return -1;
+#endif
 }
@@ -1,4 +1,3 @@
-// todo: create new file, insert_index the key in order to reduce the blanks
 //
 // Created by Machearn Ning on 3/21/22.
 //
@@ -6,19 +5,68 @@
 #ifndef MDBM_MDBM_H
 #define MDBM_MDBM_H
 
+#include <pthread.h>
+
 #include "btree.h"
+#include "stats.h"
+
+typedef struct Reorg Reorg;
+typedef struct Compactor Compactor;
+typedef struct VersionStore VersionStore;
+typedef struct PageCache PageCache;
+typedef struct Memtable Memtable;
+typedef struct Expirer Expirer;
+typedef struct SecondaryIndex SecondaryIndex;
+typedef struct Backup Backup;
+typedef struct ChangeFeed ChangeFeed;
+typedef struct Warmer Warmer;
+
+typedef struct {
+    size_t size;
+    char* data;
+}Record;
+
+// computes the new value of a key for db_merge from its current value, NULL if it has none, and
+// the operand. result->data must come from malloc, the handle frees it. a nonzero return leaves
+// the key as it is and is returned by db_merge.
+typedef int (*MergeOperator)(const Record* value, const Record* operand, Record* result, void* arg);
 
 typedef struct {
     int idx_fd;
     int data_fd;
     Header* header;
     char* name;
+    pthread_rwlock_t latch; // shared by readers, exclusive by writers of this handle.
+    Reorg* reorg; // non-NULL while db_reorganize is rebuilding the files.
+    Compactor* compactor; // dead-byte accounting and the background compaction thread.
+    VersionStore* versions; // page images kept for open snapshots.
+    Stats* stats; // per-thread counters and latency histograms, see db_stats.
+    int writable; // opened for writing, the header is marked clean again on close.
+    int direct; // opened with O_DIRECT.
+    PageCache* cache; // index pages and data blocks, private or shared with other processes. NULL if disabled.
+    Memtable* memtable; // recent puts and deletes not yet in the tree, see db_buffer_start. NULL if disabled.
+    MergeOperator merge; // see db_set_merge_operator.
+    void* merge_arg;
+    Expirer* expirer; // <name>.ttl and the background expirer, NULL until a writer needs them.
+    SecondaryIndex* indexes; // maintained with every write, see db_index_open.
+    Backup* backup; // pages changed since the last backup, NULL until db_backup.
+    ChangeFeed* feed; // every write is appended to <name>.cdc.<seq>, NULL if the feed is off.
+    Warmer* warmer; // loads and saves <name>.warm, the hot blocks of the last run. NULL if neither is needed.
 }DB;
 
-typedef struct {
+// a value borrowed from the handle, valid until db_view_release. the bytes do not change while
+// the view is held, even if the key is stored again. the handle must outlive its views.
+typedef struct db_view {
+    const char* data;
     size_t size;
-    char* data;
-}Record;
+    PageCache* cache; // cache holding the pinned block, NULL if data is a private copy.
+    int32_t frame;
+    void* copy;
+}DBView;
+
+// called by db_scan_keys for each key in order, a nonzero return stops the scan. the key and the
+// value are only valid during the call.
+typedef int (*KeyVisitor)(const void* key, size_t key_size, const Record* value, void* arg);
 
 void db_free_record(Record** record);
 
@@ -26,13 +74,57 @@ DB* db_open(const char* name, int oflag, ...);
 void db_close(DB* db);
 
 int db_fetch(DB* db, uint64_t key, Record* record);
+int db_fetch_into(DB* db, uint64_t key, void* buf, size_t cap, size_t* size);
+int db_fetch_view(DB* db, uint64_t key, DBView* view);
+void db_view_release(DBView* view);
 int db_store(DB* db, uint64_t key, Record* record, int flag);
 int db_delete(DB* db, uint64_t key);
+int db_store_ttl(DB* db, uint64_t key, Record* record, int flag, uint32_t ttl);
+int db_expiry(DB* db, uint64_t key, uint64_t* expire_at);
+ssize_t db_expire_step(DB* db, size_t max_keys);
+
+int db_add_u64(DB* db, uint64_t key, int64_t delta, uint64_t* sum);
+int db_compare_and_swap(DB* db, uint64_t key, const Record* expected, const Record* desired);
+int db_set_merge_operator(DB* db, MergeOperator merge, void* arg);
+int db_merge(DB* db, uint64_t key, const Record* operand);
+
+// byte-string keys, ordered by memcmp with shorter keys first. they are kept in the same tree as
+// the uint64_t keys, so a database holds the kind it was first stored with and writes of the
+// other fail with EINVAL. composite keys are the concatenation of their parts, see
+// db_key_append_u64 for integers.
+int db_fetch_key(DB* db, const void* key, size_t key_size, Record* record);
+int db_store_key(DB* db, const void* key, size_t key_size, Record* record, int flag);
+int db_delete_key(DB* db, const void* key, size_t key_size);
+int db_scan_keys(DB* db, const void* lo, size_t lo_size, const void* hi, size_t hi_size,
+                 KeyVisitor visit, void* arg);
+int db_scan_prefix(DB* db, const void* prefix, size_t prefix_size, KeyVisitor visit, void* arg);
+size_t db_key_append_u64(void* key, uint64_t value);
+int db_key_record(const Record* record, Record* key, Record* value);
 
 int db_first_key(DB* db, Cell* cell);
 int db_next_key(DB* db, IndexPage* leaf, int* pos, Cell* cell);
 
 int db_reorganize(DB* db);
+int db_reorganize_parallel(DB* db, int threads);
+int db_reorg_log(DB* db, uint64_t key);
+int db_set_growth(DB* db, size_t idx_chunk, size_t data_chunk);
+int db_set_cache(DB* db, size_t bytes);
+int db_share_cache(DB* db, size_t bytes);
+
+int db_buffer_start(DB* db, size_t bytes);
+int db_buffer_flush(DB* db);
+int db_buffer_flush_latched(DB* db);
+int db_buffer_set_sync(DB* db, int sync);
+int db_buffer_stop(DB* db);
+
+int db_enable_counts(DB* db);
+int db_count_keys(DB* db, size_t* count);
+int db_count_range(DB* db, uint64_t lo, uint64_t hi, size_t* count);
+int db_rank(DB* db, uint64_t key, size_t* rank);
+int db_select(DB* db, size_t rank, Cell* cell);
+int db_sample(DB* db, uint64_t* seed, Cell* cell);
+
+int db_stats(DB* db, DBStats* stats);
 
 #define DB_INSERT 1
 #define DB_REPLACE 2
@@ -0,0 +1,297 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+
+#include "memtable.h"
+#include "lock.h"
+
+// a skiplist of the latest put or delete per key, backed by an append-only log. an acknowledged
+// write is in the page cache, so it outlives a crash of the process. it only outlives a crash of
+// the machine if the table syncs every append, see memtable_set_sync. the caller serializes
+// writers against everything else.
+
+#define LOG_PUT 1
+#define LOG_DELETE 2
+
+typedef struct {
+    uint64_t key;
+    uint32_t size;
+    uint32_t type;
+    uint64_t expire_at;
+}LogEntry;
+
+typedef struct MemNode MemNode;
+struct MemNode {
+    uint64_t key;
+    char* data; // NULL for a delete.
+    size_t size;
+    uint64_t expire_at;
+    int level;
+    MemNode* next[];
+};
+
+struct Memtable {
+    int fd;
+    off_t log_end;
+    size_t limit;
+    size_t bytes;
+    size_t count;
+    uint64_t expiry; // the earliest expiry put since the last clear, 0 if none.
+    int sync; // every append is on the disk before it returns.
+    int level;
+    uint64_t seed;
+    MemNode* head;
+};
+
+static MemNode* malloc_node(int level) {
+    MemNode* node = malloc(sizeof(MemNode) + level * sizeof(MemNode*));
+    if (node == NULL) return NULL;
+    memset(node, 0, sizeof(MemNode) + level * sizeof(MemNode*));
+    node->level = level;
+    return node;
+}
+
+static void free_node(MemNode** node) {
+    if (!(*node)) return;
+    free((*node)->data);
+    free(*node);
+    *node = NULL;
+}
+
+// each level holds about a quarter of the keys of the one below.
+static int random_level(Memtable* table) {
+    int level = 1;
+    while (level < MEMTABLE_MAX_LEVEL) {
+        table->seed ^= table->seed << 13;
+        table->seed ^= table->seed >> 7;
+        table->seed ^= table->seed << 17;
+        if (table->seed & 3) break;
+        level++;
+    }
+    return level;
+}
+
+// the last node before key on every level, and the node holding key if there is one.
+static MemNode* find(Memtable* table, uint64_t key, MemNode** update) {
+    MemNode* node = table->head;
+    for (int i = table->level - 1; i >= 0; i--) {
+        while (node->next[i] && node->next[i]->key < key) node = node->next[i];
+        if (update) update[i] = node;
+    }
+    node = node->next[0];
+    return node && node->key == key ? node : NULL;
+}
+
+// data is NULL for a delete, it is copied.
+static int apply(Memtable* table, uint64_t key, const void* data, size_t size, uint64_t expire_at) {
+    if (expire_at && (table->expiry == 0 || expire_at < table->expiry)) table->expiry = expire_at;
+    char* copy = NULL;
+    if (data) {
+        copy = malloc(size ? size : 1);
+        if (copy == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        memcpy(copy, data, size);
+    }
+
+    MemNode* update[MEMTABLE_MAX_LEVEL];
+    MemNode* node = find(table, key, update);
+    if (node) {
+        table->bytes = table->bytes - node->size + size;
+        free(node->data);
+        node->data = copy;
+        node->size = size;
+        node->expire_at = expire_at;
+        return 0;
+    }
+
+    int level = random_level(table);
+    if ((node = malloc_node(level)) == NULL) {
+        free(copy);
+        errno = ENOMEM;
+        return -1;
+    }
+    for (int i = table->level; i < level; i++) update[i] = table->head;
+    if (level > table->level) table->level = level;
+    node->key = key;
+    node->data = copy;
+    node->size = size;
+    node->expire_at = expire_at;
+    for (int i = 0; i < level; i++) {
+        node->next[i] = update[i]->next[i];
+        update[i]->next[i] = node;
+    }
+    table->bytes += MEMTABLE_NODE_BYTES + size;
+    table->count++;
+    return 0;
+}
+
+// a torn entry at the end of the log is the tail of a write that never returned, so it is cut off.
+static int replay(Memtable* table) {
+    off_t offset = 0;
+    char* data = NULL;
+    size_t capacity = 0;
+    for (;;) {
+        LogEntry entry;
+        if (pread(table->fd, &entry, sizeof(LogEntry), offset) != sizeof(LogEntry)) break;
+        if (entry.type != LOG_PUT && entry.type != LOG_DELETE) break;
+        if (entry.type == LOG_PUT) {
+            if (entry.size > capacity) {
+                char* grown = realloc(data, entry.size);
+                if (grown == NULL) {
+                    free(data);
+                    errno = ENOMEM;
+                    return -1;
+                }
+                data = grown;
+                capacity = entry.size;
+            }
+            if (pread(table->fd, data, entry.size, offset + sizeof(LogEntry)) != (ssize_t) entry.size) break;
+        }
+        if (apply(table, entry.key, entry.type == LOG_PUT ? (data ? data : "") : NULL, entry.size, entry.expire_at) < 0) {
+            free(data);
+            return -1;
+        }
+        offset += sizeof(LogEntry) + (entry.type == LOG_PUT ? entry.size : 0);
+    }
+    free(data);
+    table->log_end = offset;
+    return ftruncate(table->fd, offset);
+}
+
+static int append(Memtable* table, uint64_t key, const void* data, size_t size, uint64_t expire_at) {
+    if (size > UINT32_MAX) {
+        errno = EINVAL;
+        return -1;
+    }
+    LogEntry entry = {key, (uint32_t) size, data ? LOG_PUT : LOG_DELETE, expire_at};
+    struct iovec iov[2] = {{&entry, sizeof(LogEntry)}, {(void*) data, data ? size : 0}};
+    ssize_t total = sizeof(LogEntry) + (data ? size : 0);
+    if (writev(table->fd, iov, 2) != total || (table->sync && fdatasync(table->fd) < 0)) {
+        // nothing may follow a torn entry, or the replay would stop before it.
+        if (ftruncate(table->fd, table->log_end) == 0) lseek(table->fd, table->log_end, SEEK_SET);
+        errno = EIO;
+        return -1;
+    }
+    table->log_end += total;
+    return 0;
+}
+
+// opens the log at path, replaying what is left in it. limit is the size memtable_full reports
+// at, 0 for none. the log is locked, so only one process buffers writes for it at a time.
+Memtable* memtable_open(const char* path, size_t limit) {
+    Memtable* table = malloc(sizeof(Memtable));
+    if (table == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    memset(table, 0, sizeof(Memtable));
+    table->limit = limit;
+    table->level = 1;
+    table->seed = (uintptr_t) table | 1;
+    table->head = malloc_node(MEMTABLE_MAX_LEVEL);
+    table->fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (table->head == NULL || table->fd < 0) {
+        int err = table->head ? errno : ENOMEM;
+        memtable_close(&table);
+        errno = err;
+        return NULL;
+    }
+    if (write_lock(table->fd, 0, SEEK_SET, 0) < 0) {
+        memtable_close(&table);
+        errno = EBUSY;
+        return NULL;
+    }
+    if (replay(table) < 0) {
+        int err = errno;
+        memtable_close(&table);
+        errno = err;
+        return NULL;
+    }
+    return table;
+}
+
+void memtable_close(Memtable** table) {
+    if (!(*table)) return;
+    MemNode* node = (*table)->head;
+    while (node) {
+        MemNode* next = node->next[0];
+        free_node(&node);
+        node = next;
+    }
+    if ((*table)->fd >= 0) close((*table)->fd);
+    free(*table);
+    *table = NULL;
+}
+
+// *data points into the table until the key is written again or the table is cleared. a value
+// is returned even once it expired, the caller checks *expire_at.
+MemtableState memtable_get(Memtable* table, uint64_t key, const char** data, size_t* size, uint64_t* expire_at) {
+    MemNode* node = find(table, key, NULL);
+    if (node == NULL) return MEMTABLE_MISS;
+    if (node->data == NULL) return MEMTABLE_DELETED;
+    *data = node->data;
+    *size = node->size;
+    *expire_at = node->expire_at;
+    return MEMTABLE_VALUE;
+}
+
+// expire_at is the time the value expires at, 0 if it does not.
+int memtable_put(Memtable* table, uint64_t key, const void* data, size_t size, uint64_t expire_at) {
+    if (append(table, key, data ? data : "", size, expire_at) < 0) return -1;
+    return apply(table, key, data ? data : "", size, expire_at);
+}
+
+int memtable_delete(Memtable* table, uint64_t key) {
+    if (append(table, key, NULL, 0, 0) < 0) return -1;
+    return apply(table, key, NULL, 0, 0);
+}
+
+// whether every append waits for fdatasync. a crash of the machine loses none of the writes it
+// acknowledged, at the cost of a disk flush per write.
+void memtable_set_sync(Memtable* table, int sync) {
+    table->sync = sync;
+}
+
+int memtable_full(Memtable* table) {
+    return table->limit && table->bytes >= table->limit;
+}
+
+size_t memtable_count(Memtable* table) {
+    return table->count;
+}
+
+// no buffered value expires before this time, 0 if none expires at all.
+uint64_t memtable_expiry(Memtable* table) {
+    return table->expiry;
+}
+
+// visit every buffered key in order. a nonzero return of visit stops the scan and is returned.
+int memtable_scan(Memtable* table, MemtableVisitor visit, void* arg) {
+    for (MemNode* node = table->head->next[0]; node; node = node->next[0]) {
+        int ret = visit(node->key, node->data, node->size, node->expire_at, arg);
+        if (ret) return ret;
+    }
+    return 0;
+}
+
+// forget everything, once it is safely in the tree.
+int memtable_clear(Memtable* table) {
+    MemNode* node = table->head->next[0];
+    while (node) {
+        MemNode* next = node->next[0];
+        free_node(&node);
+        node = next;
+    }
+    memset(table->head->next, 0, MEMTABLE_MAX_LEVEL * sizeof(MemNode*));
+    table->level = 1;
+    table->bytes = 0;
+    table->count = 0;
+    table->expiry = 0;
+    table->log_end = 0;
+    return ftruncate(table->fd, 0);
+}
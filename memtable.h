@@ -0,0 +1,36 @@
+#ifndef MDBM_MEMTABLE_H
+#define MDBM_MEMTABLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define MEMTABLE_MAX_LEVEL 16
+#define MEMTABLE_NODE_BYTES 64 // charged against the limit for every buffered key besides its value.
+
+typedef struct Memtable Memtable;
+
+typedef enum {
+    MEMTABLE_MISS, // not buffered, the tree has the latest state.
+    MEMTABLE_VALUE,
+    MEMTABLE_DELETED,
+}MemtableState;
+
+// called for each buffered key in order. data is NULL for a delete, expire_at 0 for a value that
+// does not expire.
+typedef int (*MemtableVisitor)(uint64_t key, const char* data, size_t size, uint64_t expire_at, void* arg);
+
+Memtable* memtable_open(const char* path, size_t limit);
+void memtable_close(Memtable** table);
+
+MemtableState memtable_get(Memtable* table, uint64_t key, const char** data, size_t* size, uint64_t* expire_at);
+int memtable_put(Memtable* table, uint64_t key, const void* data, size_t size, uint64_t expire_at);
+int memtable_delete(Memtable* table, uint64_t key);
+void memtable_set_sync(Memtable* table, int sync);
+int memtable_full(Memtable* table);
+size_t memtable_count(Memtable* table);
+uint64_t memtable_expiry(Memtable* table);
+
+int memtable_scan(Memtable* table, MemtableVisitor visit, void* arg);
+int memtable_clear(Memtable* table);
+
+#endif //MDBM_MEMTABLE_H
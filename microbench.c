@@ -0,0 +1,290 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+#include "btree.h"
+#include "lock.h"
+
+// mdbm_microbench [iterations] [dir]
+// times the index primitives in isolation. "warm" variants reuse one page that stays in the
+// cpu caches (or the kernel page cache for file I/O); "cold" variants walk a working set far
+// larger than the last level cache, or drop the page from the page cache before each read.
+
+#define COLD_SET_BYTES (256 << 20)
+#define NUM_COUNTERS 4
+
+typedef struct {
+    int fds[NUM_COUNTERS];
+    uint64_t values[NUM_COUNTERS];
+    int available;
+}Counters;
+
+static const char* counter_names[NUM_COUNTERS] = {"cycles", "instructions", "llc-misses", "branch-misses"};
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+static uint64_t next_random(uint64_t* state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+static void counters_open(Counters* counters) {
+    memset(counters, 0, sizeof(Counters));
+    for (int i = 0; i < NUM_COUNTERS; i++) counters->fds[i] = -1;
+#ifdef __linux__
+    static const uint64_t configs[NUM_COUNTERS] = {
+            PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+            PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES,
+    };
+    for (int i = 0; i < NUM_COUNTERS; i++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.size = sizeof(attr);
+        attr.config = configs[i];
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        counters->fds[i] = (int) syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        if (counters->fds[i] >= 0) counters->available = 1;
+    }
+#endif
+}
+
+static void counters_close(Counters* counters) {
+    for (int i = 0; i < NUM_COUNTERS; i++) {
+        if (counters->fds[i] >= 0) close(counters->fds[i]);
+    }
+}
+
+static void counters_start(Counters* counters) {
+#ifdef __linux__
+    for (int i = 0; i < NUM_COUNTERS; i++) {
+        if (counters->fds[i] < 0) continue;
+        ioctl(counters->fds[i], PERF_EVENT_IOC_RESET, 0);
+        ioctl(counters->fds[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+#endif
+}
+
+static void counters_stop(Counters* counters) {
+#ifdef __linux__
+    for (int i = 0; i < NUM_COUNTERS; i++) {
+        counters->values[i] = 0;
+        if (counters->fds[i] < 0) continue;
+        ioctl(counters->fds[i], PERF_EVENT_IOC_DISABLE, 0);
+        if (read(counters->fds[i], counters->values + i, sizeof(uint64_t)) != sizeof(uint64_t)) counters->values[i] = 0;
+    }
+#endif
+}
+
+static Counters counters;
+static uint64_t bench_start;
+
+static void begin() {
+    counters_start(&counters);
+    bench_start = now_ns();
+}
+
+// excluded is time spent on setup inside the timed loop that should not be charged to the primitive.
+static void end(const char* name, size_t iterations, uint64_t excluded) {
+    uint64_t elapsed = now_ns() - bench_start - excluded;
+    counters_stop(&counters);
+
+    printf("%-28s %10.1f ns/op", name, (double) elapsed / (double) iterations);
+    if (counters.available) {
+        for (int i = 0; i < NUM_COUNTERS; i++) {
+            if (counters.fds[i] < 0) continue;
+            printf("  %s=%.1f", counter_names[i], (double) counters.values[i] / (double) iterations);
+        }
+    }
+    printf("\n");
+}
+
+static void fill_node(IndexPage* page, NodeType type, uint64_t base) {
+    init_page(page, 0, type, -1, -1, -1, 0, 0);
+    for (int i = 0; i < MAX_CELL; i++) {
+        page->cells[i].key = base + (uint64_t) i * 2;
+        page->cells[i].offset = i;
+        page->cells[i].size = 8;
+    }
+    page->num_cells = MAX_CELL;
+}
+
+static volatile int sink;
+
+static void bench_search(size_t iterations) {
+    size_t num_pages = COLD_SET_BYTES / sizeof(IndexPage);
+    IndexPage* pages = malloc(num_pages * sizeof(IndexPage));
+    if (pages == NULL) return;
+    for (size_t i = 0; i < num_pages; i++) fill_node(pages + i, INTERNAL_NODE, 0);
+    uint64_t state = 0x9e3779b97f4a7c15ULL;
+    Cell cell;
+
+    begin();
+    for (size_t i = 0; i < iterations; i++) sink += search_internal_node(pages, next_random(&state) % (MAX_CELL * 2));
+    end("search_internal_node warm", iterations, 0);
+
+    begin();
+    for (size_t i = 0; i < iterations; i++) {
+        sink += search_internal_node(pages + next_random(&state) % num_pages, next_random(&state) % (MAX_CELL * 2));
+    }
+    end("search_internal_node cold", iterations, 0);
+
+    for (size_t i = 0; i < num_pages; i++) pages[i].type = LEAF_NODE;
+
+    begin();
+    for (size_t i = 0; i < iterations; i++) sink += search_leaf_node(pages, next_random(&state) % (MAX_CELL * 2), &cell);
+    end("search_leaf_node warm", iterations, 0);
+
+    begin();
+    for (size_t i = 0; i < iterations; i++) {
+        sink += search_leaf_node(pages + next_random(&state) % num_pages, next_random(&state) % (MAX_CELL * 2), &cell);
+    }
+    end("search_leaf_node cold", iterations, 0);
+
+    free(pages);
+}
+
+static void bench_cells(size_t iterations) {
+    IndexPage* page = malloc_index_page();
+    uint64_t state = 0x2545F4914F6CDD1DULL;
+    fill_node(page, LEAF_NODE, 0);
+
+    // delete a random cell and put it back, so the page stays full and every call moves cells.
+    begin();
+    for (size_t i = 0; i < iterations; i++) {
+        int pos = (int) (next_random(&state) % MAX_CELL);
+        Cell cell = page->cells[pos];
+        delete_cell(page, pos);
+        add_cell(page, pos - 1, cell.key, cell.offset, cell.size);
+    }
+    end("delete_cell + add_cell", iterations, 0);
+
+    begin();
+    for (size_t i = 0; i < iterations; i++) {
+        Cell cell = page->cells[0];
+        delete_cell(page, 0);
+        add_cell(page, -1, cell.key, cell.offset, cell.size);
+    }
+    end("delete_cell + add_cell head", iterations, 0);
+
+    free_index_page(&page);
+}
+
+static void bench_page_io(const char* dir, size_t iterations) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/mdbm_microbench.idx", dir);
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror(path);
+        return;
+    }
+
+    size_t num_pages = 4096;
+    IndexPage* page = malloc_index_page();
+    fill_node(page, LEAF_NODE, 0);
+    for (size_t i = 0; i < num_pages; i++) {
+        page->offset = (off_t) (i * sizeof(IndexPage));
+        dump_page(fd, page);
+    }
+    fsync(fd);
+    uint64_t state = 0x853c49e6748fea9bULL;
+
+    begin();
+    for (size_t i = 0; i < iterations; i++) sink += (int) load_page(fd, 0, page);
+    end("load_page warm", iterations, 0);
+
+    size_t cold_iterations = iterations / 100 ? iterations / 100 : 1;
+    uint64_t excluded = 0;
+    begin();
+    for (size_t i = 0; i < cold_iterations; i++) {
+        off_t offset = (off_t) ((next_random(&state) % num_pages) * sizeof(IndexPage));
+        uint64_t start = now_ns();
+        posix_fadvise(fd, offset, sizeof(IndexPage), POSIX_FADV_DONTNEED);
+        excluded += now_ns() - start;
+        sink += (int) load_page(fd, offset, page);
+    }
+    end("load_page cold", cold_iterations, excluded);
+
+    begin();
+    for (size_t i = 0; i < iterations; i++) {
+        page->offset = (off_t) ((i % num_pages) * sizeof(IndexPage));
+        sink += (int) dump_page(fd, page);
+    }
+    end("dump_page", iterations, 0);
+
+    begin();
+    for (size_t i = 0; i < iterations; i++) {
+        off_t offset = (off_t) ((i % num_pages) * sizeof(IndexPage));
+        read_lock_wait(fd, offset, SEEK_SET, sizeof(IndexPage));
+        unlock(fd, offset, SEEK_SET, sizeof(IndexPage));
+    }
+    end("lock_region read + unlock", iterations, 0);
+
+    begin();
+    for (size_t i = 0; i < iterations; i++) {
+        off_t offset = (off_t) ((i % num_pages) * sizeof(IndexPage));
+        write_lock_wait(fd, offset, SEEK_SET, sizeof(IndexPage));
+        unlock(fd, offset, SEEK_SET, sizeof(IndexPage));
+    }
+    end("lock_region write + unlock", iterations, 0);
+
+    // every iteration splits a full root leaf of a fresh tree, which also creates the new root.
+    size_t split_iterations = iterations / 100 ? iterations / 100 : 1;
+    Header header;
+    excluded = 0;
+    begin();
+    for (size_t i = 0; i < split_iterations; i++) {
+        uint64_t start = now_ns();
+        ftruncate(fd, 0);
+        create_tree(fd);
+        load_index_header(fd, &header);
+        load_page(fd, header.left_most_leaf_offset, page);
+        off_t offset = page->offset;
+        fill_node(page, LEAF_NODE, 0);
+        page->offset = offset;
+        dump_page(fd, page);
+        excluded += now_ns() - start;
+
+        IndexPage* new_page = split_page(fd, &header, page);
+        free_index_page(&new_page);
+    }
+    end("split_page (root leaf)", split_iterations, excluded);
+
+    free_index_page(&page);
+    close(fd);
+    unlink(path);
+}
+
+int main(int argc, char** argv) {
+    size_t iterations = argc > 1 ? strtoull(argv[1], NULL, 10) : 1000000;
+    const char* dir = argc > 2 ? argv[2] : "/tmp";
+
+    counters_open(&counters);
+    if (!counters.available) printf("hardware counters unavailable, reporting time only\n");
+
+    bench_search(iterations);
+    bench_cells(iterations);
+    bench_page_io(dir, iterations / 10 ? iterations / 10 : 1);
+
+    counters_close(&counters);
+    return 0;
+}
@@ -0,0 +1,281 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+#include "pipeline.h"
+
+#define PIPE_SPIN 1024 // empty polls before a worker goes to sleep.
+#define PIPE_BATCH 64 // requests drained per pass.
+#define PIPE_IDLE_MS 10
+
+// bounded multi-producer single-consumer ring. a slot is free for the producer that claimed
+// position p once sequence == p, and holds a request for the consumer once sequence == p + 1.
+typedef struct {
+    atomic_size_t sequence;
+    Request* request;
+}Slot;
+
+typedef struct {
+    Pipeline* pipeline;
+    DB* db;
+    Slot* slots;
+    size_t mask;
+    _Alignas(64) atomic_size_t tail; // next position claimed by a producer.
+    atomic_int submitters; // pipeline_submit calls on this queue in progress.
+    _Alignas(64) size_t head; // next position read by the worker.
+    atomic_int sleeping;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    pthread_t thread;
+}Worker;
+
+struct Pipeline {
+    ShardedDB* sdb;
+    Worker* workers;
+    size_t num_workers;
+    atomic_int running; // cleared by pipeline_shutdown, submits fail from then on.
+    atomic_int stopped; // set once no submit can queue a request any more.
+};
+
+static int push(Worker* worker, Request* request) {
+    size_t pos = atomic_load_explicit(&worker->tail, memory_order_relaxed);
+    for (;;) {
+        Slot* slot = worker->slots + (pos & worker->mask);
+        size_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        if (sequence == pos) {
+            if (atomic_compare_exchange_weak_explicit(&worker->tail, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                slot->request = request;
+                atomic_store_explicit(&slot->sequence, pos + 1, memory_order_release);
+                return 0;
+            }
+        } else if (sequence < pos) {
+            return -1; // full
+        } else {
+            pos = atomic_load_explicit(&worker->tail, memory_order_relaxed);
+        }
+    }
+}
+
+static Request* pop(Worker* worker) {
+    Slot* slot = worker->slots + (worker->head & worker->mask);
+    size_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+    if (sequence != worker->head + 1) return NULL;
+
+    Request* request = slot->request;
+    atomic_store_explicit(&slot->sequence, worker->head + worker->mask + 1, memory_order_release);
+    worker->head++;
+    return request;
+}
+
+static void wake(atomic_int* word) {
+#ifdef __linux__
+    syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+#else
+    (void) word;
+#endif
+}
+
+// the callback runs first; once done is set the waiter may release the request.
+static void complete(Request* request) {
+    if (request->callback) request->callback(request, request->arg);
+    atomic_store_explicit(&request->done, 1, memory_order_release);
+    wake(&request->done);
+}
+
+static void execute(DB* db, Request* request) {
+    errno = 0;
+    switch (request->op) {
+        case PIPE_FETCH:
+            request->result = db_fetch(db, request->key, &request->record);
+            break;
+        case PIPE_STORE:
+            request->result = db_store(db, request->key, &request->record, request->flag);
+            break;
+        case PIPE_DELETE:
+            request->result = db_delete(db, request->key);
+            break;
+        default:
+            request->result = -1;
+            errno = EINVAL;
+    }
+    request->error = request->result < 0 ? errno : 0;
+    complete(request);
+}
+
+static void* worker_main(void* arg) {
+    Worker* worker = arg;
+    Pipeline* pipeline = worker->pipeline;
+
+    int idle = 0;
+    while (!atomic_load(&pipeline->stopped) || atomic_load(&worker->tail) != worker->head) {
+        Request* request;
+        int n = 0;
+        while (n < PIPE_BATCH && (request = pop(worker))) {
+            execute(worker->db, request);
+            n++;
+        }
+        if (n) {
+            idle = 0;
+            continue;
+        }
+        if (++idle < PIPE_SPIN) {
+            sched_yield();
+            continue;
+        }
+
+        // announce the sleep before the final check so a producer either sees it or we see its request.
+        atomic_store(&worker->sleeping, 1);
+        pthread_mutex_lock(&worker->mutex);
+        if (atomic_load(&worker->tail) == worker->head && !atomic_load(&pipeline->stopped)) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += PIPE_IDLE_MS * 1000000L;
+            if (deadline.tv_nsec >= 1000000000L) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&worker->cond, &worker->mutex, &deadline);
+        }
+        pthread_mutex_unlock(&worker->mutex);
+        atomic_store(&worker->sleeping, 0);
+        idle = 0;
+    }
+    return NULL;
+}
+
+// start one worker per shard. each worker is the only thread using its DB.
+Pipeline* pipeline_open(ShardedDB* sdb, size_t queue_size) {
+    if (queue_size == 0) queue_size = PIPE_QUEUE_SIZE;
+    if (queue_size & (queue_size - 1)) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    Pipeline* pipeline = malloc(sizeof(Pipeline));
+    if (pipeline == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    pipeline->sdb = sdb;
+    pipeline->num_workers = 0;
+    atomic_init(&pipeline->running, 1);
+    atomic_init(&pipeline->stopped, 0);
+    pipeline->workers = aligned_alloc(64, ((sdb->num_shards * sizeof(Worker) + 63) / 64) * 64);
+    if (pipeline->workers == NULL) {
+        free(pipeline);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    for (size_t i = 0; i < sdb->num_shards; i++) {
+        Worker* worker = pipeline->workers + i;
+        memset(worker, 0, sizeof(Worker));
+        worker->pipeline = pipeline;
+        worker->db = sdb->shards[i];
+        worker->mask = queue_size - 1;
+        worker->slots = malloc(queue_size * sizeof(Slot));
+        if (worker->slots == NULL) {
+            pipeline_close(pipeline);
+            errno = ENOMEM;
+            return NULL;
+        }
+        for (size_t j = 0; j < queue_size; j++) atomic_init(&worker->slots[j].sequence, j);
+        atomic_init(&worker->tail, 0);
+        atomic_init(&worker->submitters, 0);
+        atomic_init(&worker->sleeping, 0);
+        pthread_mutex_init(&worker->mutex, NULL);
+        pthread_cond_init(&worker->cond, NULL);
+        if (pthread_create(&worker->thread, NULL, worker_main, worker) != 0) {
+            free(worker->slots);
+            pthread_mutex_destroy(&worker->mutex);
+            pthread_cond_destroy(&worker->cond);
+            pipeline_close(pipeline);
+            errno = EAGAIN;
+            return NULL;
+        }
+        pipeline->num_workers++;
+    }
+    return pipeline;
+}
+
+// stop taking requests, drain the queues and stop the workers. pipeline_submit may still be
+// called, also while this runs, and fails with ESHUTDOWN. the ShardedDB stays open.
+void pipeline_shutdown(Pipeline* pipeline) {
+    atomic_store(&pipeline->running, 0);
+    // a submit that saw the pipeline running may still be queueing its request.
+    for (size_t i = 0; i < pipeline->num_workers; i++) {
+        while (atomic_load(&pipeline->workers[i].submitters)) sched_yield();
+    }
+    atomic_store(&pipeline->stopped, 1);
+    for (size_t i = 0; i < pipeline->num_workers; i++) {
+        Worker* worker = pipeline->workers + i;
+        pthread_mutex_lock(&worker->mutex);
+        pthread_cond_signal(&worker->cond);
+        pthread_mutex_unlock(&worker->mutex);
+        pthread_join(worker->thread, NULL);
+        pthread_mutex_destroy(&worker->mutex);
+        pthread_cond_destroy(&worker->cond);
+        free(worker->slots);
+    }
+    pipeline->num_workers = 0;
+}
+
+// pipeline_shutdown and free the pipeline, no submit may be running or follow.
+void pipeline_close(Pipeline* pipeline) {
+    if (pipeline == NULL) return;
+    pipeline_shutdown(pipeline);
+    free(pipeline->workers);
+    free(pipeline);
+}
+
+// queue request on the worker owning its key. returns -1 with EAGAIN if that queue is full.
+int pipeline_submit(Pipeline* pipeline, Request* request) {
+    Worker* worker = pipeline->workers + shard_index(pipeline->sdb, request->key);
+    // counted before running is checked, so pipeline_shutdown either waits for the request or
+    // the submit sees it stopped.
+    atomic_fetch_add(&worker->submitters, 1);
+    int ret = -1;
+    if (!atomic_load(&pipeline->running)) {
+        errno = ESHUTDOWN;
+    } else {
+        atomic_store_explicit(&request->done, 0, memory_order_relaxed);
+        if (push(worker, request) < 0) {
+            errno = EAGAIN;
+        } else {
+            ret = 0;
+            if (atomic_load(&worker->sleeping)) {
+                pthread_mutex_lock(&worker->mutex);
+                pthread_cond_signal(&worker->cond);
+                pthread_mutex_unlock(&worker->mutex);
+            }
+        }
+    }
+    atomic_fetch_sub(&worker->submitters, 1);
+    return ret;
+}
+
+// block until request has completed, then return its result with errno set from it.
+int pipeline_wait(Request* request) {
+    for (int spin = 0; !atomic_load_explicit(&request->done, memory_order_acquire); spin++) {
+        if (spin < PIPE_SPIN) {
+            sched_yield();
+            continue;
+        }
+#ifdef __linux__
+        struct timespec timeout = {0, PIPE_IDLE_MS * 1000000L};
+        syscall(SYS_futex, &request->done, FUTEX_WAIT_PRIVATE, 0, &timeout, NULL, 0);
+#else
+        sched_yield();
+#endif
+    }
+    if (request->result < 0) errno = request->error;
+    return request->result;
+}
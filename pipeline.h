@@ -0,0 +1,39 @@
+#ifndef MDBM_PIPELINE_H
+#define MDBM_PIPELINE_H
+
+#include <stdatomic.h>
+
+#include "shard.h"
+
+#define PIPE_FETCH 1
+#define PIPE_STORE 2
+#define PIPE_DELETE 3
+
+#define PIPE_QUEUE_SIZE 1024 // slots per worker queue, a power of two.
+
+typedef struct Request Request;
+typedef struct Pipeline Pipeline;
+
+typedef void (*RequestCallback)(Request* request, void* arg);
+
+struct Request {
+    int op; // PIPE_FETCH, PIPE_STORE or PIPE_DELETE.
+    uint64_t key;
+    Record record; // the value to store, or the fetched value owned by the caller afterwards.
+    int flag; // DB_INSERT, DB_REPLACE or DB_STORE for PIPE_STORE.
+
+    int result; // return value of the operation.
+    int error; // errno of the operation if result < 0.
+    RequestCallback callback; // called on the worker thread once the request completed, may be NULL.
+    void* arg;
+    atomic_int done;
+};
+
+Pipeline* pipeline_open(ShardedDB* sdb, size_t queue_size);
+void pipeline_shutdown(Pipeline* pipeline);
+void pipeline_close(Pipeline* pipeline);
+
+int pipeline_submit(Pipeline* pipeline, Request* request);
+int pipeline_wait(Request* request);
+
+#endif //MDBM_PIPELINE_H
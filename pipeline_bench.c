@@ -0,0 +1,151 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sched.h>
+
+#include "pipeline.h"
+
+#define WINDOW 64 // requests each client keeps in flight.
+
+// mdbm_pipeline_bench [path] [shards] [threads] [ops per thread] [value size]
+// compares clients calling shard_store/shard_fetch directly against submitting to the pipeline.
+
+typedef struct {
+    ShardedDB* sdb;
+    Pipeline* pipeline;
+    int id;
+    size_t ops;
+    size_t value_size;
+    size_t errors;
+}Client;
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+static uint64_t random_key(uint64_t* state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+static void* direct_client(void* arg) {
+    Client* client = arg;
+    char* value = malloc(client->value_size);
+    memset(value, 'v', client->value_size);
+    uint64_t state = 88172645463325252ULL + client->id;
+
+    for (size_t i = 0; i < client->ops; i++) {
+        uint64_t key = random_key(&state) % (client->ops * 4);
+        if (i % 2 == 0) {
+            Record record = {client->value_size, value};
+            if (shard_store(client->sdb, key, &record, DB_STORE) < 0) client->errors++;
+        } else {
+            Record record;
+            if (shard_fetch(client->sdb, key, &record) == 0) free(record.data);
+        }
+    }
+    free(value);
+    return NULL;
+}
+
+static void finish(Request* request, Client* client) {
+    if (pipeline_wait(request) < 0 && request->op == PIPE_STORE) client->errors++;
+    if (request->op == PIPE_FETCH && request->result == 0) free(request->record.data);
+}
+
+static void* pipeline_client(void* arg) {
+    Client* client = arg;
+    char* value = malloc(client->value_size);
+    memset(value, 'v', client->value_size);
+    uint64_t state = 88172645463325252ULL + client->id;
+    Request* requests = calloc(WINDOW, sizeof(Request));
+
+    for (size_t i = 0; i < client->ops; i++) {
+        Request* request = requests + i % WINDOW;
+        if (i >= WINDOW) finish(request, client);
+
+        memset(request, 0, sizeof(Request));
+        request->key = random_key(&state) % (client->ops * 4);
+        if (i % 2 == 0) {
+            request->op = PIPE_STORE;
+            request->flag = DB_STORE;
+            request->record.size = client->value_size;
+            request->record.data = value;
+        } else {
+            request->op = PIPE_FETCH;
+        }
+        while (pipeline_submit(client->pipeline, request) < 0) sched_yield();
+    }
+    for (size_t i = client->ops > WINDOW ? client->ops - WINDOW : 0; i < client->ops; i++) {
+        finish(requests + i % WINDOW, client);
+    }
+    free(requests);
+    free(value);
+    return NULL;
+}
+
+static double run(const char* mode, ShardedDB* sdb, Pipeline* pipeline, int threads, size_t ops, size_t value_size) {
+    pthread_t* tids = malloc(threads * sizeof(pthread_t));
+    Client* clients = calloc(threads, sizeof(Client));
+
+    double start = now();
+    for (int i = 0; i < threads; i++) {
+        clients[i].sdb = sdb;
+        clients[i].pipeline = pipeline;
+        clients[i].id = i;
+        clients[i].ops = ops;
+        clients[i].value_size = value_size;
+        pthread_create(tids + i, NULL, pipeline ? pipeline_client : direct_client, clients + i);
+    }
+    size_t errors = 0;
+    for (int i = 0; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+        errors += clients[i].errors;
+    }
+    double elapsed = now() - start;
+
+    double rate = (double) ops * threads / elapsed;
+    printf("%-9s %10.0f ops/s  (%d threads, %zu ops, %.2fs, %zu errors)\n", mode, rate, threads, ops * threads,
+           elapsed, errors);
+    free(clients);
+    free(tids);
+    return rate;
+}
+
+int main(int argc, char** argv) {
+    const char* path = argc > 1 ? argv[1] : "/tmp/mdbm_pipeline_bench";
+    size_t shards = argc > 2 ? strtoul(argv[2], NULL, 10) : 4;
+    int threads = argc > 3 ? atoi(argv[3]) : 4;
+    size_t ops = argc > 4 ? strtoul(argv[4], NULL, 10) : 100000;
+    size_t value_size = argc > 5 ? strtoul(argv[5], NULL, 10) : 100;
+
+    ShardedDB* sdb = shard_open(path, shards, SHARD_HASH, NULL, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (sdb == NULL) {
+        perror("shard_open");
+        return 1;
+    }
+    run("direct", sdb, NULL, threads, ops, value_size);
+    shard_close(sdb);
+
+    sdb = shard_open(path, shards, SHARD_HASH, NULL, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (sdb == NULL) {
+        perror("shard_open");
+        return 1;
+    }
+    Pipeline* pipeline = pipeline_open(sdb, PIPE_QUEUE_SIZE);
+    if (pipeline == NULL) {
+        perror("pipeline_open");
+        return 1;
+    }
+    run("pipeline", sdb, pipeline, threads, ops, value_size);
+    pipeline_close(pipeline);
+    shard_close(sdb);
+    return 0;
+}
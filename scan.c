@@ -0,0 +1,202 @@
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "scan.h"
+#include "snapshot.h"
+
+typedef struct {
+    off_t* offsets;
+    size_t count;
+    size_t capacity;
+}OffsetList;
+
+static int push_offset(OffsetList* list, off_t offset) {
+    if (list->count == list->capacity) {
+        size_t capacity = list->capacity ? list->capacity * 2 : 256;
+        off_t* offsets = realloc(list->offsets, capacity * sizeof(off_t));
+        if (offsets == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        list->offsets = offsets;
+        list->capacity = capacity;
+    }
+    list->offsets[list->count++] = offset;
+    return 0;
+}
+
+// the separators of the highest level with at least parts - 1 of them, or of the level above
+// the leaves if none has that many. keys at one level increase from page to page.
+static int collect_separators(DB* db, int parts, uint64_t** keys, size_t* num_keys) {
+    OffsetList level = {NULL, 0, 0};
+    OffsetList children = {NULL, 0, 0};
+    IndexPage* page = malloc_index_page();
+    *keys = NULL;
+    *num_keys = 0;
+    if (page == NULL || push_offset(&level, db->header->root_offset) < 0) {
+        free_index_page(&page);
+        free(level.offsets);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    for (size_t depth = db->header->height - 1;; depth--) {
+        free(*keys);
+        *keys = malloc((level.count * MAX_CELL + 1) * sizeof(uint64_t));
+        *num_keys = 0;
+        children.count = 0;
+        int ret = *keys ? 0 : -1;
+        for (size_t i = 0; ret == 0 && i < level.count; i++) {
+            if (load_page(db->idx_fd, level.offsets[i], page) < 0 || page->type != INTERNAL_NODE) {
+                errno = EIO;
+                ret = -1;
+                break;
+            }
+            if (page->left_most >= 0) ret = push_offset(&children, page->left_most);
+            for (int c = 0; ret == 0 && c < page->num_cells; c++) {
+                (*keys)[(*num_keys)++] = page->cells[c].key;
+                ret = push_offset(&children, page->cells[c].offset);
+            }
+        }
+        if (ret < 0 || *num_keys >= (size_t) parts - 1 || depth <= 1) {
+            free_index_page(&page);
+            free(level.offsets);
+            free(children.offsets);
+            if (ret < 0) {
+                free(*keys);
+                *keys = NULL;
+            }
+            return ret;
+        }
+        OffsetList swap = level;
+        level = children;
+        children = swap;
+    }
+}
+
+// split the key space into at most parts ranges of about the same number of keys, using the
+// separators of the upper levels of the tree. returns the number of ranges.
+int scan_partition(DB* db, int parts, KeyRange* ranges) {
+    memset(ranges, 0, sizeof(KeyRange));
+    if (parts <= 1) return 1;
+
+    pthread_rwlock_rdlock(&db->latch);
+    if (db->header->root_offset < 0) {
+        pthread_rwlock_unlock(&db->latch);
+        return 1;
+    }
+    uint64_t* keys;
+    size_t num_keys;
+    int ret = collect_separators(db, parts, &keys, &num_keys);
+    pthread_rwlock_unlock(&db->latch);
+    if (ret < 0) return -1;
+
+    int count = 0;
+    uint64_t lo = 0;
+    for (int i = 1; i < parts; i++) {
+        uint64_t bound = keys[(size_t) i * num_keys / parts];
+        if (bound <= lo) continue;
+        ranges[count].lo = lo;
+        ranges[count].hi = bound;
+        ranges[count].bounded = 1;
+        count++;
+        lo = bound;
+    }
+    ranges[count].lo = lo;
+    ranges[count].bounded = 0;
+    free(keys);
+    return count + 1;
+}
+
+typedef struct {
+    DB* db;
+    Snapshot* snapshot;
+    KeyRange range;
+    int partition;
+    ScanVisitor visit;
+    void* arg;
+    atomic_int* stop;
+    int ret;
+    int err;
+}ScanTask;
+
+static void* scan_main(void* arg) {
+    ScanTask* task = arg;
+    Cursor* cursor = db_cursor_open(task->db, task->snapshot);
+    if (cursor == NULL || db_cursor_seek(cursor, task->range.lo) < 0) {
+        task->ret = -1;
+        task->err = errno;
+        db_cursor_close(cursor);
+        atomic_store(task->stop, 1);
+        return NULL;
+    }
+
+    Cell cell;
+    Record record;
+    int ret = 0;
+    while (!atomic_load_explicit(task->stop, memory_order_relaxed) && (ret = db_cursor_next(cursor, &cell, &record)) == 0) {
+        if (task->range.bounded && cell.key >= task->range.hi) {
+            free(record.data);
+            break;
+        }
+        int visited = task->visit(task->partition, &cell, &record, task->arg);
+        free(record.data);
+        if (visited) {
+            task->ret = visited;
+            atomic_store(task->stop, 1);
+            break;
+        }
+    }
+    if (ret == -1) {
+        task->ret = -1;
+        task->err = errno;
+        atomic_store(task->stop, 1);
+    }
+    db_cursor_close(cursor);
+    return NULL;
+}
+
+// visit every key and value, with the key space split across up to threads threads. all of
+// them read from one snapshot, so the scan sees the database at a single point in time.
+// returns 0, -1 on error, or the nonzero value a visitor stopped the scan with.
+int db_scan_parallel(DB* db, int threads, ScanVisitor visit, void* arg) {
+    if (threads < 1 || threads > SCAN_MAX_THREADS || visit == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    KeyRange ranges[SCAN_MAX_THREADS];
+    int parts = scan_partition(db, threads, ranges);
+    if (parts < 0) return -1;
+
+    Snapshot* snapshot = db_snapshot_begin(db);
+    if (snapshot == NULL) return -1;
+
+    atomic_int stop = 0;
+    ScanTask tasks[SCAN_MAX_THREADS];
+    pthread_t tids[SCAN_MAX_THREADS];
+    int started[SCAN_MAX_THREADS];
+    for (int i = 0; i < parts; i++) {
+        tasks[i] = (ScanTask) {db, snapshot, ranges[i], i, visit, arg, &stop, 0, 0};
+        // the first partition runs on the calling thread, as does any that fails to get its own.
+        started[i] = i > 0 && pthread_create(tids + i, NULL, scan_main, tasks + i) == 0;
+    }
+    scan_main(tasks);
+    for (int i = 1; i < parts; i++) {
+        if (started[i]) pthread_join(tids[i], NULL);
+        else scan_main(tasks + i);
+    }
+    db_snapshot_end(db, snapshot);
+
+    for (int i = 0; i < parts; i++) {
+        if (tasks[i].ret == -1) {
+            errno = tasks[i].err;
+            return -1;
+        }
+    }
+    for (int i = 0; i < parts; i++) {
+        if (tasks[i].ret) return tasks[i].ret;
+    }
+    return 0;
+}
@@ -0,0 +1,22 @@
+#ifndef MDBM_SCAN_H
+#define MDBM_SCAN_H
+
+#include "mdbm.h"
+
+#define SCAN_MAX_THREADS 64
+
+typedef struct {
+    uint64_t lo;
+    uint64_t hi;
+    int bounded; // 0 for the last range, which has no upper bound.
+}KeyRange;
+
+// called for every key of a partition in order, on that partition's thread. a nonzero return
+// stops the whole scan.
+typedef int (*ScanVisitor)(int partition, const Cell* cell, const Record* value, void* arg);
+
+int db_scan_parallel(DB* db, int threads, ScanVisitor visit, void* arg);
+
+int scan_partition(DB* db, int parts, KeyRange* ranges);
+
+#endif //MDBM_SCAN_H
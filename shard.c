@@ -0,0 +1,343 @@
+#include <stdarg.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "shard.h"
+#include "compact.h"
+
+#define SHARD_MAGIC 0x5348
+
+// <name>.shards records how the key space is split, so later opens route keys the same way.
+typedef struct {
+    int magic_number;
+    int mode;
+    size_t num_shards;
+}ShardManifest;
+
+struct ShardCursor {
+    ShardedDB* sdb;
+    Cursor** cursors;
+    Cell* heads; // the next cell of every shard.
+    int* valid; // 1 if heads[i] holds a cell, 0 once shard i is exhausted.
+};
+
+static uint64_t mix_key(uint64_t key) {
+    key ^= key >> 30;
+    key *= 0xbf58476d1ce4e5b9ULL;
+    key ^= key >> 27;
+    key *= 0x94d049bb133111ebULL;
+    key ^= key >> 31;
+    return key;
+}
+
+static char* shard_file_name(const char* name, const char* suffix, long index) {
+    size_t len = strlen(name) + strlen(suffix) + 24;
+    char* path = malloc(len);
+    if (path == NULL) return NULL;
+    if (index < 0) snprintf(path, len, "%s%s", name, suffix);
+    else snprintf(path, len, "%s.%ld%s", name, index, suffix);
+    return path;
+}
+
+static ShardedDB* malloc_sharded_db(const char* name, size_t num_shards) {
+    ShardedDB* sdb = malloc(sizeof(ShardedDB));
+    if (sdb == NULL) return NULL;
+    memset(sdb, 0, sizeof(ShardedDB));
+    sdb->name = strdup(name);
+    sdb->num_shards = num_shards;
+    sdb->shards = calloc(num_shards, sizeof(DB*));
+    sdb->bounds = calloc(num_shards, sizeof(uint64_t));
+    if (sdb->name == NULL || sdb->shards == NULL || sdb->bounds == NULL) {
+        free(sdb->name);
+        free(sdb->shards);
+        free(sdb->bounds);
+        free(sdb);
+        return NULL;
+    }
+    return sdb;
+}
+
+void shard_close(ShardedDB* sdb) {
+    if (sdb == NULL) return;
+    for (size_t i = 0; i < sdb->num_shards; i++) {
+        if (sdb->shards[i]) db_close(sdb->shards[i]);
+    }
+    free(sdb->shards);
+    free(sdb->bounds);
+    free(sdb->name);
+    free(sdb);
+}
+
+static int write_manifest(ShardedDB* sdb, int mode) {
+    char* path = shard_file_name(sdb->name, ".shards", -1);
+    if (path == NULL) return -1;
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, mode);
+    free(path);
+    if (fd < 0) return -1;
+
+    ShardManifest manifest;
+    memset(&manifest, 0, sizeof(ShardManifest));
+    manifest.magic_number = SHARD_MAGIC;
+    manifest.mode = sdb->mode;
+    manifest.num_shards = sdb->num_shards;
+
+    size_t bounds_size = (sdb->num_shards - 1) * sizeof(uint64_t);
+    int ret = 0;
+    if (write(fd, &manifest, sizeof(ShardManifest)) != sizeof(ShardManifest) ||
+        write(fd, sdb->bounds, bounds_size) != (ssize_t) bounds_size || fsync(fd) < 0) {
+        ret = -1;
+    }
+    close(fd);
+    return ret;
+}
+
+// a hash or range layout of 1 to MAX_SHARD shards, with strictly increasing range bounds.
+static int valid_layout(size_t num_shards, int mode, const uint64_t* bounds) {
+    if (num_shards == 0 || num_shards > MAX_SHARD || (mode != SHARD_HASH && mode != SHARD_RANGE)) return 0;
+    if (mode == SHARD_RANGE && num_shards > 1 && bounds == NULL) return 0;
+    for (size_t i = 1; mode == SHARD_RANGE && i + 1 < num_shards; i++) {
+        if (bounds[i] <= bounds[i - 1]) return 0;
+    }
+    return 1;
+}
+
+static ShardedDB* read_manifest(const char* name) {
+    char* path = shard_file_name(name, ".shards", -1);
+    if (path == NULL) return NULL;
+    int fd = open(path, O_RDONLY);
+    free(path);
+    if (fd < 0) return NULL;
+
+    ShardManifest manifest;
+    if (read(fd, &manifest, sizeof(ShardManifest)) != sizeof(ShardManifest) ||
+        manifest.magic_number != SHARD_MAGIC || manifest.num_shards == 0 || manifest.num_shards > MAX_SHARD) {
+        close(fd);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    ShardedDB* sdb = malloc_sharded_db(name, manifest.num_shards);
+    if (sdb == NULL) {
+        close(fd);
+        errno = ENOMEM;
+        return NULL;
+    }
+    sdb->mode = manifest.mode;
+    size_t bounds_size = (manifest.num_shards - 1) * sizeof(uint64_t);
+    if (read(fd, sdb->bounds, bounds_size) != (ssize_t) bounds_size ||
+        !valid_layout(sdb->num_shards, sdb->mode, sdb->bounds)) {
+        close(fd);
+        shard_close(sdb);
+        errno = EINVAL;
+        return NULL;
+    }
+    close(fd);
+    return sdb;
+}
+
+// shards from num_shards up left behind by an earlier layout with more of them. each is opened
+// with O_TRUNC, which also drops its buffer log, expiry list, hot set and change feed, and then
+// its remaining files are removed, so a later layout never picks up stale keys.
+static int remove_shards(const char* name, size_t num_shards) {
+    static const char* suffixes[] = {".idx", ".dat", ".log", ".ttl", ".warm"};
+    for (size_t i = num_shards; i < MAX_SHARD; i++) {
+        char* path = shard_file_name(name, "", (long) i);
+        char* idx_path = shard_file_name(name, ".idx", (long) i);
+        if (path == NULL || idx_path == NULL) {
+            free(path);
+            free(idx_path);
+            errno = ENOMEM;
+            return -1;
+        }
+        int exists = access(idx_path, F_OK) == 0;
+        free(idx_path);
+        if (!exists) {
+            free(path);
+            continue;
+        }
+        DB* db = db_open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+        free(path);
+        if (db == NULL) return -1;
+        db_close(db);
+        for (size_t j = 0; j < sizeof(suffixes) / sizeof(suffixes[0]); j++) {
+            char* file = shard_file_name(name, suffixes[j], (long) i);
+            if (file == NULL) {
+                errno = ENOMEM;
+                return -1;
+            }
+            int ret = unlink(file);
+            free(file);
+            if (ret < 0 && errno != ENOENT) return -1;
+        }
+    }
+    return 0;
+}
+
+// opens <name>.0 ... <name>.<num_shards - 1>, each an independent DB with its own latch.
+// num_shards, mode and bounds are only used when the manifest is created; bounds must hold
+// num_shards - 1 increasing split keys for SHARD_RANGE. O_TRUNC removes the shards past num_shards.
+ShardedDB* shard_open(const char* name, size_t num_shards, int mode, const uint64_t* bounds, int oflag, ...) {
+    int file_mode = 0;
+    if (oflag & O_CREAT) {
+        va_list ap;
+        va_start(ap, oflag);
+        file_mode = va_arg(ap, int);
+        va_end(ap);
+    }
+
+    ShardedDB* sdb = NULL;
+    if (!(oflag & O_TRUNC)) sdb = read_manifest(name);
+
+    if (sdb == NULL) {
+        if (!(oflag & O_CREAT)) return NULL;
+        if (!valid_layout(num_shards, mode, bounds)) {
+            errno = EINVAL;
+            return NULL;
+        }
+        if ((oflag & O_TRUNC) && remove_shards(name, num_shards) < 0) return NULL;
+
+        if ((sdb = malloc_sharded_db(name, num_shards)) == NULL) {
+            errno = ENOMEM;
+            return NULL;
+        }
+        sdb->mode = mode;
+        if (mode == SHARD_RANGE) memcpy(sdb->bounds, bounds, (num_shards - 1) * sizeof(uint64_t));
+        if (write_manifest(sdb, file_mode) < 0) {
+            shard_close(sdb);
+            return NULL;
+        }
+    }
+
+    for (size_t i = 0; i < sdb->num_shards; i++) {
+        char* path = shard_file_name(name, "", (long) i);
+        if (path == NULL) {
+            shard_close(sdb);
+            errno = ENOMEM;
+            return NULL;
+        }
+        if (oflag & O_CREAT) sdb->shards[i] = db_open(path, oflag, file_mode);
+        else sdb->shards[i] = db_open(path, oflag);
+        free(path);
+        if (sdb->shards[i] == NULL) {
+            int err = errno;
+            shard_close(sdb);
+            errno = err;
+            return NULL;
+        }
+    }
+    return sdb;
+}
+
+size_t shard_index(ShardedDB* sdb, uint64_t key) {
+    if (sdb->mode == SHARD_HASH) return mix_key(key) % sdb->num_shards;
+
+    // first shard whose upper bound is above key.
+    size_t left = 0;
+    size_t right = sdb->num_shards - 1;
+    while (left < right) {
+        size_t mid = left + (right - left) / 2;
+        if (key < sdb->bounds[mid]) right = mid;
+        else left = mid + 1;
+    }
+    return left;
+}
+
+int shard_fetch(ShardedDB* sdb, uint64_t key, Record* record) {
+    return db_fetch(sdb->shards[shard_index(sdb, key)], key, record);
+}
+
+int shard_store(ShardedDB* sdb, uint64_t key, Record* record, int flag) {
+    return db_store(sdb->shards[shard_index(sdb, key)], key, record, flag);
+}
+
+int shard_delete(ShardedDB* sdb, uint64_t key) {
+    return db_delete(sdb->shards[shard_index(sdb, key)], key);
+}
+
+static int advance(ShardCursor* cursor, size_t i) {
+    int ret = db_cursor_next(cursor->cursors[i], cursor->heads + i, NULL);
+    if (ret == -1) return -1;
+    cursor->valid[i] = ret == 0;
+    return 0;
+}
+
+// iterate all shards in key order. every shard is read through its own snapshot, taken
+// one after the other, so the view is consistent per shard rather than across shards.
+ShardCursor* shard_cursor_open(ShardedDB* sdb) {
+    ShardCursor* cursor = malloc(sizeof(ShardCursor));
+    if (cursor == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    cursor->sdb = sdb;
+    cursor->cursors = calloc(sdb->num_shards, sizeof(Cursor*));
+    cursor->heads = calloc(sdb->num_shards, sizeof(Cell));
+    cursor->valid = calloc(sdb->num_shards, sizeof(int));
+    if (cursor->cursors == NULL || cursor->heads == NULL || cursor->valid == NULL) {
+        shard_cursor_close(cursor);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    for (size_t i = 0; i < sdb->num_shards; i++) {
+        if ((cursor->cursors[i] = db_cursor_open(sdb->shards[i], NULL)) == NULL || advance(cursor, i) < 0) {
+            int err = errno;
+            shard_cursor_close(cursor);
+            errno = err;
+            return NULL;
+        }
+    }
+    return cursor;
+}
+
+// returns 0 with the smallest remaining cell, -2 at the end, -1 on error.
+int shard_cursor_next(ShardCursor* cursor, Cell* cell, Record* record) {
+    ShardedDB* sdb = cursor->sdb;
+
+    size_t min = sdb->num_shards;
+    for (size_t i = 0; i < sdb->num_shards; i++) {
+        if (!cursor->valid[i]) continue;
+        if (min == sdb->num_shards || cursor->heads[i].key < cursor->heads[min].key) min = i;
+    }
+    if (min == sdb->num_shards) return -2;
+
+    memcpy(cell, cursor->heads + min, sizeof(Cell));
+    if (record && db_cursor_value(cursor->cursors[min], cell, record) < 0) return -1;
+    return advance(cursor, min);
+}
+
+void shard_cursor_close(ShardCursor* cursor) {
+    if (cursor == NULL) return;
+    for (size_t i = 0; cursor->cursors && i < cursor->sdb->num_shards; i++) {
+        db_cursor_close(cursor->cursors[i]);
+    }
+    free(cursor->cursors);
+    free(cursor->heads);
+    free(cursor->valid);
+    free(cursor);
+}
+
+// one compaction thread per shard.
+int shard_compact_start(ShardedDB* sdb, size_t rate_limit) {
+    for (size_t i = 0; i < sdb->num_shards; i++) {
+        if (db_compact_start(sdb->shards[i], rate_limit) < 0) {
+            int err = errno;
+            shard_compact_stop(sdb);
+            errno = err;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int shard_compact_stop(ShardedDB* sdb) {
+    int ret = 0;
+    for (size_t i = 0; i < sdb->num_shards; i++) {
+        if (db_compact_stop(sdb->shards[i]) < 0) ret = -1;
+    }
+    return ret;
+}
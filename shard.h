@@ -0,0 +1,38 @@
+#ifndef MDBM_SHARD_H
+#define MDBM_SHARD_H
+
+#include "mdbm.h"
+#include "snapshot.h"
+
+#define SHARD_HASH 1
+#define SHARD_RANGE 2
+
+#define MAX_SHARD 256
+
+typedef struct {
+    char* name;
+    int mode; // SHARD_HASH or SHARD_RANGE.
+    size_t num_shards;
+    uint64_t* bounds; // SHARD_RANGE only: shard i holds keys in [bounds[i - 1], bounds[i]).
+    DB** shards;
+}ShardedDB;
+
+typedef struct ShardCursor ShardCursor;
+
+ShardedDB* shard_open(const char* name, size_t num_shards, int mode, const uint64_t* bounds, int oflag, ...);
+void shard_close(ShardedDB* sdb);
+
+size_t shard_index(ShardedDB* sdb, uint64_t key);
+
+int shard_fetch(ShardedDB* sdb, uint64_t key, Record* record);
+int shard_store(ShardedDB* sdb, uint64_t key, Record* record, int flag);
+int shard_delete(ShardedDB* sdb, uint64_t key);
+
+ShardCursor* shard_cursor_open(ShardedDB* sdb);
+int shard_cursor_next(ShardCursor* cursor, Cell* cell, Record* record);
+void shard_cursor_close(ShardCursor* cursor);
+
+int shard_compact_start(ShardedDB* sdb, size_t rate_limit);
+int shard_compact_stop(ShardedDB* sdb);
+
+#endif //MDBM_SHARD_H
@@ -0,0 +1,135 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "slab.h"
+#include "btree.h"
+#include "io.h"
+#include "mdbm.h"
+
+// per-thread magazines in front of a shared depot, so steady-state operations allocate and free
+// without locks or calls into malloc. a magazine that runs empty or full moves half its capacity
+// from or to the depot in one locked step.
+
+typedef struct {
+    void* objects[SLAB_MAGAZINE];
+    size_t count;
+}Magazine;
+
+typedef struct {
+    pthread_mutex_t mutex;
+    void** objects;
+    size_t count;
+    size_t capacity;
+}Depot;
+
+static const size_t object_size[NUM_SLABS] = {IO_ALIGN, sizeof(Cell), sizeof(Record)};
+
+static Depot depots[NUM_SLABS] = {
+        {PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0},
+        {PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0},
+        {PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0},
+};
+
+static _Thread_local Magazine magazines[NUM_SLABS];
+static pthread_key_t flush_key;
+static pthread_once_t flush_once = PTHREAD_ONCE_INIT;
+
+// pages beyond SLAB_DEPOT go back to the system. small objects live in chunks that are never
+// freed, so the depot grows to hold all of them. returns how many objects were taken.
+static size_t depot_put(SlabClass cls, void** objects, size_t count) {
+    Depot* depot = depots + cls;
+    pthread_mutex_lock(&depot->mutex);
+    size_t wanted = depot->count + count;
+    if (cls == SLAB_PAGE && wanted > SLAB_DEPOT) wanted = SLAB_DEPOT;
+    if (wanted > depot->capacity) {
+        size_t capacity = depot->capacity ? depot->capacity : SLAB_MAGAZINE;
+        while (capacity < wanted) capacity *= 2;
+        void** grown = realloc(depot->objects, capacity * sizeof(void*));
+        if (grown) {
+            depot->objects = grown;
+            depot->capacity = capacity;
+        }
+    }
+    size_t room = depot->capacity - depot->count;
+    size_t n = count < room ? count : room;
+    if (n) memcpy(depot->objects + depot->count, objects, n * sizeof(void*));
+    depot->count += n;
+    pthread_mutex_unlock(&depot->mutex);
+
+    if (cls != SLAB_PAGE) return n;
+    for (size_t i = n; i < count; i++) free(objects[i]);
+    return count;
+}
+
+static size_t depot_get(SlabClass cls, void** objects, size_t count) {
+    Depot* depot = depots + cls;
+    pthread_mutex_lock(&depot->mutex);
+    size_t n = count < depot->count ? count : depot->count;
+    depot->count -= n;
+    if (n) memcpy(objects, depot->objects + depot->count, n * sizeof(void*));
+    pthread_mutex_unlock(&depot->mutex);
+    return n;
+}
+
+static void flush_magazines(void* arg) {
+    Magazine* thread_magazines = arg;
+    for (int cls = 0; cls < NUM_SLABS; cls++) {
+        Magazine* magazine = thread_magazines + cls;
+        size_t n = depot_put((SlabClass) cls, magazine->objects, magazine->count);
+        memmove(magazine->objects, magazine->objects + n, (magazine->count - n) * sizeof(void*));
+        magazine->count -= n;
+    }
+}
+
+static void make_flush_key() {
+    pthread_key_create(&flush_key, flush_magazines);
+}
+
+static size_t refill(SlabClass cls, Magazine* magazine) {
+    // registering a value makes the destructor return the magazines when the thread exits.
+    pthread_once(&flush_once, make_flush_key);
+    if (pthread_getspecific(flush_key) == NULL) pthread_setspecific(flush_key, magazines);
+
+    size_t n = depot_get(cls, magazine->objects, SLAB_MAGAZINE / 2);
+    if (n) return n;
+
+    if (cls == SLAB_PAGE) {
+        for (; n < SLAB_MAGAZINE / 2; n++) {
+            if (posix_memalign(magazine->objects + n, IO_ALIGN, IO_ALIGN) != 0) break;
+        }
+        return n;
+    }
+
+    char* chunk = malloc(SLAB_CHUNK * object_size[cls]);
+    if (chunk == NULL) return 0;
+    void* rest[SLAB_CHUNK];
+    size_t num_rest = 0;
+    for (size_t i = 0; i < SLAB_CHUNK; i++) {
+        void* object = chunk + i * object_size[cls];
+        if (n < SLAB_MAGAZINE / 2) magazine->objects[n++] = object;
+        else rest[num_rest++] = object;
+    }
+    depot_put(cls, rest, num_rest);
+    return n;
+}
+
+void* slab_alloc(SlabClass cls) {
+    Magazine* magazine = magazines + cls;
+    if (magazine->count == 0 && (magazine->count = refill(cls, magazine)) == 0) return NULL;
+    return magazine->objects[--magazine->count];
+}
+
+void slab_free(SlabClass cls, void* object) {
+    if (object == NULL) return;
+    Magazine* magazine = magazines + cls;
+    if (magazine->count == SLAB_MAGAZINE) {
+        size_t half = SLAB_MAGAZINE / 2;
+        size_t n = depot_put(cls, magazine->objects + half, half);
+        memmove(magazine->objects + half, magazine->objects + half + n, (half - n) * sizeof(void*));
+        magazine->count -= n;
+    }
+    // only a depot that cannot grow leaves the magazine full, the object is then lost to its chunk.
+    if (magazine->count < SLAB_MAGAZINE) magazine->objects[magazine->count++] = object;
+    else if (cls == SLAB_PAGE) free(object);
+}
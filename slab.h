@@ -0,0 +1,20 @@
+#ifndef MDBM_SLAB_H
+#define MDBM_SLAB_H
+
+#include <stddef.h>
+
+#define SLAB_MAGAZINE 64 // free objects a thread keeps for itself per class.
+#define SLAB_DEPOT 4096 // free objects kept in the shared depot per class, the rest go back to the system.
+#define SLAB_CHUNK 64 // small objects are carved out of chunks of this many.
+
+typedef enum {
+    SLAB_PAGE, // IndexPage and DataPage, aligned for O_DIRECT.
+    SLAB_CELL,
+    SLAB_RECORD,
+    NUM_SLABS
+}SlabClass;
+
+void* slab_alloc(SlabClass cls);
+void slab_free(SlabClass cls, void* object);
+
+#endif //MDBM_SLAB_H
@@ -0,0 +1,470 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "snapshot.h"
+#include "lock.h"
+#include "io.h"
+#include "expire.h"
+
+#define VERSION_BUCKETS 1024
+
+// the image a page of the index file behind fd had before the first write while the epoch
+// counter was tag.
+typedef struct PageVersion PageVersion;
+struct PageVersion {
+    int fd;
+    off_t offset;
+    uint64_t tag;
+    IndexPage* image;
+    PageVersion* next;
+};
+
+struct Snapshot {
+    uint64_t epoch;
+    Header header;
+    int idx_fd; // the files as of the snapshot, the old pair once a reorganize swapped them out.
+    int data_fd;
+    Snapshot* next;
+};
+
+struct VersionStore {
+    pthread_mutex_t mutex;
+    int idx_fd; // the index file the page hook is on.
+    uint64_t epoch;
+    Snapshot* snapshots;
+    size_t num_snapshots;
+    PageVersion* buckets[VERSION_BUCKETS];
+};
+
+struct Cursor {
+    DB* db;
+    Snapshot* snapshot;
+    int own_snapshot;
+    IndexPage* leaf;
+    int pos;
+};
+
+static size_t bucket_of(off_t offset) {
+    return ((uint64_t) offset / sizeof(IndexPage)) % VERSION_BUCKETS;
+}
+
+// page hook: keep the on-disk image of a page about to be overwritten while snapshots may need it.
+static void preserve_page(int fd, off_t offset, void* arg) {
+    VersionStore* store = arg;
+
+    pthread_mutex_lock(&store->mutex);
+    if (store->num_snapshots == 0) {
+        pthread_mutex_unlock(&store->mutex);
+        return;
+    }
+    // pages past the end every snapshot saw were allocated after them and need no copy.
+    int seen = 0;
+    for (Snapshot* s = store->snapshots; s && !seen; s = s->next) {
+        if (s->idx_fd == fd && offset < s->header.idx_end) seen = 1;
+    }
+    if (!seen) {
+        pthread_mutex_unlock(&store->mutex);
+        return;
+    }
+    PageVersion** bucket = store->buckets + bucket_of(offset);
+    for (PageVersion* v = *bucket; v; v = v->next) {
+        if (v->fd == fd && v->offset == offset && v->tag == store->epoch) {
+            pthread_mutex_unlock(&store->mutex);
+            return;
+        }
+    }
+
+    PageVersion* version = malloc(sizeof(PageVersion));
+    IndexPage* image = malloc_index_page();
+    if (version == NULL || image == NULL || io_pread(fd, image, sizeof(IndexPage), offset) < (ssize_t) sizeof(IndexPage)) {
+        free(version);
+        free_index_page(&image);
+        pthread_mutex_unlock(&store->mutex);
+        return;
+    }
+    version->fd = fd;
+    version->offset = offset;
+    version->tag = store->epoch;
+    version->image = image;
+    version->next = *bucket;
+    *bucket = version;
+    pthread_mutex_unlock(&store->mutex);
+}
+
+// drop the versions no remaining snapshot can see, the caller holds the mutex.
+static void collect_versions(VersionStore* store) {
+    for (size_t b = 0; b < VERSION_BUCKETS; b++) {
+        PageVersion** link = store->buckets + b;
+        while (*link) {
+            PageVersion* v = *link;
+
+            // a snapshot reads v if v is the oldest version of the page with tag >= its epoch.
+            uint64_t floor = 0;
+            for (PageVersion* o = store->buckets[b]; o; o = o->next) {
+                if (o->fd == v->fd && o->offset == v->offset && o->tag < v->tag && o->tag >= floor) floor = o->tag + 1;
+            }
+            int needed = 0;
+            for (Snapshot* s = store->snapshots; s && !needed; s = s->next) {
+                if (s->idx_fd == v->fd && s->epoch >= floor && s->epoch <= v->tag) needed = 1;
+            }
+
+            if (needed) {
+                link = &v->next;
+            } else {
+                *link = v->next;
+                free_index_page(&v->image);
+                free(v);
+            }
+        }
+    }
+}
+
+static VersionStore* malloc_version_store(int idx_fd) {
+    VersionStore* store = malloc(sizeof(VersionStore));
+    if (store == NULL) return NULL;
+    memset(store, 0, sizeof(VersionStore));
+    pthread_mutex_init(&store->mutex, NULL);
+    store->idx_fd = idx_fd;
+    return store;
+}
+
+static int retired(const VersionStore* store, const Snapshot* snapshot) {
+    return snapshot->idx_fd != store->idx_fd;
+}
+
+// whether an open snapshot still reads the files of snapshot.
+static int files_in_use(const VersionStore* store, const Snapshot* snapshot) {
+    for (Snapshot* s = store->snapshots; s; s = s->next) {
+        if (s->idx_fd == snapshot->idx_fd) return 1;
+    }
+    return 0;
+}
+
+static void close_files(const Snapshot* snapshot) {
+    io_set_direct(snapshot->idx_fd, 0);
+    io_set_direct(snapshot->data_fd, 0);
+    close(snapshot->idx_fd);
+    close(snapshot->data_fd);
+}
+
+int snapshot_active(DB* db) {
+    VersionStore* store = db->versions;
+    if (store == NULL) return 0;
+
+    pthread_mutex_lock(&store->mutex);
+    int active = store->num_snapshots > 0;
+    pthread_mutex_unlock(&store->mutex);
+    return active;
+}
+
+void snapshot_free(DB* db) {
+    VersionStore* store = db->versions;
+    if (store == NULL) return;
+
+    set_page_hook(store->idx_fd, NULL, store);
+    while (store->snapshots) {
+        Snapshot* s = store->snapshots;
+        store->snapshots = s->next;
+        if (retired(store, s) && !files_in_use(store, s)) close_files(s);
+        free(s);
+    }
+    store->num_snapshots = 0;
+    collect_versions(store);
+    pthread_mutex_destroy(&store->mutex);
+    free(store);
+    db->versions = NULL;
+}
+
+// begin a read-only view of the database as of now. writers are not blocked by it.
+Snapshot* db_snapshot_begin(DB* db) {
+    Snapshot* snapshot = malloc(sizeof(Snapshot));
+    if (snapshot == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    // the latch waits for in-flight writers, so the view falls between two operations. buffered
+    // writes are not in the tree the snapshot reads, so they are flushed under the same latch.
+    pthread_rwlock_wrlock(&db->latch);
+    if (db_buffer_flush_latched(db) < 0) {
+        pthread_rwlock_unlock(&db->latch);
+        free(snapshot);
+        return NULL;
+    }
+    if (db->versions == NULL && (db->versions = malloc_version_store(db->idx_fd)) == NULL) {
+        pthread_rwlock_unlock(&db->latch);
+        free(snapshot);
+        errno = ENOMEM;
+        return NULL;
+    }
+    VersionStore* store = db->versions;
+
+    pthread_mutex_lock(&store->mutex);
+    if (store->num_snapshots == 0 && set_page_hook(db->idx_fd, preserve_page, store) < 0) {
+        pthread_mutex_unlock(&store->mutex);
+        pthread_rwlock_unlock(&db->latch);
+        free(snapshot);
+        errno = EMFILE;
+        return NULL;
+    }
+    snapshot->epoch = ++store->epoch;
+    memcpy(&snapshot->header, db->header, sizeof(Header));
+    snapshot->idx_fd = db->idx_fd;
+    snapshot->data_fd = db->data_fd;
+    snapshot->next = store->snapshots;
+    store->snapshots = snapshot;
+    store->num_snapshots++;
+    pthread_mutex_unlock(&store->mutex);
+
+    pthread_rwlock_unlock(&db->latch);
+    return snapshot;
+}
+
+int db_snapshot_end(DB* db, Snapshot* snapshot) {
+    VersionStore* store = db->versions;
+    if (store == NULL || snapshot == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    pthread_mutex_lock(&store->mutex);
+    Snapshot** link = &store->snapshots;
+    while (*link && *link != snapshot) link = &(*link)->next;
+    if (*link == NULL) {
+        pthread_mutex_unlock(&store->mutex);
+        errno = EINVAL;
+        return -1;
+    }
+    *link = snapshot->next;
+    store->num_snapshots--;
+
+    collect_versions(store);
+    if (retired(store, snapshot) && !files_in_use(store, snapshot)) close_files(snapshot);
+    if (store->num_snapshots == 0) set_page_hook(store->idx_fd, NULL, store);
+    pthread_mutex_unlock(&store->mutex);
+    free(snapshot);
+    return 0;
+}
+
+// a reorganize renamed rebuilt files over the ones behind old_idx_fd and old_data_fd, and db
+// reads the new ones now. the caller holds the exclusive latch. returns 1 if open snapshots still
+// read the old pair, which is closed when the last of them ends, and 0 if the caller closes it.
+int snapshot_retire(DB* db, int old_idx_fd, int old_data_fd) {
+    VersionStore* store = db->versions;
+    if (store == NULL) return 0;
+
+    pthread_mutex_lock(&store->mutex);
+    int kept = 0;
+    for (Snapshot* s = store->snapshots; s; s = s->next) {
+        if (s->idx_fd == old_idx_fd && s->data_fd == old_data_fd) kept = 1;
+    }
+    // nothing writes the old files any more, so their versions are complete.
+    if (store->num_snapshots) {
+        set_page_hook(store->idx_fd, NULL, store);
+        set_page_hook(db->idx_fd, preserve_page, store);
+    }
+    store->idx_fd = db->idx_fd;
+    pthread_mutex_unlock(&store->mutex);
+    return kept;
+}
+
+// read a page as the snapshot sees it: the disk image unless it has been overwritten since.
+static int snapshot_load(DB* db, Snapshot* snapshot, off_t offset, IndexPage* page) {
+    VersionStore* store = db->versions;
+    if (load_page(snapshot->idx_fd, offset, page) < 0) return -1;
+
+    pthread_mutex_lock(&store->mutex);
+    PageVersion* found = NULL;
+    for (PageVersion* v = store->buckets[bucket_of(offset)]; v; v = v->next) {
+        if (v->fd != snapshot->idx_fd || v->offset != offset || v->tag < snapshot->epoch) continue;
+        if (found == NULL || v->tag < found->tag) found = v;
+    }
+    if (found) memcpy(page, found->image, sizeof(IndexPage));
+    pthread_mutex_unlock(&store->mutex);
+    return 0;
+}
+
+// the header the database had when the snapshot began.
+const Header* snapshot_header(const Snapshot* snapshot) {
+    return &snapshot->header;
+}
+
+// the index file as of the snapshot, to be read through snapshot_patch.
+int snapshot_idx_fd(const Snapshot* snapshot) {
+    return snapshot->idx_fd;
+}
+
+int snapshot_data_fd(const Snapshot* snapshot) {
+    return snapshot->data_fd;
+}
+
+// overwrite the pages in buf, read from the index file at offset, that have changed since the
+// snapshot began with their images as of it. offset is page aligned.
+void snapshot_patch(DB* db, Snapshot* snapshot, off_t offset, void* buf, size_t size) {
+    VersionStore* store = db->versions;
+    off_t start = offset < HEADER_SIZE ? HEADER_SIZE : offset;
+
+    pthread_mutex_lock(&store->mutex);
+    for (off_t page = start; page + (off_t) sizeof(IndexPage) <= offset + (off_t) size; page += sizeof(IndexPage)) {
+        PageVersion* found = NULL;
+        for (PageVersion* v = store->buckets[bucket_of(page)]; v; v = v->next) {
+            if (v->fd != snapshot->idx_fd || v->offset != page || v->tag < snapshot->epoch) continue;
+            if (found == NULL || v->tag < found->tag) found = v;
+        }
+        if (found) memcpy((char*) buf + (page - offset), found->image, sizeof(IndexPage));
+    }
+    pthread_mutex_unlock(&store->mutex);
+}
+
+static int snapshot_search(DB* db, Snapshot* snapshot, IndexPage* node, uint64_t key, Cell* cell) {
+    Header* header = &snapshot->header;
+    off_t off = header->root_offset < 0 ? header->left_most_leaf_offset : header->root_offset;
+
+    if (snapshot_load(db, snapshot, off, node) < 0) return -2;
+    while (node->type == INTERNAL_NODE) {
+        int pos = search_internal_node(node, key);
+
+        off_t offset;
+        if (pos < 0) offset = -1;
+        else if (pos >= MAX_CELL) offset = node->left_most;
+        else offset = node->cells[pos].offset;
+
+        if (offset < 0 || snapshot_load(db, snapshot, offset, node) < 0) return -2;
+    }
+    return search_leaf_node(node, key, cell);
+}
+
+// values are neither overwritten nor blanked while a snapshot is open, so no latch is needed.
+static int read_value(Snapshot* snapshot, const Cell* cell, Record* record) {
+    int fd = snapshot->data_fd;
+    char* data = malloc(cell->size ? cell->size : 1);
+    if (data == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    if (cell->size && read_lock_wait(fd, cell->offset, SEEK_SET, cell->size) < 0) {
+        free(data);
+        errno = EAGAIN;
+        return -1;
+    }
+    ssize_t ret = io_pread(fd, data, cell->size, cell->offset);
+    if (cell->size) unlock(fd, cell->offset, SEEK_SET, cell->size);
+    if (ret < 0) {
+        free(data);
+        errno = EIO;
+        return -1;
+    }
+    record->size = cell->size;
+    record->data = data;
+    return 0;
+}
+
+int db_snapshot_fetch(DB* db, Snapshot* snapshot, uint64_t key, Record* record) {
+    IndexPage* node = malloc_index_page();
+    if (node == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    Cell cell;
+    int pos = snapshot_search(db, snapshot, node, key, &cell);
+    free_index_page(&node);
+    if (pos < -1) {
+        errno = EIO;
+        return -1;
+    }
+    if (pos < 0 || cell.key != key || cell_expired(&cell)) {
+        errno = ENOENT;
+        return -1;
+    }
+    return read_value(snapshot, &cell, record);
+}
+
+// iterate the keys in order as of snapshot. without a snapshot the cursor takes its own.
+Cursor* db_cursor_open(DB* db, Snapshot* snapshot) {
+    Cursor* cursor = malloc(sizeof(Cursor));
+    if (cursor == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    memset(cursor, 0, sizeof(Cursor));
+    cursor->db = db;
+    cursor->pos = -1;
+
+    cursor->leaf = malloc_index_page();
+    if (cursor->leaf == NULL) {
+        free(cursor);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    if (snapshot == NULL) {
+        if ((snapshot = db_snapshot_begin(db)) == NULL) {
+            free_index_page(&cursor->leaf);
+            free(cursor);
+            return NULL;
+        }
+        cursor->own_snapshot = 1;
+    }
+    cursor->snapshot = snapshot;
+
+    if (snapshot_load(db, snapshot, snapshot->header.left_most_leaf_offset, cursor->leaf) < 0) {
+        db_cursor_close(cursor);
+        errno = EIO;
+        return NULL;
+    }
+    return cursor;
+}
+
+// position the cursor so that the next cell returned is the first with a key >= key.
+int db_cursor_seek(Cursor* cursor, uint64_t key) {
+    int pos = snapshot_search(cursor->db, cursor->snapshot, cursor->leaf, key, NULL);
+    if (pos < -1) {
+        errno = EIO;
+        return -1;
+    }
+    if (pos >= 0 && cursor->leaf->cells[pos].key == key) pos--;
+    cursor->pos = pos;
+    return 0;
+}
+
+// returns 0 with the next cell (and its value if record is not NULL), -2 at the end, -1 on error.
+// expired values are skipped, whether or not they were removed yet.
+static int cursor_next(Cursor* cursor, Cell* cell, Record* record) {
+    IndexPage* leaf = cursor->leaf;
+    do {
+        while (cursor->pos + 1 >= leaf->num_cells) {
+            if (leaf->next_page == -1) return -2;
+            if (snapshot_load(cursor->db, cursor->snapshot, leaf->next_page, leaf) < 0) {
+                errno = EIO;
+                return -1;
+            }
+            cursor->pos = -1;
+        }
+        cursor->pos++;
+    } while (cell_expired(leaf->cells + cursor->pos));
+    memcpy(cell, leaf->cells + cursor->pos, sizeof(Cell));
+    if (record) return read_value(cursor->snapshot, cell, record);
+    return 0;
+}
+
+int db_cursor_next(Cursor* cursor, Cell* cell, Record* record) {
+    stat_begin(scope, cursor->db->stats);
+    int ret = cursor_next(cursor, cell, record);
+    stat_end(STAT_OP_SCAN, scope);
+    return ret;
+}
+
+// the value of a cell returned by this cursor, read as of its snapshot.
+int db_cursor_value(Cursor* cursor, const Cell* cell, Record* record) {
+    return read_value(cursor->snapshot, cell, record);
+}
+
+void db_cursor_close(Cursor* cursor) {
+    if (cursor == NULL) return;
+    if (cursor->own_snapshot) db_snapshot_end(cursor->db, cursor->snapshot);
+    free_index_page(&cursor->leaf);
+    free(cursor);
+}
@@ -0,0 +1,27 @@
+#ifndef MDBM_SNAPSHOT_H
+#define MDBM_SNAPSHOT_H
+
+#include "mdbm.h"
+
+typedef struct Snapshot Snapshot;
+typedef struct Cursor Cursor;
+
+Snapshot* db_snapshot_begin(DB* db);
+int db_snapshot_end(DB* db, Snapshot* snapshot);
+int db_snapshot_fetch(DB* db, Snapshot* snapshot, uint64_t key, Record* record);
+
+Cursor* db_cursor_open(DB* db, Snapshot* snapshot);
+int db_cursor_seek(Cursor* cursor, uint64_t key);
+int db_cursor_next(Cursor* cursor, Cell* cell, Record* record);
+int db_cursor_value(Cursor* cursor, const Cell* cell, Record* record);
+void db_cursor_close(Cursor* cursor);
+
+const Header* snapshot_header(const Snapshot* snapshot);
+int snapshot_idx_fd(const Snapshot* snapshot);
+int snapshot_data_fd(const Snapshot* snapshot);
+void snapshot_patch(DB* db, Snapshot* snapshot, off_t offset, void* buf, size_t size);
+int snapshot_active(DB* db);
+int snapshot_retire(DB* db, int old_idx_fd, int old_data_fd);
+void snapshot_free(DB* db);
+
+#endif //MDBM_SNAPSHOT_H
@@ -0,0 +1,172 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "stats.h"
+
+#define STATS_CACHE 8 // handles a thread can alternate between without touching the mutex.
+
+typedef struct StatsBlock {
+    struct StatsBlock* next;
+    pthread_t thread;
+    _Atomic uint64_t counters[NUM_STATS];
+    Histogram latency[NUM_STAT_OPS]; // written by the owning thread only, read racily by db_stats.
+}StatsBlock;
+
+struct Stats {
+    uint64_t id; // unique per handle, so a cached block of a closed handle is never reused.
+    pthread_mutex_t mutex; // guards blocks.
+    StatsBlock* blocks;
+};
+
+static atomic_uint_fast64_t next_id = 1;
+
+Stats* malloc_stats() {
+    Stats* stats = malloc(sizeof(Stats));
+    if (stats == NULL) return NULL;
+    memset(stats, 0, sizeof(Stats));
+    stats->id = atomic_fetch_add(&next_id, 1);
+    pthread_mutex_init(&stats->mutex, NULL);
+    return stats;
+}
+
+void free_stats(Stats** stats) {
+    if (!(*stats)) return;
+    StatsBlock* block = (*stats)->blocks;
+    while (block) {
+        StatsBlock* next = block->next;
+        free(block);
+        block = next;
+    }
+    pthread_mutex_destroy(&(*stats)->mutex);
+    free(*stats);
+    *stats = NULL;
+}
+
+void stats_collect(Stats* stats, DBStats* out) {
+    memset(out, 0, sizeof(DBStats));
+    for (int i = 0; i < NUM_STAT_OPS; i++) histogram_reset(out->latency + i);
+    if (stats == NULL) return;
+
+    pthread_mutex_lock(&stats->mutex);
+    for (StatsBlock* block = stats->blocks; block; block = block->next) {
+        for (int i = 0; i < NUM_STATS; i++) {
+            out->counters[i] += atomic_load_explicit(block->counters + i, memory_order_relaxed);
+        }
+        for (int i = 0; i < NUM_STAT_OPS; i++) histogram_merge(out->latency + i, block->latency + i);
+    }
+    pthread_mutex_unlock(&stats->mutex);
+}
+
+static const char* counter_names[NUM_STATS] = {
+        "page_reads", "page_writes", "page_splits", "latch_waits", "lock_waits",
+        "data_read", "data_appended", "data_overwritten", "errors",
+};
+
+static const char* op_names[NUM_STAT_OPS] = {"fetch", "store", "delete", "scan"};
+
+int db_stats_print(FILE* out, const DBStats* stats, int format) {
+    if (format == DB_STATS_TEXT) {
+        for (int i = 0; i < NUM_STATS; i++) fprintf(out, "%-18s %llu\n", counter_names[i], (unsigned long long) stats->counters[i]);
+        for (int i = 0; i < NUM_STAT_OPS; i++) {
+            if (stats->latency[i].total) histogram_print(out, op_names[i], stats->latency + i);
+        }
+        return 0;
+    }
+
+    if (format != DB_STATS_JSON) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    fprintf(out, "{\"counters\":{");
+    for (int i = 0; i < NUM_STATS; i++) {
+        fprintf(out, "%s\"%s\":%llu", i ? "," : "", counter_names[i], (unsigned long long) stats->counters[i]);
+    }
+    fprintf(out, "},\"latency\":{");
+    for (int i = 0; i < NUM_STAT_OPS; i++) {
+        const Histogram* hist = stats->latency + i;
+        fprintf(out, "%s\"%s\":{\"count\":%llu,\"mean\":%.1f,\"min\":%llu,\"p50\":%llu,\"p90\":%llu,"
+                     "\"p99\":%llu,\"p999\":%llu,\"max\":%llu}",
+                i ? "," : "", op_names[i], (unsigned long long) hist->total, histogram_mean(hist),
+                (unsigned long long) (hist->total ? hist->min : 0),
+                (unsigned long long) histogram_percentile(hist, 50),
+                (unsigned long long) histogram_percentile(hist, 90),
+                (unsigned long long) histogram_percentile(hist, 99),
+                (unsigned long long) histogram_percentile(hist, 99.9),
+                (unsigned long long) hist->max);
+    }
+    fprintf(out, "}}\n");
+    return 0;
+}
+
+#ifdef MDBM_STATS
+
+typedef struct {
+    uint64_t id;
+    StatsBlock* block;
+}CacheEntry;
+
+static _Thread_local CacheEntry cache[STATS_CACHE];
+static _Thread_local unsigned cache_next;
+static _Thread_local StatsBlock* current;
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+static StatsBlock* find_block(Stats* stats) {
+    pthread_t self = pthread_self();
+    pthread_mutex_lock(&stats->mutex);
+    StatsBlock* block = stats->blocks;
+    while (block && !pthread_equal(block->thread, self)) block = block->next;
+    if (block == NULL && (block = calloc(1, sizeof(StatsBlock)))) {
+        block->thread = self;
+        for (int i = 0; i < NUM_STAT_OPS; i++) histogram_reset(block->latency + i);
+        block->next = stats->blocks;
+        stats->blocks = block;
+    }
+    pthread_mutex_unlock(&stats->mutex);
+    return block;
+}
+
+StatScope stats_enter(Stats* stats) {
+    StatScope scope = {current, 0};
+    if (stats == NULL) return scope;
+    scope.start = now_ns();
+
+    for (int i = 0; i < STATS_CACHE; i++) {
+        if (cache[i].id == stats->id) {
+            current = cache[i].block;
+            return scope;
+        }
+    }
+
+    current = find_block(stats);
+    if (current == NULL) return scope;
+    cache[cache_next].id = stats->id;
+    cache[cache_next].block = current;
+    cache_next = (cache_next + 1) % STATS_CACHE;
+    return scope;
+}
+
+void stats_leave(StatOp op, StatScope* scope) {
+    if (current != NULL && op < NUM_STAT_OPS && scope->start) {
+        histogram_record(current->latency + op, now_ns() - scope->start);
+    }
+    current = scope->prev;
+}
+
+void stats_add(StatCounter counter, uint64_t n) {
+    if (current == NULL) return;
+    // only the owner thread writes, so a relaxed load and store is enough and avoids a locked add.
+    _Atomic uint64_t* value = current->counters + counter;
+    atomic_store_explicit(value, atomic_load_explicit(value, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+#endif
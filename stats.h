@@ -0,0 +1,73 @@
+#ifndef MDBM_STATS_H
+#define MDBM_STATS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "histogram.h"
+
+typedef struct Stats Stats;
+
+typedef enum {
+    STAT_PAGE_READS,
+    STAT_PAGE_WRITES,
+    STAT_PAGE_SPLITS, // includes the new pages started by sequential appends.
+    STAT_LATCH_WAITS, // the handle's rwlock was held by someone else.
+    STAT_LOCK_WAITS, // an fcntl range lock was held by another process.
+    STAT_DATA_READ, // value bytes read from the data file.
+    STAT_DATA_APPENDED, // value bytes appended at the end of the data file.
+    STAT_DATA_OVERWRITTEN, // value bytes written in place over an older value.
+    STAT_ERRORS,
+    NUM_STATS
+}StatCounter;
+
+typedef enum {
+    STAT_OP_FETCH,
+    STAT_OP_STORE,
+    STAT_OP_DELETE,
+    STAT_OP_SCAN, // one db_first_key, db_next_key or db_cursor_next call.
+    NUM_STAT_OPS,
+    STAT_OP_NONE = NUM_STAT_OPS // scope that only counts, without a latency sample.
+}StatOp;
+
+typedef struct db_stats {
+    uint64_t counters[NUM_STATS];
+    Histogram latency[NUM_STAT_OPS]; // nanoseconds per call.
+}DBStats;
+
+#define DB_STATS_TEXT 0
+#define DB_STATS_JSON 1
+
+int db_stats_print(FILE* out, const DBStats* stats, int format);
+
+Stats* malloc_stats();
+void free_stats(Stats** stats);
+void stats_collect(Stats* stats, DBStats* out);
+
+#ifdef MDBM_STATS
+
+typedef struct {
+    void* prev; // block of the enclosing scope, restored on exit so nested calls count correctly.
+    uint64_t start;
+}StatScope;
+
+// every thread counts into its own block of the handle it is working on, so the hot path is
+// a thread-local lookup and a relaxed add. the blocks are summed up when db_stats is called.
+// counting only happens inside a scope, which keeps a closed handle from being written to.
+StatScope stats_enter(Stats* stats);
+void stats_leave(StatOp op, StatScope* scope);
+void stats_add(StatCounter counter, uint64_t n);
+
+#define stat_begin(name, stats) StatScope name = stats_enter(stats)
+#define stat_end(op, name) stats_leave((op), &(name))
+#define stat_add(counter, n) stats_add((counter), (n))
+
+#else
+
+#define stat_begin(name, stats) ((void) 0)
+#define stat_end(op, name) ((void) 0)
+#define stat_add(counter, n) ((void) 0)
+
+#endif
+
+#endif //MDBM_STATS_H
@@ -0,0 +1,110 @@
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+
+#include "test.h"
+#include "backup.h"
+
+#define NAME "backup_test_db"
+#define BACKUP_DIR NAME ".backup"
+#define RESTORED NAME ".restored"
+#define STEPS 20000
+#define EXTRA_KEYS 4096
+
+static atomic_int stop_writer;
+
+// writes keys past the model while a backup runs, so the model keys stay as they were when it began.
+static void* writer_main(void* arg) {
+    char value[MODEL_VALUE];
+    memset(value, 'w', sizeof(value));
+    for (uint64_t i = 0; !atomic_load(&stop_writer) || i < 100; i++) {
+        Record record = {i % MODEL_VALUE, value};
+        CHECK(db_store(arg, MODEL_KEYS + i % EXTRA_KEYS, &record, DB_STORE) == 0);
+    }
+    return NULL;
+}
+
+static void backup_racing(DB* db, int incremental) {
+    pthread_t thread;
+    atomic_store(&stop_writer, 0);
+    CHECK(pthread_create(&thread, NULL, writer_main, db) == 0);
+    CHECK((incremental ? db_backup_incremental(db, BACKUP_DIR) : db_backup(db, BACKUP_DIR)) == 0);
+    atomic_store(&stop_writer, 1);
+    pthread_join(thread, NULL);
+}
+
+static void remove_backup(void) {
+    DIR* dir = opendir(BACKUP_DIR);
+    if (dir == NULL) return;
+    struct dirent* entry;
+    char path[512];
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.') continue;
+        snprintf(path, sizeof(path), BACKUP_DIR "/%s", entry->d_name);
+        unlink(path);
+    }
+    closedir(dir);
+    rmdir(BACKUP_DIR);
+}
+
+// the database restored from the backup and its deltas so far holds the model.
+static void check_restore(const Model* model) {
+    unlink(RESTORED ".idx");
+    unlink(RESTORED ".dat");
+    unlink(RESTORED ".ttl");
+    CHECK(db_restore(BACKUP_DIR, RESTORED) == 0);
+    CHECK(db_restore(BACKUP_DIR, RESTORED) < 0 && errno == EEXIST);
+    DB* db = db_open(RESTORED, O_RDWR);
+    CHECK(db != NULL);
+    model_check_fetch(db, model);
+    db_close(db);
+}
+
+int main(void) {
+    uint64_t seed = 0x2545F4914F6CDD1DULL;
+    Model* model = malloc(sizeof(Model));
+    CHECK(model != NULL);
+    model_init(model);
+    remove_backup();
+
+    DB* db = db_open(NAME, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    CHECK(db != NULL);
+    CHECK(db_backup_incremental(db, BACKUP_DIR) < 0 && errno == ESTALE);
+    for (int i = 0; i < STEPS; i++) model_step(db, model, &seed);
+    backup_racing(db, 0);
+    CHECK(db_backup(db, BACKUP_DIR) < 0 && errno == EEXIST);
+    check_restore(model);
+
+    // each delta holds what changed since the one before.
+    for (int round = 0; round < 3; round++) {
+        for (int i = 0; i < STEPS / 4; i++) model_step(db, model, &seed);
+        backup_racing(db, 1);
+        check_restore(model);
+    }
+    CHECK(db_backup_incremental(db, "elsewhere") < 0 && errno == ESTALE);
+
+    // a reorganize rewrites every page behind the tracking, so the next delta takes them all.
+    CHECK(db_reorganize(db) == 0);
+    for (int i = 0; i < STEPS / 4; i++) model_step(db, model, &seed);
+    backup_racing(db, 1);
+    check_restore(model);
+
+    // through the write buffer.
+    CHECK(db_buffer_start(db, 16 << 10) == 0);
+    for (int i = 0; i < STEPS / 4; i++) model_step(db, model, &seed);
+    CHECK(db_backup_incremental(db, BACKUP_DIR) == 0);
+    check_restore(model);
+    CHECK(db_buffer_stop(db) == 0);
+    db_close(db);
+
+    // the tracking does not outlive the handle.
+    db = db_open(NAME, O_RDWR);
+    CHECK(db != NULL);
+    CHECK(db_backup_incremental(db, BACKUP_DIR) < 0 && errno == ESTALE);
+    db_close(db);
+    remove_backup();
+    free(model);
+    return 0;
+}
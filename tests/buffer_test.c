@@ -0,0 +1,119 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "test.h"
+
+#define NAME "buffer_test_db"
+#define MODEL_FILE NAME ".model"
+#define STEPS 20000
+#define THREADS 4
+#define BUFFER_BYTES (16 << 10)
+
+typedef struct {
+    DB* db;
+    Model* model; // shared, each thread only touches the keys k with k % THREADS == id.
+    int id;
+}Writer;
+
+// stores and deletes of one thread's keys, checked against the model as they go.
+static void* writer_main(void* arg) {
+    Writer* writer = arg;
+    Model* model = writer->model;
+    uint64_t seed = 0x9E3779B97F4A7C15ULL * (uint64_t) (writer->id + 1);
+    for (int i = 0; i < STEPS / THREADS; i++) {
+        uint64_t key = test_rand(&seed) % (MODEL_KEYS / THREADS) * THREADS + (uint64_t) writer->id;
+        if ((test_rand(&seed) >> 32) % 4 == 0) model_delete(writer->db, model, key);
+        else model_store(writer->db, model, key, &seed);
+        Record record = {0, NULL};
+        int ret = db_fetch(writer->db, key, &record);
+        CHECK(model->size[key] < 0 ? ret < 0 && errno == ENOENT : ret == 0 && record.size == (size_t) model->size[key]);
+        if (ret == 0) CHECK(memcmp(record.data, model->value[key], record.size) == 0);
+        free(record.data);
+    }
+    return NULL;
+}
+
+// writes through the buffer in another process that exits without closing, then takes its model.
+static void crash_writer(Model* model, uint64_t* seed, int sync) {
+    pid_t pid = fork();
+    CHECK(pid >= 0);
+    if (pid == 0) {
+        DB* db = db_open(NAME, O_RDWR);
+        CHECK(db != NULL);
+        CHECK(db_buffer_set_sync(db, 1) < 0 && errno == EINVAL);
+        CHECK(db_buffer_start(db, 1 << 20) == 0);
+        CHECK(db_buffer_set_sync(db, sync) == 0);
+        // every write of a synced buffer waits for the disk.
+        int steps = sync ? STEPS / 10 : STEPS;
+        for (int i = 0; i < steps; i++) model_step(db, model, seed);
+        FILE* out = fopen(MODEL_FILE, "w");
+        CHECK(out != NULL && fwrite(model, sizeof(Model), 1, out) == 1);
+        fclose(out);
+        _exit(0);
+    }
+    int status;
+    CHECK(waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    CHECK(access(NAME ".log", F_OK) == 0);
+    FILE* in = fopen(MODEL_FILE, "r");
+    CHECK(in != NULL && fread(model, sizeof(Model), 1, in) == 1);
+    fclose(in);
+    unlink(MODEL_FILE);
+}
+
+int main(void) {
+    uint64_t seed = 0x2545F4914F6CDD1DULL;
+    Model* model = malloc(sizeof(Model));
+    CHECK(model != NULL);
+    model_init(model);
+
+    DB* db = db_open(NAME, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    CHECK(db != NULL);
+    CHECK(db_buffer_start(db, 0) < 0 && errno == EINVAL);
+    CHECK(db_buffer_start(db, BUFFER_BYTES) == 0);
+    CHECK(db_buffer_start(db, BUFFER_BYTES) < 0 && errno == EBUSY);
+    for (int i = 0; i < STEPS; i++) {
+        model_step(db, model, &seed);
+        if (i % 1000 == 0) model_check_fetch(db, model);
+    }
+    model_check_fetch(db, model);
+    CHECK(db_buffer_flush(db) == 0);
+    model_check(db, model);
+
+    // threads writing through the buffer while it flushes.
+    Writer writers[THREADS];
+    pthread_t threads[THREADS];
+    for (int i = 0; i < THREADS; i++) {
+        writers[i] = (Writer) {db, model, i};
+        CHECK(pthread_create(threads + i, NULL, writer_main, writers + i) == 0);
+    }
+    for (int i = 0; i < THREADS; i++) pthread_join(threads[i], NULL);
+    model_check_fetch(db, model);
+    CHECK(db_buffer_stop(db) == 0);
+    model_check(db, model);
+    CHECK(access(NAME ".log", F_OK) < 0 && errno == ENOENT);
+    db_close(db);
+
+    // writes left in the log of a handle that never closed are replayed by the next open.
+    crash_writer(model, &seed, 0);
+    db = db_open(NAME, O_RDWR);
+    CHECK(db != NULL);
+    model_check(db, model);
+    db_close(db);
+    crash_writer(model, &seed, 1);
+    db = db_open(NAME, O_RDWR);
+    CHECK(db != NULL);
+    model_check(db, model);
+    db_close(db);
+
+    // truncating the database discards the log too.
+    crash_writer(model, &seed, 0);
+    db = db_open(NAME, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    CHECK(db != NULL);
+    model_init(model);
+    model_check(db, model);
+    db_close(db);
+    free(model);
+    return 0;
+}
@@ -0,0 +1,142 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "test.h"
+#include "cache.h"
+
+#define NAME "cache_test_db"
+#define MODEL_FILE NAME ".model"
+#define STEPS 20000
+#define READERS 4
+#define CACHE_BYTES (1 << 20)
+
+static DB* open_shared(void) {
+    DB* db = db_open(NAME, O_RDWR);
+    CHECK(db != NULL);
+    CHECK(db_share_cache(db, CACHE_BYTES) == 0);
+    return db;
+}
+
+static void wait_child(pid_t pid) {
+    int status;
+    CHECK(waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+// data blocks are only cached for views, small values are pinned in place.
+static void check_views(DB* db, const Model* model) {
+    for (uint64_t key = 0; key < MODEL_KEYS; key++) {
+        DBView view;
+        int ret = db_fetch_view(db, key, &view);
+        if (model->size[key] < 0) {
+            CHECK(ret < 0 && errno == ENOENT);
+            continue;
+        }
+        CHECK(ret == 0 && view.size == (size_t) model->size[key]);
+        CHECK(memcmp(view.data, model->value[key], view.size) == 0);
+        db_view_release(&view);
+    }
+}
+
+// processes reading at the same time fill the shared cache and find the model in it.
+static void check_readers(const Model* model) {
+    pid_t pids[READERS];
+    for (int i = 0; i < READERS; i++) {
+        CHECK((pids[i] = fork()) >= 0);
+        if (pids[i] > 0) continue;
+        DB* db = open_shared();
+        model_check(db, model);
+        check_views(db, model);
+        db_close(db);
+        _exit(0);
+    }
+    for (int i = 0; i < READERS; i++) wait_child(pids[i]);
+}
+
+typedef struct {
+    DB* db;
+    const Model* model;
+}Reader;
+
+static void* reader_main(void* arg) {
+    Reader* reader = arg;
+    for (int i = 0; i < 4; i++) {
+        check_views(reader->db, reader->model);
+        model_check_fetch(reader->db, reader->model);
+    }
+    return NULL;
+}
+
+// threads of one handle pinning and filling blocks of a private cache, over all of its stripes
+// at once.
+static void check_threads(const Model* model) {
+    DB* db = db_open(NAME, O_RDWR);
+    CHECK(db != NULL);
+    CHECK(db_set_cache(db, CACHE_BYTES) == 0);
+    Reader reader = {db, model};
+    pthread_t threads[READERS];
+    for (int i = 0; i < READERS; i++) CHECK(pthread_create(threads + i, NULL, reader_main, &reader) == 0);
+    for (int i = 0; i < READERS; i++) pthread_join(threads[i], NULL);
+    db_close(db);
+}
+
+int main(void) {
+    uint64_t seed = 0x2545F4914F6CDD1DULL;
+    Model* model = malloc(sizeof(Model));
+    CHECK(model != NULL);
+    model_init(model);
+    DB* db = db_open(NAME, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    CHECK(db != NULL);
+    db_close(db);
+
+    // keeps the segment mapped, so the blocks cached by one process are still there for the next.
+    PageCache* holder = cache_open_shared(NAME ".idx", CACHE_BYTES);
+    CHECK(holder != NULL);
+    db = open_shared();
+    // a run that died left its segment behind with the blocks of the files truncated above.
+    cache_purge(db->cache, db->idx_fd);
+    cache_purge(db->cache, db->data_fd);
+    for (int i = 0; i < STEPS; i++) model_step(db, model, &seed);
+    model_check(db, model);
+    db_close(db);
+    check_readers(model);
+
+    // stores overwrite the blocks the readers cached.
+    db = open_shared();
+    for (int i = 0; i < STEPS; i++) model_step(db, model, &seed);
+    db_close(db);
+    check_readers(model);
+
+    // and the ones written by another process are seen here.
+    db = open_shared();
+    model_check(db, model);
+    check_views(db, model);
+    db_close(db);
+    pid_t pid = fork();
+    CHECK(pid >= 0);
+    if (pid == 0) {
+        db = open_shared();
+        for (int i = 0; i < STEPS; i++) model_step(db, model, &seed);
+        db_close(db);
+        FILE* out = fopen(MODEL_FILE, "w");
+        CHECK(out != NULL && fwrite(model, sizeof(Model), 1, out) == 1);
+        fclose(out);
+        _exit(0);
+    }
+    wait_child(pid);
+    FILE* in = fopen(MODEL_FILE, "r");
+    CHECK(in != NULL && fread(model, sizeof(Model), 1, in) == 1);
+    fclose(in);
+    db = open_shared();
+    model_check(db, model);
+    check_views(db, model);
+    db_close(db);
+    check_readers(model);
+    check_threads(model);
+
+    CHECK(cache_close(&holder) == 0);
+    unlink(MODEL_FILE);
+    free(model);
+    return 0;
+}
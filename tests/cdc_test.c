@@ -0,0 +1,121 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "test.h"
+#include "cdc.h"
+
+#define NAME "cdc_test_db"
+#define REPLICA NAME ".replica"
+#define STEPS 20000
+#define BATCH 64
+
+static atomic_int stop_tailer;
+
+typedef struct {
+    CdcTailer* tailer;
+    DB* replica;
+}Tail;
+
+// apply what is there in small batches until it has caught up.
+static void catch_up(CdcTailer* tailer, DB* replica) {
+    ssize_t n;
+    while ((n = db_cdc_apply(tailer, replica, BATCH)) > 0) continue;
+    CHECK(n == 0);
+}
+
+// follows the feed while the main thread writes.
+static void* tailer_main(void* arg) {
+    Tail* tail = arg;
+    while (!atomic_load(&stop_tailer)) CHECK(db_cdc_apply(tail->tailer, tail->replica, BATCH) >= 0);
+    return NULL;
+}
+
+// the changes from seq on are numbered one after the other up to the last one appended.
+static void check_sequence(DB* db, uint64_t seq) {
+    CdcTailer* tailer = db_cdc_tail(NAME, seq);
+    CHECK(tailer != NULL);
+    Change changes[BATCH];
+    ssize_t n;
+    while ((n = db_cdc_read(tailer, changes, BATCH)) > 0) {
+        for (ssize_t i = 0; i < n; i++) {
+            CHECK(changes[i].seq == seq++);
+            CHECK(changes[i].op == CDC_PUT || changes[i].op == CDC_DELETE);
+            CHECK(changes[i].key < MODEL_KEYS);
+        }
+    }
+    CHECK(n == 0);
+    uint64_t last;
+    CHECK(db_cdc_seq(db, &last) == 0 && last == seq - 1);
+    CHECK(db_cdc_position(tailer) == seq);
+    db_cdc_close(tailer);
+}
+
+int main(void) {
+    uint64_t seed = 0x2545F4914F6CDD1DULL;
+    Model* model = malloc(sizeof(Model));
+    CHECK(model != NULL);
+    model_init(model);
+
+    DB* db = db_open(NAME, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    DB* replica = db_open(REPLICA, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    CHECK(db != NULL && replica != NULL);
+    uint64_t seq;
+    CHECK(db_cdc_seq(db, &seq) < 0 && errno == ENOENT);
+    CHECK(db_cdc_start(db) == 0);
+    CHECK(db_cdc_seq(db, &seq) == 0 && seq == 0);
+    for (int i = 0; i < STEPS; i++) model_step(db, model, &seed);
+    check_sequence(db, 1);
+
+    // a replica that follows the feed while the writes go on ends up with the same values.
+    Tail tail = {db_cdc_tail(NAME, 1), replica};
+    CHECK(tail.tailer != NULL);
+    pthread_t thread;
+    CHECK(pthread_create(&thread, NULL, tailer_main, &tail) == 0);
+    for (int i = 0; i < STEPS; i++) model_step(db, model, &seed);
+    atomic_store(&stop_tailer, 1);
+    pthread_join(thread, NULL);
+    catch_up(tail.tailer, replica);
+    model_check(replica, model);
+
+    // buffered writes are in the feed as soon as they are made.
+    CHECK(db_buffer_start(db, 16 << 10) == 0);
+    for (int i = 0; i < STEPS; i++) model_step(db, model, &seed);
+    catch_up(tail.tailer, replica);
+    model_check(replica, model);
+    CHECK(db_buffer_stop(db) == 0);
+
+    // a value with a ttl keeps its expiry on the replica.
+    char value[8] = "expiring";
+    Record record = {sizeof(value), value};
+    CHECK(db_store_ttl(db, 0, &record, DB_STORE, 3600) == 0);
+    model->size[0] = sizeof(value);
+    memcpy(model->value[0], value, sizeof(value));
+    catch_up(tail.tailer, replica);
+    uint64_t expire_at, replica_expire_at;
+    CHECK(db_expiry(db, 0, &expire_at) == 0 && db_expiry(replica, 0, &replica_expire_at) == 0);
+    CHECK(replica_expire_at >= expire_at - 1 && replica_expire_at <= expire_at + 1);
+
+    // the feed goes on after a reopen, and a replica resuming from an earlier position only
+    // applies some changes again.
+    uint64_t position = db_cdc_position(tail.tailer);
+    db_cdc_close(tail.tailer);
+    db_close(db);
+    db = db_open(NAME, O_RDWR);
+    CHECK(db != NULL);
+    for (int i = 0; i < STEPS; i++) model_step(db, model, &seed);
+    check_sequence(db, position / 2);
+    tail.tailer = db_cdc_tail(NAME, position / 2);
+    CHECK(tail.tailer != NULL);
+    catch_up(tail.tailer, replica);
+    model_check(replica, model);
+    db_cdc_close(tail.tailer);
+    model_check(db, model);
+
+    CHECK(db_cdc_stop(db) == 0);
+    CHECK(db_cdc_tail(NAME, 1) == NULL && errno == ENOENT);
+    db_close(db);
+    db_close(replica);
+    free(model);
+    return 0;
+}
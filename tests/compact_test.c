@@ -0,0 +1,134 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+
+#include "test.h"
+#include "compact.h"
+
+#define NAME "compact_test_db"
+#define STEPS 20000
+#define MAX_STEPS 10000
+#define FILLERS 4000
+#define FILLER_SIZE 1000
+
+// large values under keys past the model, stored between writes of the model and then deleted,
+// so that most of every region of the data file is dead and the rest holds values of the model.
+static void fill(DB* db, Model* model, uint64_t* seed) {
+    static char filler[FILLER_SIZE];
+    Record record = {FILLER_SIZE, filler};
+    for (uint64_t i = 0; i < FILLERS; i++) {
+        CHECK(db_store(db, MODEL_KEYS + i, &record, DB_STORE) == 0);
+        model_step(db, model, seed);
+    }
+    for (uint64_t i = 0; i < FILLERS; i++) CHECK(db_delete(db, MODEL_KEYS + i) == 0);
+}
+
+// compact until nothing is left worth moving, with a few writes between the steps. returns the
+// number of steps that did some work.
+static int compact_all(DB* db, Model* model, uint64_t* seed) {
+    int worked = 0;
+    for (int i = 0; i < MAX_STEPS; i++) {
+        ssize_t moved = db_compact_step(db, 16 << 10);
+        CHECK(moved >= 0);
+        if (moved == 0) return worked;
+        worked++;
+        for (int j = 0; j < 4; j++) model_step(db, model, seed);
+    }
+    CHECK(0);
+    return worked;
+}
+
+static atomic_int reorganized;
+static int reorganize_ret;
+
+static void* reorganize_main(void* arg) {
+    reorganize_ret = db_reorganize(arg);
+    atomic_store(&reorganized, 1);
+    return NULL;
+}
+
+int main(void) {
+    uint64_t seed = 0x2545F4914F6CDD1DULL;
+    Model* model = malloc(sizeof(Model));
+    Model* seen = malloc(sizeof(Model));
+    CHECK(model && seen);
+    model_init(model);
+
+    DB* db = db_open(NAME, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    CHECK(db != NULL);
+    for (int i = 0; i < STEPS; i++) model_step(db, model, &seed);
+    fill(db, model, &seed);
+    CHECK(db->header->data_end > 2 * COMPACT_REGION_SIZE);
+    CHECK(compact_all(db, model, &seed) > 0);
+    model_check(db, model);
+
+    // nothing moves while a snapshot may still read the old copies.
+    fill(db, model, &seed);
+    Snapshot* snapshot = db_snapshot_begin(db);
+    CHECK(snapshot != NULL);
+    memcpy(seen, model, sizeof(Model));
+    CHECK(db_compact_step(db, 16 << 10) == 0);
+    for (int i = 0; i < STEPS / 10; i++) model_step(db, model, &seed);
+    Cursor* cursor = db_cursor_open(db, snapshot);
+    CHECK(cursor != NULL);
+    model_check_cursor(cursor, seen);
+    db_cursor_close(cursor);
+    CHECK(db_snapshot_end(db, snapshot) == 0);
+    CHECK(compact_all(db, model, &seed) > 0);
+    model_check(db, model);
+
+    // the background thread, racing the writers.
+    CHECK(db_compact_start(db, 0) == 0);
+    CHECK(db_compact_start(db, 0) < 0 && errno == EBUSY);
+    for (int i = 0; i < 4; i++) fill(db, model, &seed);
+    CHECK(db_compact_stop(db) == 0);
+    model_check(db, model);
+
+    // steps racing a reorganize leave the values it copies where they are.
+    fill(db, model, &seed);
+    pthread_t thread;
+    CHECK(pthread_create(&thread, NULL, reorganize_main, db) == 0);
+    for (int i = 0; !atomic_load(&reorganized) || i < 2000; i++) {
+        CHECK(db_compact_step(db, 4 << 10) >= 0);
+        model_step(db, model, &seed);
+    }
+    pthread_join(thread, NULL);
+    CHECK(reorganize_ret == 0);
+    model_check(db, model);
+
+    db_close(db);
+
+    // a range another handle claimed is not punched before the claim is given back, even though
+    // nothing indexed points into it.
+    int fd = open(NAME ".dat", O_RDWR);
+    CHECK(fd >= 0);
+    Header header;
+    memset(&header, 0, sizeof(Header));
+    off_t claim = alloc_data(fd, &header, 2 * COMPACT_REGION_SIZE);
+    CHECK(claim >= 0);
+    char marker[4096];
+    memset(marker, 'C', sizeof(marker));
+    CHECK(pwrite(fd, marker, sizeof(marker), claim) == sizeof(marker));
+
+    db = db_open(NAME, O_RDWR);
+    CHECK(db != NULL);
+    model_check(db, model);
+    fill(db, model, &seed);
+    fill(db, model, &seed);
+    CHECK(db->header->data_end > claim + 2 * COMPACT_REGION_SIZE);
+    CHECK(compact_all(db, model, &seed) > 0);
+    model_check(db, model);
+    char buf[4096];
+    CHECK(pread(db->data_fd, buf, sizeof(buf), claim) == sizeof(buf));
+    CHECK(memcmp(buf, marker, sizeof(buf)) == 0);
+    close(fd);
+    CHECK(compact_all(db, model, &seed) > 0);
+    CHECK(pread(db->data_fd, buf, sizeof(buf), claim) == sizeof(buf));
+    for (size_t i = 0; i < sizeof(buf); i++) CHECK(buf[i] == 0);
+    model_check(db, model);
+    db_close(db);
+    free(model);
+    free(seen);
+    return 0;
+}
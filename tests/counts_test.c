@@ -0,0 +1,99 @@
+#include <fcntl.h>
+
+#include "test.h"
+
+#define NAME "counts_test_db"
+#define STEPS 20000
+#define FILLERS 50000 // keys past the model, enough for a tree a few levels high.
+
+// ranks, selects and counts of the model keys, with the fillers above them.
+static void check_counts(DB* db, const Model* model, size_t fillers) {
+    size_t present = 0;
+    for (uint64_t key = 0; key < MODEL_KEYS; key++) {
+        size_t rank;
+        CHECK(db_rank(db, key, &rank) == 0 && rank == present);
+        if (model->size[key] < 0) continue;
+        Cell cell;
+        CHECK(db_select(db, present, &cell) == 0 && cell.key == key);
+        present++;
+    }
+    size_t count;
+    CHECK(db_count_keys(db, &count) == 0 && count == present + fillers);
+    CHECK(db_count_range(db, 0, MODEL_KEYS, &count) == 0 && count == present);
+    CHECK(db_count_range(db, MODEL_KEYS, UINT64_MAX, &count) == 0 && count == fillers);
+    CHECK(db_count_range(db, MODEL_KEYS, 0, &count) == 0 && count == 0);
+    Cell cell;
+    CHECK(db_select(db, present + fillers, &cell) < 0 && errno == ERANGE);
+    if (fillers) {
+        CHECK(db_select(db, present + fillers - 1, &cell) == 0 && cell.key == MODEL_KEYS + fillers - 1);
+        size_t rank;
+        CHECK(db_rank(db, MODEL_KEYS + fillers / 2, &rank) == 0 && rank == present + fillers / 2);
+    }
+
+    // samples only return keys that are there and reach most of them.
+    uint64_t seed = 42;
+    size_t hits = 0;
+    for (int i = 0; i < 2000; i++) {
+        if (present + fillers == 0) {
+            CHECK(db_sample(db, &seed, &cell) < 0 && errno == ENOENT);
+            return;
+        }
+        CHECK(db_sample(db, &seed, &cell) == 0);
+        CHECK(cell.key >= MODEL_KEYS ? cell.key < MODEL_KEYS + fillers : model->size[cell.key] >= 0);
+        hits += cell.key < MODEL_KEYS;
+    }
+    // the model keys are a share present / (present + fillers) of the samples, give or take.
+    double share = (double) present / (double) (present + fillers);
+    CHECK(hits >= (size_t) (2000 * share * 0.7) && hits <= (size_t) (2000 * share * 1.3) + 10);
+}
+
+static void fill(DB* db, size_t fillers) {
+    Record record = {0, ""};
+    for (size_t i = 0; i < fillers; i++) CHECK(db_store(db, MODEL_KEYS + i, &record, DB_STORE) == 0);
+}
+
+int main(void) {
+    uint64_t seed = 0x2545F4914F6CDD1DULL;
+    Model* model = malloc(sizeof(Model));
+    CHECK(model != NULL);
+    model_init(model);
+
+    DB* db = db_open(NAME, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    CHECK(db != NULL);
+    size_t count;
+    CHECK(db_count_keys(db, &count) < 0 && errno == ENOTSUP);
+    for (int i = 0; i < STEPS; i++) model_step(db, model, &seed);
+    CHECK(db_enable_counts(db) == 0);
+    CHECK(db_enable_counts(db) == 0);
+    check_counts(db, model, 0);
+
+    // the counts follow splits as the tree grows, and merges as it shrinks.
+    fill(db, FILLERS);
+    for (int i = 0; i < STEPS; i++) model_step(db, model, &seed);
+    check_counts(db, model, FILLERS);
+    for (size_t i = FILLERS / 2; i < FILLERS; i++) CHECK(db_delete(db, MODEL_KEYS + i) == 0);
+    check_counts(db, model, FILLERS / 2);
+
+    // through the write buffer, and after a reorganize.
+    CHECK(db_buffer_start(db, 16 << 10) == 0);
+    for (int i = 0; i < STEPS; i++) model_step(db, model, &seed);
+    check_counts(db, model, FILLERS / 2);
+    CHECK(db_buffer_stop(db) == 0);
+    CHECK(db_reorganize_parallel(db, 4) == 0);
+    check_counts(db, model, FILLERS / 2);
+    for (size_t i = 0; i < FILLERS / 2; i++) CHECK(db_delete(db, MODEL_KEYS + i) == 0);
+    for (uint64_t key = 0; key < MODEL_KEYS; key++) {
+        if (model->size[key] >= 0) model_delete(db, model, key);
+    }
+    check_counts(db, model, 0);
+    for (int i = 0; i < STEPS; i++) model_step(db, model, &seed);
+    db_close(db);
+
+    db = db_open(NAME, O_RDWR);
+    CHECK(db != NULL);
+    check_counts(db, model, 0);
+    model_check(db, model);
+    db_close(db);
+    free(model);
+    return 0;
+}
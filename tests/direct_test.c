@@ -0,0 +1,47 @@
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+
+#include "test.h"
+
+#define NAME "direct_test_db"
+#define STEPS 20000
+
+int main(void) {
+    uint64_t seed = 0x2545F4914F6CDD1DULL;
+    Model* model = malloc(sizeof(Model));
+    CHECK(model != NULL);
+    model_init(model);
+
+    DB* db = db_open(NAME, O_RDWR | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+    CHECK(db != NULL && db->direct);
+    for (int i = 0; i < STEPS; i++) model_step(db, model, &seed);
+    model_check(db, model);
+
+    // the rebuilt files are opened the same way.
+    CHECK(db_reorganize(db) == 0);
+    CHECK(db->direct);
+    for (int i = 0; i < STEPS; i++) model_step(db, model, &seed);
+    model_check(db, model);
+
+    // through the write buffer.
+    CHECK(db_buffer_start(db, 16 << 10) == 0);
+    for (int i = 0; i < STEPS; i++) model_step(db, model, &seed);
+    model_check(db, model);
+    CHECK(db_buffer_stop(db) == 0);
+    model_check(db, model);
+    db_close(db);
+
+    // the files written with O_DIRECT read the same through the page cache, and back.
+    db = db_open(NAME, O_RDWR);
+    CHECK(db != NULL && !db->direct);
+    model_check(db, model);
+    for (int i = 0; i < STEPS; i++) model_step(db, model, &seed);
+    db_close(db);
+    db = db_open(NAME, O_RDWR | O_DIRECT);
+    CHECK(db != NULL && db->direct);
+    model_check(db, model);
+    db_close(db);
+    free(model);
+    return 0;
+}
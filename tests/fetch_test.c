@@ -0,0 +1,88 @@
+#include <fcntl.h>
+#include <pthread.h>
+
+#include "test.h"
+#include "slab.h"
+
+#define NAME "fetch_test_db"
+#define STEPS 20000
+#define THREADS 4
+#define ALLOCS 20000
+
+// every key reads back into a caller buffer, and a buffer one byte short reports the size it needs.
+static void check_into(DB* db, const Model* model) {
+    char buf[MODEL_VALUE];
+    for (uint64_t key = 0; key < MODEL_KEYS; key++) {
+        size_t size = MODEL_VALUE + 1;
+        int ret = db_fetch_into(db, key, buf, sizeof(buf), &size);
+        if (model->size[key] < 0) {
+            CHECK(ret < 0 && errno == ENOENT);
+            continue;
+        }
+        CHECK(ret == 0 && size == (size_t) model->size[key]);
+        CHECK(memcmp(buf, model->value[key], size) == 0);
+        if (size == 0) continue;
+        size = 0;
+        CHECK(db_fetch_into(db, key, buf, (size_t) model->size[key] - 1, &size) < 0 && errno == ENOBUFS);
+        CHECK(size == (size_t) model->size[key]);
+    }
+}
+
+// objects allocated by one thread and freed by another go back through the magazines and the
+// depot without ever being handed out twice.
+static void* slab_main(void* arg) {
+    void** objects = arg;
+    for (int i = 0; i < ALLOCS; i++) {
+        SlabClass cls = (SlabClass) (i % NUM_SLABS);
+        if (objects[i]) slab_free(cls, objects[i]);
+        CHECK((objects[i] = slab_alloc(cls)) != NULL);
+        *(int*) objects[i] = i;
+    }
+    for (int i = 0; i < ALLOCS; i++) CHECK(*(int*) objects[i] == i);
+    return NULL;
+}
+
+static void check_slab(void) {
+    void** objects = calloc(THREADS * ALLOCS, sizeof(void*));
+    CHECK(objects != NULL);
+    void** last = malloc(ALLOCS * sizeof(void*));
+    CHECK(last != NULL);
+    for (int round = 0; round < 3; round++) {
+        // each round a thread frees the objects the one before it allocated in the round before.
+        memcpy(last, objects + (THREADS - 1) * ALLOCS, ALLOCS * sizeof(void*));
+        memmove(objects + ALLOCS, objects, (THREADS - 1) * ALLOCS * sizeof(void*));
+        memcpy(objects, last, ALLOCS * sizeof(void*));
+        pthread_t threads[THREADS];
+        for (int i = 0; i < THREADS; i++) CHECK(pthread_create(threads + i, NULL, slab_main, objects + i * ALLOCS) == 0);
+        for (int i = 0; i < THREADS; i++) pthread_join(threads[i], NULL);
+    }
+    for (int i = 0; i < THREADS * ALLOCS; i++) slab_free((SlabClass) (i % ALLOCS % NUM_SLABS), objects[i]);
+    free(last);
+    free(objects);
+}
+
+int main(void) {
+    uint64_t seed = 0x2545F4914F6CDD1DULL;
+    Model* model = malloc(sizeof(Model));
+    CHECK(model != NULL);
+    model_init(model);
+
+    DB* db = db_open(NAME, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    CHECK(db != NULL);
+    CHECK(db_fetch_into(db, 0, NULL, 0, NULL) < 0 && errno == EINVAL);
+    for (int i = 0; i < STEPS; i++) model_step(db, model, &seed);
+    check_into(db, model);
+
+    // through the write buffer.
+    CHECK(db_buffer_start(db, 16 << 10) == 0);
+    for (int i = 0; i < STEPS; i++) model_step(db, model, &seed);
+    check_into(db, model);
+    CHECK(db_buffer_stop(db) == 0);
+    check_into(db, model);
+    model_check(db, model);
+    db_close(db);
+    free(model);
+
+    check_slab();
+    return 0;
+}
@@ -0,0 +1,107 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "test.h"
+
+#define NAME "growth_test_db"
+#define WRITERS 4
+#define ALLOCS 2000
+
+typedef struct {
+    off_t offset;
+    uint32_t size;
+    uint32_t writer;
+}Range;
+
+// every writer process allocates ranges in both files of the same database and fills them with
+// its own id. no two ranges may overlap.
+static void writer(int id) {
+    DB* db = db_open(NAME, O_RDWR);
+    CHECK(db != NULL);
+    CHECK(db_set_growth(db, 64 << 10, 64 << 10) == 0);
+    uint64_t seed = 0x9E3779B97F4A7C15ULL * (uint64_t) (id + 1);
+    char buf[4096];
+    memset(buf, 'A' + id, sizeof(buf));
+    char path[64];
+    snprintf(path, sizeof(path), NAME ".ranges.%d", id);
+    FILE* out = fopen(path, "w");
+    CHECK(out != NULL);
+    for (int i = 0; i < ALLOCS; i++) {
+        Range range = {0, 0, (uint32_t) id};
+        if (i % 4 == 0) {
+            CHECK((range.offset = alloc_page(db->idx_fd, db->header)) > 0);
+            CHECK(range.offset % sizeof(IndexPage) == 0);
+            range.size = sizeof(IndexPage);
+            CHECK(pwrite(db->idx_fd, buf, range.size, range.offset) == range.size);
+            range.offset = -range.offset;
+        } else {
+            size_t size = 1 + test_rand(&seed) % 3000;
+            CHECK((range.offset = alloc_data(db->data_fd, db->header, size)) >= 0);
+            range.size = (uint32_t) size;
+            CHECK(pwrite(db->data_fd, buf, range.size, range.offset) == range.size);
+        }
+        CHECK(fwrite(&range, sizeof(Range), 1, out) == 1);
+    }
+    fclose(out);
+    _exit(0);
+}
+
+static void check_ranges(int fd, int idx) {
+    char buf[4096];
+    for (int id = 0; id < WRITERS; id++) {
+        char path[64];
+        snprintf(path, sizeof(path), NAME ".ranges.%d", id);
+        FILE* in = fopen(path, "r");
+        CHECK(in != NULL);
+        Range range;
+        while (fread(&range, sizeof(Range), 1, in) == 1) {
+            if ((range.offset < 0) != idx) continue;
+            off_t offset = range.offset < 0 ? -range.offset : range.offset;
+            CHECK(pread(fd, buf, range.size, offset) == range.size);
+            for (uint32_t i = 0; i < range.size; i++) CHECK(buf[i] == 'A' + id);
+        }
+        fclose(in);
+    }
+}
+
+int main() {
+    DB* db = db_open(NAME, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    CHECK(db != NULL);
+    db_close(db);
+
+    pid_t pids[WRITERS];
+    for (int i = 0; i < WRITERS; i++) {
+        CHECK((pids[i] = fork()) >= 0);
+        if (pids[i] == 0) writer(i);
+    }
+    for (int i = 0; i < WRITERS; i++) {
+        int status;
+        CHECK(waitpid(pids[i], &status, 0) == pids[i] && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    }
+
+    int idx_fd = open(NAME ".idx", O_RDONLY);
+    int data_fd = open(NAME ".dat", O_RDONLY);
+    CHECK(idx_fd >= 0 && data_fd >= 0);
+    check_ranges(idx_fd, 1);
+    check_ranges(data_fd, 0);
+    close(idx_fd);
+    close(data_fd);
+
+    // the files still make a database after the writers grew them.
+    uint64_t seed = 2463534242ULL;
+    Model* model = malloc(sizeof(Model));
+    CHECK(model != NULL);
+    model_init(model);
+    db = db_open(NAME, O_RDWR);
+    CHECK(db != NULL);
+    for (int i = 0; i < 10000; i++) model_step(db, model, &seed);
+    model_check(db, model);
+    db_close(db);
+    db = db_open(NAME, O_RDWR);
+    CHECK(db != NULL);
+    model_check(db, model);
+    db_close(db);
+    free(model);
+    return 0;
+}
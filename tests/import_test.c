@@ -0,0 +1,91 @@
+#include <fcntl.h>
+
+#include "test.h"
+#include "import.h"
+#include "index.h"
+
+#define NAME "import_test_db"
+#define ADDS 60000
+#define STEPS 20000
+
+// add random keys of the model in random order, most of them several times. with the smallest
+// budget the input is spilled into several runs, and the last value added for a key wins.
+static void add_all(Importer* importer, Model* model, uint64_t* seed) {
+    for (int i = 0; i < ADDS; i++) {
+        uint64_t key = test_rand(seed) % MODEL_KEYS;
+        char value[MODEL_VALUE];
+        int size = (int) (test_rand(seed) % MODEL_VALUE);
+        for (int j = 0; j < size; j++) value[j] = (char) ('a' + test_rand(seed) % 26);
+        CHECK(db_import_add(importer, key, value, (size_t) size) == 0);
+        model->size[key] = size;
+        memcpy(model->value[key], value, (size_t) size);
+    }
+}
+
+static int extract_size(uint64_t key, const Record* value, uint64_t* attr, void* arg) {
+    (void) key;
+    (void) arg;
+    *attr = value->size;
+    return 1;
+}
+
+static void import_into(Model* model, uint64_t* seed, int threads) {
+    model_init(model);
+    DB* db = db_open(NAME, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    CHECK(db != NULL);
+    Importer* importer = db_import_begin(db, IMPORT_MIN_MEMORY);
+    CHECK(importer != NULL);
+    add_all(importer, model, seed);
+    CHECK(db_import_finish(&importer, threads) == 0 && importer == NULL);
+    model_check(db, model);
+
+    // only an empty database takes an import.
+    CHECK(db_import_begin(db, IMPORT_MIN_MEMORY) == NULL && errno == ENOTEMPTY);
+    for (int i = 0; i < STEPS; i++) model_step(db, model, seed);
+    model_check(db, model);
+    db_close(db);
+
+    db = db_open(NAME, O_RDWR);
+    CHECK(db != NULL);
+    model_check(db, model);
+    db_close(db);
+}
+
+int main(void) {
+    uint64_t seed = 0x2545F4914F6CDD1DULL;
+    Model* model = malloc(sizeof(Model));
+    CHECK(model != NULL);
+
+    import_into(model, &seed, 1);
+    import_into(model, &seed, 4);
+
+    // an aborted import leaves the database empty for the next one.
+    model_init(model);
+    DB* db = db_open(NAME, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    CHECK(db != NULL);
+    Importer* importer = db_import_begin(db, IMPORT_MIN_MEMORY);
+    CHECK(importer != NULL);
+    add_all(importer, model, &seed);
+    db_import_abort(&importer);
+    model_init(model);
+    model_check(db, model);
+
+    // the import bypasses the secondary indexes, so it is refused while one is open, also when
+    // the index was opened after the import began.
+    CHECK((importer = db_import_begin(db, IMPORT_MIN_MEMORY)) != NULL);
+    add_all(importer, model, &seed);
+    CHECK(db_index_open(db, "size", extract_size, NULL) == 0);
+    CHECK(db_import_finish(&importer, 2) < 0 && errno == EBUSY && importer == NULL);
+    CHECK(db_import_begin(db, IMPORT_MIN_MEMORY) == NULL && errno == EBUSY);
+    CHECK(db_index_drop(db, "size") == 0);
+    model_init(model);
+    model_check(db, model);
+
+    CHECK((importer = db_import_begin(db, IMPORT_MIN_MEMORY)) != NULL);
+    add_all(importer, model, &seed);
+    CHECK(db_import_finish(&importer, 2) == 0);
+    model_check(db, model);
+    db_close(db);
+    free(model);
+    return 0;
+}
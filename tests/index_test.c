@@ -0,0 +1,126 @@
+#include <fcntl.h>
+
+#include "test.h"
+#include "index.h"
+
+#define NAME "index_test_db"
+#define INDEX "first"
+#define STEPS 20000
+#define ATTRS 26
+#define SCANS 200
+
+// the first letter of a value, so that about MODEL_KEYS / ATTRS keys share each attribute. an
+// empty value has none.
+static int extract(uint64_t key, const Record* value, uint64_t* attr, void* arg) {
+    (void) key;
+    (void) arg;
+    if (value->size == 0) return 0;
+    *attr = (uint64_t) (value->data[0] - 'a');
+    return 1;
+}
+
+static int has_attr(const Model* model, uint64_t key, uint64_t* attr) {
+    if (model->size[key] <= 0) return 0;
+    *attr = (uint64_t) (model->value[key][0] - 'a');
+    return 1;
+}
+
+typedef struct {
+    const Model* model;
+    uint64_t attr; // the posting the scan should visit next.
+    uint64_t key;
+    uint64_t hi;
+    int stop_after; // stop with 7 after this many postings, -1 for never.
+}ScanCheck;
+
+// move the check to the next posting of the model, returns 0 past the last attribute below hi.
+static int next_posting(ScanCheck* check) {
+    for (; check->attr < check->hi && check->attr < ATTRS; check->attr++, check->key = 0) {
+        for (; check->key < MODEL_KEYS; check->key++) {
+            uint64_t attr;
+            if (has_attr(check->model, check->key, &attr) && attr == check->attr) return 1;
+        }
+    }
+    return 0;
+}
+
+static int visit(uint64_t attr, uint64_t key, void* arg) {
+    ScanCheck* check = arg;
+    CHECK(next_posting(check));
+    CHECK(attr == check->attr && key == check->key);
+    check->key++;
+    if (check->stop_after > 0 && --check->stop_after == 0) return 7;
+    return 0;
+}
+
+static void check_scan(DB* db, const Model* model, uint64_t lo, uint64_t hi, int stop_after) {
+    ScanCheck check = {model, lo, 0, hi, stop_after};
+    int ret = db_index_scan(db, INDEX, lo, hi, visit, &check);
+    if (stop_after > 0 && check.stop_after == 0) {
+        CHECK(ret == 7);
+        return;
+    }
+    CHECK(ret == 0);
+    CHECK(!next_posting(&check));
+}
+
+static void check_index(DB* db, const Model* model, uint64_t* seed) {
+    model_check(db, model);
+    check_scan(db, model, 0, UINT64_MAX, -1);
+    for (int i = 0; i < SCANS; i++) {
+        uint64_t lo = test_rand(seed) % (ATTRS + 2);
+        uint64_t hi = test_rand(seed) % (ATTRS + 2);
+        check_scan(db, model, lo, hi, (test_rand(seed) >> 32) % 4 ? -1 : (int) (test_rand(seed) % 100) + 1);
+    }
+}
+
+static void steps(DB* db, Model* model, uint64_t* seed) {
+    for (int i = 0; i < STEPS; i++) model_step(db, model, seed);
+}
+
+int main(void) {
+    Model* model = malloc(sizeof(Model));
+    CHECK(model != NULL);
+    model_init(model);
+    uint64_t seed = 0x2545F4914F6CDD1DULL;
+
+    DB* db = db_open(NAME, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    CHECK(db != NULL);
+    CHECK(db_index_open(db, INDEX, extract, NULL) == 0);
+    steps(db, model, &seed);
+    check_index(db, model, &seed);
+
+    // through the write buffer.
+    CHECK(db_buffer_start(db, 16 << 10) == 0);
+    steps(db, model, &seed);
+    CHECK(db_buffer_stop(db) == 0);
+    check_index(db, model, &seed);
+    db_close(db);
+
+    // a clean index is opened as it is.
+    db = db_open(NAME, O_RDWR);
+    CHECK(db != NULL);
+    CHECK(db_index_open(db, INDEX, extract, NULL) == 0);
+    check_index(db, model, &seed);
+
+    // a dropped index is built again from the values.
+    CHECK(db_index_drop(db, INDEX) == 0);
+    steps(db, model, &seed);
+    CHECK(db_index_open(db, INDEX, extract, NULL) == 0);
+    check_index(db, model, &seed);
+    steps(db, model, &seed);
+    check_index(db, model, &seed);
+    db_close(db);
+
+    // a clean index of the database before it was truncated is built again too.
+    db = db_open(NAME, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    CHECK(db != NULL);
+    model_init(model);
+    CHECK(db_index_open(db, INDEX, extract, NULL) == 0);
+    check_index(db, model, &seed);
+    steps(db, model, &seed);
+    check_index(db, model, &seed);
+    db_close(db);
+    free(model);
+    return 0;
+}
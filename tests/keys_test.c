@@ -0,0 +1,252 @@
+#include <fcntl.h>
+
+#include "test.h"
+#include "index.h"
+#include "import.h"
+
+#define NAME "keys_test_db"
+#define STEPS 20000
+#define KEY_MAX 24
+#define SCANS 200
+#define INDEX "first"
+#define ATTRS 26
+
+// byte-string key i of the model. the keys are drawn from three bytes, so many share long
+// prefixes, some are prefixes of others and some hold zero bytes.
+static char keys[MODEL_KEYS][KEY_MAX];
+static size_t key_sizes[MODEL_KEYS];
+static int order[MODEL_KEYS]; // the keys in byte order.
+
+static int compare(const void* a, size_t a_size, const void* b, size_t b_size) {
+    int cmp = a_size && b_size ? memcmp(a, b, a_size < b_size ? a_size : b_size) : 0;
+    if (cmp) return cmp;
+    return a_size < b_size ? -1 : a_size > b_size;
+}
+
+static int compare_order(const void* a, const void* b) {
+    int i = *(const int*) a, j = *(const int*) b;
+    return compare(keys[i], key_sizes[i], keys[j], key_sizes[j]);
+}
+
+static void make_keys(uint64_t* seed) {
+    for (int i = 0; i < MODEL_KEYS; i++) {
+        int unique;
+        do {
+            key_sizes[i] = test_rand(seed) % (KEY_MAX + 1);
+            for (size_t j = 0; j < key_sizes[i]; j++) keys[i][j] = "ab\0"[(test_rand(seed) >> 32) % 3];
+            unique = 1;
+            for (int j = 0; j < i && unique; j++) unique = compare(keys[i], key_sizes[i], keys[j], key_sizes[j]) != 0;
+        } while (!unique);
+        order[i] = i;
+    }
+    qsort(order, MODEL_KEYS, sizeof(int), compare_order);
+}
+
+// a random store, insert, replace or delete of one of the first used keys.
+static void step(DB* db, Model* model, uint64_t* seed, int used) {
+    int key = (int) (test_rand(seed) % (uint64_t) used);
+    uint64_t kind = (test_rand(seed) >> 32) % 4;
+    int present = model->size[key] >= 0;
+    if (kind == 0) {
+        int ret = db_delete_key(db, keys[key], key_sizes[key]);
+        CHECK(present ? ret == 0 : ret < 0 && errno == ENOENT);
+        model->size[key] = -1;
+        return;
+    }
+    char value[MODEL_VALUE];
+    int size = (int) (test_rand(seed) % MODEL_VALUE);
+    for (int i = 0; i < size; i++) value[i] = (char) ('a' + test_rand(seed) % 26);
+    Record record = {(size_t) size, value};
+    int flag = kind == 1 ? DB_INSERT : kind == 2 ? DB_REPLACE : DB_STORE;
+    int ret = db_store_key(db, keys[key], key_sizes[key], &record, flag);
+    if ((flag == DB_INSERT && present) || (flag == DB_REPLACE && !present)) {
+        CHECK(ret < 0 && errno == (present ? EEXIST : ENOENT));
+        return;
+    }
+    CHECK(ret == 0);
+    model->size[key] = size;
+    memcpy(model->value[key], value, (size_t) size);
+}
+
+typedef struct {
+    const Model* model;
+    int next; // the position in order of the next key the scan should visit.
+    int end;
+}ScanCheck;
+
+static int visit(const void* key, size_t key_size, const Record* value, void* arg) {
+    ScanCheck* check = arg;
+    while (check->next < check->end && check->model->size[order[check->next]] < 0) check->next++;
+    CHECK(check->next < check->end);
+    int i = order[check->next++];
+    CHECK(compare(key, key_size, keys[i], key_sizes[i]) == 0);
+    CHECK(value->size == (size_t) check->model->size[i]);
+    CHECK(memcmp(value->data, check->model->value[i], value->size) == 0);
+    return 0;
+}
+
+// the first position in order with a key >= key.
+static int lower_bound(const void* key, size_t size) {
+    int pos = 0;
+    while (pos < MODEL_KEYS && compare(keys[order[pos]], key_sizes[order[pos]], key, size) < 0) pos++;
+    return pos;
+}
+
+static void check_scan(DB* db, const Model* model, int lo, int hi) {
+    ScanCheck check = {model, lo < 0 ? 0 : lower_bound(keys[lo], key_sizes[lo]),
+                       hi < 0 ? MODEL_KEYS : lower_bound(keys[hi], key_sizes[hi])};
+    if (check.end < check.next) check.end = check.next;
+    int end = check.end;
+    CHECK(db_scan_keys(db, lo < 0 ? "" : keys[lo], lo < 0 ? 0 : key_sizes[lo], hi < 0 ? NULL : keys[hi],
+                       hi < 0 ? 0 : key_sizes[hi], visit, &check) == 0);
+    while (check.next < end && model->size[order[check.next]] < 0) check.next++;
+    CHECK(check.next == end);
+}
+
+static void check_prefix(DB* db, const Model* model, int key, size_t size) {
+    ScanCheck check = {model, lower_bound(keys[key], size), 0};
+    check.end = check.next;
+    while (check.end < MODEL_KEYS && key_sizes[order[check.end]] >= size &&
+           memcmp(keys[order[check.end]], keys[key], size) == 0) check.end++;
+    int end = check.end;
+    CHECK(db_scan_prefix(db, keys[key], size, visit, &check) == 0);
+    while (check.next < end && model->size[order[check.next]] < 0) check.next++;
+    CHECK(check.next == end);
+}
+
+static void check_keys(DB* db, const Model* model, uint64_t* seed) {
+    for (int i = 0; i < MODEL_KEYS; i++) {
+        Record record = {0, NULL};
+        int ret = db_fetch_key(db, keys[i], key_sizes[i], &record);
+        if (model->size[i] < 0) {
+            CHECK(ret < 0 && errno == ENOENT);
+            continue;
+        }
+        CHECK(ret == 0);
+        CHECK(record.size == (size_t) model->size[i]);
+        CHECK(memcmp(record.data, model->value[i], record.size) == 0);
+        free(record.data);
+    }
+    check_scan(db, model, -1, -1);
+    for (int i = 0; i < SCANS; i++) {
+        int lo = (int) (test_rand(seed) % MODEL_KEYS);
+        int hi = (int) (test_rand(seed) % MODEL_KEYS);
+        check_scan(db, model, lo, (test_rand(seed) >> 32) % 8 ? hi : -1);
+        check_prefix(db, model, lo, test_rand(seed) % (key_sizes[lo] + 1));
+    }
+}
+
+// the first letter of a value, an empty value has none.
+static int extract(uint64_t key, const Record* value, uint64_t* attr, void* arg) {
+    (void) key;
+    (void) arg;
+    if (value->size == 0) return 0;
+    *attr = (uint64_t) (value->data[0] - 'a');
+    return 1;
+}
+
+static int count_posting(uint64_t attr, uint64_t key, void* arg) {
+    (void) key;
+    CHECK(attr < ATTRS);
+    ((size_t*) arg)[attr]++;
+    return 0;
+}
+
+// every key with a value has one posting, however often it moved down a layer.
+static void check_index(DB* db, const Model* model) {
+    size_t want[ATTRS] = {0};
+    size_t got[ATTRS] = {0};
+    for (int i = 0; i < MODEL_KEYS; i++) {
+        if (model->size[i] > 0) want[model->value[i][0] - 'a']++;
+    }
+    CHECK(db_index_scan(db, INDEX, 0, ATTRS, count_posting, got) == 0);
+    CHECK(memcmp(want, got, sizeof(want)) == 0);
+}
+
+int main(void) {
+    Model* model = malloc(sizeof(Model));
+    CHECK(model != NULL);
+    model_init(model);
+    uint64_t seed = 0x2545F4914F6CDD1DULL;
+    make_keys(&seed);
+
+    DB* db = db_open(NAME, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    CHECK(db != NULL);
+    for (int i = 0; i < STEPS; i++) step(db, model, &seed, MODEL_KEYS / 2);
+    check_keys(db, model, &seed);
+
+    // through the write buffer.
+    CHECK(db_buffer_start(db, 16 << 10) == 0);
+    for (int i = 0; i < STEPS; i++) step(db, model, &seed, MODEL_KEYS / 2);
+    CHECK(db_buffer_stop(db) == 0);
+    check_keys(db, model, &seed);
+    db_close(db);
+
+    // the layers made so far are kept through a reopen and a reorganize, so the ones the other
+    // half of the keys adds do not reuse their numbers.
+    db = db_open(NAME, O_RDWR);
+    CHECK(db != NULL);
+    check_keys(db, model, &seed);
+    CHECK(db_reorganize(db) == 0);
+    check_keys(db, model, &seed);
+    for (int i = 0; i < STEPS; i++) step(db, model, &seed, MODEL_KEYS);
+    check_keys(db, model, &seed);
+    db_close(db);
+
+    db = db_open(NAME, O_RDWR);
+    CHECK(db != NULL);
+    check_keys(db, model, &seed);
+
+    // a database holds one kind of key, writes of the other fail and leave it as it was.
+    Record record = {1, "x"};
+    uint64_t sum;
+    CHECK(db_store(db, 1, &record, DB_STORE) < 0 && errno == EINVAL);
+    CHECK(db_store_ttl(db, 1, &record, DB_STORE, 60) < 0 && errno == EINVAL);
+    CHECK(db_add_u64(db, 1, 1, &sum) < 0 && errno == EINVAL);
+    CHECK(db_delete(db, 1) < 0 && errno == EINVAL);
+    check_keys(db, model, &seed);
+
+    // cell writes keep the secondary indexes, also the ones that move a key down a layer.
+    CHECK(db_index_open(db, INDEX, extract, NULL) == 0);
+    check_index(db, model);
+    for (int i = 0; i < STEPS; i++) step(db, model, &seed, MODEL_KEYS);
+    check_index(db, model);
+    CHECK(db_buffer_start(db, 16 << 10) == 0);
+    for (int i = 0; i < STEPS; i++) step(db, model, &seed, MODEL_KEYS);
+    CHECK(db_buffer_stop(db) == 0);
+    check_index(db, model);
+    check_keys(db, model, &seed);
+    CHECK(db_index_drop(db, INDEX) == 0);
+    db_close(db);
+
+    // the first store decides the kind, and a reopen and a reorganize keep it.
+    db = db_open(NAME, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    CHECK(db != NULL);
+    CHECK(db_delete_key(db, "k", 1) < 0 && errno == ENOENT);
+    CHECK(db_store(db, 1, &record, DB_STORE) == 0);
+    CHECK(db_store_key(db, "k", 1, &record, DB_STORE) < 0 && errno == EINVAL);
+    CHECK(db_delete_key(db, "k", 1) < 0 && errno == EINVAL);
+    db_close(db);
+    db = db_open(NAME, O_RDWR);
+    CHECK(db != NULL);
+    CHECK(db_reorganize(db) == 0);
+    CHECK(db_store_key(db, "k", 1, &record, DB_STORE) < 0 && errno == EINVAL);
+    Record fetched;
+    CHECK(db_fetch(db, 1, &fetched) == 0 && fetched.size == 1 && fetched.data[0] == 'x');
+    free(fetched.data);
+    db_close(db);
+
+    // an import brings uint64_t keys, so an emptied database of byte-string keys refuses it.
+    db = db_open(NAME, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    CHECK(db != NULL);
+    CHECK(db_store_key(db, "k", 1, &record, DB_STORE) == 0);
+    CHECK(db_delete_key(db, "k", 1) == 0);
+    Importer* importer = db_import_begin(db, 1 << 20);
+    CHECK(importer != NULL);
+    CHECK(db_import_add(importer, 1, "x", 1) == 0);
+    CHECK(db_import_finish(&importer, 1) < 0 && errno == EINVAL);
+    CHECK(db_store_key(db, "k", 1, &record, DB_STORE) == 0);
+    db_close(db);
+    free(model);
+    return 0;
+}
@@ -0,0 +1,127 @@
+#include <fcntl.h>
+#include <pthread.h>
+
+#include "test.h"
+
+#define NAME "modify_test_db"
+#define STEPS 20000
+#define ADDERS 4
+#define ADDS 5000
+#define COUNTER (MODEL_KEYS + 1)
+
+// appends the operand to the value.
+static int append(const Record* value, const Record* operand, Record* result, void* arg) {
+    (void) arg;
+    size_t size = value ? value->size : 0;
+    result->size = size + operand->size;
+    result->data = malloc(result->size ? result->size : 1);
+    if (result->data == NULL) return -1;
+    if (size) memcpy(result->data, value->data, size);
+    if (operand->size) memcpy(result->data + size, operand->data, operand->size);
+    return 0;
+}
+
+static void set(Model* model, uint64_t key, const void* value, size_t size) {
+    model->size[key] = (int) size;
+    memcpy(model->value[key], value, size);
+}
+
+// a random store or delete, or one of the read-modify-write operations.
+static void step(DB* db, Model* model, uint64_t* seed) {
+    uint64_t key = test_rand(seed) % MODEL_KEYS;
+    uint64_t kind = (test_rand(seed) >> 32) % 8;
+    int size = model->size[key];
+    if (kind == 0) {
+        model_delete(db, model, key);
+    } else if (kind == 1) {
+        model_store(db, model, key, seed);
+    } else if (kind <= 3) {
+        // an add needs an 8-byte value or none.
+        int64_t delta = (int64_t) (test_rand(seed) % 2001) - 1000;
+        uint64_t sum, old = 0;
+        int ret = db_add_u64(db, key, delta, &sum);
+        if (size >= 0 && size != sizeof(uint64_t)) {
+            CHECK(ret < 0 && errno == EINVAL);
+            return;
+        }
+        if (size >= 0) memcpy(&old, model->value[key], sizeof(uint64_t));
+        CHECK(ret == 0 && sum == old + (uint64_t) delta);
+        set(model, key, &sum, sizeof(uint64_t));
+    } else if (kind <= 5) {
+        // a swap with the value the key has, with another one, or expecting none.
+        char desired[MODEL_VALUE];
+        int desired_size = (int) (test_rand(seed) % MODEL_VALUE);
+        for (int i = 0; i < desired_size; i++) desired[i] = (char) ('a' + test_rand(seed) % 26);
+        Record desired_record = {(size_t) desired_size, desired};
+        uint64_t pick = test_rand(seed) % 3;
+        char other[1] = {'!'};
+        Record expected = {size > 0 ? (size_t) size : 0, size > 0 ? model->value[key] : other};
+        if (pick == 1) expected = (Record) {1, other};
+        int ret = db_compare_and_swap(db, key, pick == 2 ? NULL : &expected, &desired_record);
+        int match = pick == 2 ? size < 0 : pick == 0 && size >= 0;
+        if (!match) {
+            CHECK(ret < 0 && errno == ECANCELED);
+            return;
+        }
+        CHECK(ret == 0);
+        set(model, key, desired, (size_t) desired_size);
+    } else {
+        char operand[MODEL_VALUE];
+        int used = size > 0 ? size : 0;
+        int operand_size = (int) (test_rand(seed) % (MODEL_VALUE - used + 1));
+        for (int i = 0; i < operand_size; i++) operand[i] = (char) ('a' + test_rand(seed) % 26);
+        Record record = {(size_t) operand_size, operand};
+        CHECK(db_merge(db, key, &record) == 0);
+        memcpy(model->value[key] + used, operand, (size_t) operand_size);
+        model->size[key] = used + operand_size;
+    }
+}
+
+static void* adder_main(void* arg) {
+    for (int i = 0; i < ADDS; i++) CHECK(db_add_u64(arg, COUNTER, 1, NULL) == 0);
+    return NULL;
+}
+
+// threads adding to one key lose none of their adds.
+static void check_adders(DB* db) {
+    Record zero = {sizeof(uint64_t), (char[sizeof(uint64_t)]) {0}};
+    CHECK(db_store(db, COUNTER, &zero, DB_STORE) == 0);
+    pthread_t threads[ADDERS];
+    for (int i = 0; i < ADDERS; i++) CHECK(pthread_create(threads + i, NULL, adder_main, db) == 0);
+    for (int i = 0; i < ADDERS; i++) pthread_join(threads[i], NULL);
+    uint64_t sum;
+    CHECK(db_add_u64(db, COUNTER, 0, &sum) == 0 && sum == ADDERS * ADDS);
+    CHECK(db_delete(db, COUNTER) == 0);
+}
+
+int main(void) {
+    uint64_t seed = 0x2545F4914F6CDD1DULL;
+    Model* model = malloc(sizeof(Model));
+    CHECK(model != NULL);
+    model_init(model);
+
+    DB* db = db_open(NAME, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    CHECK(db != NULL);
+    Record operand = {1, "x"};
+    CHECK(db_merge(db, 0, &operand) < 0 && errno == EINVAL);
+    CHECK(db_set_merge_operator(db, append, NULL) == 0);
+    for (int i = 0; i < STEPS; i++) step(db, model, &seed);
+    model_check(db, model);
+    check_adders(db);
+
+    // through the write buffer.
+    CHECK(db_buffer_start(db, 16 << 10) == 0);
+    for (int i = 0; i < STEPS; i++) step(db, model, &seed);
+    model_check(db, model);
+    check_adders(db);
+    CHECK(db_buffer_stop(db) == 0);
+    model_check(db, model);
+    db_close(db);
+
+    db = db_open(NAME, O_RDWR);
+    CHECK(db != NULL);
+    model_check(db, model);
+    db_close(db);
+    free(model);
+    return 0;
+}
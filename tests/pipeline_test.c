@@ -0,0 +1,206 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "test.h"
+#include "pipeline.h"
+
+#define NAME "pipeline_test_db"
+#define SHARDS 4
+#define CLIENTS 4
+#define QUEUE 64
+#define WINDOW 48
+#define STEPS 20000
+
+// a request in flight with what it should find.
+typedef struct {
+    Request request;
+    char value[MODEL_VALUE];
+    int expected_size; // -1 if the key should be missing.
+    char expected[MODEL_VALUE];
+}Flight;
+
+typedef struct {
+    Pipeline* pipeline;
+    Model* model; // shared, each client only touches the keys k with k % CLIENTS == id.
+    int id;
+    uint64_t seed;
+    Flight flights[WINDOW];
+}Client;
+
+static atomic_int completed;
+
+static void count_completion(Request* request, void* arg) {
+    (void) request;
+    atomic_fetch_add((atomic_int*) arg, 1);
+}
+
+static void finish(Flight* flight) {
+    Request* request = &flight->request;
+    int ret = pipeline_wait(request);
+    int present = flight->expected_size >= 0;
+    if (request->op == PIPE_FETCH) {
+        if (!present) {
+            CHECK(ret < 0 && errno == ENOENT);
+            return;
+        }
+        CHECK(ret == 0 && request->record.size == (size_t) flight->expected_size);
+        CHECK(memcmp(request->record.data, flight->expected, request->record.size) == 0);
+        free(request->record.data);
+    } else if (request->op == PIPE_DELETE || request->flag != DB_STORE) {
+        // a delete or a replace needs the key to be there before the request, an insert needs it missing.
+        int ok = request->op == PIPE_DELETE || request->flag == DB_REPLACE ? present : !present;
+        CHECK(ok ? ret == 0 : ret < 0 && request->error == (present ? EEXIST : ENOENT));
+    } else {
+        CHECK(ret == 0);
+    }
+}
+
+// the requests of one window go to the workers in order, and the ones to the same shard run
+// in that order, so the model is updated as they are submitted.
+static void* client_main(void* arg) {
+    Client* client = arg;
+    Model* model = client->model;
+    for (int done = 0; done < STEPS; done += WINDOW) {
+        for (int i = 0; i < WINDOW; i++) {
+            Flight* flight = client->flights + i;
+            Request* request = &flight->request;
+            uint64_t key = test_rand(&client->seed) % (MODEL_KEYS / CLIENTS) * CLIENTS + (uint64_t) client->id;
+            uint64_t kind = (test_rand(&client->seed) >> 32) % 6;
+            memset(request, 0, sizeof(Request));
+            request->key = key;
+            request->callback = count_completion;
+            request->arg = &completed;
+            flight->expected_size = model->size[key];
+            if (model->size[key] > 0) memcpy(flight->expected, model->value[key], (size_t) model->size[key]);
+
+            if (kind == 0) {
+                request->op = PIPE_FETCH;
+            } else if (kind == 1) {
+                request->op = PIPE_DELETE;
+                model->size[key] = -1;
+            } else {
+                request->op = PIPE_STORE;
+                request->flag = kind == 2 ? DB_INSERT : kind == 3 ? DB_REPLACE : DB_STORE;
+                int size = (int) (test_rand(&client->seed) % MODEL_VALUE);
+                for (int j = 0; j < size; j++) flight->value[j] = (char) ('a' + test_rand(&client->seed) % 26);
+                request->record = (Record) {(size_t) size, flight->value};
+                int present = model->size[key] >= 0;
+                if (request->flag == DB_STORE || (request->flag == DB_INSERT) != present) {
+                    model->size[key] = size;
+                    memcpy(model->value[key], flight->value, (size_t) size);
+                }
+            }
+            // a full queue empties once the requests already in it are done.
+            while (pipeline_submit(client->pipeline, request) < 0) {
+                CHECK(errno == EAGAIN);
+                sched_yield();
+            }
+        }
+        for (int i = 0; i < WINDOW; i++) finish(client->flights + i);
+    }
+    return NULL;
+}
+
+static atomic_int accepted;
+
+// stores its own keys until the pipeline shuts down. every request it queued has to complete.
+static void* shutdown_main(void* arg) {
+    Client* client = arg;
+    uint64_t next = (uint64_t) client->id;
+    for (int open = 1; open;) {
+        int queued = 0;
+        while (queued < WINDOW) {
+            Flight* flight = client->flights + queued;
+            Request* request = &flight->request;
+            memset(request, 0, sizeof(Request));
+            request->op = PIPE_STORE;
+            request->flag = DB_STORE;
+            request->key = MODEL_KEYS + next;
+            memcpy(flight->value, &request->key, sizeof(uint64_t));
+            request->record = (Record) {sizeof(uint64_t), flight->value};
+            if (pipeline_submit(client->pipeline, request) == 0) {
+                queued++;
+                next += CLIENTS;
+                continue;
+            }
+            if (errno == EAGAIN) {
+                sched_yield();
+                continue;
+            }
+            CHECK(errno == ESHUTDOWN);
+            open = 0;
+            break;
+        }
+        for (int i = 0; i < queued; i++) CHECK(pipeline_wait(&client->flights[i].request) == 0);
+        atomic_fetch_add(&accepted, queued);
+    }
+    client->seed = next; // the first key it did not store.
+    return NULL;
+}
+
+int main(void) {
+    Model* model = malloc(sizeof(Model));
+    Client* clients = malloc(CLIENTS * sizeof(Client));
+    CHECK(model && clients);
+    model_init(model);
+
+    ShardedDB* sdb = shard_open(NAME, SHARDS, SHARD_HASH, NULL, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    CHECK(sdb != NULL);
+    CHECK(pipeline_open(sdb, 100) == NULL && errno == EINVAL);
+    Pipeline* pipeline = pipeline_open(sdb, QUEUE);
+    CHECK(pipeline != NULL);
+    pthread_t threads[CLIENTS];
+    for (int i = 0; i < CLIENTS; i++) {
+        clients[i].pipeline = pipeline;
+        clients[i].model = model;
+        clients[i].id = i;
+        clients[i].seed = 0x2545F4914F6CDD1DULL * (uint64_t) (i + 1);
+        CHECK(pthread_create(threads + i, NULL, client_main, clients + i) == 0);
+    }
+    for (int i = 0; i < CLIENTS; i++) pthread_join(threads[i], NULL);
+    pipeline_close(pipeline);
+    int windows = (STEPS + WINDOW - 1) / WINDOW;
+    CHECK(atomic_load(&completed) == CLIENTS * windows * WINDOW);
+
+    for (uint64_t key = 0; key < MODEL_KEYS; key++) {
+        Record record = {0, NULL};
+        int ret = shard_fetch(sdb, key, &record);
+        if (model->size[key] < 0) {
+            CHECK(ret < 0 && errno == ENOENT);
+            continue;
+        }
+        CHECK(ret == 0 && record.size == (size_t) model->size[key]);
+        CHECK(memcmp(record.data, model->value[key], record.size) == 0);
+        free(record.data);
+    }
+
+    // a shutdown while clients submit. what was queued completes, what comes after is refused.
+    pipeline = pipeline_open(sdb, QUEUE);
+    CHECK(pipeline != NULL);
+    for (int i = 0; i < CLIENTS; i++) {
+        clients[i].pipeline = pipeline;
+        CHECK(pthread_create(threads + i, NULL, shutdown_main, clients + i) == 0);
+    }
+    while (atomic_load(&accepted) < STEPS) sched_yield();
+    pipeline_shutdown(pipeline);
+    for (int i = 0; i < CLIENTS; i++) pthread_join(threads[i], NULL);
+    Request late = {.op = PIPE_FETCH, .key = 0};
+    CHECK(pipeline_submit(pipeline, &late) < 0 && errno == ESHUTDOWN);
+    pipeline_close(pipeline);
+    size_t stored = 0;
+    for (int i = 0; i < CLIENTS; i++) {
+        for (uint64_t key = MODEL_KEYS + (uint64_t) i; key < MODEL_KEYS + clients[i].seed; key += CLIENTS) {
+            Record record = {0, NULL};
+            CHECK(shard_fetch(sdb, key, &record) == 0);
+            CHECK(record.size == sizeof(uint64_t) && memcmp(record.data, &key, sizeof(uint64_t)) == 0);
+            free(record.data);
+            stored++;
+        }
+    }
+    CHECK(stored == (size_t) atomic_load(&accepted));
+    shard_close(sdb);
+    free(model);
+    free(clients);
+    return 0;
+}
@@ -0,0 +1,125 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+
+#include "test.h"
+
+#define NAME "reorganize_test_db"
+#define MAX_SNAPSHOTS 8
+
+static atomic_int reorganized;
+static int reorganize_ret;
+
+static void* reorganize_main(void* arg) {
+    reorganize_ret = db_reorganize_parallel(arg, 2);
+    atomic_store(&reorganized, 1);
+    return NULL;
+}
+
+static void copy_file(const char* from, const char* to) {
+    char buf[1 << 16];
+    int in = open(from, O_RDONLY);
+    int out = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    CHECK(in >= 0 && out >= 0);
+    ssize_t n;
+    while ((n = read(in, buf, sizeof(buf))) > 0) CHECK(write(out, buf, (size_t) n) == n);
+    CHECK(n == 0);
+    close(in);
+    close(out);
+}
+
+int main() {
+    uint64_t seed = 88172645463325252ULL;
+    Model* model = malloc(sizeof(Model));
+    Model* seen = malloc(MAX_SNAPSHOTS * sizeof(Model));
+    Snapshot* snapshots[MAX_SNAPSHOTS];
+    CHECK(model && seen);
+    model_init(model);
+
+    DB* db = db_open(NAME, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    CHECK(db != NULL);
+    for (int i = 0; i < 20000; i++) model_step(db, model, &seed);
+    model_check(db, model);
+
+    // writers, cursors and snapshots go on while the files are rebuilt and swapped. a snapshot
+    // taken before the swap keeps its view after it.
+    int num_snapshots = 0;
+    CHECK((snapshots[num_snapshots] = db_snapshot_begin(db)) != NULL);
+    memcpy(seen + num_snapshots++, model, sizeof(Model));
+    pthread_t thread;
+    CHECK(pthread_create(&thread, NULL, reorganize_main, db) == 0);
+    for (int i = 0; !atomic_load(&reorganized) || i < 2000; i++) {
+        model_step(db, model, &seed);
+        if (i % 500 == 0 && num_snapshots < MAX_SNAPSHOTS) {
+            CHECK((snapshots[num_snapshots] = db_snapshot_begin(db)) != NULL);
+            memcpy(seen + num_snapshots++, model, sizeof(Model));
+        }
+        if (i % 700 == 0) {
+            Cursor* cursor = db_cursor_open(db, NULL);
+            CHECK(cursor != NULL);
+            model_check_cursor(cursor, model);
+            db_cursor_close(cursor);
+        }
+    }
+    pthread_join(thread, NULL);
+    CHECK(reorganize_ret == 0);
+    for (int i = 0; i < num_snapshots; i++) {
+        Cursor* cursor = db_cursor_open(db, snapshots[i]);
+        CHECK(cursor != NULL);
+        model_check_cursor(cursor, seen + i);
+        db_cursor_close(cursor);
+        CHECK(db_snapshot_end(db, snapshots[i]) == 0);
+    }
+    model_check(db, model);
+
+    // a reorganize while a snapshot is open, without writers.
+    Snapshot* snapshot = db_snapshot_begin(db);
+    CHECK(snapshot != NULL);
+    CHECK(db_reorganize(db) == 0);
+    Cursor* cursor = db_cursor_open(db, snapshot);
+    CHECK(cursor != NULL);
+    model_check_cursor(cursor, model);
+    db_cursor_close(cursor);
+    CHECK(db_snapshot_end(db, snapshot) == 0);
+    db_close(db);
+
+    db = db_open(NAME, O_RDWR);
+    CHECK(db != NULL);
+    model_check(db, model);
+    db_close(db);
+
+    // a crash in the middle of the swap: the marker is on disk and only the data file was
+    // renamed. db_open finishes the swap, the old index must not be paired with the new data.
+    copy_file(NAME ".idx", NAME ".idx.reorg");
+    copy_file(NAME ".dat", NAME ".dat.reorg");
+    memcpy(seen, model, sizeof(Model));
+    db = db_open(NAME, O_RDWR);
+    CHECK(db != NULL);
+    for (int i = 0; i < 5000; i++) model_step(db, model, &seed);
+    db_close(db);
+    CHECK(rename(NAME ".dat.reorg", NAME ".dat") == 0);
+    int fd = open(NAME ".reorg", O_WRONLY | O_CREAT, 0644);
+    CHECK(fd >= 0);
+    close(fd);
+    db = db_open(NAME, O_RDWR);
+    CHECK(db != NULL);
+    CHECK(access(NAME ".reorg", F_OK) < 0 && access(NAME ".idx.reorg", F_OK) < 0);
+    model_check(db, seen);
+    db_close(db);
+
+    // without the marker, leftover files of a rebuild that never finished are ignored.
+    copy_file(NAME ".idx", NAME ".idx.reorg");
+    db = db_open(NAME, O_RDWR);
+    CHECK(db != NULL);
+    for (int i = 0; i < 2000; i++) model_step(db, seen, &seed);
+    db_close(db);
+    db = db_open(NAME, O_RDWR);
+    CHECK(db != NULL);
+    model_check(db, seen);
+    db_close(db);
+
+    free(model);
+    free(seen);
+    return 0;
+}
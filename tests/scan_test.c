@@ -0,0 +1,124 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "test.h"
+#include "scan.h"
+
+#define NAME "scan_test_db"
+#define STEPS 20000
+#define EXTRA_KEYS 4096
+#define STOP_KEY (MODEL_KEYS / 2)
+
+typedef struct {
+    uint64_t first;
+    uint64_t last;
+    size_t count;
+}Partition;
+
+typedef struct {
+    const Model* model;
+    Partition partitions[SCAN_MAX_THREADS];
+    atomic_int seen[MODEL_KEYS];
+    int stop; // stop the scan at STOP_KEY.
+}Scan;
+
+static atomic_int stop_writer;
+
+// each partition sees its keys in order, and every model key holds its value.
+static int visit(int partition, const Cell* cell, const Record* value, void* arg) {
+    Scan* scan = arg;
+    Partition* p = scan->partitions + partition;
+    CHECK(p->count == 0 || cell->key > p->last);
+    if (p->count++ == 0) p->first = cell->key;
+    p->last = cell->key;
+    if (cell->key >= MODEL_KEYS) return 0;
+    CHECK(atomic_fetch_add(scan->seen + cell->key, 1) == 0);
+    CHECK(value->size == (size_t) scan->model->size[cell->key]);
+    CHECK(memcmp(value->data, scan->model->value[cell->key], value->size) == 0);
+    return scan->stop && cell->key == STOP_KEY ? 7 : 0;
+}
+
+// the partitions cover the keys in order without overlapping, and the model keys exactly once.
+static void check_scan(DB* db, const Model* model, int threads) {
+    Scan* scan = calloc(1, sizeof(Scan));
+    CHECK(scan != NULL);
+    scan->model = model;
+    CHECK(db_scan_parallel(db, threads, visit, scan) == 0);
+    uint64_t last = 0;
+    int any = 0;
+    for (int i = 0; i < threads; i++) {
+        Partition* p = scan->partitions + i;
+        if (p->count == 0) continue;
+        CHECK(!any || p->first > last);
+        last = p->last;
+        any = 1;
+    }
+    for (uint64_t key = 0; key < MODEL_KEYS; key++) CHECK(atomic_load(scan->seen + key) == (model->size[key] >= 0));
+
+    // a visitor stopping the scan returns what it stopped with.
+    memset(scan, 0, sizeof(Scan));
+    scan->model = model;
+    scan->stop = 1;
+    CHECK(db_scan_parallel(db, threads, visit, scan) == (model->size[STOP_KEY] >= 0 ? 7 : 0));
+    free(scan);
+}
+
+// writes keys past the model, so the scans and the reorganize run next to a writer.
+static void* writer_main(void* arg) {
+    char value[MODEL_VALUE];
+    memset(value, 'w', sizeof(value));
+    for (uint64_t i = 0; !atomic_load(&stop_writer) || i < 100; i++) {
+        Record record = {i % MODEL_VALUE, value};
+        CHECK(db_store(arg, MODEL_KEYS + i % EXTRA_KEYS, &record, DB_STORE) == 0);
+    }
+    return NULL;
+}
+
+static void check_all(DB* db, const Model* model) {
+    for (int threads = 1; threads <= 8; threads++) check_scan(db, model, threads);
+    check_scan(db, model, SCAN_MAX_THREADS);
+}
+
+int main(void) {
+    uint64_t seed = 0x2545F4914F6CDD1DULL;
+    Model* model = malloc(sizeof(Model));
+    CHECK(model != NULL);
+    model_init(model);
+
+    DB* db = db_open(NAME, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    CHECK(db != NULL);
+    CHECK(db_scan_parallel(db, 0, visit, NULL) < 0 && errno == EINVAL);
+    CHECK(db_scan_parallel(db, SCAN_MAX_THREADS + 1, visit, NULL) < 0 && errno == EINVAL);
+    CHECK(db_reorganize_parallel(db, 0) < 0 && errno == EINVAL);
+    check_all(db, model);
+    for (int i = 0; i < STEPS; i++) model_step(db, model, &seed);
+    check_all(db, model);
+
+    // with a writer going, and through the write buffer.
+    pthread_t thread;
+    CHECK(pthread_create(&thread, NULL, writer_main, db) == 0);
+    check_all(db, model);
+    for (int threads = 1; threads <= 8; threads *= 2) {
+        CHECK(db_reorganize_parallel(db, threads) == 0);
+        check_all(db, model);
+    }
+    atomic_store(&stop_writer, 1);
+    pthread_join(thread, NULL);
+    CHECK(db_buffer_start(db, 16 << 10) == 0);
+    for (int i = 0; i < STEPS; i++) model_step(db, model, &seed);
+    check_all(db, model);
+    CHECK(db_reorganize_parallel(db, 4) == 0);
+    CHECK(db_buffer_stop(db) == 0);
+    for (uint64_t key = MODEL_KEYS; key < MODEL_KEYS + EXTRA_KEYS; key++) CHECK(db_delete(db, key) == 0 || errno == ENOENT);
+    model_check(db, model);
+    db_close(db);
+
+    db = db_open(NAME, O_RDWR);
+    CHECK(db != NULL);
+    model_check(db, model);
+    check_all(db, model);
+    db_close(db);
+    free(model);
+    return 0;
+}
@@ -0,0 +1,142 @@
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "test.h"
+#include "shard.h"
+
+#define NAME "shard_test_db"
+#define SHARDS 4
+#define STEPS 20000
+
+static void step(ShardedDB* sdb, Model* model, uint64_t* seed) {
+    uint64_t key = test_rand(seed) % MODEL_KEYS;
+    if ((test_rand(seed) >> 32) % 4 == 0) {
+        int ret = shard_delete(sdb, key);
+        CHECK(model->size[key] < 0 ? ret < 0 && errno == ENOENT : ret == 0);
+        model->size[key] = -1;
+        return;
+    }
+    char value[MODEL_VALUE];
+    int size = (int) (test_rand(seed) % MODEL_VALUE);
+    for (int i = 0; i < size; i++) value[i] = (char) ('a' + test_rand(seed) % 26);
+    Record record = {(size_t) size, value};
+    CHECK(shard_store(sdb, key, &record, DB_STORE) == 0);
+    model->size[key] = size;
+    memcpy(model->value[key], value, (size_t) size);
+}
+
+// every key is fetched from the shard it belongs to, and the cursor merges the shards in key order.
+static void check(ShardedDB* sdb, const Model* model) {
+    for (uint64_t key = 0; key < MODEL_KEYS; key++) {
+        size_t shard = shard_index(sdb, key);
+        CHECK(shard < sdb->num_shards);
+        if (sdb->mode == SHARD_RANGE) {
+            CHECK(shard == 0 || key >= sdb->bounds[shard - 1]);
+            CHECK(shard == sdb->num_shards - 1 || key < sdb->bounds[shard]);
+        }
+        Record record = {0, NULL};
+        int ret = shard_fetch(sdb, key, &record);
+        if (model->size[key] < 0) {
+            CHECK(ret < 0 && errno == ENOENT);
+            continue;
+        }
+        CHECK(ret == 0);
+        CHECK(record.size == (size_t) model->size[key]);
+        CHECK(memcmp(record.data, model->value[key], record.size) == 0);
+        free(record.data);
+        CHECK(db_fetch(sdb->shards[shard], key, &record) == 0);
+        free(record.data);
+    }
+
+    ShardCursor* cursor = shard_cursor_open(sdb);
+    CHECK(cursor != NULL);
+    uint64_t next = 0;
+    Cell cell;
+    Record record;
+    int ret;
+    while ((ret = shard_cursor_next(cursor, &cell, &record)) == 0) {
+        while (next < MODEL_KEYS && model->size[next] < 0) next++;
+        CHECK(next < MODEL_KEYS && cell.key == next);
+        CHECK(record.size == (size_t) model->size[next]);
+        CHECK(memcmp(record.data, model->value[next], record.size) == 0);
+        free(record.data);
+        next++;
+    }
+    CHECK(ret == -2);
+    while (next < MODEL_KEYS && model->size[next] < 0) next++;
+    CHECK(next == MODEL_KEYS);
+    shard_cursor_close(cursor);
+}
+
+static void run(int mode, const uint64_t* bounds, uint64_t* seed) {
+    Model* model = malloc(sizeof(Model));
+    CHECK(model != NULL);
+    model_init(model);
+
+    ShardedDB* sdb = shard_open(NAME, SHARDS, mode, bounds, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    CHECK(sdb != NULL && sdb->num_shards == SHARDS && sdb->mode == mode);
+    for (int i = 0; i < STEPS; i++) step(sdb, model, seed);
+    check(sdb, model);
+
+    // with the shards compacting in the background.
+    CHECK(shard_compact_start(sdb, 0) == 0);
+    for (int i = 0; i < STEPS; i++) step(sdb, model, seed);
+    CHECK(shard_compact_stop(sdb) == 0);
+    check(sdb, model);
+    shard_close(sdb);
+
+    // the manifest keeps the layout, whatever a later open asks for.
+    sdb = shard_open(NAME, SHARDS * 2, SHARD_HASH + SHARD_RANGE - mode, NULL, O_RDWR);
+    CHECK(sdb != NULL && sdb->num_shards == SHARDS && sdb->mode == mode);
+    check(sdb, model);
+    shard_close(sdb);
+    free(model);
+}
+
+// a manifest with an unknown mode or unsorted bounds is refused, and truncating to fewer shards
+// removes the ones past the new count.
+static void check_layout(void) {
+    uint64_t bounds[SHARDS - 1] = {100, MODEL_KEYS / 2, MODEL_KEYS - 1};
+    ShardedDB* sdb = shard_open(NAME, SHARDS, SHARD_RANGE, bounds, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    CHECK(sdb != NULL);
+    Record record = {1, "x"};
+    for (uint64_t key = 0; key < MODEL_KEYS; key++) CHECK(shard_store(sdb, key, &record, DB_STORE) == 0);
+    shard_close(sdb);
+
+    // mode sits after the magic number, the bounds after the whole manifest header.
+    int fd = open(NAME ".shards", O_RDWR);
+    CHECK(fd >= 0);
+    int mode = 7;
+    CHECK(pwrite(fd, &mode, sizeof(int), sizeof(int)) == sizeof(int));
+    CHECK(shard_open(NAME, SHARDS, SHARD_HASH, NULL, O_RDWR) == NULL && errno == EINVAL);
+    mode = SHARD_RANGE;
+    CHECK(pwrite(fd, &mode, sizeof(int), sizeof(int)) == sizeof(int));
+    uint64_t bound = MODEL_KEYS;
+    off_t bounds_offset = (off_t) (2 * sizeof(int) + sizeof(size_t));
+    CHECK(pwrite(fd, &bound, sizeof(uint64_t), bounds_offset) == sizeof(uint64_t));
+    CHECK(shard_open(NAME, SHARDS, SHARD_HASH, NULL, O_RDWR) == NULL && errno == EINVAL);
+    close(fd);
+
+    sdb = shard_open(NAME, 2, SHARD_HASH, NULL, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    CHECK(sdb != NULL && sdb->num_shards == 2);
+    for (uint64_t key = 0; key < MODEL_KEYS; key++) CHECK(shard_fetch(sdb, key, &record) < 0 && errno == ENOENT);
+    shard_close(sdb);
+    CHECK(access(NAME ".1.idx", F_OK) == 0);
+    CHECK(access(NAME ".2.idx", F_OK) < 0 && access(NAME ".2.dat", F_OK) < 0);
+    CHECK(access(NAME ".3.idx", F_OK) < 0 && access(NAME ".3.dat", F_OK) < 0);
+
+    // the old count comes back empty.
+    sdb = shard_open(NAME, SHARDS, SHARD_HASH, NULL, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    CHECK(sdb != NULL);
+    for (uint64_t key = 0; key < MODEL_KEYS; key++) CHECK(shard_fetch(sdb, key, &record) < 0 && errno == ENOENT);
+    shard_close(sdb);
+}
+
+int main(void) {
+    uint64_t seed = 0x2545F4914F6CDD1DULL;
+    run(SHARD_HASH, NULL, &seed);
+    uint64_t bounds[SHARDS - 1] = {100, MODEL_KEYS / 2, MODEL_KEYS - 1};
+    run(SHARD_RANGE, bounds, &seed);
+    check_layout();
+    return 0;
+}
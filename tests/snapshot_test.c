@@ -0,0 +1,186 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "test.h"
+
+#define NAME "snapshot_test_db"
+#define MAX_SNAPSHOTS 8
+#define STEPS 4000
+#define SEEKS 200
+#define APPENDS 20000 // keys the writer adds past the model while snapshots begin.
+
+static atomic_int stop_reader;
+
+typedef struct {
+    DB* db;
+    Snapshot* snapshot;
+    const Model* seen;
+    int passes;
+}Reader;
+
+static void check_fetches(DB* db, Snapshot* snapshot, const Model* seen) {
+    for (uint64_t key = 0; key < MODEL_KEYS; key++) {
+        Record record = {0, NULL};
+        int ret = db_snapshot_fetch(db, snapshot, key, &record);
+        if (seen->size[key] < 0) {
+            CHECK(ret < 0 && errno == ENOENT);
+            continue;
+        }
+        CHECK(ret == 0);
+        CHECK(record.size == (size_t) seen->size[key]);
+        CHECK(memcmp(record.data, seen->value[key], record.size) == 0);
+        free(record.data);
+    }
+}
+
+static void check_snapshot(DB* db, Snapshot* snapshot, const Model* seen) {
+    check_fetches(db, snapshot, seen);
+    Cursor* cursor = db_cursor_open(db, snapshot);
+    CHECK(cursor != NULL);
+    model_check_cursor(cursor, seen);
+    db_cursor_close(cursor);
+}
+
+// a seek lands on the first key of the snapshot at or after the target.
+static void check_seeks(DB* db, Snapshot* snapshot, const Model* seen, uint64_t* seed) {
+    Cursor* cursor = db_cursor_open(db, snapshot);
+    CHECK(cursor != NULL);
+    for (int i = 0; i < SEEKS; i++) {
+        uint64_t target = test_rand(seed) % (MODEL_KEYS + 1);
+        uint64_t next = target;
+        while (next < MODEL_KEYS && seen->size[next] < 0) next++;
+        CHECK(db_cursor_seek(cursor, target) == 0);
+        Cell cell;
+        int ret = db_cursor_next(cursor, &cell, NULL);
+        if (next == MODEL_KEYS) CHECK(ret == -2);
+        else CHECK(ret == 0 && cell.key == next);
+    }
+    db_cursor_close(cursor);
+}
+
+// reads one snapshot over and over while the main thread writes.
+static void* reader_main(void* arg) {
+    Reader* reader = arg;
+    while (!atomic_load(&stop_reader) || reader->passes == 0) {
+        check_snapshot(reader->db, reader->snapshot, reader->seen);
+        reader->passes++;
+    }
+    return NULL;
+}
+
+typedef struct {
+    DB* db;
+    atomic_uint_fast64_t acked; // the appended keys whose store returned.
+}Writer;
+
+// stores MODEL_KEYS, MODEL_KEYS + 1, ... in order through the write buffer.
+static void* writer_main(void* arg) {
+    Writer* writer = arg;
+    for (uint64_t i = 0; i < APPENDS; i++) {
+        uint64_t key = MODEL_KEYS + i;
+        Record record = {sizeof(uint64_t), (char*) &key};
+        CHECK(db_store(writer->db, key, &record, DB_STORE) == 0);
+        atomic_store(&writer->acked, i + 1);
+    }
+    return NULL;
+}
+
+static int has_append(DB* db, Snapshot* snapshot, uint64_t i) {
+    Record record = {0, NULL};
+    uint64_t key = MODEL_KEYS + i;
+    int ret = db_snapshot_fetch(db, snapshot, key, &record);
+    if (ret < 0) {
+        CHECK(errno == ENOENT);
+        return 0;
+    }
+    CHECK(record.size == sizeof(uint64_t) && memcmp(record.data, &key, sizeof(uint64_t)) == 0);
+    free(record.data);
+    return 1;
+}
+
+// a snapshot begun while the writer runs holds every append acked before it began, and the
+// appends it holds have no gap.
+static void check_appends(DB* db, const Model* model, uint64_t* seed) {
+    Writer writer = {db, 0};
+    pthread_t thread;
+    CHECK(db_buffer_start(db, 16 << 10) == 0);
+    CHECK(pthread_create(&thread, NULL, writer_main, &writer) == 0);
+    for (int round = 0; atomic_load(&writer.acked) < APPENDS; round++) {
+        uint64_t before = atomic_load(&writer.acked);
+        Snapshot* snapshot = db_snapshot_begin(db);
+        CHECK(snapshot != NULL);
+        uint64_t after = atomic_load(&writer.acked);
+        for (int i = 0; before && i < 16; i++) CHECK(has_append(db, snapshot, test_rand(seed) % before));
+        uint64_t held = before;
+        while (held <= after && has_append(db, snapshot, held)) held++;
+        for (uint64_t i = held; i <= after + 1 && i < APPENDS; i++) CHECK(!has_append(db, snapshot, i));
+        if (round % 64 == 0) check_fetches(db, snapshot, model);
+        CHECK(db_snapshot_end(db, snapshot) == 0);
+    }
+    pthread_join(thread, NULL);
+    CHECK(db_buffer_stop(db) == 0);
+    for (uint64_t i = 0; i < APPENDS; i++) CHECK(db_delete(db, MODEL_KEYS + i) == 0);
+}
+
+int main(void) {
+    uint64_t seed = 0x9E3779B97F4A7C15ULL;
+    Model* model = malloc(sizeof(Model));
+    Model* seen = malloc(MAX_SNAPSHOTS * sizeof(Model));
+    Snapshot* snapshots[MAX_SNAPSHOTS];
+    CHECK(model && seen);
+    model_init(model);
+
+    DB* db = db_open(NAME, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    CHECK(db != NULL);
+    for (int i = 0; i < STEPS; i++) model_step(db, model, &seed);
+
+    // every snapshot keeps its view while later writes split, merge and rewrite its pages.
+    for (int i = 0; i < MAX_SNAPSHOTS; i++) {
+        CHECK((snapshots[i] = db_snapshot_begin(db)) != NULL);
+        memcpy(seen + i, model, sizeof(Model));
+        for (int j = 0; j < STEPS; j++) model_step(db, model, &seed);
+    }
+    for (int i = 0; i < MAX_SNAPSHOTS; i++) {
+        check_snapshot(db, snapshots[i], seen + i);
+        check_seeks(db, snapshots[i], seen + i, &seed);
+    }
+    model_check(db, model);
+
+    // ending the snapshots out of order keeps the pages the others still need.
+    for (int i = 0; i < MAX_SNAPSHOTS; i += 2) CHECK(db_snapshot_end(db, snapshots[i]) == 0);
+    for (int j = 0; j < STEPS; j++) model_step(db, model, &seed);
+    for (int i = 1; i < MAX_SNAPSHOTS; i += 2) {
+        check_snapshot(db, snapshots[i], seen + i);
+        CHECK(db_snapshot_end(db, snapshots[i]) == 0);
+    }
+    model_check(db, model);
+
+    // a reader on another thread, through the write buffer.
+    Reader reader = {db, NULL, seen, 0};
+    CHECK((reader.snapshot = db_snapshot_begin(db)) != NULL);
+    memcpy(seen, model, sizeof(Model));
+    CHECK(db_buffer_start(db, 16 << 10) == 0);
+    pthread_t thread;
+    CHECK(pthread_create(&thread, NULL, reader_main, &reader) == 0);
+    for (int j = 0; j < STEPS * 2; j++) model_step(db, model, &seed);
+    atomic_store(&stop_reader, 1);
+    pthread_join(thread, NULL);
+    CHECK(db_buffer_stop(db) == 0);
+    check_snapshot(db, reader.snapshot, seen);
+    CHECK(db_snapshot_end(db, reader.snapshot) == 0);
+    model_check(db, model);
+
+    // snapshots begun while another thread writes through the buffer.
+    check_appends(db, model, &seed);
+    model_check(db, model);
+    db_close(db);
+
+    db = db_open(NAME, O_RDWR);
+    CHECK(db != NULL);
+    model_check(db, model);
+    db_close(db);
+    free(model);
+    free(seen);
+    return 0;
+}
@@ -0,0 +1,110 @@
+#include <fcntl.h>
+#include <pthread.h>
+
+#include "test.h"
+
+#define NAME "stats_test_db"
+#define STEPS 20000
+#define THREADS 4
+
+typedef struct {
+    DB* db;
+    Model* model; // shared, each thread only touches the keys k with k % THREADS == id.
+    int id;
+    uint64_t fetches;
+    uint64_t stores;
+    uint64_t deletes;
+}Worker;
+
+static void* worker_main(void* arg) {
+    Worker* worker = arg;
+    Model* model = worker->model;
+    uint64_t seed = 0x9E3779B97F4A7C15ULL * (uint64_t) (worker->id + 1);
+    for (int i = 0; i < STEPS / THREADS; i++) {
+        uint64_t key = test_rand(&seed) % (MODEL_KEYS / THREADS) * THREADS + (uint64_t) worker->id;
+        uint64_t kind = (test_rand(&seed) >> 32) % 4;
+        if (kind == 0) {
+            model_delete(worker->db, model, key);
+            worker->deletes++;
+        } else if (kind == 1) {
+            model_store(worker->db, model, key, &seed);
+            worker->stores++;
+        } else {
+            Record record = {0, NULL};
+            int ret = db_fetch(worker->db, key, &record);
+            CHECK(model->size[key] < 0 ? ret < 0 && errno == ENOENT : ret == 0);
+            free(record.data);
+            worker->fetches++;
+        }
+    }
+    return NULL;
+}
+
+static void check_histogram(const Histogram* hist, uint64_t calls) {
+    CHECK(hist->total == calls);
+    if (calls == 0) return;
+    uint64_t p50 = histogram_percentile(hist, 50);
+    uint64_t p99 = histogram_percentile(hist, 99);
+    CHECK(hist->min <= p50 && p50 <= p99 && p99 <= hist->max + hist->max / HIST_SUB_BUCKETS);
+    CHECK(hist->sum >= hist->min * calls);
+}
+
+int main(void) {
+    Model* model = malloc(sizeof(Model));
+    CHECK(model != NULL);
+    model_init(model);
+
+    DB* db = db_open(NAME, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    CHECK(db != NULL);
+    DBStats stats;
+#ifndef MDBM_STATS
+    CHECK(db_stats(db, &stats) < 0 && errno == ENOTSUP);
+#else
+    CHECK(db_stats(db, &stats) == 0);
+    for (int i = 0; i < NUM_STAT_OPS; i++) CHECK(stats.latency[i].total == 0);
+
+    // the blocks of threads that have exited still count.
+    Worker workers[THREADS];
+    pthread_t threads[THREADS];
+    for (int i = 0; i < THREADS; i++) {
+        workers[i] = (Worker) {db, model, i, 0, 0, 0};
+        CHECK(pthread_create(threads + i, NULL, worker_main, workers + i) == 0);
+    }
+    for (int i = 0; i < THREADS; i++) pthread_join(threads[i], NULL);
+    uint64_t fetches = 0, stores = 0, deletes = 0;
+    for (int i = 0; i < THREADS; i++) {
+        fetches += workers[i].fetches;
+        stores += workers[i].stores;
+        deletes += workers[i].deletes;
+    }
+    CHECK(db_stats(db, &stats) == 0);
+    check_histogram(stats.latency + STAT_OP_FETCH, fetches);
+    check_histogram(stats.latency + STAT_OP_STORE, stores);
+    check_histogram(stats.latency + STAT_OP_DELETE, deletes);
+    CHECK(stats.counters[STAT_PAGE_WRITES] > 0 && stats.counters[STAT_DATA_APPENDED] > 0);
+    CHECK(stats.counters[STAT_ERRORS] == 0);
+
+    // a cursor step is a scan, and a failed call an error.
+    model_check(db, model);
+    size_t present = 0;
+    for (int key = 0; key < MODEL_KEYS; key++) present += model->size[key] >= 0;
+    Record record = {1, "x"};
+    CHECK(db_store(db, 0, NULL, DB_STORE) < 0);
+    CHECK(db_stats(db, &stats) == 0);
+    check_histogram(stats.latency + STAT_OP_FETCH, fetches + MODEL_KEYS);
+    check_histogram(stats.latency + STAT_OP_SCAN, present + 1);
+    CHECK(stats.counters[STAT_ERRORS] == 1);
+    CHECK(db_store(db, 0, &record, DB_STORE) == 0);
+
+    char* text = NULL;
+    size_t size = 0;
+    FILE* out = open_memstream(&text, &size);
+    CHECK(out != NULL && db_stats_print(out, &stats, DB_STATS_JSON) == 0);
+    fclose(out);
+    CHECK(size > 0 && text[0] == '{');
+    free(text);
+#endif
+    db_close(db);
+    free(model);
+    return 0;
+}
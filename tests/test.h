@@ -0,0 +1,106 @@
+#ifndef MDBM_TEST_H
+#define MDBM_TEST_H
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mdbm.h"
+#include "snapshot.h"
+
+#define CHECK(cond)                                                                             \
+    do {                                                                                        \
+        if (!(cond)) {                                                                          \
+            fprintf(stderr, "%s:%d: check failed: %s (errno %d)\n", __FILE__, __LINE__, #cond, errno); \
+            exit(1);                                                                            \
+        }                                                                                       \
+    } while (0)
+
+#define MODEL_KEYS 2048
+#define MODEL_VALUE 96
+
+// what the database should hold for keys 0 .. MODEL_KEYS - 1. size is -1 for an absent key.
+typedef struct {
+    int size[MODEL_KEYS];
+    char value[MODEL_KEYS][MODEL_VALUE];
+}Model;
+
+static inline uint64_t test_rand(uint64_t* seed) {
+    *seed ^= *seed << 13;
+    *seed ^= *seed >> 7;
+    *seed ^= *seed << 17;
+    return *seed;
+}
+
+static inline void model_init(Model* model) {
+    for (int i = 0; i < MODEL_KEYS; i++) model->size[i] = -1;
+}
+
+static inline void model_store(DB* db, Model* model, uint64_t key, uint64_t* seed) {
+    char value[MODEL_VALUE];
+    int size = (int) (test_rand(seed) % MODEL_VALUE);
+    for (int i = 0; i < size; i++) value[i] = (char) ('a' + test_rand(seed) % 26);
+    Record record = {(size_t) size, value};
+    CHECK(db_store(db, key, &record, DB_STORE) == 0);
+    model->size[key] = size;
+    memcpy(model->value[key], value, (size_t) size);
+}
+
+static inline void model_delete(DB* db, Model* model, uint64_t key) {
+    int ret = db_delete(db, key);
+    CHECK(model->size[key] < 0 ? ret < 0 && errno == ENOENT : ret == 0);
+    model->size[key] = -1;
+}
+
+// a random store or delete of a random key.
+static inline void model_step(DB* db, Model* model, uint64_t* seed) {
+    uint64_t key = test_rand(seed) % MODEL_KEYS;
+    if (test_rand(seed) % 4 == 0) model_delete(db, model, key);
+    else model_store(db, model, key, seed);
+}
+
+static inline void model_check_fetch(DB* db, const Model* model) {
+    for (uint64_t key = 0; key < MODEL_KEYS; key++) {
+        Record record = {0, NULL};
+        int ret = db_fetch(db, key, &record);
+        if (model->size[key] < 0) {
+            CHECK(ret < 0 && errno == ENOENT);
+            continue;
+        }
+        CHECK(ret == 0);
+        CHECK(record.size == (size_t) model->size[key]);
+        CHECK(memcmp(record.data, model->value[key], record.size) == 0);
+        free(record.data);
+    }
+}
+
+// the cursor returns exactly the keys of the model in order, with their values.
+static inline void model_check_cursor(Cursor* cursor, const Model* model) {
+    uint64_t next = 0;
+    Cell cell;
+    Record record;
+    int ret;
+    while ((ret = db_cursor_next(cursor, &cell, &record)) == 0) {
+        while (next < MODEL_KEYS && model->size[next] < 0) next++;
+        CHECK(next < MODEL_KEYS && cell.key == next);
+        CHECK(record.size == (size_t) model->size[next]);
+        CHECK(memcmp(record.data, model->value[next], record.size) == 0);
+        free(record.data);
+        next++;
+    }
+    CHECK(ret == -2);
+    while (next < MODEL_KEYS && model->size[next] < 0) next++;
+    CHECK(next == MODEL_KEYS);
+}
+
+static inline void model_check(DB* db, const Model* model) {
+    model_check_fetch(db, model);
+    Cursor* cursor = db_cursor_open(db, NULL);
+    CHECK(cursor != NULL);
+    model_check_cursor(cursor, model);
+    db_cursor_close(cursor);
+}
+
+#endif //MDBM_TEST_H
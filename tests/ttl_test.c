@@ -0,0 +1,112 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "test.h"
+
+#define NAME "ttl_test_db"
+#define STEPS 20000
+#define SHORT_TTL 1
+#define LONG_TTL 3600
+
+// the ttl each key of the model was last stored with, 0 for none.
+static uint32_t ttls[MODEL_KEYS];
+
+// a random store with or without a ttl, or a delete. a value stored with SHORT_TTL may expire
+// while the steps run, and a buffered delete of an expired value leaves it to db_expire_step, so
+// such a key is only stored again. a NULL db only updates the model.
+static void step(DB* db, Model* model, uint64_t* seed) {
+    uint64_t key = test_rand(seed) % MODEL_KEYS;
+    uint64_t kind = (test_rand(seed) >> 32) % 8;
+    if (kind == 0 && ttls[key] != SHORT_TTL) {
+        if (db) CHECK(model->size[key] < 0 ? db_delete(db, key) < 0 && errno == ENOENT : db_delete(db, key) == 0);
+        model->size[key] = -1;
+        ttls[key] = 0;
+        return;
+    }
+    char value[MODEL_VALUE];
+    int size = (int) (test_rand(seed) % MODEL_VALUE);
+    for (int i = 0; i < size; i++) value[i] = (char) ('a' + test_rand(seed) % 26);
+    Record record = {(size_t) size, value};
+    uint32_t ttl = kind == 1 ? SHORT_TTL : kind == 2 ? LONG_TTL : 0;
+    if (db) CHECK((ttl ? db_store_ttl(db, key, &record, DB_STORE, ttl) : db_store(db, key, &record, DB_STORE)) == 0);
+    model->size[key] = size;
+    memcpy(model->value[key], value, (size_t) size);
+    ttls[key] = ttl;
+}
+
+static void steps(DB* db, Model* model, uint64_t* seed) {
+    for (int i = 0; i < STEPS; i++) step(db, model, seed);
+}
+
+// once the values stored with SHORT_TTL expired, fetches and db_expiry miss them and <name>.ttl
+// holds one entry for each of them and none for any other key.
+static void check_expiry(DB* db, Model* model) {
+    sleep(SHORT_TTL + 1);
+    size_t due = 0;
+    for (uint64_t key = 0; key < MODEL_KEYS; key++) {
+        uint64_t expire_at;
+        int ret = db_expiry(db, key, &expire_at);
+        if (ttls[key] == SHORT_TTL) {
+            CHECK(ret < 0 && errno == ENOENT);
+            model->size[key] = -1;
+            ttls[key] = 0;
+            due++;
+        } else if (model->size[key] < 0) {
+            CHECK(ret < 0 && errno == ENOENT);
+        } else {
+            CHECK(ret == 0);
+            if (!(ttls[key] ? expire_at > (uint64_t) time(NULL) : expire_at == 0)) fprintf(stderr, "key %lu ttl %u expire_at %lu now %lu\n", key, ttls[key], expire_at, time(NULL));
+        }
+    }
+    model_check(db, model);
+    CHECK(db_expire_step(db, MODEL_KEYS * 4) == (ssize_t) due);
+    CHECK(db_expire_step(db, MODEL_KEYS * 4) == 0);
+}
+
+int main(void) {
+    Model* model = malloc(sizeof(Model));
+    CHECK(model != NULL);
+    model_init(model);
+    uint64_t seed = 0x2545F4914F6CDD1DULL;
+
+    DB* db = db_open(NAME, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    CHECK(db != NULL);
+    steps(db, model, &seed);
+    check_expiry(db, model);
+
+    // through the write buffer, flushed when it fills and at the end.
+    CHECK(db_buffer_start(db, 16 << 10) == 0);
+    steps(db, model, &seed);
+    CHECK(db_buffer_stop(db) == 0);
+    check_expiry(db, model);
+
+    // writes left in the log of a handle that never closed are replayed with their expiry.
+    db_close(db);
+    pid_t pid = fork();
+    CHECK(pid >= 0);
+    if (pid == 0) {
+        db = db_open(NAME, O_RDWR);
+        CHECK(db != NULL);
+        CHECK(db_buffer_start(db, 16 << 10) == 0);
+        steps(db, model, &seed);
+        _exit(0);
+    }
+    int status;
+    CHECK(waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    steps(NULL, model, &seed);
+    db = db_open(NAME, O_RDWR);
+    CHECK(db != NULL);
+    CHECK(db_buffer_start(db, 16 << 10) == 0);
+    steps(db, model, &seed);
+    CHECK(db_buffer_stop(db) == 0);
+    check_expiry(db, model);
+    db_close(db);
+
+    db = db_open(NAME, O_RDWR);
+    CHECK(db != NULL);
+    model_check(db, model);
+    db_close(db);
+    free(model);
+    return 0;
+}
@@ -0,0 +1,115 @@
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "test.h"
+
+#define NAME "view_test_db"
+#define STEPS 20000
+#define HELD 64
+#define CACHE_BYTES (1 << 20)
+#define EXTRA_KEYS 1024
+
+typedef struct {
+    DBView view;
+    int size;
+    char expected[MODEL_VALUE];
+}Held;
+
+static atomic_int stop_writer;
+
+// the views hold the bytes they had when they were taken, whatever was stored since.
+static void release_all(Held* held, int* num_held) {
+    for (int i = 0; i < *num_held; i++) {
+        CHECK(held[i].view.size == (size_t) held[i].size);
+        CHECK(memcmp(held[i].view.data, held[i].expected, (size_t) held[i].size) == 0);
+        db_view_release(&held[i].view);
+        CHECK(held[i].view.data == NULL && held[i].view.cache == NULL);
+    }
+    *num_held = 0;
+}
+
+// takes views of random keys between random stores and deletes, so keys are stored again and
+// deleted while views of them are held.
+static void run(DB* db, Model* model, uint64_t* seed) {
+    Held* held = malloc(HELD * sizeof(Held));
+    CHECK(held != NULL);
+    int num_held = 0;
+    for (int i = 0; i < STEPS; i++) {
+        uint64_t key = test_rand(seed) % MODEL_KEYS;
+        if ((test_rand(seed) >> 32) % 2) {
+            model_step(db, model, seed);
+            continue;
+        }
+        Held* h = held + num_held;
+        int ret = db_fetch_view(db, key, &h->view);
+        if (model->size[key] < 0) {
+            CHECK(ret < 0 && errno == ENOENT);
+            continue;
+        }
+        CHECK(ret == 0);
+        h->size = model->size[key];
+        memcpy(h->expected, model->value[key], (size_t) h->size);
+        if (++num_held == HELD) release_all(held, &num_held);
+    }
+    release_all(held, &num_held);
+    free(held);
+    model_check_fetch(db, model);
+}
+
+// stores keys past the model, so the data blocks under the views keep changing.
+static void* writer_main(void* arg) {
+    char value[MODEL_VALUE];
+    memset(value, 'w', sizeof(value));
+    for (uint64_t i = 0; !atomic_load(&stop_writer); i++) {
+        Record record = {i % MODEL_VALUE, value};
+        CHECK(db_store(arg, MODEL_KEYS + i % EXTRA_KEYS, &record, DB_STORE) == 0);
+    }
+    return NULL;
+}
+
+int main(void) {
+    uint64_t seed = 0x2545F4914F6CDD1DULL;
+    Model* model = malloc(sizeof(Model));
+    CHECK(model != NULL);
+    model_init(model);
+
+    // without a cache every view is a copy.
+    DB* db = db_open(NAME, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    CHECK(db != NULL);
+    run(db, model, &seed);
+
+    // with one, views pin the cached blocks and a cache with pinned blocks cannot be dropped.
+    CHECK(db_set_cache(db, CACHE_BYTES) == 0);
+    run(db, model, &seed);
+    DBView view;
+    uint64_t key = 0;
+    while (model->size[key] < 0) key++;
+    CHECK(db_fetch_view(db, key, &view) == 0 && view.cache != NULL);
+    CHECK(db_set_cache(db, 0) < 0 && errno == EBUSY);
+    db_view_release(&view);
+
+    // through the write buffer, and with another thread writing.
+    CHECK(db_buffer_start(db, 16 << 10) == 0);
+    run(db, model, &seed);
+    CHECK(db_buffer_stop(db) == 0);
+    pthread_t thread;
+    CHECK(pthread_create(&thread, NULL, writer_main, db) == 0);
+    run(db, model, &seed);
+    atomic_store(&stop_writer, 1);
+    pthread_join(thread, NULL);
+    for (uint64_t extra = MODEL_KEYS; extra < MODEL_KEYS + EXTRA_KEYS; extra++) db_delete(db, extra);
+    model_check(db, model);
+    CHECK(db_set_cache(db, 0) == 0);
+    db_close(db);
+
+    // the cache of a handle opened with O_DIRECT.
+    db = db_open(NAME, O_RDWR | O_DIRECT);
+    CHECK(db != NULL);
+    run(db, model, &seed);
+    db_close(db);
+    free(model);
+    return 0;
+}
@@ -0,0 +1,109 @@
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "test.h"
+#include "cache.h"
+#include "warm.h"
+
+#define NAME "warm_test_db"
+#define WARM NAME ".warm"
+#define STALE NAME ".warm.stale"
+#define STEPS 20000
+
+static void copy_file(const char* from, const char* to) {
+    FILE* in = fopen(from, "r");
+    FILE* out = fopen(to, "w");
+    CHECK(in != NULL && out != NULL);
+    char buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), in)) > 0) CHECK(fwrite(buf, 1, n, out) == n);
+    fclose(in);
+    fclose(out);
+}
+
+// the saved list holds some index blocks.
+static void check_list(void) {
+    FILE* in = fopen(WARM, "r");
+    CHECK(in != NULL);
+    uint32_t header[2];
+    uint64_t counts[2];
+    CHECK(fread(header, sizeof(header), 1, in) == 1 && fread(counts, sizeof(counts), 1, in) == 1);
+    CHECK(header[0] == WARM_MAGIC && header[1] == CACHE_BLOCK && counts[0] > 0);
+    fclose(in);
+}
+
+// the loader fills the cache of a handle opened with O_DIRECT in the background.
+static void check_loaded(DB* db) {
+    off_t offsets[16];
+    for (int ms = 0; cache_list(db->cache, db->idx_fd, offsets, 16) == 0; ms++) {
+        CHECK(ms < 10000);
+        usleep(1000);
+    }
+}
+
+int main(void) {
+    uint64_t seed = 0x2545F4914F6CDD1DULL;
+    Model* model = malloc(sizeof(Model));
+    CHECK(model != NULL);
+    model_init(model);
+
+    DB* db = db_open(NAME, O_RDWR | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+    CHECK(db != NULL && db->warmer == NULL);
+    for (int i = 0; i < STEPS; i++) model_step(db, model, &seed);
+    model_check(db, model);
+    db_close(db);
+    check_list();
+    copy_file(WARM, STALE);
+
+    db = db_open(NAME, O_RDWR | O_DIRECT);
+    CHECK(db != NULL && db->warmer != NULL);
+    check_loaded(db);
+    for (int i = 0; i < STEPS; i++) model_step(db, model, &seed);
+    model_check(db, model);
+    db_close(db);
+
+    // a buffered handle only hints the kernel. the reorganize moves every block the list names.
+    db = db_open(NAME, O_RDWR);
+    CHECK(db != NULL);
+    CHECK(db_reorganize(db) == 0);
+    for (int i = 0; i < STEPS; i++) model_step(db, model, &seed);
+    model_check(db, model);
+    db_close(db);
+    check_list();
+
+    // a stale list costs reads, but never returns an old value.
+    copy_file(STALE, WARM);
+    db = db_open(NAME, O_RDWR | O_DIRECT);
+    CHECK(db != NULL);
+    for (int i = 0; i < STEPS; i++) model_step(db, model, &seed);
+    check_loaded(db);
+    model_check(db, model);
+
+    // the saver keeps a recent list behind a handle that never gets to db_close.
+    unlink(WARM);
+    CHECK(db_warm_start(db, 10) == 0);
+    CHECK(db_warm_start(db, 10) < 0 && errno == EBUSY);
+    while (access(WARM, F_OK) < 0) usleep(1000);
+    CHECK(db_warm_stop(db) == 0);
+    CHECK(db_warm_stop(db) == 0);
+    check_list();
+    db_close(db);
+
+    // a damaged list is ignored, and truncating the database drops it.
+    FILE* out = fopen(WARM, "w");
+    CHECK(out != NULL && fwrite("damaged", 7, 1, out) == 1);
+    fclose(out);
+    db = db_open(NAME, O_RDWR | O_DIRECT);
+    CHECK(db != NULL && db->warmer == NULL);
+    model_check(db, model);
+    db_close(db);
+    db = db_open(NAME, O_RDWR | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+    CHECK(db != NULL && db->warmer == NULL);
+    CHECK(access(STALE, F_OK) == 0 && access(WARM, F_OK) < 0 && errno == ENOENT);
+    db_close(db);
+    unlink(STALE);
+    free(model);
+    return 0;
+}
@@ -0,0 +1,360 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "warm.h"
+#include "cache.h"
+#include "io.h"
+#include "lock.h"
+
+// <name>.warm lists the blocks of both files that were hot when a handle closed or the saver last
+// ran: what the handle cache held, or without one what the kernel page cache held. db_open reads
+// them back in sorted runs, with readahead hints for a buffered handle and through a background
+// loader for one with a cache. the list is only a hint, the blocks are read from the files as they
+// are now, so a stale list costs reads but never returns an old value.
+
+typedef struct {
+    uint32_t magic;
+    uint32_t block; // CACHE_BLOCK of the writer.
+    uint64_t num_idx;
+    uint64_t num_data;
+}WarmHeader;
+
+struct Warmer {
+    off_t* offsets; // the saved list, index blocks then data blocks, owned by the loader.
+    size_t num_idx;
+    size_t num_data;
+    atomic_int loading; // cleared to stop the loader early.
+    atomic_int pending; // the saved list is not in the cache yet and must not be overwritten.
+    int loader_started;
+    pthread_t loader;
+
+    unsigned interval_ms;
+    int running;
+    pthread_t thread;
+    pthread_mutex_t mutex; // guards running.
+    pthread_cond_t cond;
+};
+
+static char* warm_path(const char* name, const char* suffix) {
+    char* path = malloc(strlen(name) + strlen(suffix) + 1);
+    if (path == NULL) return NULL;
+    strcpy(path, name);
+    strcat(path, suffix);
+    return path;
+}
+
+static Warmer* new_warmer() {
+    Warmer* warmer = calloc(1, sizeof(Warmer));
+    if (warmer == NULL) return NULL;
+    pthread_mutex_init(&warmer->mutex, NULL);
+    pthread_cond_init(&warmer->cond, NULL);
+    return warmer;
+}
+
+static int compare_offsets(const void* a, const void* b) {
+    off_t x = *(const off_t*) a;
+    off_t y = *(const off_t*) b;
+    return x < y ? -1 : x > y;
+}
+
+// sorts the offsets and drops duplicates and anything not block aligned, returns how many are left.
+static size_t sort_offsets(off_t* offsets, size_t n) {
+    qsort(offsets, n, sizeof(off_t), compare_offsets);
+    size_t kept = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (offsets[i] < 0 || offsets[i] % CACHE_BLOCK) continue;
+        if (kept && offsets[kept - 1] == offsets[i]) continue;
+        offsets[kept++] = offsets[i];
+    }
+    return kept;
+}
+
+// the end of the run of sorted offsets that starts at i.
+static size_t run_end(const off_t* offsets, size_t n, size_t i) {
+    size_t j = i + 1;
+    while (j < n && offsets[j] + CACHE_BLOCK - offsets[i] <= WARM_RUN &&
+           offsets[j] - offsets[j - 1] - CACHE_BLOCK <= WARM_GAP) {
+        j++;
+    }
+    return j;
+}
+
+// the blocks of fd below end that are in the kernel page cache.
+static size_t resident(int fd, off_t end, off_t* offsets, size_t max) {
+    struct stat st;
+    if (fstat(fd, &st) < 0) return 0;
+    if (end > st.st_size) end = st.st_size;
+    if (end <= 0 || max == 0) return 0;
+
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    size_t len = (size_t) end;
+    size_t pages = (len + page - 1) / page;
+    unsigned char* vec = malloc(pages);
+    void* map = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+    size_t n = 0;
+    if (vec && map != MAP_FAILED && mincore(map, len, vec) == 0) {
+        for (size_t i = 0; i < pages && n < max; i++) {
+            if (!(vec[i] & 1)) continue;
+            off_t from = (off_t) (i * page) / CACHE_BLOCK * CACHE_BLOCK;
+            off_t to = (off_t) ((i + 1) * page) < end ? (off_t) ((i + 1) * page) : end;
+            for (off_t block = from; block < to && n < max; block += CACHE_BLOCK) {
+                if (n == 0 || offsets[n - 1] != block) offsets[n++] = block;
+            }
+        }
+    }
+    if (map != MAP_FAILED) munmap(map, len);
+    free(vec);
+    return n;
+}
+
+// write the hot blocks of the handle to <name>.warm. a list still being prefetched is kept.
+int db_warm_save(DB* db) {
+    Warmer* warmer = db->warmer;
+    if (warmer && atomic_load(&warmer->pending)) return 0;
+
+    off_t* offsets = malloc(WARM_MAX_BLOCKS * sizeof(off_t));
+    char* tmp_path = warm_path(db->name, ".warm.XXXXXX");
+    char* path = warm_path(db->name, ".warm");
+    if (offsets == NULL || tmp_path == NULL || path == NULL) {
+        free(offsets);
+        free(tmp_path);
+        free(path);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    WarmHeader header = {WARM_MAGIC, CACHE_BLOCK, 0, 0};
+    pthread_rwlock_rdlock(&db->latch);
+    if (db->cache) {
+        header.num_idx = cache_list(db->cache, db->idx_fd, offsets, WARM_MAX_BLOCKS);
+        header.num_data = cache_list(db->cache, db->data_fd, offsets + header.num_idx,
+                                     WARM_MAX_BLOCKS - header.num_idx);
+    } else {
+        header.num_idx = resident(db->idx_fd, db->header->idx_end, offsets, WARM_MAX_BLOCKS);
+        header.num_data = resident(db->data_fd, db->header->data_end, offsets + header.num_idx,
+                                   WARM_MAX_BLOCKS - header.num_idx);
+    }
+    pthread_rwlock_unlock(&db->latch);
+
+    size_t size = (header.num_idx + header.num_data) * sizeof(off_t);
+    int fd = mkstemp(tmp_path);
+    int ret = fd < 0 || write(fd, &header, sizeof(WarmHeader)) != sizeof(WarmHeader) ||
+              write(fd, offsets, size) != (ssize_t) size ? -1 : 0;
+    if (fd >= 0) {
+        fchmod(fd, 0644);
+        close(fd);
+        if (ret == 0 && rename(tmp_path, path) < 0) ret = -1;
+        if (ret < 0) unlink(tmp_path);
+    }
+    free(offsets);
+    free(tmp_path);
+    free(path);
+    return ret;
+}
+
+// reads the runs of the saved list into the handle cache, index blocks first. every run is read
+// under the shared latch, so no store can slip in before its blocks are cached. stops once a
+// stripe of the cache has no free frame left, a warm-up never evicts anything.
+static void* warm_main(void* arg) {
+    DB* db = arg;
+    Warmer* warmer = db->warmer;
+    char* buf = NULL;
+    int done = posix_memalign((void**) &buf, IO_ALIGN, WARM_RUN) != 0;
+
+    for (int data = 0; data < 2 && !done; data++) {
+        off_t* offsets = data ? warmer->offsets + warmer->num_idx : warmer->offsets;
+        size_t n = data ? warmer->num_data : warmer->num_idx;
+        for (size_t i = 0, j; i < n && !done; i = j) {
+            if (!atomic_load(&warmer->loading)) {
+                free(buf);
+                return NULL;
+            }
+            j = run_end(offsets, n, i);
+            size_t size = (size_t) (offsets[j - 1] + CACHE_BLOCK - offsets[i]);
+
+            pthread_rwlock_rdlock(&db->latch);
+            int fd = data ? db->data_fd : db->idx_fd;
+            ssize_t got = -1;
+            if (db->cache && read_lock_wait(fd, offsets[i], SEEK_SET, size) == 0) {
+                got = io_pread(fd, buf, size, offsets[i]);
+                unlock(fd, offsets[i], SEEK_SET, size);
+            }
+            for (size_t k = i; k < j && got > 0; k++) {
+                off_t at = offsets[k] - offsets[i];
+                if (at + CACHE_BLOCK > got) break;
+                if (cache_warm(db->cache, fd, offsets[k], buf + at) < 0) done = 1;
+            }
+            pthread_rwlock_unlock(&db->latch);
+            if (got < 0) done = 1;
+        }
+    }
+    free(buf);
+    atomic_store(&warmer->pending, 0);
+    return NULL;
+}
+
+// reads <name>.warm back. a buffered handle hands the runs to the kernel as readahead hints, which
+// return at once. a handle with its own cache, as one opened with O_DIRECT, starts a loader.
+// a missing or damaged list is not an error, the handle only starts cold.
+void warm_open(DB* db, int truncated) {
+    char* path = warm_path(db->name, ".warm");
+    if (path == NULL) return;
+    if (truncated) {
+        unlink(path);
+        free(path);
+        return;
+    }
+    int fd = open(path, O_RDONLY);
+    free(path);
+    if (fd < 0) return;
+
+    WarmHeader header;
+    struct stat st;
+    off_t* offsets = NULL;
+    size_t size = 0;
+    if (fstat(fd, &st) == 0 && read(fd, &header, sizeof(WarmHeader)) == sizeof(WarmHeader) &&
+        header.magic == WARM_MAGIC && header.block == CACHE_BLOCK &&
+        header.num_idx + header.num_data <= WARM_MAX_BLOCKS) {
+        size = (header.num_idx + header.num_data) * sizeof(off_t);
+        if (st.st_size != (off_t) (sizeof(WarmHeader) + size) || size == 0 ||
+            (offsets = malloc(size)) == NULL || read(fd, offsets, size) != (ssize_t) size) {
+            free(offsets);
+            offsets = NULL;
+        }
+    }
+    close(fd);
+    if (offsets == NULL) return;
+
+    size_t num_idx = sort_offsets(offsets, header.num_idx);
+    size_t num_data = sort_offsets(offsets + header.num_idx, header.num_data);
+    memmove(offsets + num_idx, offsets + header.num_idx, num_data * sizeof(off_t));
+
+    if (db->cache == NULL) {
+        for (int data = 0; data < 2; data++) {
+            off_t* run = data ? offsets + num_idx : offsets;
+            size_t n = data ? num_data : num_idx;
+            int file = data ? db->data_fd : db->idx_fd;
+            for (size_t i = 0, j; i < n; i = j) {
+                j = run_end(run, n, i);
+                posix_fadvise(file, run[i], run[j - 1] + CACHE_BLOCK - run[i], POSIX_FADV_WILLNEED);
+            }
+        }
+        free(offsets);
+        return;
+    }
+
+    Warmer* warmer = new_warmer();
+    if (warmer == NULL) {
+        free(offsets);
+        return;
+    }
+    warmer->offsets = offsets;
+    warmer->num_idx = num_idx;
+    warmer->num_data = num_data;
+    atomic_store(&warmer->loading, 1);
+    atomic_store(&warmer->pending, 1);
+    db->warmer = warmer;
+    if (pthread_create(&warmer->loader, NULL, warm_main, db) == 0) {
+        warmer->loader_started = 1;
+    } else {
+        atomic_store(&warmer->pending, 0);
+    }
+}
+
+static void* save_main(void* arg) {
+    DB* db = arg;
+    Warmer* warmer = db->warmer;
+
+    pthread_mutex_lock(&warmer->mutex);
+    while (warmer->running) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += warmer->interval_ms / 1000;
+        deadline.tv_nsec += (long) (warmer->interval_ms % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&warmer->cond, &warmer->mutex, &deadline);
+        if (!warmer->running) break;
+
+        pthread_mutex_unlock(&warmer->mutex);
+        db_warm_save(db);
+        pthread_mutex_lock(&warmer->mutex);
+    }
+    pthread_mutex_unlock(&warmer->mutex);
+    return NULL;
+}
+
+// start a background thread saving the hot blocks every interval_ms, WARM_IDLE_MS if 0, so a
+// handle that never gets to db_close still leaves a recent list behind.
+int db_warm_start(DB* db, unsigned interval_ms) {
+    pthread_rwlock_wrlock(&db->latch);
+    if (db->warmer == NULL) db->warmer = new_warmer();
+    pthread_rwlock_unlock(&db->latch);
+    Warmer* warmer = db->warmer;
+    if (warmer == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    pthread_mutex_lock(&warmer->mutex);
+    if (warmer->running) {
+        pthread_mutex_unlock(&warmer->mutex);
+        errno = EBUSY;
+        return -1;
+    }
+    warmer->interval_ms = interval_ms ? interval_ms : WARM_IDLE_MS;
+    warmer->running = 1;
+    if (pthread_create(&warmer->thread, NULL, save_main, db) != 0) {
+        warmer->running = 0;
+        pthread_mutex_unlock(&warmer->mutex);
+        errno = EAGAIN;
+        return -1;
+    }
+    pthread_mutex_unlock(&warmer->mutex);
+    return 0;
+}
+
+int db_warm_stop(DB* db) {
+    Warmer* warmer = db->warmer;
+    if (warmer == NULL) return 0;
+
+    pthread_mutex_lock(&warmer->mutex);
+    if (!warmer->running) {
+        pthread_mutex_unlock(&warmer->mutex);
+        return 0;
+    }
+    warmer->running = 0;
+    pthread_cond_signal(&warmer->cond);
+    pthread_mutex_unlock(&warmer->mutex);
+
+    return pthread_join(warmer->thread, NULL) == 0 ? 0 : -1;
+}
+
+void warm_free(DB* db) {
+    Warmer* warmer = db->warmer;
+    if (warmer == NULL) return;
+
+    db_warm_stop(db);
+    if (warmer->loader_started) {
+        atomic_store(&warmer->loading, 0);
+        pthread_join(warmer->loader, NULL);
+    }
+    pthread_mutex_destroy(&warmer->mutex);
+    pthread_cond_destroy(&warmer->cond);
+    free(warmer->offsets);
+    free(warmer);
+    db->warmer = NULL;
+}
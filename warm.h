@@ -0,0 +1,19 @@
+#ifndef MDBM_WARM_H
+#define MDBM_WARM_H
+
+#include "mdbm.h"
+
+#define WARM_MAX_BLOCKS (1 << 18) // at most this many hot blocks are recorded, index pages first.
+#define WARM_RUN (1 << 20) // hot blocks are prefetched in sorted runs of up to this many bytes.
+#define WARM_GAP (64 << 10) // a hole this small between two hot blocks is read rather than split the run.
+#define WARM_IDLE_MS 60000
+#define WARM_MAGIC 0x6d64776d
+
+int db_warm_save(DB* db);
+int db_warm_start(DB* db, unsigned interval_ms);
+int db_warm_stop(DB* db);
+
+void warm_open(DB* db, int truncated);
+void warm_free(DB* db);
+
+#endif //MDBM_WARM_H